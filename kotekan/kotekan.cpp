@@ -1,6 +1,7 @@
 #include "Config.hpp"             // for Config
 #include "StageFactory.hpp"       // for StageFactoryRegistry, StageMaker
 #include "basebandApiManager.hpp" // for basebandApiManager
+#include "configLoader.hpp"       // for configCache, parse_yaml
 #include "errors.h"               // for get_error_message, get_exit_code, __enable_syslog, exi...
 #include "kotekanLogging.hpp"     // for INFO_NON_OO, logLevel, ERROR_NON_OO, FATAL_ERROR_NON_OO
 #include "kotekanMode.hpp"        // for kotekanMode
@@ -19,15 +20,17 @@
 #include <assert.h>    // for assert
 #include <csignal>     // for signal, SIGINT, sig_atomic_t
 #include <exception>   // for exception
+#include <fstream>     // for ifstream
 #include <getopt.h>    // for no_argument, getopt_long, required_argument, option
-#include <iostream>    // for endl, basic_ostream, cout, ostream
-#include <iterator>    // for reverse_iterator
+#include <iostream>    // for endl, basic_ostream, cout, cerr, ostream
+#include <iterator>    // for reverse_iterator, istreambuf_iterator
 #include <map>         // for map
-#include <memory>      // for allocator_traits<>::value_type
+#include <memory>      // for allocator_traits<>::value_type, make_unique, unique_ptr
 #include <mutex>       // for mutex, lock_guard
+#include <optional>    // for optional
 #include <stdexcept>   // for runtime_error, out_of_range
 #include <stdio.h>     // for printf, fprintf, feof, fgets, fdopen, stderr, fclose, STDOUT_FILENO
-#include <stdlib.h>    // for exit, free
+#include <stdlib.h>    // for exit, free, getenv
 #include <string.h>    // for strdup
 #include <string>      // for string, basic_string, operator!=, operator<<, operator==
 #include <strings.h>   // for strcasecmp
@@ -49,6 +52,7 @@ using namespace kotekan;
 
 // Embedded script for converting the YAML config to json
 // Copied from python/scripts/config_to_json.py
+// Only used for Jinja templates if kotekan was built with yaml-cpp.
 // TODO copy this in automatically at compile time.
 const std::string yaml_to_json = R"(
 import argparse
@@ -195,6 +199,8 @@ void print_help() {
     printf("    --no-stderr (-n)               Disables output to std error if syslog (-s) is "
            "enabled.\n");
     printf("    --variables (-e) [json]        Add Jinja config variables in JSON format\n");
+    printf("    --config-cache (-k) [dir]      Directory to cache converted configs in, 'none' to\n"
+           "                                   disable (default ~/.cache/kotekan/config)\n");
     printf("    --version (-v)                 Prints the kotekan version and build details.\n");
 
     printf("    --print-json (-p)              Prints the json version of the config.\n");
@@ -360,6 +366,87 @@ std::string exec(std::vector<std::string>& cmd) {
     return result;
 }
 
+/**
+ * @brief The default directory for the config cache.
+ *
+ * @return `$XDG_CACHE_HOME/kotekan/config` or `$HOME/.cache/kotekan/config`,
+ *         or "none" if neither is set.
+ */
+std::string default_config_cache() {
+    const char* cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home != nullptr && cache_home[0] != '\0')
+        return string(cache_home) + "/kotekan/config";
+    const char* home = getenv("HOME");
+    if (home != nullptr && home[0] != '\0')
+        return string(home) + "/.cache/kotekan/config";
+    return "none";
+}
+
+/**
+ * @brief Converts a YAML config file or a Jinja template to json.
+ *
+ * YAML is converted in kotekan if it was built with yaml-cpp, templates are
+ * rendered by the embedded Python script. Exits if the config can't be loaded.
+ *
+ * @param config_file_name The config file.
+ * @param jinja_variables  Extra Jinja variables in JSON format.
+ * @param dump_yaml        Print the YAML to stderr.
+ *
+ * @return The config.
+ */
+json load_config_file(const std::string& config_file_name, const std::string& jinja_variables,
+                      bool dump_yaml) {
+#ifdef WITH_YAML_CPP
+    if (config_file_name.size() < 3
+        || config_file_name.compare(config_file_name.size() - 3, 3, ".j2") != 0) {
+        std::ifstream in(config_file_name);
+        if (!in) {
+            ERROR_NON_OO("Unable to read config file {:s}", config_file_name);
+            exit(-1);
+        }
+        std::string yaml((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (dump_yaml)
+            std::cerr << yaml << std::endl;
+
+        try {
+            return parse_yaml(yaml);
+        } catch (const std::runtime_error& ex) {
+            ERROR_NON_OO("Unable to load config from {:s}", config_file_name);
+            ERROR_NON_OO("{:s}", ex.what());
+            exit(-1);
+        }
+    }
+#endif
+
+    // Create the command line, adding the yaml dump, and extra vars if needed
+    std::vector<std::string> exec_command;
+    exec_command.push_back("python");
+    exec_command.push_back("-c");
+    exec_command.push_back(yaml_to_json);
+
+    if (dump_yaml) {
+        exec_command.push_back("-d");
+    }
+    if (jinja_variables != "") {
+        exec_command.push_back("-e");
+        exec_command.push_back(jinja_variables);
+    }
+    exec_command.push_back(config_file_name);
+
+    std::string json_string = exec(exec_command);
+    if (json_string == "") {
+        ERROR_NON_OO("Unable to load config from {:s}", config_file_name);
+        exit(-1);
+    }
+    try {
+        return json::parse(json_string);
+    } catch (const json::exception& exp) {
+        ERROR_NON_OO("Unable to parse JSON");
+        ERROR_NON_OO("Error {:s}", exp.what());
+        exit(-1);
+    }
+}
+
 void update_log_levels(Config& config) {
     // Adjust the log level
     string s_log_level = config.get<std::string>("/", "log_level");
@@ -417,6 +504,7 @@ int main(int argc, char** argv) {
     bool dump_yaml = false;
     std::string bind_address = "0.0.0.0:12048";
     std::string jinja_variables = "";
+    std::string config_cache_dir = default_config_cache();
     // We disable syslog to start.
     // If only --config is provided, then we only send messages to stderr
     // If --syslog is added, then output is to both syslog and stderr
@@ -431,6 +519,7 @@ int main(int argc, char** argv) {
                                                {"syslog", no_argument, nullptr, 's'},
                                                {"no-stderr", no_argument, nullptr, 'n'},
                                                {"variables", required_argument, nullptr, 'e'},
+                                               {"config-cache", required_argument, nullptr, 'k'},
                                                {"version", no_argument, nullptr, 'v'},
                                                {"version-json", no_argument, nullptr, 'j'},
                                                {"print-json", no_argument, nullptr, 'p'},
@@ -439,7 +528,7 @@ int main(int argc, char** argv) {
 
         int option_index = 0;
 
-        int opt_val = getopt_long(argc, argv, "hc:b:sne:vjpy", long_options, &option_index);
+        int opt_val = getopt_long(argc, argv, "hc:b:sne:k:vjpy", long_options, &option_index);
 
         // End of args
         if (opt_val == -1) {
@@ -466,6 +555,9 @@ int main(int argc, char** argv) {
             case 'e':
                 jinja_variables = string(optarg);
                 break;
+            case 'k':
+                config_cache_dir = string(optarg);
+                break;
             case 'v':
                 print_version();
                 return 0;
@@ -521,35 +613,33 @@ int main(int argc, char** argv) {
         std::lock_guard<std::mutex> lock(kotekan_state_lock);
         INFO_NON_OO("Opening config file {:s}", config_file_name);
 
-        // Create the command line, adding the yaml dump, and extra vars if needed
-        std::vector<std::string> exec_command;
-        exec_command.push_back("python");
-        exec_command.push_back("-c");
-        exec_command.push_back(yaml_to_json);
-
-        if (dump_yaml) {
-            exec_command.push_back("-d");
-        }
-        if (jinja_variables != "") {
-            exec_command.push_back("-e");
-            exec_command.push_back(jinja_variables);
+        // Use the converted config from the last start with the same file, if
+        // there is one. Not when the YAML should be printed, that needs converting.
+        std::unique_ptr<configCache> cache;
+        std::string cache_key;
+        std::optional<json> config_json;
+        if (config_cache_dir != "none" && !dump_yaml) {
+            string file_name = config_file_name;
+            bool is_template =
+                file_name.size() >= 3 && file_name.compare(file_name.size() - 3, 3, ".j2") == 0;
+            try {
+                cache = std::make_unique<configCache>(config_cache_dir);
+                cache_key = configCache::key(file_name, is_template, jinja_variables);
+                config_json = cache->get(cache_key);
+            } catch (const std::runtime_error& ex) {
+                WARN_NON_OO("Not using the config cache: {:s}", ex.what());
+                cache.reset();
+            }
         }
-        exec_command.push_back(config_file_name);
 
-        std::string json_string = exec(exec_command);
-        if (json_string == "") {
-            ERROR_NON_OO("Unable to load config from {:s}", config_file_name);
-            exit(-1);
-        }
-        json config_json = {};
-        try {
-            config_json = json::parse(json_string);
-        } catch (const json::exception& exp) {
-            ERROR_NON_OO("Unable to parse JSON");
-            ERROR_NON_OO("Error {:s}", exp.what());
-            exit(-1);
+        if (config_json) {
+            INFO_NON_OO("Using the cached config {:s} from {:s}", cache_key, config_cache_dir);
+        } else {
+            config_json = load_config_file(config_file_name, jinja_variables, dump_yaml);
+            if (cache)
+                cache->put(cache_key, config_json.value());
         }
-        config.update_config(config_json);
+        config.update_config(config_json.value());
         try {
             start_new_kotekan_mode(config, dump_config);
         } catch (const std::exception& ex) {
@@ -1,31 +1,43 @@
 #include "buffer.h"
 
-#include "errors.h"    // for CHECK_ERROR_F, ERROR_F, CHECK_MEM_F, INFO_F, DEBUG_F, WARN_F, DEB...
-#include "metadata.h"  // for metadataContainer, decrement_metadata_ref_count, increment_metada...
-#include "nt_memset.h" // for nt_memset
-#include "util.h"      // for e_time
+#include "bufferZeroer.h" // for buffer_zeroer_submit, buffer_zeroer_flush
+#include "errors.h"       // for CHECK_ERROR_F, ERROR_F, CHECK_MEM_F, INFO_F, DEBUG_F, WARN_F, ...
+#include "metadata.h"     // for metadataContainer, decrement_metadata_ref_count, increment_me...
+#include "nt_memset.h"    // for nt_memset
+#include "util.h"         // for e_time
 #ifdef WITH_HSA
 #include "hsaBase.h" // for hsa_host_free, hsa_host_malloc
 #endif
 
 #include <assert.h>   // for assert
 #include <errno.h>    // for ETIMEDOUT
-#include <sched.h>    // for cpu_set_t, CPU_SET, CPU_ZERO
 #include <stdio.h>    // for snprintf
 #include <stdlib.h>   // for free, malloc
 #include <string.h>   // for memset, memcpy, strncmp, strncpy, strdup
-#include <sys/mman.h> // IWYU pragma: keep
+#include <sys/mman.h> // for mmap, munmap, mlock, MAP_HUGETLB
 #include <time.h>     // for NULL, size_t, timespec
 #ifdef WITH_NUMA
 #include <numa.h> // IWYU pragma: keep
 #endif
+#ifdef __linux__
+#include <limits.h>      // for INT_MAX
+#include <linux/futex.h> // for FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE, FUTEX_WAIT_BITSET_PRIVATE
+#include <sys/syscall.h> // for SYS_futex
+#define BUFFER_HAVE_FUTEX
+#endif
+#include <unistd.h> // for sysconf, syscall
+
+/// Number of times a fast path waiter polls the frame state before sleeping
+#define SPSC_SPIN_COUNT 1024
 
-struct zero_frames_thread_args {
-    struct Buffer* buf;
-    int ID;
-};
+// The spin count actually used, spinning is pointless if we only have one CPU.
+static int spsc_spin_count = -1;
 
-void* private_zero_frames(void* args);
+// Zeros frame `ID` following the zeroing policy of the buffer
+void private_zero_frame(struct Buffer* buf, const int ID);
+
+// Run by the zeroing worker, zeros the frame and then marks it as empty
+void private_zero_frame_and_release(struct Buffer* buf, int ID);
 
 // Returns -1 if there is no consumer with that name
 int private_get_consumer_id(struct Buffer* buf, const char* name);
@@ -33,11 +45,21 @@ int private_get_consumer_id(struct Buffer* buf, const char* name);
 // Returns -1 if there is no producer with that name
 int private_get_producer_id(struct Buffer* buf, const char* name);
 
-// Marks the consumer named by `name` as done for the given ID
-void private_mark_consumer_done(struct Buffer* buf, const char* name, const int ID);
+// Marks the consumer with index `consumer_id` as done for the given ID
+void private_mark_consumer_done(struct Buffer* buf, const int consumer_id, const int ID);
+
+// Marks the producer with index `producer_id` as done for the given ID
+void private_mark_producer_done(struct Buffer* buf, const int producer_id, const int ID);
 
-// Marks the producer named by `name` as done for the given ID
-void private_mark_producer_done(struct Buffer* buf, const char* name, const int ID);
+// The implementations of the frame state functions. Stages are identified either by
+// `name` or, if `name` is NULL, by the handle returned from register_consumer/producer.
+void private_mark_frame_full(struct Buffer* buf, const char* name, int producer_id, const int ID);
+void private_mark_frame_empty_for(struct Buffer* buf, const char* name, int consumer_id,
+                                  const int ID);
+uint8_t* private_wait_for_empty_frame(struct Buffer* buf, const char* name, int producer_id,
+                                      const int ID);
+uint8_t* private_wait_for_full_frame(struct Buffer* buf, const char* name, int consumer_id,
+                                     const int ID);
 
 // Returns 1 if all consumers are done for the given ID.
 int private_consumers_done(struct Buffer* buf, const int ID);
@@ -51,17 +73,68 @@ void private_reset_producers(struct Buffer* buf, const int ID);
 // Resets the list of consumers for the given ID
 void private_reset_consumers(struct Buffer* buf, const int ID);
 
+// Sets the is_full state of a frame and wakes any fast path waiters.
+void private_set_frame_full(struct Buffer* buf, const int ID, const int full);
+
+// Wakes any threads sleeping in the fast path, call after every state change.
+void private_notify_waiters(struct Buffer* buf);
+
+// Decides if the single producer/consumer fast path can be used, requires buf->lock.
+void private_update_spsc_mode(struct Buffer* buf);
+
+// Returns 1 if the single producer/consumer fast path is active.
+static inline int private_spsc_active(struct Buffer* buf) {
+    return __atomic_load_n(&buf->spsc_active, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Lock free wait until frame @c ID has the given @c is_full state.
+ *
+ * @param buf The buffer the frame is in.
+ * @param ID The frame to wait on.
+ * @param full The state to wait for, 1 for full and 0 for empty.
+ * @param timeout Absolute (CLOCK_REALTIME) time to give up at, or NULL to wait forever.
+ * @return 0 if the frame is in the requested state, -1 on shutdown, 1 on timeout,
+ *         and 2 if the buffer is no longer in the fast path mode.
+ */
+int private_spsc_wait(struct Buffer* buf, const int ID, const int full,
+                      const struct timespec* timeout);
+
 /**
- * @brief Marks a frame as empty and if the buffer requires zeroing then it starts
- *        the zeroing thread and delays marking it as empty until the zeroing is done.
+ * @brief Marks a frame as empty and if the buffer requires zeroing then it queues
+ *        the frame for the zeroing worker which marks it as empty when it is done.
  * @param buf The buffer the frame to empty is in.
  * @param id The id of the frame to mark as empty.
  * @return 1 if the frame was marked as empty, 0 if it is being zeroed.
  */
 int private_mark_frame_empty(struct Buffer* buf, const int id);
 
+// buffer_malloc, but optionally interleaving the memory over all NUMA nodes.
+uint8_t* private_buffer_malloc(ssize_t len, int numa_node, enum buffer_numa_policy numa_policy);
+
+// Allocates all the frames of `buf` from one huge page backed region, and sets
+// `buf->frame_region`.  Leaves `buf->frame_region` NULL if that isn't possible.
+void private_alloc_frame_region(struct Buffer* buf, enum buffer_page_size page_size,
+                                enum buffer_numa_policy numa_policy, int numa_node);
+
+// Logs the page size and the NUMA nodes the frame memory actually ended up on.
+void private_report_frame_placement(struct Buffer* buf, enum buffer_numa_policy numa_policy);
+
+// Returns 1 if frame pointers can be exchanged between the two buffers.
+static inline int private_frames_swappable(struct Buffer* a, struct Buffer* b) {
+    return (a->frame_region == NULL) == (b->frame_region == NULL);
+}
+
 struct Buffer* create_buffer(int num_frames, int len, struct metadataPool* pool,
                              const char* buffer_name, const char* buffer_type, int numa_node) {
+    return create_buffer_with_policy(num_frames, len, pool, buffer_name, buffer_type, numa_node,
+                                     BUFFER_PAGES_DEFAULT, BUFFER_NUMA_NODE);
+}
+
+struct Buffer* create_buffer_with_policy(int num_frames, int len, struct metadataPool* pool,
+                                         const char* buffer_name, const char* buffer_type,
+                                         int numa_node, enum buffer_page_size page_size,
+                                         enum buffer_numa_policy numa_policy) {
 
     assert(num_frames > 0);
 
@@ -146,22 +219,60 @@ struct Buffer* create_buffer(int num_frames, int len, struct metadataPool* pool,
 
     // By default don't zero buffers at the end of their use.
     buf->zero_frames = 0;
+    buf->zero_header_size = 0;
+    buf->zero_header_stride = 0;
+    buf->numa_node = numa_node;
 
     buf->last_arrival_time = 0;
 
+    // The fast path is only possible where we can sleep on a futex.
+#ifdef BUFFER_HAVE_FUTEX
+    buf->spsc_allowed = 1;
+#else
+    buf->spsc_allowed = 0;
+#endif
+    buf->spsc_active = 0;
+    buf->spsc_producer_id = -1;
+    buf->spsc_consumer_id = -1;
+    buf->wait_seq = 0;
+    buf->num_waiters = 0;
+    if (spsc_spin_count < 0)
+        spsc_spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPSC_SPIN_COUNT : 0;
+
     // Create the frames.
-    for (int i = 0; i < num_frames; ++i) {
-        buf->frames[i] = buffer_malloc(buf->aligned_frame_size, numa_node);
-        if (buf->frames[i] == NULL)
-            return NULL;
+    buf->frame_region = NULL;
+    buf->frame_region_size = 0;
+    buf->frame_page_size = PAGESIZE_MEM;
+    if (page_size != BUFFER_PAGES_DEFAULT) {
+        private_alloc_frame_region(buf, page_size, numa_policy, numa_node);
+    }
+    if (buf->frame_region == NULL) {
+        for (int i = 0; i < num_frames; ++i) {
+            buf->frames[i] =
+                private_buffer_malloc(buf->aligned_frame_size, numa_node, numa_policy);
+            if (buf->frames[i] == NULL)
+                return NULL;
+        }
     }
 
+    if (page_size != BUFFER_PAGES_DEFAULT || numa_policy != BUFFER_NUMA_NODE)
+        private_report_frame_placement(buf, numa_policy);
+
     return buf;
 }
 
 void delete_buffer(struct Buffer* buf) {
+    // Make sure the zeroing workers are done with our frames
+    if (buf->zero_frames == 1)
+        buffer_zeroer_flush(buf);
+
+    if (buf->frame_region != NULL) {
+        CHECK_ERROR_F(munmap(buf->frame_region, buf->frame_region_size));
+    }
+
     for (int i = 0; i < buf->num_frames; ++i) {
-        buffer_free(buf->frames[i], buf->aligned_frame_size);
+        if (buf->frame_region == NULL)
+            buffer_free(buf->frames[i], buf->aligned_frame_size);
         free(buf->producers_done[i]);
         free(buf->consumers_done[i]);
     }
@@ -181,20 +292,50 @@ void delete_buffer(struct Buffer* buf) {
 }
 
 void mark_frame_full(struct Buffer* buf, const char* name, const int ID) {
+    private_mark_frame_full(buf, name, -1, ID);
+}
+
+void mark_frame_full_h(struct Buffer* buf, const int producer_id, const int ID) {
+    assert(producer_id >= 0);
+    assert(producer_id < MAX_PRODUCERS);
+    private_mark_frame_full(buf, NULL, producer_id, ID);
+}
+
+void private_mark_frame_full(struct Buffer* buf, const char* name, int producer_id, const int ID) {
     assert(ID >= 0);
     assert(ID < buf->num_frames);
 
     // DEBUG_F("Frame %s[%d] being marked full by producer %s\n", buf->buffer_name, ID, name);
 
+    if (private_spsc_active(buf)) {
+        buf->producers[buf->spsc_producer_id].last_frame_released = ID;
+        buf->last_arrival_time = e_time();
+        private_set_frame_full(buf, ID, 1);
+        // Only needed if a consumer registered while we were marking the frame.
+        if (!private_spsc_active(buf)) {
+            CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
+            CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+            CHECK_ERROR_F(pthread_cond_broadcast(&buf->full_cond));
+        }
+        return;
+    }
+
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
 
     int set_full = 0;
     int set_empty = 0;
 
-    private_mark_producer_done(buf, name, ID);
+    if (name != NULL) {
+        producer_id = private_get_producer_id(buf, name);
+        if (producer_id == -1) {
+            ERROR_F("The producer %s hasn't been registered!", name);
+        }
+    }
+
+    private_mark_producer_done(buf, producer_id, ID);
     if (private_producers_done(buf, ID) == 1) {
         private_reset_producers(buf, ID);
-        buf->is_full[ID] = 1;
+        private_set_frame_full(buf, ID, 1);
         buf->last_arrival_time = e_time();
         set_full = 1;
 
@@ -202,7 +343,7 @@ void mark_frame_full(struct Buffer* buf, const char* name, const int ID) {
         if (private_consumers_done(buf, ID) == 1) {
             DEBUG_F("No consumers are registered on %s dropping data in frame %d...",
                     buf->buffer_name, ID);
-            buf->is_full[ID] = 0;
+            private_set_frame_full(buf, ID, 0);
             if (buf->metadata[ID] != NULL) {
                 decrement_metadata_ref_count(buf->metadata[ID]);
                 buf->metadata[ID] = NULL;
@@ -225,56 +366,212 @@ void mark_frame_full(struct Buffer* buf, const char* name, const int ID) {
     }
 }
 
-void* private_zero_frames(void* args) {
-
-    int ID = ((struct zero_frames_thread_args*)(args))->ID;
-    struct Buffer* buf = ((struct zero_frames_thread_args*)(args))->buf;
-
+void private_zero_frame(struct Buffer* buf, const int ID) {
     assert(ID >= 0);
-    assert(ID <= buf->num_frames);
+    assert(ID < buf->num_frames);
+
+    if (buf->zero_header_size > 0) {
+        for (int i = 0; i + buf->zero_header_size <= buf->frame_size;
+             i += buf->zero_header_stride) {
+            memset((void*)&buf->frames[ID][i], 0x00, buf->zero_header_size);
+        }
+        return;
+    }
 
-    // This zeros everything, but for VDIF we just need to header zeroed.
     int div_256 = 256 * (buf->frame_size / 256);
     nt_memset((void*)buf->frames[ID], 0x00, div_256);
     memset((void*)&buf->frames[ID][div_256], 0x00, buf->frame_size - div_256);
+}
 
-    // HACK: Just zero the first two words of the VDIF header
-    // for (int i = 0; i < buf->frame_size/1056; ++i) {
-    //    *((uint64_t*)&buf->frames[ID][i*1056]) = 0;
-    //}
+void private_zero_frame_and_release(struct Buffer* buf, int ID) {
+    private_zero_frame(buf, ID);
 
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
 
-    buf->is_full[ID] = 0;
+    private_set_frame_full(buf, ID, 0);
     private_reset_consumers(buf, ID);
 
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
 
     CHECK_ERROR_F(pthread_cond_broadcast(&buf->empty_cond));
-
-    free(args);
-
-    int ret = 0;
-    pthread_exit(&ret);
 }
 
 void zero_frames(struct Buffer* buf) {
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
     buf->zero_frames = 1;
+    buf->zero_header_size = 0;
+    private_update_spsc_mode(buf);
+    CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+}
+
+void zero_frame_headers(struct Buffer* buf, int header_size, int header_stride) {
+    assert(header_size > 0);
+    assert(header_stride >= header_size);
+
+    CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
+    buf->zero_frames = 1;
+    buf->zero_header_size = header_size;
+    buf->zero_header_stride = header_stride;
+    private_update_spsc_mode(buf);
+    CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+}
+
+void set_spsc_fast_path(struct Buffer* buf, int enable) {
+    CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
+#ifdef BUFFER_HAVE_FUTEX
+    buf->spsc_allowed = enable;
+#else
+    if (enable)
+        WARN_F("The SPSC fast path isn't supported on this platform, buffer %s will use locks",
+               buf->buffer_name);
+#endif
+    private_update_spsc_mode(buf);
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
 }
 
+void private_update_spsc_mode(struct Buffer* buf) {
+    int num_producers = 0, num_consumers = 0;
+    int producer_id = -1, consumer_id = -1;
+    for (int i = 0; i < MAX_PRODUCERS; ++i) {
+        if (buf->producers[i].in_use == 1) {
+            num_producers++;
+            producer_id = i;
+        }
+    }
+    for (int i = 0; i < MAX_CONSUMERS; ++i) {
+        if (buf->consumers[i].in_use == 1) {
+            num_consumers++;
+            consumer_id = i;
+        }
+    }
+
+    int spsc = buf->spsc_allowed == 1 && buf->zero_frames == 0 && num_producers == 1
+               && num_consumers == 1;
+
+    if (spsc == buf->spsc_active)
+        return;
+
+    DEBUG_F("Buffer %s: %s single producer/consumer fast path", buf->buffer_name,
+            spsc ? "enabling" : "disabling");
+
+    buf->spsc_producer_id = spsc ? producer_id : -1;
+    buf->spsc_consumer_id = spsc ? consumer_id : -1;
+    __atomic_store_n(&buf->spsc_active, spsc, __ATOMIC_SEQ_CST);
+
+    // Wake everyone so they can move over to the other wait mechanism.
+    private_notify_waiters(buf);
+    CHECK_ERROR_F(pthread_cond_broadcast(&buf->empty_cond));
+    CHECK_ERROR_F(pthread_cond_broadcast(&buf->full_cond));
+}
+
+void private_set_frame_full(struct Buffer* buf, const int ID, const int full) {
+    __atomic_store_n(&buf->is_full[ID], full, __ATOMIC_SEQ_CST);
+    private_notify_waiters(buf);
+}
+
+void private_notify_waiters(struct Buffer* buf) {
+    // Waiters increment num_waiters before sleeping on wait_seq, so if nobody is
+    // counted here any thread about to sleep will see the new sequence number.
+    __atomic_add_fetch(&buf->wait_seq, 1, __ATOMIC_SEQ_CST);
+#ifdef BUFFER_HAVE_FUTEX
+    if (__atomic_load_n(&buf->num_waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &buf->wait_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+#endif
+}
+
+int private_spsc_wait(struct Buffer* buf, const int ID, const int full,
+                      const struct timespec* timeout) {
+#ifdef BUFFER_HAVE_FUTEX
+    for (int spin = 0;; ++spin) {
+        int seq = __atomic_load_n(&buf->wait_seq, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&buf->shutdown_signal, __ATOMIC_SEQ_CST) == 1)
+            return -1;
+        if (!private_spsc_active(buf))
+            return 2;
+        if (__atomic_load_n(&buf->is_full[ID], __ATOMIC_SEQ_CST) == full)
+            return 0;
+
+        if (spin < spsc_spin_count) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            continue;
+        }
+
+        __atomic_add_fetch(&buf->num_waiters, 1, __ATOMIC_SEQ_CST);
+        long err;
+        if (timeout == NULL) {
+            err = syscall(SYS_futex, &buf->wait_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        } else {
+            // FUTEX_WAIT_BITSET takes an absolute timeout, like pthread_cond_timedwait
+            err = syscall(SYS_futex, &buf->wait_seq,
+                          FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, seq, timeout, NULL,
+                          FUTEX_BITSET_MATCH_ANY);
+        }
+        __atomic_sub_fetch(&buf->num_waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (err == -1 && errno == ETIMEDOUT) {
+            if (__atomic_load_n(&buf->is_full[ID], __ATOMIC_SEQ_CST) == full)
+                return 0;
+            return 1;
+        }
+    }
+#else
+    (void)ID;
+    (void)full;
+    (void)timeout;
+    (void)buf;
+    return 2;
+#endif
+}
+
 void mark_frame_empty(struct Buffer* buf, const char* consumer_name, const int ID) {
+    private_mark_frame_empty_for(buf, consumer_name, -1, ID);
+}
+
+void mark_frame_empty_h(struct Buffer* buf, const int consumer_id, const int ID) {
+    assert(consumer_id >= 0);
+    assert(consumer_id < MAX_CONSUMERS);
+    private_mark_frame_empty_for(buf, NULL, consumer_id, ID);
+}
+
+void private_mark_frame_empty_for(struct Buffer* buf, const char* name, int consumer_id,
+                                  const int ID) {
     assert(ID >= 0);
     assert(ID < buf->num_frames);
     int broadcast = 0;
 
+    if (private_spsc_active(buf)) {
+        buf->consumers[buf->spsc_consumer_id].last_frame_released = ID;
+        if (buf->metadata[ID] != NULL) {
+            decrement_metadata_ref_count(buf->metadata[ID]);
+            buf->metadata[ID] = NULL;
+        }
+        private_set_frame_full(buf, ID, 0);
+        // Only needed if a stage registered while we were marking the frame.
+        if (!private_spsc_active(buf)) {
+            CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
+            CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+            CHECK_ERROR_F(pthread_cond_broadcast(&buf->empty_cond));
+        }
+        return;
+    }
+
     // If we've been asked to zero the buffer do it here.
     // This needs to happen out side of the critical section
     // so that we don't block for a long time here.
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
 
-    private_mark_consumer_done(buf, consumer_name, ID);
+    if (name != NULL) {
+        consumer_id = private_get_consumer_id(buf, name);
+        if (consumer_id == -1) {
+            ERROR_F("The consumer %s hasn't been registered!", name);
+        }
+    }
+
+    private_mark_consumer_done(buf, consumer_id, ID);
 
     if (private_consumers_done(buf, ID) == 1) {
         broadcast = private_mark_frame_empty(buf, ID);
@@ -290,22 +587,20 @@ void mark_frame_empty(struct Buffer* buf, const char* consumer_name, const int I
 
 int private_mark_frame_empty(struct Buffer* buf, const int id) {
     int broadcast = 0;
+    int queued = 0;
     if (buf->zero_frames == 1) {
-        pthread_t zero_t;
-        struct zero_frames_thread_args* zero_args = malloc(sizeof(struct zero_frames_thread_args));
-        zero_args->ID = id;
-        zero_args->buf = buf;
-
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        // TODO: Move this to the config file (when buffers.c updated to C++11)
-        CPU_SET(5, &cpuset);
-
-        CHECK_ERROR_F(pthread_create(&zero_t, NULL, &private_zero_frames, (void*)zero_args));
-        CHECK_ERROR_F(pthread_setaffinity_np(zero_t, sizeof(cpu_set_t), &cpuset));
-        CHECK_ERROR_F(pthread_detach(zero_t));
-    } else {
-        buf->is_full[id] = 0;
+        // The zeroing worker marks the frame as empty once it is done.  If its queue is
+        // full we zero the frame here instead, which stalls the buffer but keeps the
+        // queue bounded.
+        queued = buffer_zeroer_submit(buf, id, buf->numa_node, &private_zero_frame_and_release)
+                 == 0;
+        if (!queued) {
+            DEBUG_F("Zeroing queue full, zeroing frame %s[%d] in place", buf->buffer_name, id);
+            private_zero_frame(buf, id);
+        }
+    }
+    if (!queued) {
+        private_set_frame_full(buf, id, 0);
         private_reset_consumers(buf, id);
         broadcast = 1;
     }
@@ -317,27 +612,56 @@ int private_mark_frame_empty(struct Buffer* buf, const int id) {
 }
 
 uint8_t* wait_for_empty_frame(struct Buffer* buf, const char* producer_name, const int ID) {
+    return private_wait_for_empty_frame(buf, producer_name, -1, ID);
+}
+
+uint8_t* wait_for_empty_frame_h(struct Buffer* buf, const int producer_id, const int ID) {
+    assert(producer_id >= 0);
+    assert(producer_id < MAX_PRODUCERS);
+    return private_wait_for_empty_frame(buf, NULL, producer_id, ID);
+}
+
+uint8_t* private_wait_for_empty_frame(struct Buffer* buf, const char* name, int producer_id,
+                                      const int ID) {
     assert(ID >= 0);
     assert(ID < buf->num_frames);
 
     int print_stat = 0;
 
+    if (private_spsc_active(buf)) {
+        int ret = private_spsc_wait(buf, ID, 0, NULL);
+        if (ret == -1)
+            return NULL;
+        if (ret == 0) {
+            buf->producers[buf->spsc_producer_id].last_frame_acquired = ID;
+            return buf->frames[ID];
+        }
+        // Otherwise the buffer left the fast path mode, so use the locked path
+    }
+
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
 
-    int producer_id = private_get_producer_id(buf, producer_name);
+    if (name != NULL)
+        producer_id = private_get_producer_id(buf, name);
     assert(producer_id != -1);
 
     // If the buffer isn't full, i.e. is_full[ID] == 0, then we never sleep on the cond var.
     // The second condition stops us from using a buffer we've already filled,
     // and forces a wait until that buffer has been marked as empty.
     while ((buf->is_full[ID] == 1 || buf->producers_done[ID][producer_id] == 1)
-           && buf->shutdown_signal == 0) {
+           && buf->shutdown_signal == 0 && buf->spsc_active == 0) {
         DEBUG_F("wait_for_empty_frame: %s waiting for empty frame ID = %d in buffer %s",
-                producer_name, ID, buf->buffer_name);
+                buf->producers[producer_id].name, ID, buf->buffer_name);
         print_stat = 1;
         pthread_cond_wait(&buf->empty_cond, &buf->lock);
     }
 
+    // A registration switched the buffer into the fast path while we were waiting
+    if (buf->spsc_active == 1 && buf->shutdown_signal == 0 && buf->is_full[ID] == 1) {
+        CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+        return private_wait_for_empty_frame(buf, NULL, producer_id, ID);
+    }
+
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
 
     // TODO: remove this output until we have a solution which has better control over log levels
@@ -352,7 +676,7 @@ uint8_t* wait_for_empty_frame(struct Buffer* buf, const char* producer_name, con
     return buf->frames[ID];
 }
 
-void register_consumer(struct Buffer* buf, const char* name) {
+int register_consumer(struct Buffer* buf, const char* name) {
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
 
     DEBUG_F("Registering consumer %s for buffer %s", name, buf->buffer_name);
@@ -361,7 +685,7 @@ void register_consumer(struct Buffer* buf, const char* name) {
         ERROR_F("You cannot register two consumers with the same name!");
         assert(0); // Optional
         CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
-        return;
+        return -1;
     }
 
     for (int i = 0; i < MAX_CONSUMERS; ++i) {
@@ -371,8 +695,9 @@ void register_consumer(struct Buffer* buf, const char* name) {
             buf->consumers[i].last_frame_acquired = -1;
             buf->consumers[i].last_frame_released = -1;
             strncpy(buf->consumers[i].name, name, MAX_STAGE_NAME_LEN);
+            private_update_spsc_mode(buf);
             CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
-            return;
+            return i;
         }
     }
 
@@ -380,6 +705,7 @@ void register_consumer(struct Buffer* buf, const char* name) {
     assert(0); // Optional
 
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+    return -1;
 }
 
 void unregister_consumer(struct Buffer* buf, const char* name) {
@@ -397,6 +723,7 @@ void unregister_consumer(struct Buffer* buf, const char* name) {
 
     buf->consumers[consumer_id].in_use = 0;
     snprintf(buf->consumers[consumer_id].name, MAX_STAGE_NAME_LEN, "unregistered");
+    private_update_spsc_mode(buf);
 
     // Check if removing this consumer would cause any of the frames
     // which are currently full to become empty.
@@ -416,14 +743,14 @@ void unregister_consumer(struct Buffer* buf, const char* name) {
 }
 
 
-void register_producer(struct Buffer* buf, const char* name) {
+int register_producer(struct Buffer* buf, const char* name) {
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
     DEBUG_F("Buffer: %s Registering producer: %s", buf->buffer_name, name);
     if (private_get_producer_id(buf, name) != -1) {
         ERROR_F("You cannot register two consumers with the same name!");
         assert(0); // Optional
         CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
-        return;
+        return -1;
     }
 
     for (int i = 0; i < MAX_PRODUCERS; ++i) {
@@ -433,8 +760,9 @@ void register_producer(struct Buffer* buf, const char* name) {
             buf->producers[i].last_frame_acquired = -1;
             buf->producers[i].last_frame_released = -1;
             strncpy(buf->producers[i].name, name, MAX_STAGE_NAME_LEN);
+            private_update_spsc_mode(buf);
             CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
-            return;
+            return i;
         }
     }
 
@@ -442,6 +770,7 @@ void register_producer(struct Buffer* buf, const char* name) {
     assert(0); // Optional
 
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+    return -1;
 }
 
 int private_get_consumer_id(struct Buffer* buf, const char* name) {
@@ -474,16 +803,12 @@ void private_reset_consumers(struct Buffer* buf, const int ID) {
     memset(buf->consumers_done[ID], 0, MAX_CONSUMERS * sizeof(int));
 }
 
-void private_mark_consumer_done(struct Buffer* buf, const char* name, const int ID) {
-    int consumer_id = private_get_consumer_id(buf, name);
-    if (consumer_id == -1) {
-        ERROR_F("The consumer %s hasn't been registered!", name);
-    }
-
+void private_mark_consumer_done(struct Buffer* buf, const int consumer_id, const int ID) {
     // DEBUG_F("%s->consumers_done[%d][%d] == %d", buf->buffer_name, ID, consumer_id,
     // buf->consumers_done[ID][consumer_id] );
 
     assert(consumer_id != -1);
+    assert(buf->consumers[consumer_id].in_use == 1);
     // The consumer we are marking as done, shouldn't already be done!
     assert(buf->consumers_done[ID][consumer_id] == 0);
 
@@ -491,16 +816,12 @@ void private_mark_consumer_done(struct Buffer* buf, const char* name, const int
     buf->consumers_done[ID][consumer_id] = 1;
 }
 
-void private_mark_producer_done(struct Buffer* buf, const char* name, const int ID) {
-    int producer_id = private_get_producer_id(buf, name);
-    if (producer_id == -1) {
-        ERROR_F("The producer %s hasn't been registered!", name);
-    }
-
+void private_mark_producer_done(struct Buffer* buf, const int producer_id, const int ID) {
     // DEBUG_F("%s->producers_done[%d][%d] == %d", buf->buffer_name, ID, producer_id,
     // buf->producers_done[ID][producer_id] );
 
     assert(producer_id != -1);
+    assert(buf->producers[producer_id].in_use == 1);
     // The producer we are marking as done, shouldn't already be done!
     assert(buf->producers_done[ID][producer_id] == 0);
 
@@ -545,18 +866,47 @@ int is_frame_empty(struct Buffer* buf, const int ID) {
 }
 
 uint8_t* wait_for_full_frame(struct Buffer* buf, const char* name, const int ID) {
+    return private_wait_for_full_frame(buf, name, -1, ID);
+}
+
+uint8_t* wait_for_full_frame_h(struct Buffer* buf, const int consumer_id, const int ID) {
+    assert(consumer_id >= 0);
+    assert(consumer_id < MAX_CONSUMERS);
+    return private_wait_for_full_frame(buf, NULL, consumer_id, ID);
+}
+
+uint8_t* private_wait_for_full_frame(struct Buffer* buf, const char* name, int consumer_id,
+                                     const int ID) {
+    if (private_spsc_active(buf)) {
+        int ret = private_spsc_wait(buf, ID, 1, NULL);
+        if (ret == -1)
+            return NULL;
+        if (ret == 0) {
+            buf->consumers[buf->spsc_consumer_id].last_frame_acquired = ID;
+            return buf->frames[ID];
+        }
+        // Otherwise the buffer left the fast path mode, so use the locked path
+    }
+
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
 
-    int consumer_id = private_get_consumer_id(buf, name);
+    if (name != NULL)
+        consumer_id = private_get_consumer_id(buf, name);
     assert(consumer_id != -1);
 
     // This loop exists when is_full == 1 (i.e. a full buffer) AND
     // when this producer hasn't already marked this buffer as
     while ((buf->is_full[ID] == 0 || buf->consumers_done[ID][consumer_id] == 1)
-           && buf->shutdown_signal == 0) {
+           && buf->shutdown_signal == 0 && buf->spsc_active == 0) {
         pthread_cond_wait(&buf->full_cond, &buf->lock);
     }
 
+    // A registration switched the buffer into the fast path while we were waiting
+    if (buf->spsc_active == 1 && buf->shutdown_signal == 0 && buf->is_full[ID] == 0) {
+        CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+        return private_wait_for_full_frame(buf, NULL, consumer_id, ID);
+    }
+
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
 
     if (buf->shutdown_signal == 1)
@@ -568,6 +918,15 @@ uint8_t* wait_for_full_frame(struct Buffer* buf, const char* name, const int ID)
 
 int wait_for_full_frame_timeout(struct Buffer* buf, const char* name, const int ID,
                                 const struct timespec timeout) {
+    if (private_spsc_active(buf)) {
+        int ret = private_spsc_wait(buf, ID, 1, &timeout);
+        if (ret == 0)
+            buf->consumers[buf->spsc_consumer_id].last_frame_acquired = ID;
+        if (ret != 2)
+            return ret;
+        // Otherwise the buffer left the fast path mode, so use the locked path
+    }
+
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
 
     int consumer_id = private_get_consumer_id(buf, name);
@@ -577,10 +936,16 @@ int wait_for_full_frame_timeout(struct Buffer* buf, const char* name, const int
     // This loop exists when is_full == 1 (i.e. a full buffer) AND
     // when this producer hasn't already marked this buffer as
     while ((buf->is_full[ID] == 0 || buf->consumers_done[ID][consumer_id] == 1)
-           && buf->shutdown_signal == 0 && err == 0) {
+           && buf->shutdown_signal == 0 && err == 0 && buf->spsc_active == 0) {
         err = pthread_cond_timedwait(&buf->full_cond, &buf->lock, &timeout);
     }
 
+    // A registration switched the buffer into the fast path while we were waiting
+    if (buf->spsc_active == 1 && buf->shutdown_signal == 0 && err == 0 && buf->is_full[ID] == 0) {
+        CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+        return wait_for_full_frame_timeout(buf, name, ID, timeout);
+    }
+
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
 
     if (buf->shutdown_signal == 1)
@@ -807,6 +1172,13 @@ uint8_t* swap_external_frame(struct Buffer* buf, int frame_id, uint8_t* external
     }
     assert(num_producers == 1);
 
+    // Frames in a huge page region can't be handed out, copy the data in instead.
+    if (buf->frame_region != NULL) {
+        CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
+        memcpy(buf->frames[frame_id], external_frame, buf->frame_size);
+        return external_frame;
+    }
+
     uint8_t* temp_frame = buf->frames[frame_id];
     buf->frames[frame_id] = external_frame;
 
@@ -834,6 +1206,11 @@ void swap_frames(struct Buffer* from_buf, int from_frame_id, struct Buffer* to_b
     assert(num_producers == 1);
     (void)num_producers;
 
+    if (!private_frames_swappable(from_buf, to_buf)) {
+        memcpy(to_buf->frames[to_frame_id], from_buf->frames[from_frame_id], from_buf->frame_size);
+        return;
+    }
+
     // Swap the frames
     uint8_t* temp_frame = from_buf->frames[from_frame_id];
     from_buf->frames[from_frame_id] = to_buf->frames[to_frame_id];
@@ -864,24 +1241,29 @@ void safe_swap_frame(struct Buffer* src_buf, int src_frame_id, struct Buffer* de
     int num_consumers = get_num_consumers(src_buf);
 
     // Copy or transfer the data part.
-    if (num_consumers == 1) {
+    if (num_consumers == 1 && private_frames_swappable(src_buf, dest_buf)) {
         // Swap the frames
         uint8_t* temp_frame = src_buf->frames[src_frame_id];
         src_buf->frames[src_frame_id] = dest_buf->frames[dest_frame_id];
         dest_buf->frames[dest_frame_id] = temp_frame;
-    } else if (num_consumers > 1) {
+    } else if (num_consumers >= 1) {
         // Copy the frame data over, leaving the source intact
         memcpy(dest_buf->frames[dest_frame_id], src_buf->frames[src_frame_id], src_buf->frame_size);
     }
 }
 
 uint8_t* buffer_malloc(ssize_t len, int numa_node) {
+    return private_buffer_malloc(len, numa_node, BUFFER_NUMA_NODE);
+}
+
+uint8_t* private_buffer_malloc(ssize_t len, int numa_node, enum buffer_numa_policy numa_policy) {
 
     uint8_t* frame = NULL;
     int err;
 
 #ifdef WITH_HSA
     (void)err;
+    (void)numa_policy;
     // Is this memory aligned?
     frame = hsa_host_malloc(len, numa_node);
     if (frame == NULL) {
@@ -889,10 +1271,15 @@ uint8_t* buffer_malloc(ssize_t len, int numa_node) {
     }
 #else
 #ifdef WITH_NUMA
-    frame = (uint8_t*)numa_alloc_onnode(len, numa_node);
+    if (numa_policy == BUFFER_NUMA_INTERLEAVE)
+        frame = (uint8_t*)numa_alloc_interleaved(len);
+    else
+        frame = (uint8_t*)numa_alloc_onnode(len, numa_node);
     CHECK_MEM_F(frame);
 #else
     (void)numa_node;
+    if (numa_policy == BUFFER_NUMA_INTERLEAVE)
+        WARN_F("NUMA support isn't enabled, can't interleave frame memory");
     // Create a page aligned block of memory for the buffer
     err = posix_memalign((void**)&(frame), PAGESIZE_MEM, len);
     CHECK_MEM_F(frame);
@@ -921,6 +1308,110 @@ uint8_t* buffer_malloc(ssize_t len, int numa_node) {
     return frame;
 }
 
+void private_alloc_frame_region(struct Buffer* buf, enum buffer_page_size page_size,
+                                enum buffer_numa_policy numa_policy, int numa_node) {
+    const char* page_name = (page_size == BUFFER_PAGES_1GB) ? "1GB" : "2MB";
+#if defined(MAP_HUGETLB) && !defined(WITH_HSA)
+    size_t huge_page = (page_size == BUFFER_PAGES_1GB) ? (1UL << 30) : (2UL << 20);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+    flags |= ((page_size == BUFFER_PAGES_1GB) ? 30 : 21) << MAP_HUGE_SHIFT;
+#endif
+
+    // Round each frame up to a whole number of huge pages so they all start on a page.
+    size_t stride = huge_page * ((buf->aligned_frame_size + huge_page - 1) / huge_page);
+    size_t size = stride * buf->num_frames;
+
+    uint8_t* region = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (region == MAP_FAILED) {
+        WARN_F("Couldn't map %zu bytes of %s huge pages for buffer %s (error %d), check "
+               "/proc/sys/vm/nr_hugepages. Falling back to normal pages.",
+               size, page_name, buf->buffer_name, errno);
+        return;
+    }
+
+    // Set the placement before the pages are touched, so it applies when they fault in.
+#ifdef WITH_NUMA
+    if (numa_available() != -1) {
+        if (numa_policy == BUFFER_NUMA_INTERLEAVE)
+            numa_interleave_memory(region, size, numa_all_nodes_ptr);
+        else
+            numa_tonode_memory(region, size, numa_node);
+    }
+#else
+    (void)numa_node;
+    if (numa_policy == BUFFER_NUMA_INTERLEAVE)
+        WARN_F("NUMA support isn't enabled, can't interleave frame memory");
+#endif
+
+#ifndef WITH_NO_MEMLOCK
+    if (mlock(region, size) == -1) {
+        WARN_F("Error locking %zu bytes of huge pages for buffer %s: %d - check ulimit -a to "
+               "check memlock limits. Falling back to normal pages.",
+               size, buf->buffer_name, errno);
+        munmap(region, size);
+        return;
+    }
+#endif
+
+    // Faults in every page, so a shortage shows up here rather than as a SIGBUS later.
+    memset(region, 0x0, size);
+
+    buf->frame_region = region;
+    buf->frame_region_size = size;
+    buf->frame_page_size = huge_page;
+    for (int i = 0; i < buf->num_frames; ++i) {
+        buf->frames[i] = region + i * stride;
+    }
+#else
+    (void)numa_policy;
+    (void)numa_node;
+    WARN_F("Huge page (%s) backed frames aren't supported in this build, buffer %s will use "
+           "normal pages",
+           page_name, buf->buffer_name);
+#endif
+}
+
+void private_report_frame_placement(struct Buffer* buf, enum buffer_numa_policy numa_policy) {
+    char nodes[128] = "unknown";
+#ifdef WITH_NUMA
+    if (numa_available() != -1) {
+        // Ask the kernel which nodes a sample of pages spread over all the frames are on.
+        void* pages[64];
+        int status[64];
+        int max_samples = sizeof(pages) / sizeof(pages[0]);
+        int per_frame = max_samples / buf->num_frames > 0 ? max_samples / buf->num_frames : 1;
+        size_t step = buf->aligned_frame_size / per_frame;
+        int num_samples = 0;
+        for (int i = 0; i < buf->num_frames && num_samples < max_samples; ++i) {
+            for (int j = 0; j < per_frame && num_samples < max_samples; ++j) {
+                uintptr_t addr = (uintptr_t)buf->frames[i] + j * step;
+                pages[num_samples++] = (void*)(addr & ~(uintptr_t)(PAGESIZE_MEM - 1));
+            }
+        }
+        if (numa_move_pages(0, num_samples, pages, NULL, status, 0) == 0) {
+            int len = 0;
+            for (int node = 0; node <= numa_max_node(); ++node) {
+                for (int k = 0; k < num_samples; ++k) {
+                    if (status[k] == node) {
+                        if (len < (int)sizeof(nodes))
+                            len += snprintf(nodes + len, sizeof(nodes) - len, len ? ",%d" : "%d",
+                                            node);
+                        break;
+                    }
+                }
+            }
+            if (len == 0)
+                snprintf(nodes, sizeof(nodes), "none");
+        }
+    }
+#endif
+    INFO_F("Buffer %s frames are backed by %zu byte pages with NUMA policy %s, sampled pages are "
+           "on node(s) %s",
+           buf->buffer_name, buf->frame_page_size,
+           numa_policy == BUFFER_NUMA_INTERLEAVE ? "interleave" : "node", nodes);
+}
+
 void buffer_free(uint8_t* frame_pointer, size_t size) {
 #ifdef WITH_HSA
     (void)size;
@@ -958,7 +1449,8 @@ double get_last_arrival_time(struct Buffer* buf) {
 
 void send_shutdown_signal(struct Buffer* buf) {
     CHECK_ERROR_F(pthread_mutex_lock(&buf->lock));
-    buf->shutdown_signal = 1;
+    __atomic_store_n(&buf->shutdown_signal, 1, __ATOMIC_SEQ_CST);
+    private_notify_waiters(buf);
     CHECK_ERROR_F(pthread_mutex_unlock(&buf->lock));
 
     CHECK_ERROR_F(pthread_cond_broadcast(&buf->empty_cond));
@@ -4,14 +4,18 @@
  *  - buffer
  *  - StageInfo
  *  - create_buffer
+ *  - create_buffer_with_policy
  *  - delete_buffer
  *  - zero_frames
+ *  - zero_frame_headers
+ *  - set_spsc_fast_path
  *  - register_consumer
  *  - register_producer
  *  - mark_frame_full
  *  - mark_frame_empty
  *  - wait_for_empty_frame
  *  - wait_for_full_frame
+ *  - mark_frame_full_h, mark_frame_empty_h, wait_for_empty_frame_h, wait_for_full_frame_h
  *  - is_frame_empty
  *  - get_num_full_frames
  *  - print_buffer_status
@@ -53,6 +57,24 @@ extern "C" {
 /// The maximum number of producers that can register on a buffer
 #define MAX_PRODUCERS 10
 
+/// The size of the pages backing the frames of a buffer
+enum buffer_page_size {
+    /// Each frame is allocated separately with the system page size
+    BUFFER_PAGES_DEFAULT = 0,
+    /// All frames come from one region of 2 MB huge pages
+    BUFFER_PAGES_2MB = 1,
+    /// All frames come from one region of 1 GB huge pages
+    BUFFER_PAGES_1GB = 2
+};
+
+/// How the frames of a buffer are placed on NUMA nodes
+enum buffer_numa_policy {
+    /// All frame memory is on the buffer's @c numa_node
+    BUFFER_NUMA_NODE = 0,
+    /// Frame memory is interleaved page by page over all NUMA nodes
+    BUFFER_NUMA_INTERLEAVE = 1
+};
+
 /**
  * @struct StageInfo
  * @brief Internal structure for tracking consumer and producer names.
@@ -94,6 +116,11 @@ struct StageInfo {
  * There can be more than one producer or consumer attached to each buffer, but
  * each one must register with the buffer separately.
  *
+ * Stages can refer to themselves either by the name they registered with, or
+ * by the integer handle returned from @c register_consumer() or
+ * @c register_producer().  The @c _h variants of the frame functions take that
+ * handle, which avoids looking up the name on every call.
+ *
  * Consumers must only read data from frames and not write anything back too them.
  * More than one producer can write to a given frame in a multi producer setup,
  * but in that case they must coordinate their address space to not overwrite
@@ -116,6 +143,25 @@ struct StageInfo {
  * @conf frame_size The size of the individual ring frames in bytes
  * @conf num_frames The buffer depth of size of the ring
  * @conf metadata_pool The name of the metadata pool to associate with the buffer
+ * @conf spsc_fast_path Bool, default true.  Allow the lock free single producer, single
+ *                      consumer fast path when exactly one of each is registered.
+ * @conf zero_frames    Bool, default false.  Zero frames after all consumers are done with them.
+ * @conf zero_header_size   Int, default 0.  If non-zero only zero this many bytes at the start
+ *                          of every @c zero_header_stride bytes, instead of the whole frame.
+ * @conf zero_header_stride Int, default frame_size.  The spacing of the headers to zero.
+ * @conf hugepages      String, default "none".  Set to "2MB" or "1GB" to allocate all the frames
+ *                      from one huge page backed region, with each frame aligned to a huge page.
+ *                      If the huge pages can't be had the buffer falls back to normal pages.
+ * @conf numa_policy    String, default "node".  Either "node" to place frames on
+ *                      @c numa_node, or "interleave" to interleave them over all NUMA nodes.
+ *
+ * When exactly one producer and one consumer are registered (and frames are not
+ * being zeroed) the buffer switches to a lock free fast path.  In that mode the
+ * frame state is carried entirely by the atomic @c is_full words, so the
+ * @c wait_for_* and @c mark_frame_* calls don't take @c lock or look up the
+ * stage name, and waiting threads spin briefly before sleeping on a futex
+ * instead of a condition variable.  The mode is recomputed every time a stage
+ * registers, so it is transparent to stages.
  *
  * See metadata.h for more information on metadata pools
  *
@@ -154,6 +200,18 @@ struct Buffer {
      */
     int aligned_frame_size;
 
+    /**
+     * @brief The huge page backed region all the frames were carved from.
+     * NULL if each frame was allocated separately with @c buffer_malloc().
+     */
+    uint8_t* frame_region;
+
+    /// The size of @c frame_region in bytes
+    size_t frame_region_size;
+
+    /// The size in bytes of the pages actually backing the frames
+    size_t frame_page_size;
+
     /**
      * @brief Array of producers which are done (marked frame as full).
      * Format is [ID][producer]
@@ -177,6 +235,18 @@ struct Buffer {
     /// Flag set to indicate if the frames should be zeroed between uses
     int zero_frames;
 
+    /**
+     * @brief The number of bytes to zero at the start of every @c zero_header_stride bytes.
+     * Zero means the whole frame is zeroed.
+     */
+    int zero_header_size;
+
+    /// The spacing in bytes of the headers to zero, only used if @c zero_header_size > 0
+    int zero_header_stride;
+
+    /// The NUMA node the frames were allocated on
+    int numa_node;
+
     /// The array of frames (the actual data we are carrying)
     uint8_t** frames;
 
@@ -200,6 +270,31 @@ struct Buffer {
 
     /// The type of the buffer for use in writing data.
     char* buffer_type;
+
+    /// Set to 1 if the buffer may use the single producer/consumer fast path
+    int spsc_allowed;
+
+    /**
+     * @brief Set to 1 while the single producer/consumer fast path is active
+     * Only changed with @c lock held, but read atomically without it.
+     */
+    int spsc_active;
+
+    /// The index in @c producers of the only producer when @c spsc_active is set
+    int spsc_producer_id;
+
+    /// The index in @c consumers of the only consumer when @c spsc_active is set
+    int spsc_consumer_id;
+
+    /**
+     * @brief Event counter for fast path waiters (used as a futex word)
+     * Incremented every time a frame changes state, the buffer mode
+     * changes or the buffer is shutdown.
+     */
+    int wait_seq;
+
+    /// The number of threads currently sleeping on @c wait_seq
+    int num_waiters;
 };
 
 /**
@@ -220,6 +315,30 @@ struct Buffer {
 struct Buffer* create_buffer(int num_frames, int frame_size, struct metadataPool* pool,
                              const char* buffer_name, const char* buffer_type, int numa_node);
 
+/**
+ * @brief Creates a buffer object with control over how its frame memory is allocated.
+ *
+ * Identical to @c create_buffer(), except that the frames can be backed by
+ * huge pages, and interleaved over NUMA nodes.  With huge pages all frames are
+ * allocated from a single region and each one starts on a huge page boundary.
+ * If that region can't be allocated a warning is logged and the frames are
+ * allocated normally.  The placement that was actually obtained is logged.
+ *
+ * @param[in] num_frames The number of frames to create in the buffer ring.
+ * @param[in] frame_size The length of each frame in bytes.
+ * @param[in] pool The metadataPool, which may be shared between more than one buffer.
+ * @param[in] buffer_name The unique name of this buffer.
+ * @param[in] buffer_type The type of data this buffer contains.
+ * @param[in] numa_node The CPU NUMA memory region to allocate memory in.
+ * @param[in] page_size The size of page to back the frames with.
+ * @param[in] numa_policy Whether to bind the frames to @c numa_node or interleave them.
+ * @returns A buffer object.
+ */
+struct Buffer* create_buffer_with_policy(int num_frames, int frame_size, struct metadataPool* pool,
+                                         const char* buffer_name, const char* buffer_type,
+                                         int numa_node, enum buffer_page_size page_size,
+                                         enum buffer_numa_policy numa_policy);
+
 /**
  * @brief Deletes a buffer object and frees all frame memory
  *
@@ -230,10 +349,39 @@ void delete_buffer(struct Buffer* buf);
 /**
  * @brief Zero all frames after all consumers have marked them as empty
  *
+ * The zeroing is done by a persistent worker pinned to the NUMA node of the buffer
+ * (see bufferZeroer.h), and the frame is only marked as empty once it is finished.
+ *
  * @param[in] buf The buffer object which will be set to automatically zero all frames
  */
 void zero_frames(struct Buffer* buf);
 
+/**
+ * @brief Only zero the headers of each frame after all consumers have marked them as empty
+ *
+ * Zeros the first @c header_size bytes of every @c header_stride bytes of the frame,
+ * which is much cheaper than zeroing the whole frame for packet formats where
+ * invalid packets are detected by a zeroed header (e.g. VDIF, with
+ * @c header_size = 8 and @c header_stride = 1056).
+ *
+ * @param[in] buf The buffer object which will be set to zero frame headers
+ * @param[in] header_size The number of bytes to zero at the start of each header
+ * @param[in] header_stride The spacing in bytes between headers
+ */
+void zero_frame_headers(struct Buffer* buf, int header_size, int header_stride);
+
+/**
+ * @brief Allow or forbid the single producer, single consumer fast path
+ *
+ * By default a buffer with exactly one producer and one consumer uses a lock free
+ * fast path for frame state changes.  Passing @c enable = 0 forces the buffer to
+ * always use the general mutex based path.
+ *
+ * @param[in] buf The buffer object
+ * @param[in] enable 1 to allow the fast path, 0 to disable it.
+ */
+void set_spsc_fast_path(struct Buffer* buf, int enable);
+
 /**
  * @brief Register a consumer with a given name.
  *
@@ -242,8 +390,10 @@ void zero_frames(struct Buffer* buf);
  *
  * @param[in] buf The buffer to register on
  * @param[in] name The name of the consumer.
+ * @returns A handle for use with the @c _h consumer functions, or -1 on failure.
+ *          It remains valid until the consumer is unregistered.
  */
-void register_consumer(struct Buffer* buf, const char* name);
+int register_consumer(struct Buffer* buf, const char* name);
 
 /**
  * @brief Removes the consumer with the given name
@@ -266,8 +416,9 @@ void unregister_consumer(struct Buffer* buf, const char* name);
  *
  * @param[in] buf The buffer to register on
  * @param[in] name The name of the producer.
+ * @returns A handle for use with the @c _h producer functions, or -1 on failure.
  */
-void register_producer(struct Buffer* buf, const char* name);
+int register_producer(struct Buffer* buf, const char* name);
 
 /**
  * @brief Marks a buffer frame as full.
@@ -328,6 +479,44 @@ uint8_t* wait_for_empty_frame(struct Buffer* buf, const char* producer_name, con
  */
 uint8_t* wait_for_full_frame(struct Buffer* buf, const char* consumer_name, const int frame_id);
 
+/**
+ * @brief Same as @c mark_frame_full() but takes the handle from @c register_producer()
+ *
+ * @param[in] buf The buffer containing the frame to mark as full
+ * @param[in] producer_id The handle returned by @c register_producer()
+ * @param[in] frame_id The frame ID to be marked as full
+ */
+void mark_frame_full_h(struct Buffer* buf, const int producer_id, const int frame_id);
+
+/**
+ * @brief Same as @c mark_frame_empty() but takes the handle from @c register_consumer()
+ *
+ * @param[in] buf The buffer containing the frame to mark as empty
+ * @param[in] consumer_id The handle returned by @c register_consumer()
+ * @param[in] frame_id The frame ID to be marked as empty
+ */
+void mark_frame_empty_h(struct Buffer* buf, const int consumer_id, const int frame_id);
+
+/**
+ * @brief Same as @c wait_for_empty_frame() but takes the handle from @c register_producer()
+ *
+ * @param[in] buf The buffer object
+ * @param[in] producer_id The handle returned by @c register_producer()
+ * @param[in] frame_id The id of the frame to wait for.
+ * @returns A pointer to the frame, or NULL if the buffer is shutting down.
+ */
+uint8_t* wait_for_empty_frame_h(struct Buffer* buf, const int producer_id, const int frame_id);
+
+/**
+ * @brief Same as @c wait_for_full_frame() but takes the handle from @c register_consumer()
+ *
+ * @param[in] buf The buffer object
+ * @param[in] consumer_id The handle returned by @c register_consumer()
+ * @param[in] frame_id The id of the frame to wait for.
+ * @returns A pointer to the frame, or NULL if the buffer is shutting down.
+ */
+uint8_t* wait_for_full_frame_h(struct Buffer* buf, const int consumer_id, const int frame_id);
+
 
 /**
  * @brief Wait for a full frame on the given buffer up to timeout.
@@ -431,6 +620,10 @@ void allocate_new_metadata_object(struct Buffer* buf, int frame_id);
  *          freed with @c buffer_free()
  * @warning Take care when using this function!
  *
+ * The frames of a huge page backed buffer can't be handed out, so for those
+ * the contents of @c external_frame are copied into the frame instead, and
+ * @c external_frame itself is returned.
+ *
  * @param buf The buffer object to swap with
  * @param frame_id The frame to swap
  * @param external_frame The extra frame to use in place of the existing internal frame.
@@ -448,6 +641,9 @@ uint8_t* swap_external_frame(struct Buffer* buf, int frame_id, uint8_t* external
  * @warning The buffer sizes must be identical.
  * @warning Take care with this function!
  *
+ * If only one of the buffers is huge page backed the frame is copied into
+ * @c to_buf instead, as frames can't move between the two kinds of allocation.
+ *
  * @param from_buf The buffer to take the frame from, and swap with the @c to_buf frame.
  * @param from_frame_id The frame ID to move to the @c to_buf
  * @param to_buf The buffer to take the frame from @c from_buf
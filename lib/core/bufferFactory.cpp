@@ -2,7 +2,7 @@
 
 #include "Config.hpp"         // for Config
 #include "HFBFrameView.hpp"   // for HFBFrameView
-#include "buffer.h"           // for create_buffer
+#include "buffer.h"           // for create_buffer_with_policy, set_spsc_fast_path, zero_f...
 #include "kotekanLogging.hpp" // for INFO_NON_OO
 #include "metadata.h"         // for metadataPool // IWYU pragma: keep
 #include "visBuffer.hpp"      // for VisFrameView
@@ -96,10 +96,58 @@ struct Buffer* bufferFactory::new_buffer(const string& type_name, const string&
         frame_size = HFBFrameView::calculate_frame_size(config, location);
     }
 
+    bool spsc_fast_path = config.get_default<bool>(location, "spsc_fast_path", true);
+    bool zero = config.get_default<bool>(location, "zero_frames", false);
+    int32_t zero_header_size = config.get_default<int32_t>(location, "zero_header_size", 0);
+    int32_t zero_header_stride =
+        config.get_default<int32_t>(location, "zero_header_stride", (int32_t)frame_size);
+    if (zero_header_size < 0 || zero_header_stride <= 0 || zero_header_size > zero_header_stride)
+        throw std::runtime_error(
+            fmt::format(fmt("Invalid zero_header_size ({:d}) or zero_header_stride ({:d}) for "
+                            "buffer {:s}"),
+                        zero_header_size, zero_header_stride, name));
+
+    std::string hugepages = config.get_default<std::string>(location, "hugepages", "none");
+    enum buffer_page_size page_size;
+    if (hugepages == "none") {
+        page_size = BUFFER_PAGES_DEFAULT;
+    } else if (hugepages == "2MB") {
+        page_size = BUFFER_PAGES_2MB;
+    } else if (hugepages == "1GB") {
+        page_size = BUFFER_PAGES_1GB;
+    } else {
+        throw std::runtime_error(fmt::format(
+            fmt("Invalid hugepages ({:s}) for buffer {:s}, must be none, 2MB or 1GB"), hugepages,
+            name));
+    }
+
+    std::string numa_policy_name = config.get_default<std::string>(location, "numa_policy", "node");
+    enum buffer_numa_policy numa_policy;
+    if (numa_policy_name == "node") {
+        numa_policy = BUFFER_NUMA_NODE;
+    } else if (numa_policy_name == "interleave") {
+        numa_policy = BUFFER_NUMA_INTERLEAVE;
+    } else {
+        throw std::runtime_error(fmt::format(
+            fmt("Invalid numa_policy ({:s}) for buffer {:s}, must be node or interleave"),
+            numa_policy_name, name));
+    }
+
     INFO_NON_OO("Creating {:s}Buffer named {:s} with {:d} frames, frame size of {:d} and "
                 "metadata pool {:s} on numa_node {:d}",
                 type_name, name, num_frames, frame_size, metadataPool_name, numa_node);
-    return create_buffer(num_frames, frame_size, pool, name.c_str(), type_name.c_str(), numa_node);
+    struct Buffer* buf = create_buffer_with_policy(num_frames, frame_size, pool, name.c_str(),
+                                                   type_name.c_str(), numa_node, page_size,
+                                                   numa_policy);
+    if (buf != nullptr && !spsc_fast_path)
+        set_spsc_fast_path(buf, 0);
+    if (buf != nullptr && zero) {
+        if (zero_header_size > 0)
+            zero_frame_headers(buf, zero_header_size, zero_header_stride);
+        else
+            zero_frames(buf);
+    }
+    return buf;
 
     // No metadata found
     throw std::runtime_error(fmt::format(fmt("No buffer type named: {:s}"), name));
@@ -0,0 +1,231 @@
+#include "bufferZeroer.h"
+
+#include "kotekanLogging.hpp"    // for INFO_NON_OO, WARN_NON_OO
+#include "prometheusMetrics.hpp" // for Metrics, Gauge, Counter, MetricFamily
+
+#include <chrono>             // for duration, steady_clock, time_point
+#include <condition_variable> // for condition_variable
+#include <deque>              // for deque
+#include <map>                // for map
+#include <memory>             // for unique_ptr, make_unique
+#include <mutex>              // for mutex, lock_guard, unique_lock
+#include <pthread.h>          // for pthread_setaffinity_np
+#include <sched.h>            // for cpu_set_t, CPU_SET, CPU_ZERO, CPU_COUNT
+#include <string>             // for string, to_string
+#include <thread>             // for thread
+#include <vector>             // for vector
+#ifdef WITH_NUMA
+#include <numa.h> // for numa_available, numa_node_to_cpus, numa_allocate_cpumask
+#endif
+
+using kotekan::prometheus::Counter;
+using kotekan::prometheus::Gauge;
+using kotekan::prometheus::MetricFamily;
+using kotekan::prometheus::Metrics;
+
+namespace {
+
+/**
+ * @class bufferZeroer
+ * @brief Singleton holding the per NUMA node zeroing workers.
+ */
+class bufferZeroer {
+public:
+    static bufferZeroer& instance() {
+        static bufferZeroer _instance;
+        return _instance;
+    }
+
+    int submit(Buffer* buf, int ID, int numa_node, buffer_zero_fn zero_fn);
+    void flush(Buffer* buf);
+
+private:
+    struct zeroJob {
+        Buffer* buf;
+        int ID;
+        buffer_zero_fn zero_fn;
+        std::chrono::steady_clock::time_point submit_time;
+    };
+
+    /// The queue and worker thread for one NUMA node
+    struct worker {
+        worker(int numa_node, Gauge& queue_depth, Counter& zeroed_frames, Gauge& latency,
+               Counter& queue_full) :
+            numa_node(numa_node),
+            queue_depth(queue_depth),
+            zeroed_frames(zeroed_frames),
+            latency(latency),
+            queue_full(queue_full) {}
+
+        const int numa_node;
+        std::mutex lock;
+        std::condition_variable cond;
+        std::deque<zeroJob> queue;
+        bool stop = false;
+        std::thread thread;
+
+        Gauge& queue_depth;
+        Counter& zeroed_frames;
+        Gauge& latency;
+        Counter& queue_full;
+    };
+
+    bufferZeroer();
+    ~bufferZeroer();
+
+    worker& get_worker(int numa_node);
+    void run(worker& w);
+    void set_affinity(worker& w);
+    void job_done(Buffer* buf);
+
+    std::mutex workers_lock;
+    std::map<int, std::unique_ptr<worker>> workers;
+
+    /// Number of queued or running jobs for each buffer, used by @c flush
+    std::mutex pending_lock;
+    std::condition_variable pending_cond;
+    std::map<Buffer*, int> pending;
+
+    MetricFamily<Gauge>& queue_depth_metric;
+    MetricFamily<Counter>& zeroed_frames_metric;
+    MetricFamily<Gauge>& latency_metric;
+    MetricFamily<Counter>& queue_full_metric;
+};
+
+bufferZeroer::bufferZeroer() :
+    // clang-format off
+    queue_depth_metric(Metrics::instance().add_gauge(
+        "kotekan_buffer_zero_queue_depth", "buffer_zeroer", {"numa_node"})),
+    zeroed_frames_metric(Metrics::instance().add_counter(
+        "kotekan_buffer_zero_frames_total", "buffer_zeroer", {"numa_node"})),
+    latency_metric(Metrics::instance().add_gauge(
+        "kotekan_buffer_zero_latency_seconds", "buffer_zeroer", {"numa_node"})),
+    queue_full_metric(Metrics::instance().add_counter(
+        "kotekan_buffer_zero_queue_full_total", "buffer_zeroer", {"numa_node"}))
+// clang-format on
+{}
+
+bufferZeroer::~bufferZeroer() {
+    for (auto& w : workers) {
+        {
+            std::lock_guard<std::mutex> lock(w.second->lock);
+            w.second->stop = true;
+        }
+        w.second->cond.notify_all();
+        w.second->thread.join();
+    }
+}
+
+bufferZeroer::worker& bufferZeroer::get_worker(int numa_node) {
+    std::lock_guard<std::mutex> lock(workers_lock);
+
+    auto it = workers.find(numa_node);
+    if (it != workers.end())
+        return *it->second;
+
+    const std::vector<std::string> labels = {std::to_string(numa_node)};
+    auto w = std::make_unique<worker>(
+        numa_node, queue_depth_metric.labels(labels), zeroed_frames_metric.labels(labels),
+        latency_metric.labels(labels), queue_full_metric.labels(labels));
+    w->thread = std::thread(&bufferZeroer::run, this, std::ref(*w));
+    set_affinity(*w);
+
+    INFO_NON_OO("Started frame zeroing worker for NUMA node {:d}", numa_node);
+
+    return *(workers[numa_node] = std::move(w));
+}
+
+void bufferZeroer::set_affinity(worker& w) {
+#ifdef WITH_NUMA
+    if (numa_available() == -1)
+        return;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    struct bitmask* cpus = numa_allocate_cpumask();
+    if (numa_node_to_cpus(w.numa_node, cpus) == 0) {
+        for (unsigned int i = 0; i < cpus->size && i < CPU_SETSIZE; ++i) {
+            if (numa_bitmask_isbitset(cpus, i))
+                CPU_SET(i, &cpuset);
+        }
+    }
+    numa_free_cpumask(cpus);
+
+    if (CPU_COUNT(&cpuset) == 0) {
+        WARN_NON_OO("No CPUs found for NUMA node {:d}, frame zeroing worker won't be pinned",
+                    w.numa_node);
+        return;
+    }
+    pthread_setaffinity_np(w.thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+#else
+    (void)w;
+#endif
+}
+
+int bufferZeroer::submit(Buffer* buf, int ID, int numa_node, buffer_zero_fn zero_fn) {
+    worker& w = get_worker(numa_node);
+
+    {
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (w.queue.size() >= BUFFER_ZEROER_QUEUE_SIZE) {
+            w.queue_full.inc();
+            return -1;
+        }
+        {
+            std::lock_guard<std::mutex> pending_guard(pending_lock);
+            pending[buf]++;
+        }
+        w.queue.push_back({buf, ID, zero_fn, std::chrono::steady_clock::now()});
+        w.queue_depth.set(w.queue.size());
+    }
+    w.cond.notify_one();
+
+    return 0;
+}
+
+void bufferZeroer::run(worker& w) {
+    std::unique_lock<std::mutex> lock(w.lock);
+
+    while (true) {
+        w.cond.wait(lock, [&w] { return w.stop || !w.queue.empty(); });
+        if (w.queue.empty())
+            break;
+
+        zeroJob job = w.queue.front();
+        w.queue.pop_front();
+        w.queue_depth.set(w.queue.size());
+        lock.unlock();
+
+        job.zero_fn(job.buf, job.ID);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - job.submit_time;
+        w.latency.set(elapsed.count());
+        w.zeroed_frames.inc();
+        job_done(job.buf);
+
+        lock.lock();
+    }
+}
+
+void bufferZeroer::job_done(Buffer* buf) {
+    std::lock_guard<std::mutex> lock(pending_lock);
+    if (--pending[buf] == 0) {
+        pending.erase(buf);
+        pending_cond.notify_all();
+    }
+}
+
+void bufferZeroer::flush(Buffer* buf) {
+    std::unique_lock<std::mutex> lock(pending_lock);
+    pending_cond.wait(lock, [this, buf] { return pending.count(buf) == 0; });
+}
+
+} // namespace
+
+int buffer_zeroer_submit(Buffer* buf, int ID, int numa_node, buffer_zero_fn zero_fn) {
+    return bufferZeroer::instance().submit(buf, ID, numa_node, zero_fn);
+}
+
+void buffer_zeroer_flush(Buffer* buf) {
+    bufferZeroer::instance().flush(buf);
+}
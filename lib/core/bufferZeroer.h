@@ -0,0 +1,66 @@
+/**
+ * @file
+ * @brief Persistent worker pool used by buffers to zero frames off the critical path.
+ * - buffer_zeroer_submit
+ * - buffer_zeroer_flush
+ *
+ * Buffers which have been set to zero their frames (see @c zero_frames()) hand each
+ * released frame to this service instead of starting a new thread for it.  There is
+ * one worker thread per NUMA node, pinned to the CPUs of that node, which is started
+ * the first time a frame from a buffer on that node is submitted.  Each worker has a
+ * bounded queue, if it is full the submit call fails and the caller must zero the
+ * frame itself.
+ *
+ * The following Prometheus metrics are exported, all labelled by @c numa_node:
+ * @metric kotekan_buffer_zero_queue_depth
+ *         The number of frames waiting to be zeroed.
+ * @metric kotekan_buffer_zero_frames_total
+ *         The number of frames zeroed by the worker.
+ * @metric kotekan_buffer_zero_latency_seconds
+ *         The time from submitting the last frame until it was marked empty.
+ * @metric kotekan_buffer_zero_queue_full_total
+ *         The number of frames which couldn't be queued because the queue was full.
+ */
+
+#ifndef BUFFER_ZEROER_H
+#define BUFFER_ZEROER_H
+
+struct Buffer;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// The maximum number of frames waiting to be zeroed on each NUMA node.
+#define BUFFER_ZEROER_QUEUE_SIZE 1024
+
+/**
+ * @brief Function run by the worker to zero frame @c ID of @c buf and mark it empty.
+ */
+typedef void (*buffer_zero_fn)(struct Buffer* buf, int ID);
+
+/**
+ * @brief Queue a frame to be zeroed by the worker for @c numa_node
+ *
+ * @param buf The buffer which owns the frame.
+ * @param ID The frame to zero.
+ * @param numa_node The NUMA node the frame memory was allocated on.
+ * @param zero_fn The function the worker calls to do the zeroing.
+ * @return 0 if the frame was queued, -1 if the queue was full.
+ */
+int buffer_zeroer_submit(struct Buffer* buf, int ID, int numa_node, buffer_zero_fn zero_fn);
+
+/**
+ * @brief Block until no frames from @c buf are queued or being zeroed.
+ *
+ * Must be called before the buffer is deleted.
+ *
+ * @param buf The buffer to wait for.
+ */
+void buffer_zeroer_flush(struct Buffer* buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,357 @@
+#include "configLoader.hpp"
+
+#include "kotekanLogging.hpp" // for WARN_NON_OO, DEBUG_NON_OO
+
+#include "MurmurHash3.hpp" // for MurmurHash3_x64_128
+#include "fmt.hpp"         // for format, fmt
+
+#include <algorithm>  // for sort, remove, transform, min
+#include <cstdint>    // for uint8_t, uint64_t
+#include <dirent.h>   // for opendir, readdir, closedir, dirent
+#include <errno.h>    // for errno, EEXIST, ERANGE
+#include <fstream>    // for ifstream
+#include <iterator>   // for istreambuf_iterator
+#include <stdexcept>  // for runtime_error
+#include <stdio.h>    // for rename
+#include <stdlib.h>   // for mkstemp
+#include <string.h>   // for strerror
+#include <sys/stat.h> // for mkdir, stat, fchmod
+#include <unistd.h>   // for close, unlink, write
+#include <vector>     // for vector
+
+#ifdef WITH_YAML_CPP
+#include <cctype>          // for tolower
+#include <cmath>           // for INFINITY, NAN
+#include <regex>           // for regex, regex_match
+#include <yaml-cpp/yaml.h> // for Node, Load, Exception, NodeType
+#endif
+
+using nlohmann::json;
+
+namespace kotekan {
+
+namespace {
+
+// Changing how configs are converted must change this, so the old entries aren't used
+const std::string CACHE_VERSION = "kotekan-config-1";
+
+// Create a directory and any missing parents
+void make_dir(const std::string& path) {
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        mkdir(path.substr(0, pos).c_str(), 0775);
+    }
+    if (mkdir(path.c_str(), 0775) < 0 && errno != EEXIST) {
+        throw std::runtime_error(fmt::format(
+            fmt("configCache: could not create directory {:s}: {:s}"), path, strerror(errno)));
+    }
+}
+
+#ifdef WITH_YAML_CPP
+
+// The implicit resolvers of YAML 1.1, as PyYAML has them
+const std::regex bool_regex("yes|Yes|YES|no|No|NO|true|True|TRUE|false|False|FALSE"
+                            "|on|On|ON|off|Off|OFF");
+const std::regex int_regex("[-+]?0b[0-1_]+|[-+]?0[0-7_]+|[-+]?(?:0|[1-9][0-9_]*)"
+                           "|[-+]?0x[0-9a-fA-F_]+|[-+]?[1-9][0-9_]*(?::[0-5]?[0-9])+");
+const std::regex float_regex("[-+]?(?:[0-9][0-9_]*)\\.[0-9_]*(?:[eE][-+][0-9]+)?"
+                             "|\\.[0-9][0-9_]*(?:[eE][-+][0-9]+)?"
+                             "|[-+]?[0-9][0-9_]*(?::[0-5]?[0-9])+\\.[0-9_]*"
+                             "|[-+]?\\.(?:inf|Inf|INF)|\\.(?:nan|NaN|NAN)");
+const std::regex null_regex("~|null|Null|NULL|");
+
+const std::string TAG_PREFIX = "tag:yaml.org,2002:";
+
+[[noreturn]] void yaml_error(const YAML::Node& node, const std::string& msg) {
+    throw std::runtime_error(fmt::format(fmt("Error parsing YAML at line {:d}, column {:d}: {:s}"),
+                                         node.Mark().line + 1, node.Mark().column + 1, msg));
+}
+
+// Remove the underscores and the sign, returning the sign
+int strip_number(std::string& value) {
+    value.erase(std::remove(value.begin(), value.end(), '_'), value.end());
+    int sign = 1;
+    if (!value.empty() && (value[0] == '-' || value[0] == '+')) {
+        sign = (value[0] == '-') ? -1 : 1;
+        value.erase(0, 1);
+    }
+    return sign;
+}
+
+json construct_int(const YAML::Node& node, std::string value) {
+    int sign = strip_number(value);
+
+    uint64_t magnitude = 0;
+    errno = 0;
+    if (value.compare(0, 2, "0b") == 0) {
+        magnitude = strtoull(value.c_str() + 2, nullptr, 2);
+    } else if (value.compare(0, 2, "0x") == 0) {
+        magnitude = strtoull(value.c_str() + 2, nullptr, 16);
+    } else if (value.find(':') != std::string::npos) {
+        // Sexagesimal, e.g. 1:30 is 90
+        size_t start = 0;
+        while (start <= value.size()) {
+            size_t end = std::min(value.find(':', start), value.size());
+            std::string digits = value.substr(start, end - start);
+            magnitude = magnitude * 60 + strtoull(digits.c_str(), nullptr, 10);
+            start = end + 1;
+        }
+    } else if (value.size() > 1 && value[0] == '0') {
+        magnitude = strtoull(value.c_str(), nullptr, 8);
+    } else {
+        magnitude = strtoull(value.c_str(), nullptr, 10);
+        // Python has no limit, and json.loads turns larger numbers into floats
+        if (errno == ERANGE) {
+            errno = 0;
+            return sign * strtod(value.c_str(), nullptr);
+        }
+    }
+    if (errno == ERANGE)
+        yaml_error(node, fmt::format(fmt("Integer {:s} is too large"), node.Scalar()));
+
+    // Like json.loads, only negative numbers are signed
+    if (sign > 0)
+        return magnitude;
+    if (magnitude <= (uint64_t)INT64_MAX + 1)
+        return (int64_t)(0 - magnitude);
+    return -(double)magnitude;
+}
+
+json construct_float(std::string value) {
+    int sign = strip_number(value);
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+
+    if (value == ".inf")
+        return sign * INFINITY;
+    if (value == ".nan")
+        return NAN;
+    if (value.find(':') != std::string::npos) {
+        double result = 0;
+        size_t start = 0;
+        while (start <= value.size()) {
+            size_t end = std::min(value.find(':', start), value.size());
+            result = result * 60 + strtod(value.substr(start, end - start).c_str(), nullptr);
+            start = end + 1;
+        }
+        return sign * result;
+    }
+    return sign * strtod(value.c_str(), nullptr);
+}
+
+json construct_bool(const std::string& value) {
+    std::string lower = value;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    return lower == "yes" || lower == "true" || lower == "on";
+}
+
+// Resolve a scalar, by its tag or, if it has none, by its value
+json construct_scalar(const YAML::Node& node) {
+    const std::string& tag = node.Tag();
+    const std::string& value = node.Scalar();
+
+    // Quoted and block scalars are always strings
+    if (tag == "!")
+        return value;
+
+    if (tag == "?" || tag.empty()) {
+        if (std::regex_match(value, bool_regex))
+            return construct_bool(value);
+        if (std::regex_match(value, int_regex))
+            return construct_int(node, value);
+        if (std::regex_match(value, float_regex))
+            return construct_float(value);
+        if (std::regex_match(value, null_regex))
+            return nullptr;
+        return value;
+    }
+
+    if (tag == TAG_PREFIX + "str")
+        return value;
+    if (tag == TAG_PREFIX + "int" && std::regex_match(value, int_regex))
+        return construct_int(node, value);
+    if (tag == TAG_PREFIX + "float" && std::regex_match(value, float_regex))
+        return construct_float(value);
+    if (tag == TAG_PREFIX + "float" && std::regex_match(value, int_regex))
+        return construct_float(value);
+    if (tag == TAG_PREFIX + "bool" && std::regex_match(value, bool_regex))
+        return construct_bool(value);
+    if (tag == TAG_PREFIX + "null" && std::regex_match(value, null_regex))
+        return nullptr;
+    yaml_error(node, fmt::format(fmt("Can't convert {:s} with tag {:s}"), value, tag));
+}
+
+// Convert a key to a string like json.dumps does
+std::string construct_key(const YAML::Node& node) {
+    if (node.IsNull())
+        return "null";
+    if (!node.IsScalar())
+        yaml_error(node, "Keys must be scalars");
+
+    json key = construct_scalar(node);
+    if (key.is_string())
+        return key.get<std::string>();
+    if (key.is_null())
+        return "null";
+    return key.dump();
+}
+
+json construct(const YAML::Node& node) {
+    switch (node.Type()) {
+        case YAML::NodeType::Null:
+            return nullptr;
+        case YAML::NodeType::Scalar:
+            return construct_scalar(node);
+        case YAML::NodeType::Sequence: {
+            json array = json::array();
+            for (const auto& item : node)
+                array.push_back(construct(item));
+            return array;
+        }
+        case YAML::NodeType::Map: {
+            json object = json::object();
+            json merged = json::object();
+            for (const auto& item : node) {
+                // Merge keys add the keys of other maps, the first one wins
+                if (item.first.IsScalar() && item.first.Tag() == "?"
+                    && item.first.Scalar() == "<<") {
+                    json values = construct(item.second);
+                    if (values.is_object())
+                        values = json::array({values});
+                    if (!values.is_array())
+                        yaml_error(item.second, "Merge keys need a map or a list of maps");
+                    for (auto& value : values) {
+                        if (!value.is_object())
+                            yaml_error(item.second, "Merge keys need a map or a list of maps");
+                        for (auto it = value.begin(); it != value.end(); ++it)
+                            merged.emplace(it.key(), it.value());
+                    }
+                    continue;
+                }
+                // Later keys replace earlier ones
+                object[construct_key(item.first)] = construct(item.second);
+            }
+            for (auto it = merged.begin(); it != merged.end(); ++it)
+                object.emplace(it.key(), it.value());
+            return object;
+        }
+        default:
+            return nullptr;
+    }
+}
+
+#endif
+
+} // namespace
+
+#ifdef WITH_YAML_CPP
+json parse_yaml(const std::string& yaml) {
+    YAML::Node root;
+    try {
+        root = YAML::Load(yaml);
+    } catch (YAML::Exception& e) {
+        throw std::runtime_error(
+            fmt::format(fmt("Error parsing YAML at line {:d}, column {:d}: {:s}"),
+                        e.mark.line + 1, e.mark.column + 1, e.msg));
+    }
+    return construct(root);
+}
+#endif
+
+configCache::configCache(const std::string& path) : _path(path) {
+    make_dir(_path);
+}
+
+std::string configCache::key(const std::string& file_name, bool is_template,
+                             const std::string& variables) {
+    std::ifstream in(file_name, std::ios::binary);
+    if (!in)
+        throw std::runtime_error(
+            fmt::format(fmt("configCache: could not read {:s}: {:s}"), file_name, strerror(errno)));
+    std::string data = CACHE_VERSION + "\n";
+    data.append(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+    if (is_template) {
+        data += "\n" + variables;
+
+        size_t slash = file_name.find_last_of('/');
+        std::string dir = ".";
+        if (slash != std::string::npos)
+            dir = (slash == 0) ? "/" : file_name.substr(0, slash);
+        std::vector<std::string> files;
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d)) {
+                struct stat st;
+                std::string name = dir + "/" + e->d_name;
+                if (stat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                    files.push_back(fmt::format(fmt("{:s} {:d} {:d}.{:09d}"), e->d_name,
+                                                st.st_size, st.st_mtim.tv_sec,
+                                                st.st_mtim.tv_nsec));
+            }
+            closedir(d);
+        }
+        std::sort(files.begin(), files.end());
+        for (auto& file : files)
+            data += "\n" + file;
+    }
+
+    uint64_t h[2];
+    MurmurHash3_x64_128(data.data(), data.size(), 0, h);
+    return fmt::format(fmt("{:016x}{:016x}"), h[0], h[1]);
+}
+
+std::string configCache::entry_file(const std::string& key) const {
+    return fmt::format(fmt("{:s}/{:s}.cbor"), _path, key);
+}
+
+std::optional<json> configCache::get(const std::string& key) const {
+    std::string file = entry_file(key);
+    std::ifstream in(file, std::ios::binary);
+    if (!in)
+        return std::nullopt;
+
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+    try {
+        return json::from_cbor(data);
+    } catch (std::exception& e) {
+        WARN_NON_OO("configCache: could not read {:s}: {:s}", file, e.what());
+        return std::nullopt;
+    }
+}
+
+bool configCache::put(const std::string& key, const json& config) const {
+    std::string file = entry_file(key);
+    std::vector<uint8_t> data = json::to_cbor(config);
+
+    // Write a temporary file next to the entry, then move it into place
+    std::string tmp = file + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        WARN_NON_OO("configCache: could not create {:s}: {:s}", tmp, strerror(errno));
+        return false;
+    }
+    fchmod(fd, 0644);
+
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t ret = write(fd, data.data() + written, data.size() - written);
+        if (ret < 0) {
+            WARN_NON_OO("configCache: could not write {:s}: {:s}", tmp, strerror(errno));
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        written += ret;
+    }
+    close(fd);
+
+    if (rename(tmp.c_str(), file.c_str()) < 0) {
+        WARN_NON_OO("configCache: could not move {:s} into place: {:s}", file, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    DEBUG_NON_OO("configCache: saved {:s}", file);
+    return true;
+}
+
+} // namespace kotekan
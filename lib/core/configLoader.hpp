@@ -0,0 +1,106 @@
+/*****************************************
+@file
+@brief Load YAML configs, and cache the JSON they are converted to.
+- parse_yaml
+- configCache
+*****************************************/
+#ifndef CONFIG_LOADER_HPP
+#define CONFIG_LOADER_HPP
+
+#include "json.hpp" // for json
+
+#include <optional> // for optional
+#include <string>   // for string
+
+namespace kotekan {
+
+#ifdef WITH_YAML_CPP
+/**
+ * @brief Convert a YAML document into JSON.
+ *
+ * Gives the same JSON as loading the document with PyYAML's `safe_load`, as
+ * the Python config script does. So plain scalars are resolved by the rules
+ * of YAML 1.1: `yes` and `off` are booleans, `0755` is an octal integer and
+ * `1e5`, without a dot, is a string. Merge keys (`<<`) are applied. Keys which
+ * aren't strings are converted to strings like Python's `json.dumps` does.
+ * Timestamps are kept as strings.
+ *
+ * @param  yaml  The YAML document.
+ *
+ * @returns The document as JSON.
+ *
+ * @throws std::runtime_error with the line and column of the error if the
+ *         YAML can't be parsed.
+ **/
+nlohmann::json parse_yaml(const std::string& yaml);
+#endif
+
+/**
+ * @brief A directory of configs, converted to JSON.
+ *
+ * Converting a config, especially a Jinja template, can take seconds. The
+ * result is kept here so that a restart with the same config can skip this.
+ * Each entry is a CBOR file named by a hash of the config file, see @c key.
+ *
+ * Entries are written to a temporary file that is then renamed into place,
+ * so several kotekan instances can share a cache. Entries that can't be read
+ * are logged and treated as missing.
+ **/
+class configCache {
+public:
+    /**
+     * @brief Open a cache, creating its directory if needed.
+     *
+     * @param  path  The directory of the cache.
+     *
+     * @throws std::runtime_error if the directory can't be created.
+     **/
+    explicit configCache(const std::string& path);
+
+    /**
+     * @brief Get the key of a config file.
+     *
+     * This is a hash of the contents of the file. A Jinja template can
+     * include other files from its directory, so for templates the name, size
+     * and modification time of each file in that directory are added, as well
+     * as the template variables.
+     *
+     * @param  file_name    The config file.
+     * @param  is_template  If the file is a Jinja template.
+     * @param  variables    The template variables, in JSON.
+     *
+     * @returns The key.
+     *
+     * @throws std::runtime_error if the file can't be read.
+     **/
+    static std::string key(const std::string& file_name, bool is_template,
+                           const std::string& variables);
+
+    /**
+     * @brief Load a config.
+     *
+     * @param  key  Key of the config file.
+     *
+     * @returns The config, if it is in the cache.
+     **/
+    std::optional<nlohmann::json> get(const std::string& key) const;
+
+    /**
+     * @brief Save a config.
+     *
+     * @param  key     Key of the config file.
+     * @param  config  The config.
+     *
+     * @returns False if the config could not be written.
+     **/
+    bool put(const std::string& key, const nlohmann::json& config) const;
+
+private:
+    std::string entry_file(const std::string& key) const;
+
+    std::string _path;
+};
+
+} // namespace kotekan
+
+#endif // CONFIG_LOADER_HPP
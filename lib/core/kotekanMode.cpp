@@ -111,6 +111,7 @@ void kotekanMode::initalize_stages() {
 
     // Update REST server
     restServer::instance().set_server_affinity(config);
+    restServer::instance().set_worker_config(config);
 
     // Register pipeline status callbacks
     restServer::instance().register_get_callback(
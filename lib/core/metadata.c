@@ -6,6 +6,12 @@
 #include <stdlib.h> // for malloc, free
 #include <string.h> // for memset
 
+// Pops a container index off the free stack, returns METADATA_POOL_EMPTY if there are none.
+static uint32_t private_pop_free(struct metadataPool* pool);
+
+// Pushes the container index `index` onto the free stack.
+static void private_push_free(struct metadataPool* pool, uint32_t index);
+
 // *** Metadata object section ***
 
 struct metadataContainer* create_metadata(size_t object_size, struct metadataPool* parent_pool) {
@@ -20,6 +26,7 @@ struct metadataContainer* create_metadata(size_t object_size, struct metadataPoo
 
     metadata_container->ref_count = 0;
     metadata_container->parent_pool = parent_pool;
+    metadata_container->pool_index = 0;
 
     reset_metadata_object(metadata_container);
 
@@ -39,7 +46,7 @@ void delete_metadata(struct metadataContainer* container) {
 }
 
 void reset_metadata_object(struct metadataContainer* container) {
-    assert(container->ref_count == 0);
+    assert(__atomic_load_n(&container->ref_count, __ATOMIC_ACQUIRE) == 0);
     memset(container->metadata, 0, container->metadata_size);
 }
 
@@ -52,24 +59,18 @@ void unlock_metadata(struct metadataContainer* container) {
 }
 
 void increment_metadata_ref_count(struct metadataContainer* container) {
-    lock_metadata(container);
-    container->ref_count += 1;
-    unlock_metadata(container);
+    // The caller already holds a reference, so no ordering is needed here.
+    __atomic_add_fetch(&container->ref_count, 1, __ATOMIC_RELAXED);
 }
 
 void decrement_metadata_ref_count(struct metadataContainer* container) {
-    uint32_t local_ref_count;
-
-    lock_metadata(container);
-
-    assert(container->ref_count > 0);
+    // Release our writes to the metadata, and if we are the last reference
+    // acquire everyone else's before the container is reset.
+    uint32_t old_ref_count = __atomic_fetch_sub(&container->ref_count, 1, __ATOMIC_ACQ_REL);
 
-    container->ref_count -= 1;
-    local_ref_count = container->ref_count;
+    assert(old_ref_count > 0);
 
-    unlock_metadata(container);
-
-    if (local_ref_count == 0) {
+    if (old_ref_count == 1) {
         return_metadata_to_pool(container->parent_pool, container);
     }
 }
@@ -83,17 +84,22 @@ struct metadataPool* create_metadata_pool(int num_metadata_objects, size_t objec
 
     pool->pool_size = num_metadata_objects;
     pool->metadata_object_size = object_size;
-    CHECK_ERROR_F(pthread_mutex_init(&pool->pool_lock, NULL));
 
     pool->in_use = malloc(pool->pool_size * sizeof(int));
     CHECK_MEM_F(pool->in_use);
+    pool->next_free = malloc(pool->pool_size * sizeof(uint32_t));
+    CHECK_MEM_F(pool->next_free);
     pool->metadata_objects = malloc(pool->pool_size * sizeof(struct metadataContainer*));
     CHECK_MEM_F(pool->metadata_objects);
 
+    // Put all the containers on the free stack, lowest index on top.
     for (unsigned int i = 0; i < pool->pool_size; ++i) {
         pool->metadata_objects[i] = create_metadata(object_size, pool);
+        pool->metadata_objects[i]->pool_index = i;
         pool->in_use[i] = 0;
+        pool->next_free[i] = (i + 1 < pool->pool_size) ? i + 1 : METADATA_POOL_EMPTY;
     }
+    pool->free_head = (pool->pool_size > 0) ? 0 : METADATA_POOL_EMPTY;
 
     return pool;
 }
@@ -103,51 +109,73 @@ void delete_metadata_pool(struct metadataPool* pool) {
         delete_metadata(pool->metadata_objects[i]);
     }
 
-    CHECK_ERROR_F(pthread_mutex_destroy(&pool->pool_lock));
     free(pool->metadata_objects);
     free(pool->in_use);
+    free(pool->next_free);
+}
+
+static uint32_t private_pop_free(struct metadataPool* pool) {
+    uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    uint32_t index;
+
+    do {
+        index = (uint32_t)head;
+        if (index == METADATA_POOL_EMPTY)
+            return METADATA_POOL_EMPTY;
+        // This can read a stale value if another thread pops `index` first, but then
+        // the counter in the head has changed and the swap below fails.
+        uint32_t next = __atomic_load_n(&pool->next_free[index], __ATOMIC_RELAXED);
+        new_head = (((head >> 32) + 1) << 32) | next;
+    } while (!__atomic_compare_exchange_n(&pool->free_head, &head, new_head, 1, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+
+    return index;
+}
+
+static void private_push_free(struct metadataPool* pool, uint32_t index) {
+    uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+
+    do {
+        __atomic_store_n(&pool->next_free[index], (uint32_t)head, __ATOMIC_RELAXED);
+        new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!__atomic_compare_exchange_n(&pool->free_head, &head, new_head, 1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
 }
 
 struct metadataContainer* request_metadata_object(struct metadataPool* pool) {
     struct metadataContainer* container = NULL;
 
-    CHECK_ERROR_F(pthread_mutex_lock(&pool->pool_lock));
-
-    // TODO there are better data structures for this.
-    for (unsigned int i = 0; i < pool->pool_size; ++i) {
-        if (pool->in_use[i] == 0) {
-            // DEBUG_F("pool->metadata_objects[%d] == %p", i, pool->metadata_objects[i]);
-            container = pool->metadata_objects[i];
-            assert(container->ref_count == 0); // Shouldn't give an inuse object (!)
-            container->ref_count = 1;
-            pool->in_use[i] = 1;
-            break;
-        }
-    }
-    CHECK_ERROR_F(pthread_mutex_unlock(&pool->pool_lock));
+    uint32_t index = private_pop_free(pool);
 
     // We will assume that we cannot use more containers than are in the pool.
     // If you hit this increase your pool size.
-    assert(container != NULL);
+    assert(index != METADATA_POOL_EMPTY);
+    if (index == METADATA_POOL_EMPTY)
+        return NULL;
+
+    container = pool->metadata_objects[index];
+    int was_in_use = __atomic_exchange_n(&pool->in_use[index], 1, __ATOMIC_RELAXED);
+    // Shouldn't give an inuse object (!)
+    assert(was_in_use == 0);
+    assert(__atomic_load_n(&container->ref_count, __ATOMIC_RELAXED) == 0);
+    (void)was_in_use;
+    __atomic_store_n(&container->ref_count, 1, __ATOMIC_RELEASE);
 
     return container;
 }
 
 void return_metadata_to_pool(struct metadataPool* pool, struct metadataContainer* info) {
+    assert(info->parent_pool == pool);
+    assert(info->pool_index < pool->pool_size);
+    assert(pool->metadata_objects[info->pool_index] == info);
 
-    CHECK_ERROR_F(pthread_mutex_lock(&pool->pool_lock));
+    reset_metadata_object(info);
 
-    // DEBUG_F("Called return_metadata_to_pool");
-    for (unsigned int i = 0; i < pool->pool_size; ++i) {
-        // Pointer check
-        if (pool->metadata_objects[i] == info) {
-            assert(pool->in_use[i] == 1); // Should be in-use if we are returning it!
-
-            reset_metadata_object(pool->metadata_objects[i]);
-            pool->in_use[i] = 0;
-            CHECK_ERROR_F(pthread_mutex_unlock(&pool->pool_lock));
-            return;
-        }
-    }
-    assert(0 == 1); // We should have found the info object in the pool (!)
+    int was_in_use = __atomic_exchange_n(&pool->in_use[info->pool_index], 0, __ATOMIC_RELAXED);
+    assert(was_in_use == 1); // Should be in-use if we are returning it!
+    (void)was_in_use;
+
+    private_push_free(pool, info->pool_index);
 }
@@ -22,7 +22,7 @@
 #define METADATA_H
 
 #include <pthread.h> // for pthread_mutex_t
-#include <stdint.h>  // for uint32_t
+#include <stdint.h>  // for uint32_t, uint64_t, UINT32_MAX
 #include <stdio.h>   // for size_t
 
 struct metadataPool;
@@ -56,7 +56,7 @@ struct metadataContainer {
      * @brief Pointer reference count.
      * Tracks references to this object,
      * and returns the object to the associated @c metadataPool, once
-     * the counter reaches zero.
+     * the counter reaches zero.  Only accessed with atomic operations.
      */
     uint32_t ref_count;
 
@@ -68,6 +68,9 @@ struct metadataContainer {
 
     /// Reference to metadataPool that this object belongs too.
     struct metadataPool* parent_pool;
+
+    /// The index of this container in the @c metadata_objects array of its pool.
+    uint32_t pool_index;
 };
 
 /**
@@ -115,7 +118,8 @@ void decrement_metadata_ref_count(struct metadataContainer* container);
 /**
  * @brief Request the lock on the metadata container
  *
- * Used for example when changing the reference counter
+ * Used for example when updating metadata values shared between stages.
+ * The reference counter is atomic and doesn't need this lock.
  *
  * @param[in] container The container to request the lock for
  */
@@ -142,6 +146,12 @@ void unlock_metadata(struct metadataContainer* container);
  * When the a metadata container's reference counter reaches zero, it returns
  * itself back to its associated pool
  *
+ * The free containers are kept on a lock free stack (a Treiber stack) of indices
+ * into @c metadata_objects.  The head of the stack packs the index of the top
+ * container into the low 32 bits and a counter which is bumped by every update
+ * into the high 32 bits, which prevents ABA problems when a container is popped
+ * and pushed back between another thread reading the head and swapping it.
+ *
  * @author Andre Renard
  */
 struct metadataPool {
@@ -154,16 +164,22 @@ struct metadataPool {
      */
     int* in_use;
 
+    /// For each free container the index of the next free container, or @c METADATA_POOL_EMPTY
+    uint32_t* next_free;
+
+    /// The head of the free stack, the top free index and the update counter.
+    uint64_t free_head;
+
     /// The size of the @c metadataContainer array.
     unsigned int pool_size;
 
     /// The size of the object stored by the metadata containers
     size_t metadata_object_size;
-
-    /// Locks requests for metadata to avoid race conditions.
-    pthread_mutex_t pool_lock;
 };
 
+/// Marks the end of the free list of a @c metadataPool
+#define METADATA_POOL_EMPTY UINT32_MAX
+
 /**
  * @brief Creates a new metadata pool with a fixed number of metadata containers.
  * @param[in] num_metadata_objects The number of containers to store in the pool.
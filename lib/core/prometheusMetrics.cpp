@@ -5,12 +5,14 @@
 
 #include "fmt.hpp" // for print, format, fmt
 
-#include <cmath>      // for isinf, isnan
-#include <functional> // for _Bind_helper<>::type, _Placeholder, bind, _1, placeholders
-#include <iterator>   // for begin, end
-#include <ostream>    // for operator<<, basic_ostream
-#include <sys/time.h> // for gettimeofday, timeval
-#include <utility>    // for pair
+#include <atomic>       // for atomic, memory_order_relaxed
+#include <cmath>        // for isinf, isnan
+#include <functional>   // for _Bind_helper<>::type, _Placeholder, bind, _1, placeholders
+#include <iterator>     // for begin, end
+#include <ostream>      // for operator<<, basic_ostream
+#include <shared_mutex> // for shared_lock, shared_mutex
+#include <sys/time.h>   // for gettimeofday, timeval
+#include <utility>      // for pair
 
 using std::string;
 
@@ -23,36 +25,42 @@ Metric::Metric(const std::vector<string>& label_values) : label_values(label_val
 Counter::Counter(const std::vector<string>& label_values) : Metric(label_values) {}
 
 void Counter::inc() {
-    std::lock_guard<std::mutex> lock(metric_lock);
-
-    ++value;
+    value.fetch_add(1, std::memory_order_relaxed);
 }
 
 void Counter::inc(const uint64_t increment) {
-    std::lock_guard<std::mutex> lock(metric_lock);
-
-    value += increment;
+    value.fetch_add(increment, std::memory_order_relaxed);
 }
 
 string Counter::to_string() {
-    return std::to_string(value);
+    return std::to_string(value.load(std::memory_order_relaxed));
 }
 
 std::ostringstream& Counter::to_string(std::ostringstream& out) {
-    std::lock_guard<std::mutex> lock(metric_lock);
-
-    out << value;
+    out << value.load(std::memory_order_relaxed);
     return out;
 }
 
+bool Counter::update_text(string& text) {
+    uint64_t value = this->value.load(std::memory_order_relaxed);
+    if (text_valid && value == text_value)
+        return false;
+
+    text = std::to_string(value);
+    text_value = value;
+    text_valid = true;
+    return true;
+}
+
 
 Gauge::Gauge(const std::vector<string>& label_values) : Metric(label_values) {}
 
 void Gauge::set(const double value) {
-    std::lock_guard<std::mutex> lock(metric_lock);
-
-    this->value = value;
-    this->last_update_time_stamp = get_time_in_milliseconds();
+    // The value and time stamp are updated separately, so a concurrent
+    // serialisation may pair a value with the time of the update before or
+    // after it. That is fine for scraping.
+    this->value.store(value, std::memory_order_relaxed);
+    this->last_update_time_stamp.store(get_time_in_milliseconds(), std::memory_order_relaxed);
 }
 
 string Gauge::to_string() {
@@ -62,7 +70,8 @@ string Gauge::to_string() {
 }
 
 std::ostringstream& Gauge::to_string(std::ostringstream& out) {
-    std::lock_guard<std::mutex> lock(metric_lock);
+    double value = this->value.load(std::memory_order_relaxed);
+    uint64_t last_update_time_stamp = this->last_update_time_stamp.load(std::memory_order_relaxed);
 
     if (std::isnan(value)) {
         fmt::print(out, fmt("NaN {:d}"), last_update_time_stamp);
@@ -75,6 +84,26 @@ std::ostringstream& Gauge::to_string(std::ostringstream& out) {
     return out;
 }
 
+bool Gauge::update_text(string& text) {
+    double value = this->value.load(std::memory_order_relaxed);
+    uint64_t last_update_time_stamp = this->last_update_time_stamp.load(std::memory_order_relaxed);
+    bool same_value = (value == text_value) || (std::isnan(value) && std::isnan(text_value));
+    if (text_valid && same_value && last_update_time_stamp == text_time_stamp)
+        return false;
+
+    if (std::isnan(value)) {
+        text = fmt::format(fmt("NaN {:d}"), last_update_time_stamp);
+    } else if (std::isinf(value)) {
+        text = fmt::format(fmt("{} {:d}"), (value < 0 ? "-Inf" : "+Inf"), last_update_time_stamp);
+    } else {
+        text = fmt::format(fmt("{:f} {:d}"), value, last_update_time_stamp);
+    }
+    text_value = value;
+    text_time_stamp = last_update_time_stamp;
+    text_valid = true;
+    return true;
+}
+
 /* static */
 uint64_t Gauge::get_time_in_milliseconds() {
     struct timeval tv;
@@ -93,44 +122,65 @@ MetricFamily<T>::MetricFamily(const string& name, const string& stage_name,
     label_names(label_names),
     metric_type(metric_type) {}
 
+template<typename T>
+string MetricFamily<T>::series_prefix(const std::vector<string>& label_values) const {
+    string prefix = name + "{stage_name=\"" + stage_name + "\"";
+    auto value = label_values.begin();
+    for (auto& label : label_names) {
+        prefix += "," + label + "=\"" + *value++ + "\"";
+    }
+    prefix += "} ";
+    return prefix;
+}
+
 template<typename T>
 string MetricFamily<T>::serialize() {
-    std::lock_guard<std::mutex> lock(metrics_lock);
+    string out;
+    serialize(out);
+    return out;
+}
 
-    if (metrics.empty())
-        return "";
-
-    std::ostringstream out;
-    out << "# HELP " << name << "\n";
-    switch (metric_type) {
-        case MetricFamily<T>::MetricType::Counter:
-            out << "# TYPE " << name << " counter\n";
-            break;
-        case MetricFamily<T>::MetricType::Gauge:
-            out << "# TYPE " << name << " gauge\n";
-            break;
-        default:
-            out << "# TYPE " << name << " untyped\n";
+template<typename T>
+void MetricFamily<T>::serialize(string& out) {
+    std::lock_guard<std::mutex> text_guard(text_lock);
+    std::shared_lock<std::shared_mutex> lock(metrics_lock);
+
+    // Format the values that changed since last time
+    bool changed = (series_values.size() != metrics.size());
+    series_values.resize(metrics.size());
+    for (size_t i = 0; i < metrics.size(); i++) {
+        changed |= metrics[i].update_text(series_values[i]);
     }
-    for (auto& m : metrics) {
-        out << name;
-        out << "{"
-            << "stage_name=\"" << stage_name << "\"";
-        if (!label_names.empty()) {
-            auto value = m.label_values.begin();
-            for (auto label : label_names) {
-                out << ",";
-                out << label << "=\"" << *value++ << "\"";
+
+    if (changed) {
+        text.clear();
+        if (!metrics.empty()) {
+            text += "# HELP " + name + "\n";
+            switch (metric_type) {
+                case MetricFamily<T>::MetricType::Counter:
+                    text += "# TYPE " + name + " counter\n";
+                    break;
+                case MetricFamily<T>::MetricType::Gauge:
+                    text += "# TYPE " + name + " gauge\n";
+                    break;
+                default:
+                    text += "# TYPE " + name + " untyped\n";
             }
         }
-        out << "}"
-            << " ";
-        m.to_string(out);
-        out << "\n";
+        for (size_t i = 0; i < metrics.size(); i++) {
+            text += series_prefixes[i];
+            text += series_values[i];
+            text += "\n";
+        }
     }
-    return out.str();
+
+    out += text;
 }
 
+// Only these families exist, so the templates can be instantiated here.
+template class MetricFamily<Counter>;
+template class MetricFamily<Gauge>;
+
 
 Metrics::Metrics() {}
 
@@ -140,21 +190,22 @@ Metrics& Metrics::instance() {
 }
 
 
-Metrics::~Metrics() {
-    restServer::instance().remove_get_callback("/metrics");
-}
+// The restServer is built after the Metrics, and is gone by the time they are
+// destroyed, along with the /metrics endpoint.
+Metrics::~Metrics() {}
 
 string Metrics::serialize() {
-    std::ostringstream out;
+    string out;
 
     std::lock_guard<std::mutex> lock(metrics_lock);
 
+    out.reserve(last_size);
     for (auto& f : families) {
-        // out << f.first << ": " << f.second.label_names.size() << "\n";
-        out << f.second->serialize();
+        f.second->serialize(out);
     }
+    last_size = out.size();
 
-    return out.str();
+    return out;
 }
 
 void Metrics::add(const string name, const string stage_name,
@@ -3,16 +3,19 @@
 
 #include "restServer.hpp"
 
-#include <deque>     // for deque
-#include <iosfwd>    // for ostringstream
-#include <map>       // for map
-#include <memory>    // for shared_ptr
-#include <mutex>     // for mutex, lock_guard
-#include <stdexcept> // for runtime_error
-#include <stdint.h>  // for uint64_t
-#include <string>    // for string
-#include <tuple>     // for tuple
-#include <vector>    // for vector
+#include <atomic>       // for atomic
+#include <deque>        // for deque
+#include <iosfwd>       // for ostringstream
+#include <map>          // for map
+#include <memory>       // for shared_ptr
+#include <mutex>        // for mutex, lock_guard
+#include <shared_mutex> // for shared_mutex, shared_lock
+#include <stddef.h>     // for size_t
+#include <stdexcept>    // for runtime_error
+#include <stdint.h>     // for uint64_t
+#include <string>       // for string
+#include <tuple>        // for tuple
+#include <vector>       // for vector
 
 
 namespace kotekan {
@@ -31,17 +34,25 @@ public:
     virtual std::string to_string() = 0;
     /// @brief Formats the stored value as a string into the given output stream.
     virtual std::ostringstream& to_string(std::ostringstream& out) = 0;
+    /**
+     * @brief Formats the stored value into `text`, if it changed since the last call.
+     *
+     * Used by the family to only re-format the series that changed between
+     * scrapes. Must not be called concurrently.
+     *
+     * @return true if `text` was updated.
+     */
+    virtual bool update_text(std::string& text) = 0;
     const std::vector<std::string> label_values;
-
-protected:
-    /// Metric updating lock
-    std::mutex metric_lock;
 };
 
 /**
  * @class Counter
  * @brief Represents a metric whose value can only go up
  *
+ * Updates are atomic and don't take any locks, so a counter can be shared by
+ * several threads.
+ *
  * @remark See [Prometheus
  * documentation](https://prometheus.io/docs/instrumenting/exposition_formats/) for the precise
  * format specification.
@@ -53,16 +64,23 @@ public:
     void inc(const uint64_t increment);
     std::string to_string() override;
     std::ostringstream& to_string(std::ostringstream& out) override;
+    bool update_text(std::string& text) override;
 
 private:
     /// The actual value to be returned
-    uint64_t value = 0;
+    std::atomic<uint64_t> value{0};
+
+    /// The value last formatted by `update_text`
+    uint64_t text_value = 0;
+    bool text_valid = false;
 };
 
 /**
  * @class Gauge
  * @brief Represents a metric whose value can go up and down
  *
+ * Like Counter, updates don't take any locks.
+ *
  * @remark See [Prometheus
  * documentation](https://prometheus.io/docs/instrumenting/exposition_formats/) for the precise
  * format specification.
@@ -73,16 +91,22 @@ public:
     void set(const double);
     std::string to_string() override;
     std::ostringstream& to_string(std::ostringstream& out) override;
+    bool update_text(std::string& text) override;
 
 private:
     /// Internal function to get the time in
     static uint64_t get_time_in_milliseconds();
 
     /// The actual value to be returned
-    double value = 0;
+    std::atomic<double> value{0};
 
     /// Time stamp in milliseconds.
-    uint64_t last_update_time_stamp;
+    std::atomic<uint64_t> last_update_time_stamp{0};
+
+    /// The value and time stamp last formatted by `update_text`
+    double text_value = 0;
+    uint64_t text_time_stamp = 0;
+    bool text_valid = false;
 };
 
 /**
@@ -100,12 +124,20 @@ struct Serializable {
      * format specification.
      */
     virtual std::string serialize() = 0;
+
+    /**
+     * @brief Appends the Prometheus text format representation to `out`.
+     */
+    virtual void serialize(std::string& out) = 0;
 };
 
 /**
  * @class MetricFamily
  * @brief Groups together a set of metrics with the same name, type, and label names, but different
  * label values.
+ *
+ * The text representation of the family is kept between calls to `serialize`. Only the series
+ * whose values changed are formatted again, and if none did the text is reused as it is.
  */
 template<typename T>
 class MetricFamily : public Serializable {
@@ -126,6 +158,11 @@ public:
      * If the combination of values is seen for the first time, a new Metric
      * instance will be created and added to the family.
      *
+     * The returned reference stays valid for as long as the family does. A
+     * stage that updates a metric for every frame should look it up once and
+     * keep the reference, rather than formatting the label values on every
+     * update.
+     *
      * @param label_values
      * @return reference to the Metric
      * @ @throw std::runtime_error if the number of label values doesn't match the length of the
@@ -136,19 +173,30 @@ public:
             throw std::runtime_error("Label values don't match the names");
         }
 
-        std::lock_guard<std::mutex> lock(metrics_lock);
-
-        for (auto& m : metrics) {
-            if (m.label_values == label_values) {
-                return m;
+        {
+            std::shared_lock<std::shared_mutex> lock(metrics_lock);
+            auto it = index.find(label_values);
+            if (it != index.end()) {
+                return *it->second;
             }
         }
+
+        std::lock_guard<std::shared_mutex> lock(metrics_lock);
+
+        // Someone else may have added it in the meantime
+        auto it = index.find(label_values);
+        if (it != index.end()) {
+            return *it->second;
+        }
         metrics.emplace_back(label_values);
+        index.emplace(label_values, &metrics.back());
+        series_prefixes.push_back(series_prefix(label_values));
         return metrics.back();
     }
 
 
     std::string serialize() override;
+    void serialize(std::string& out) override;
 
     /// metric name
     const std::string name;
@@ -163,11 +211,29 @@ private:
     /// metric instances for label combinations observed so far
     std::deque<T> metrics;
 
+    /// metric instances by their label values
+    std::map<std::vector<std::string>, T*> index;
+
+    /// Format the name and labels of a series
+    std::string series_prefix(const std::vector<std::string>& label_values) const;
+
+    /// the name and labels of each metric instance, ready to be followed by the value
+    std::deque<std::string> series_prefixes;
+
+    /// the formatted values of the metric instances, as of the last serialisation
+    std::vector<std::string> series_values;
+
+    /// the text of the family, as of the last serialisation
+    std::string text;
+
     /// metric type
     const MetricType metric_type;
 
-    /// Metric list updating lock
-    std::mutex metrics_lock;
+    /// Metric list updating lock. Lookups take it shared.
+    std::shared_mutex metrics_lock;
+
+    /// Lock for the serialised text.
+    std::mutex text_lock;
 };
 
 /**
@@ -225,6 +291,8 @@ public:
      * ] value timestamp
      * ```
      *
+     * Only the series that changed since the last call are formatted again.
+     *
      * @remark See [Prometheus
      * documentation](https://prometheus.io/docs/instrumenting/exposition_formats/)
      * for the precise format specification.
@@ -324,6 +392,9 @@ private:
      */
     std::map<std::tuple<std::string, std::string>, std::shared_ptr<Serializable>> families;
 
+    /// Size of the last serialisation, to reserve for the next one
+    size_t last_size = 0;
+
     /// Metric updating lock
     std::mutex metrics_lock;
 };
@@ -1,31 +1,36 @@
 #include "restServer.hpp"
 
-#include "Config.hpp"         // for Config
-#include "kotekanLogging.hpp" // for ERROR_NON_OO, WARN_NON_OO, INFO_NON_OO, DEBUG_NON_OO
+#include "Config.hpp"            // for Config
+#include "kotekanLogging.hpp"    // for ERROR_NON_OO, WARN_NON_OO, INFO_NON_OO, DEBUG_NON_OO
+#include "prometheusMetrics.hpp" // for Metrics, MetricFamily, Counter, Gauge
 
 #include "fmt.hpp" // for format, fmt
 
-#include <algorithm>               // for max
+#include <algorithm>               // for max, min
 #include <assert.h>                // for assert
-#include <cstdint>                 // for int32_t
+#include <cstdint>                 // for int32_t, uint8_t
 #include <event2/buffer.h>         // for evbuffer_add, evbuffer_peek, iovec, evbuffer_free
 #include <event2/event.h>          // for event_add, event_base_dispatch, event_base_free, even...
-#include <event2/http.h>           // for evhttp_send_reply, evhttp_add_header, evhttp_request_...
+#include <event2/http.h>           // for evhttp_send_reply, evhttp_add_header, evhttp_find_he...
 #include <event2/keyvalq_struct.h> // for evkeyvalq, evkeyval, evkeyval::(anonymous)
 #include <event2/thread.h>         // for evthread_use_pthreads
 #include <evhttp.h>                // for evhttp_request
 #include <exception>               // for exception
-#include <mutex>                   // for unique_lock
+#include <mutex>                   // for unique_lock, lock_guard
 #include <netinet/in.h>            // for sockaddr_in, ntohs
 #include <pthread.h>               // for pthread_setaffinity_np, pthread_setname_np
 #include <sched.h>                 // for cpu_set_t, CPU_SET, CPU_ZERO
 #include <stdexcept>               // for runtime_error
 #include <stdlib.h>                // for exit, free, malloc, size_t
+#include <string.h>                // for memset
 #include <string>                  // for string, basic_string, allocator, operator!=, operator+
 #include <sys/socket.h>            // for getsockname, socklen_t
 #include <sys/time.h>              // for timeval
-#include <utility>                 // for pair
+#include <utility>                 // for pair, move
 #include <vector>                  // for vector
+#ifdef WITH_ZLIB
+#include <zlib.h> // for deflate, deflateInit2, deflateEnd, deflateBound, z_stream
+#endif
 #ifdef MAC_OSX
 #include "osxBindCPU.hpp"
 #endif
@@ -37,6 +42,57 @@ using std::map;
 using std::string;
 using std::vector;
 
+namespace {
+
+// The number of worker threads unless the config says otherwise
+const uint32_t DEFAULT_NUM_THREADS = 4;
+
+// The endpoint whose callback is running on this thread, if any
+thread_local const string* current_endpoint = nullptr;
+
+// A reply made on a worker thread, for the server thread to send
+struct deferredReply {
+    restServer* server;
+    std::shared_ptr<connectionInstance> conn;
+};
+
+// Add a leading slash if it's missing
+string endpoint_path(const string& endpoint) {
+    if (endpoint.substr(0, 1) != "/") {
+        return "/" + endpoint;
+    }
+    return endpoint;
+}
+
+#ifdef WITH_ZLIB
+// Text replies shorter than this aren't worth compressing
+const size_t GZIP_MIN_REPLY_SIZE = 4096;
+
+// Compress with gzip, favouring speed over size. Returns false on failure.
+bool gzip(const string& in, std::vector<uint8_t>& out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 added to the window bits asks for a gzip header
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    out.resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+
+    return ret == Z_STREAM_END;
+}
+#endif
+
+} // namespace
+
 restServer& restServer::instance() {
     static restServer server_instance;
     return server_instance;
@@ -44,9 +100,21 @@ restServer& restServer::instance() {
 
 restServer::restServer() : port(_port), main_thread() {
     stop_thread = false;
+    // The workers update metrics, so make sure they outlive the server
+    prometheus::Metrics::instance();
 }
 
 restServer::~restServer() {
+    // Stop the workers first, they hand their replies to the server thread
+    {
+        std::lock_guard<std::mutex> lock(work_lock);
+        stop_workers = true;
+    }
+    work_cond.notify_all();
+    for (auto& thread : worker_threads) {
+        thread.join();
+    }
+
     stop_thread = true;
     try {
         main_thread.join();
@@ -67,6 +135,18 @@ void restServer::start(const std::string& bind_address, u_short port) {
     pthread_setname_np(main_thread.native_handle(), "rest_server");
 #endif
 
+    auto& metrics = prometheus::Metrics::instance();
+    request_counter =
+        &metrics.add_counter("kotekan_rest_server_requests_total", "rest_server", {"endpoint"});
+    request_time =
+        &metrics.add_gauge("kotekan_rest_server_request_seconds", "rest_server", {"endpoint"});
+    queued_requests = &metrics.add_gauge("kotekan_rest_server_queued_requests", "rest_server");
+
+    {
+        std::lock_guard<std::mutex> lock(work_lock);
+        start_workers(DEFAULT_NUM_THREADS);
+    }
+
     // Framework level tracking of endpoints.
     using namespace std::placeholders;
     register_get_callback("/endpoints", std::bind(&restServer::endpoint_list_callback, this, _1));
@@ -76,55 +156,207 @@ void restServer::handle_request(struct evhttp_request* request, void* cb_data) {
 
     restServer* server = (restServer*)(cb_data);
 
+    job new_job;
+    new_job.received = std::chrono::steady_clock::now();
+
     string url = string(evhttp_uri_get_path(evhttp_request_get_evhttp_uri(request)));
 
     DEBUG2_NON_OO("restServer: Got request with url {:s}", url);
 
+    enum evhttp_cmd_type type = evhttp_request_get_command(request);
+    if (type != EVHTTP_REQ_GET && type != EVHTTP_REQ_POST) {
+        DEBUG_NON_OO("restServer: Call back with method != POST|GET called!");
+        connectionInstance conn(request);
+        conn.send_error("Bad Request", HTTP_RESPONSE::BAD_REQUEST);
+        conn.send_reply();
+        return;
+    }
+    new_job.post = (type == EVHTTP_REQ_POST);
+
+    bool found;
     {
-        // TODO This function should be locked against changes to the callback
-        // maps form other threads.  However there are a number of callbacks (start, stop, etc)
-        // which add or remove callbacks from the maps. So a more fine-grained
-        // locking system is needed here.
-        // std::shared_lock<std::shared_timed_mutex> lock(server->callback_map_lock);
-        map<string, string>& aliases = server->get_aliases();
-        if (aliases.find(url) != aliases.end()) {
-            url = aliases[url];
+        std::shared_lock<std::shared_timed_mutex> lock(server->callback_map_lock);
+        auto alias = server->aliases.find(url);
+        if (alias != server->aliases.end()) {
+            url = alias->second;
         }
+        found = new_job.post ? server->json_callbacks.count(url) : server->get_callbacks.count(url);
+    }
+
+    if (!found) {
+        DEBUG_NON_OO("restServer: {:s} Endpoint {:s} called, but not found",
+                     new_job.post ? "POST" : "GET", url);
+        connectionInstance conn(request);
+        conn.send_error("Not Found", HTTP_RESPONSE::NOT_FOUND);
+        conn.send_reply();
+        return;
+    }
+
+    // We currently assume that POST requests come with a JSON message
+    if (new_job.post && server->handle_json(request, new_job.json_request) != 0) {
+        return;
+    }
+
+    new_job.endpoint = url;
+    new_job.conn = std::make_shared<connectionInstance>(request);
+
+    // Keep track of the request, so the reply isn't sent if the client goes away
+    server->pending_replies[new_job.conn->connection] = new_job.conn;
+    evhttp_connection_set_closecb(new_job.conn->connection, &restServer::connection_closed,
+                                  server);
 
-        if (request->type == EVHTTP_REQ_GET) {
-            connectionInstance conn(request);
-            if (!server->get_callbacks.count(url)) {
-                DEBUG_NON_OO("restServer: GET Endpoint {:s} called, but not found", url);
-                conn.send_error("Not Found", HTTP_RESPONSE::NOT_FOUND);
-                return;
-            }
-            server->get_callbacks[url](conn);
+    {
+        std::lock_guard<std::mutex> lock(server->work_lock);
+        server->jobs.push_back(std::move(new_job));
+        server->queued_requests->set(server->jobs.size());
+    }
+    server->work_cond.notify_all();
+}
+
+void restServer::worker_thread() {
+    std::unique_lock<std::mutex> lock(work_lock);
+    while (true) {
+        auto next = jobs.end();
+        work_cond.wait(lock, [&] {
+            next = next_job();
+            return stop_workers || next != jobs.end();
+        });
+        if (stop_workers) {
             return;
         }
 
-        if (request->type == EVHTTP_REQ_POST) {
-            connectionInstance conn(request);
-            if (!server->json_callbacks.count(url)) {
-                DEBUG_NON_OO("restServer: POST Endpoint {:s} called, but not found", url);
-                conn.send_error("Not Found", HTTP_RESPONSE::NOT_FOUND);
-                return;
-            }
-
-            // We currently assume that POST requests come with a JSON message
-            json json_request;
-            if (server->handle_json(request, json_request) != 0) {
-                return;
-            }
-
-            server->json_callbacks[url](conn, json_request);
-            return;
+        job current = std::move(*next);
+        jobs.erase(next);
+        queued_requests->set(jobs.size());
+        running[current.endpoint]++;
+
+        lock.unlock();
+        run_job(current);
+        lock.lock();
+
+        if (--running[current.endpoint] == 0) {
+            running.erase(current.endpoint);
+        }
+        work_cond.notify_all();
+    }
+}
+
+std::deque<restServer::job>::iterator restServer::next_job() {
+    for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+        auto limit = endpoint_limits.find(it->endpoint);
+        uint32_t max_running =
+            (limit == endpoint_limits.end()) ? default_endpoint_limit : limit->second;
+        auto num_running = running.find(it->endpoint);
+        if (num_running == running.end() || num_running->second < max_running) {
+            return it;
+        }
+    }
+    return jobs.end();
+}
+
+void restServer::run_job(job& request) {
+    connectionInstance& conn = *request.conn;
+
+    // Look the callback up again, it may have been removed while the request was queued
+    std::function<void(connectionInstance&)> get_callback;
+    std::function<void(connectionInstance&, json&)> post_callback;
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(callback_map_lock);
+        if (request.post && json_callbacks.count(request.endpoint)) {
+            post_callback = json_callbacks[request.endpoint];
+        } else if (!request.post && get_callbacks.count(request.endpoint)) {
+            get_callback = get_callbacks[request.endpoint];
         }
     }
 
-    DEBUG_NON_OO("restServer: Call back with method != POST|GET called!");
+    current_endpoint = &request.endpoint;
+    try {
+        if (post_callback) {
+            post_callback(conn, request.json_request);
+        } else if (get_callback) {
+            get_callback(conn);
+        } else {
+            conn.send_error("Not Found", HTTP_RESPONSE::NOT_FOUND);
+        }
+    } catch (std::exception& e) {
+        ERROR_NON_OO("restServer: Endpoint {:s} failed: {:s}", request.endpoint, e.what());
+        if (conn.reply_status == 0) {
+            conn.send_error(e.what(), HTTP_RESPONSE::INTERNAL_ERROR);
+        }
+    }
+    current_endpoint = nullptr;
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - request.received;
+    request_counter->labels({request.endpoint}).inc();
+    request_time->labels({request.endpoint}).set(elapsed.count());
+
+    // Hand the reply to the server thread
+    struct timeval now = {0, 0};
+    deferredReply* reply = new deferredReply{this, request.conn};
+    if (event_base_once(event_base, -1, EV_TIMEOUT, &restServer::send_deferred, reply, &now)
+        != 0) {
+        ERROR_NON_OO("restServer: Could not pass the reply for {:s} to the server thread",
+                     request.endpoint);
+        delete reply;
+    }
+}
+
+void restServer::send_deferred(evutil_socket_t fd, short event, void* arg) {
+
+    // Unused parameters, required by libevent. Suppress warning.
+    (void)fd;
+    (void)event;
+
+    std::unique_ptr<deferredReply> reply((deferredReply*)arg);
+    restServer* server = reply->server;
+    connectionInstance& conn = *reply->conn;
+
+    // The request is gone if the client closed the connection
+    auto pending = server->pending_replies.find(conn.connection);
+    if (pending == server->pending_replies.end() || pending->second != reply->conn) {
+        DEBUG_NON_OO("restServer: Connection closed before the reply to {:s} was ready",
+                     conn.uri);
+        return;
+    }
+    server->pending_replies.erase(pending);
+    evhttp_connection_set_closecb(conn.connection, nullptr, nullptr);
+
+    if (conn.reply_status == 0) {
+        WARN_NON_OO("restServer: No reply was given to the request {:s}", conn.uri);
+        conn.send_error("No reply", HTTP_RESPONSE::INTERNAL_ERROR);
+    }
+    conn.send_reply();
+}
+
+void restServer::connection_closed(struct evhttp_connection* connection, void* arg) {
+    restServer* server = (restServer*)arg;
+    server->pending_replies.erase(connection);
+}
+
+void restServer::start_workers(uint32_t num_threads) {
+    while (worker_threads.size() < num_threads) {
+        worker_threads.emplace_back(&restServer::worker_thread, this);
+#ifndef MAC_OSX
+        pthread_setname_np(worker_threads.back().native_handle(), "rest_worker");
+#endif
+        if (!cpu_affinity.empty()) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            for (auto core_id : cpu_affinity)
+                CPU_SET(core_id, &cpuset);
+            pthread_setaffinity_np(worker_threads.back().native_handle(), sizeof(cpu_set_t),
+                                   &cpuset);
+        }
+    }
+}
 
-    connectionInstance conn(request);
-    conn.send_error("Bad Request", HTTP_RESPONSE::BAD_REQUEST);
+void restServer::wait_for_endpoint(const string& endpoint) {
+    // A callback removing its own endpoint can't wait for itself
+    if (current_endpoint != nullptr && *current_endpoint == endpoint) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(work_lock);
+    work_cond.wait(lock, [&] { return running.count(endpoint) == 0; });
 }
 
 void restServer::register_get_callback(string endpoint,
@@ -166,11 +398,14 @@ void restServer::remove_get_callback(string endpoint) {
         endpoint = fmt::format(fmt("/{:s}"), endpoint);
     }
 
-    std::unique_lock<std::shared_timed_mutex> lock(callback_map_lock);
-    auto it = get_callbacks.find(endpoint);
-    if (it != get_callbacks.end()) {
-        get_callbacks.erase(it);
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(callback_map_lock);
+        auto it = get_callbacks.find(endpoint);
+        if (it != get_callbacks.end()) {
+            get_callbacks.erase(it);
+        }
     }
+    wait_for_endpoint(endpoint);
 }
 
 void restServer::remove_json_callback(string endpoint) {
@@ -178,11 +413,14 @@ void restServer::remove_json_callback(string endpoint) {
         endpoint = fmt::format(fmt("/{:s}"), endpoint);
     }
 
-    std::unique_lock<std::shared_timed_mutex> lock(callback_map_lock);
-    auto it = json_callbacks.find(endpoint);
-    if (it != json_callbacks.end()) {
-        json_callbacks.erase(it);
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(callback_map_lock);
+        auto it = json_callbacks.find(endpoint);
+        if (it != json_callbacks.end()) {
+            json_callbacks.erase(it);
+        }
     }
+    wait_for_endpoint(endpoint);
 }
 
 void restServer::add_alias(string alias, string target) {
@@ -293,8 +531,13 @@ int restServer::handle_json(struct evhttp_request* request, json& json_parse) {
         return -1;
     }
 
+    // Clients can send CBOR instead of JSON text
+    const char* content_type =
+        evhttp_find_header(evhttp_request_get_input_headers(request), "Content-Type");
+    bool cbor = content_type != nullptr && string(content_type).find("application/cbor") == 0;
+
     try {
-        json_parse = json::parse(message);
+        json_parse = cbor ? json::from_cbor(message) : json::parse(message);
     } catch (const std::exception& ex) {
         string error_message =
             string("Error Message: JSON failed to parse, error: ") + string(ex.what());
@@ -312,6 +555,8 @@ int restServer::handle_json(struct evhttp_request* request, json& json_parse) {
 void restServer::endpoint_list_callback(connectionInstance& conn) {
     json reply;
 
+    std::shared_lock<std::shared_timed_mutex> lock(callback_map_lock);
+
     vector<string> get_callback_names;
     for (auto& endpoint : get_callbacks) {
         get_callback_names.push_back(endpoint.first);
@@ -425,13 +670,39 @@ void restServer::http_server_thread() {
 }
 
 void restServer::set_server_affinity(Config& config) {
-    vector<int32_t> cpu_affinity = config.get<std::vector<int32_t>>("/rest_server", "cpu_affinity");
+    std::lock_guard<std::mutex> lock(work_lock);
+    cpu_affinity = config.get<std::vector<int32_t>>("/rest_server", "cpu_affinity");
 
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
     for (auto core_id : cpu_affinity)
         CPU_SET(core_id, &cpuset);
     pthread_setaffinity_np(main_thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+    for (auto& thread : worker_threads) {
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+    }
+}
+
+void restServer::set_worker_config(Config& config) {
+    uint32_t num_threads =
+        config.get_default<uint32_t>("/rest_server", "num_threads", DEFAULT_NUM_THREADS);
+    uint32_t max_concurrent =
+        config.get_default<uint32_t>("/rest_server", "max_concurrent_requests", 1);
+    auto limits = config.get_default<std::map<string, uint32_t>>("/rest_server",
+                                                                 "endpoint_limits", {});
+
+    {
+        std::lock_guard<std::mutex> lock(work_lock);
+        default_endpoint_limit = std::max(max_concurrent, 1u);
+        endpoint_limits.clear();
+        for (auto& limit : limits) {
+            endpoint_limits[endpoint_path(limit.first)] = std::max(limit.second, 1u);
+        }
+        if (main_thread.joinable()) {
+            start_workers(num_threads);
+        }
+    }
+    work_cond.notify_all();
 }
 
 string restServer::get_http_responce_code_text(const HTTP_RESPONSE& status) {
@@ -453,11 +724,31 @@ string restServer::get_http_responce_code_text(const HTTP_RESPONSE& status) {
 
 // *** Connection Instance functions ***
 
-connectionInstance::connectionInstance(struct evhttp_request* request) : request(request) {
+connectionInstance::connectionInstance(struct evhttp_request* request) :
+    request(request),
+    connection(evhttp_request_get_connection(request)),
+    uri(evhttp_request_get_uri(request)),
+    body(restServer::get_http_message(request)) {
+
     event_buffer = evbuffer_new();
     if (event_buffer == nullptr) {
         throw std::runtime_error("Failed to create evbuffer");
     }
+
+    const char* query_string = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(request));
+    if (query_string != nullptr) {
+        query = query_string;
+    }
+
+    struct evkeyvalq* headers = evhttp_request_get_input_headers(request);
+    const char* header = evhttp_find_header(headers, "Accept");
+    if (header != nullptr) {
+        accept = header;
+    }
+    header = evhttp_find_header(headers, "Accept-Encoding");
+    if (header != nullptr) {
+        accept_encoding = header;
+    }
 }
 
 connectionInstance::~connectionInstance() {
@@ -465,79 +756,106 @@ connectionInstance::~connectionInstance() {
 }
 
 string connectionInstance::get_uri() {
-    return string(evhttp_request_get_uri(request));
+    return uri;
 }
 
 string connectionInstance::get_body() {
-    return restServer::get_http_message(request);
+    return body;
 }
 
-void connectionInstance::send_empty_reply(const HTTP_RESPONSE& status) {
-    evhttp_send_reply(request, static_cast<int>(status),
+void connectionInstance::set_reply(const HTTP_RESPONSE& status, const char* content_type) {
+    reply_status = static_cast<int>(status);
+    if (content_type != nullptr) {
+        reply_headers.emplace_back("Content-Type", content_type);
+    }
+}
+
+void connectionInstance::send_reply() {
+    struct evkeyvalq* headers = evhttp_request_get_output_headers(request);
+    for (auto& header : reply_headers) {
+        if (evhttp_add_header(headers, header.first.c_str(), header.second.c_str()) != 0) {
+            ERROR_NON_OO("restServer: Failed to add header {:s} to reply", header.first);
+        }
+    }
+
+    HTTP_RESPONSE status = static_cast<HTTP_RESPONSE>(reply_status);
+    evhttp_send_reply(request, reply_status,
                       restServer::get_http_responce_code_text(status).c_str(), event_buffer);
 }
 
+void connectionInstance::send_empty_reply(const HTTP_RESPONSE& status) {
+    set_reply(status, nullptr);
+}
+
 void connectionInstance::send_text_reply(const string& reply_message) {
 
-    if (evhttp_add_header(evhttp_request_get_output_headers(request), "Content-Type", "text/plain")
-        != 0) {
-        throw std::runtime_error("Failed to add header to reply");
+#ifdef WITH_ZLIB
+    std::vector<uint8_t> compressed;
+    if (reply_message.size() >= GZIP_MIN_REPLY_SIZE
+        && accept_encoding.find("gzip") != string::npos && gzip(reply_message, compressed)) {
+
+        if (evbuffer_add(event_buffer, (void*)compressed.data(), compressed.size()) != 0) {
+            throw std::runtime_error("Failed to add compressed reply message");
+        }
+
+        set_reply(HTTP_RESPONSE::OK, "text/plain");
+        reply_headers.emplace_back("Content-Encoding", "gzip");
+        return;
     }
+#endif
 
     if (evbuffer_add(event_buffer, (void*)reply_message.c_str(), reply_message.size()) != 0) {
         throw std::runtime_error("Failed to add reply message");
     }
 
-    evhttp_send_reply(request, static_cast<int>(HTTP_RESPONSE::OK), "OK", event_buffer);
+    set_reply(HTTP_RESPONSE::OK, "text/plain");
 }
 
 void connectionInstance::send_binary_reply(uint8_t* data, int len) {
     assert(data != nullptr);
     assert(len > 0);
 
-    if (evhttp_add_header(evhttp_request_get_output_headers(request), "Content-Type",
-                          "Application/octet-stream")
-        != 0) {
-        throw std::runtime_error("Failed to add header to reply");
-    }
-
     if (evbuffer_add(event_buffer, (void*)data, len) != 0) {
         throw std::runtime_error("Failed to add data to reply message");
     }
 
-    evhttp_send_reply(request, static_cast<int>(HTTP_RESPONSE::OK), "OK", event_buffer);
+    set_reply(HTTP_RESPONSE::OK, "Application/octet-stream");
 }
 
 void connectionInstance::send_error(const string& message, const HTTP_RESPONSE& status) {
-    if (evhttp_add_header(evhttp_request_get_output_headers(request), "Content-Type",
-                          "Application/JSON")
-        != 0) {
-        throw std::runtime_error("Failed to add header to reply");
-    }
+    // Drop anything added by a reply that failed part way
+    evbuffer_drain(event_buffer, evbuffer_get_length(event_buffer));
+    reply_headers.clear();
 
     string reply = json{{"message", message}, {"code", status}}.dump();
     if (evbuffer_add(event_buffer, (void*)reply.c_str(), reply.size()) != 0) {
         throw std::runtime_error("Failed to add reply message");
     }
 
-    evhttp_send_reply(request, static_cast<int>(status),
-                      restServer::get_http_responce_code_text(status).c_str(), event_buffer);
+    set_reply(status, "Application/JSON");
 }
 
 void connectionInstance::send_json_reply(const json& json_reply) {
-    string json_string = json_reply.dump(0);
 
-    if (evhttp_add_header(evhttp_request_get_output_headers(request), "Content-Type",
-                          "Application/JSON")
-        != 0) {
-        throw std::runtime_error("Failed to add header to reply");
+    // Reply in CBOR if the client asked for it
+    if (accept.find("application/cbor") != string::npos) {
+        std::vector<uint8_t> cbor = json::to_cbor(json_reply);
+
+        if (evbuffer_add(event_buffer, (void*)cbor.data(), cbor.size()) != 0) {
+            throw std::runtime_error("Failed to add CBOR data to reply message");
+        }
+
+        set_reply(HTTP_RESPONSE::OK, "application/cbor");
+        return;
     }
 
+    string json_string = json_reply.dump(0);
+
     if (evbuffer_add(event_buffer, (void*)json_string.c_str(), json_string.size()) != 0) {
         throw std::runtime_error("Failed to add JSON string to reply message");
     }
 
-    evhttp_send_reply(request, static_cast<int>(HTTP_RESPONSE::OK), "OK", event_buffer);
+    set_reply(HTTP_RESPONSE::OK, "Application/JSON");
 }
 
 std::map<std::string, std::string> connectionInstance::get_query() {
@@ -545,8 +863,7 @@ std::map<std::string, std::string> connectionInstance::get_query() {
     struct evkeyvalq queries;
     queries.tqh_first = nullptr;
     queries.tqh_last = nullptr;
-    const char* query_string = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(request));
-    if (query_string && evhttp_parse_query_str(query_string, &queries) == 0) {
+    if (!query.empty() && evhttp_parse_query_str(query.c_str(), &queries) == 0) {
         struct evkeyval* cur_query = queries.tqh_first;
         while (cur_query) {
             query_map[string(cur_query->key)] = string(cur_query->value);
@@ -5,19 +5,33 @@
 
 #include "json.hpp" // for json
 
-#include <atomic>        // for atomic
-#include <event2/util.h> // for evutil_socket_t
-#include <evhttp.h>      // for evhttp  // IWYU pragma: keep
-#include <functional>    // for function
-#include <map>           // for map
-#include <shared_mutex>  // for shared_timed_mutex
-#include <stdint.h>      // for uint8_t
-#include <string>        // for string, allocator
-#include <sys/types.h>   // for u_short
-#include <thread>        // for thread
+#include <atomic>             // for atomic
+#include <chrono>             // for steady_clock
+#include <condition_variable> // for condition_variable
+#include <deque>              // for deque
+#include <event2/util.h>      // for evutil_socket_t
+#include <evhttp.h>           // for evhttp  // IWYU pragma: keep
+#include <functional>         // for function
+#include <map>                // for map
+#include <memory>             // for shared_ptr
+#include <mutex>              // for mutex
+#include <shared_mutex>       // for shared_timed_mutex
+#include <stdint.h>           // for uint8_t, uint32_t, int32_t
+#include <string>             // for string, allocator
+#include <sys/types.h>        // for u_short
+#include <thread>             // for thread
+#include <utility>            // for pair
+#include <vector>             // for vector
 
 namespace kotekan {
 
+namespace prometheus {
+class Counter;
+class Gauge;
+template<typename T>
+class MetricFamily;
+} // namespace prometheus
+
 
 enum class HTTP_RESPONSE {
     OK = 200,
@@ -37,6 +51,8 @@ enum class HTTP_RESPONSE {
  * request with either an error, json, binary, text, or empty message.
  *
  * The @c send_ functions should called exactly once per connection instance.
+ * Callbacks run on one of the server's worker threads, so they only record
+ * the reply; it is sent by the server thread once the callback returns.
  *
  * @author Andre Renard
  */
@@ -57,6 +73,9 @@ public:
     /**
      * @brief Sends a json reply to the client
      *
+     * If the client accepts `application/cbor` the reply is encoded as CBOR
+     * instead of JSON text.
+     *
      * @param json_reply The json object to send to the client.
      */
     void send_json_reply(const nlohmann::json& json_reply);
@@ -79,6 +98,9 @@ public:
     /**
      * Sends an HTTP response with "content-type" header set to "text/plain"
      *
+     * Long replies (like the prometheus metrics) are gzip compressed if the
+     * client accepts that, and kotekan was built with zlib.
+     *
      * @param[in] reply The body of the reply
      */
     void send_text_reply(const std::string& reply);
@@ -111,11 +133,32 @@ public:
     std::map<std::string, std::string> get_query();
 
 private:
-    /// The request details
+    /// Record the status and content type of the reply
+    void set_reply(const HTTP_RESPONSE& status, const char* content_type);
+
+    /// Send the recorded reply. Only to be called on the server thread.
+    void send_reply();
+
+    /// The request details, only to be used on the server thread
     struct evhttp_request* request;
 
+    /// The connection the request came in on
+    struct evhttp_connection* connection;
+
     /// The buffer with the reply contents
     struct evbuffer* event_buffer;
+
+    /// Copies of the request details, for the worker threads
+    std::string uri, body, query, accept, accept_encoding;
+
+    /// The status of the reply, or zero if there is no reply yet
+    int reply_status = 0;
+
+    /// Headers to add to the reply
+    std::vector<std::pair<std::string, std::string>> reply_headers;
+
+    /// Allow the server to send the reply
+    friend class restServer;
 };
 
 /**
@@ -125,6 +168,26 @@ private:
  *
  * This object uses libevent internally to handle the http requests.
  *
+ * Requests are read and replies are sent by a single server thread, while
+ * the callbacks run on a pool of worker threads, so a slow callback doesn't
+ * hold up requests to other endpoints. Each endpoint runs at most
+ * `max_concurrent_requests` callbacks at a time (one by default), so
+ * callbacks don't need to be reentrant unless their endpoint is configured
+ * otherwise. Requests beyond that wait for a free slot.
+ *
+ * @conf   num_threads               Int. The number of worker threads. Default 4.
+ * @conf   max_concurrent_requests   Int. How many requests to each endpoint can be
+ *                                   handled at the same time. Default 1.
+ * @conf   endpoint_limits           Map of endpoint to Int. Overrides
+ *                                   `max_concurrent_requests` for some endpoints.
+ *
+ * @metric kotekan_rest_server_requests_total
+ *         The number of requests handled, by endpoint.
+ * @metric kotekan_rest_server_request_seconds
+ *         The time from receiving the last request to having its reply, by endpoint.
+ * @metric kotekan_rest_server_queued_requests
+ *         The number of requests waiting for a worker thread.
+ *
  * See the docs for examples of using this class.
  *
  * @author Andre Renard
@@ -156,6 +219,16 @@ public:
      */
     void set_server_affinity(Config& config);
 
+    /**
+     * @brief Set up the worker threads from the config
+     *
+     * Reads the "/rest_server" options described above. The number of
+     * worker threads can only grow once the server is running.
+     *
+     * @param config The config file currently being used.
+     */
+    void set_worker_config(Config& config);
+
     /**
      * Registers a GET style callback for a specified HTTP endpoint.
      *
@@ -164,6 +237,8 @@ public:
      *
      * @note Re-registering on an endpoint will override the previous
      * callback value.
+     *
+     * @note The callback runs on a worker thread, not the thread which registered it.
      */
     void register_get_callback(std::string endpoint,
                                std::function<void(connectionInstance&)> callback);
@@ -172,13 +247,15 @@ public:
      * Registers a POST callback for a specified HTTP endpoint.
      *
      * Systems calling one of these endpoints are expected to provide a JSON string
-     * in the POST data.
+     * in the POST data, or CBOR with the content type `application/cbor`.
      *
      * @param[in] endpoint Path section of the URL that is handled by the callback
      * @param[in] callback Callback function invoked to handle the request on the endpoint
      *
      * @note Re-registering on an endpoint will override the previous
      * callback value.
+     *
+     * @note The callback runs on a worker thread, not the thread which registered it.
      */
     void register_post_callback(std::string endpoint,
                                 std::function<void(connectionInstance&, nlohmann::json&)> callback);
@@ -186,6 +263,9 @@ public:
     /**
      * @brief Removes the GET endpoint referenced by @c endpoint
      *
+     * Waits for any callbacks already running on this endpoint to finish, so
+     * the callback's object can be destroyed afterwards.
+     *
      * @param endpoint The endpoint to remove.
      */
     void remove_get_callback(std::string endpoint);
@@ -193,6 +273,8 @@ public:
     /**
      * @brief Removes the JSON POST endpoint referenced by @c endpoint
      *
+     * Waits for any callbacks already running on this endpoint to finish.
+     *
      * @param endpoint The endpoint to remove.
      */
     void remove_json_callback(std::string endpoint);
@@ -268,6 +350,69 @@ private:
      */
     static void handle_request(struct evhttp_request* request, void* cb_data);
 
+    /// A request waiting for, or being handled by, a worker thread
+    struct job {
+        std::string endpoint;
+        bool post;
+        nlohmann::json json_request;
+        std::shared_ptr<connectionInstance> conn;
+        std::chrono::steady_clock::time_point received;
+    };
+
+    /**
+     * @brief Worker thread function which runs the callbacks.
+     */
+    void worker_thread();
+
+    /**
+     * @brief Run the callback for a request, and pass the reply to the server thread.
+     *
+     * @param request The request to handle.
+     */
+    void run_job(job& request);
+
+    /**
+     * @brief Find the first queued request whose endpoint isn't at its limit.
+     *
+     * Must be called with @c work_lock held.
+     *
+     * @return An iterator into @c jobs, or @c jobs.end()
+     */
+    std::deque<job>::iterator next_job();
+
+    /**
+     * @brief Start worker threads until there are @c num_threads of them.
+     *
+     * Must be called with @c work_lock held.
+     *
+     * @param num_threads The number of worker threads wanted.
+     */
+    void start_workers(uint32_t num_threads);
+
+    /**
+     * @brief Wait for the running callbacks of an endpoint to finish.
+     *
+     * @param endpoint The endpoint
+     */
+    void wait_for_endpoint(const std::string& endpoint);
+
+    /**
+     * @brief Internal callback which sends a reply made by a worker thread.
+     *
+     * @param fd Not used
+     * @param event Not used
+     * @param arg The reply (a `deferredReply`)
+     */
+    static void send_deferred(evutil_socket_t fd, short event, void* arg);
+
+    /**
+     * @brief Internal callback for a client closing a connection with a request in progress.
+     *
+     * @param connection The connection
+     * @param arg Pointer to the REST server object
+     */
+    static void connection_closed(struct evhttp_connection* connection, void* arg);
+
     /**
      * @brief Callback which returns list of endpoints to caller.
      *
@@ -279,7 +424,8 @@ private:
      * @brief Trys to parse the JSON in a POST message
      *
      * Fills the reference @c json_parse with the json string
-     * provided in the message.
+     * provided in the message, or with the CBOR data if the
+     * content type is `application/cbor`.
      *
      * If this function falls, then don't call @c ms_send
      *
@@ -343,6 +489,41 @@ private:
     /// Flag set to true when exit condition is reached
     std::atomic<bool> stop_thread;
 
+    /// Worker thread handles
+    std::vector<std::thread> worker_threads;
+
+    /// CPU affinity of the threads, empty if not set
+    std::vector<int32_t> cpu_affinity;
+
+    /// Requests waiting for a worker thread
+    std::deque<job> jobs;
+
+    /// The number of callbacks running, by endpoint
+    std::map<std::string, uint32_t> running;
+
+    /// The number of callbacks allowed to run at once, by endpoint
+    std::map<std::string, uint32_t> endpoint_limits;
+
+    /// The number of callbacks allowed to run at once for other endpoints
+    uint32_t default_endpoint_limit = 1;
+
+    /// Set to stop the worker threads
+    bool stop_workers = false;
+
+    /// Lock for the worker threads and their queue
+    std::mutex work_lock;
+
+    /// Signals a change to the queue or the running callbacks
+    std::condition_variable work_cond;
+
+    /// Requests handed to the workers, by connection. Only used on the server thread.
+    std::map<struct evhttp_connection*, std::shared_ptr<connectionInstance>> pending_replies;
+
+    /// Metrics
+    prometheus::MetricFamily<prometheus::Counter>* request_counter = nullptr;
+    prometheus::MetricFamily<prometheus::Gauge>* request_time = nullptr;
+    prometheus::Gauge* queued_requests = nullptr;
+
     /// Allow connectionInstance to use internal helper functions
     friend class connectionInstance;
 };
@@ -11,8 +11,9 @@
 #include "kotekanLogging.hpp"    // for INFO, WARN, FATAL_ERROR, DEBUG, logLevel
 #include "prometheusMetrics.hpp" // for Counter, Metrics, MetricFamily, Gauge
 #include "restServer.hpp"        // for HTTP_RESPONSE, connectionInstance, restServer
+#include "uringWriter.hpp"       // for uringWriter
 #include "version.h"             // for get_git_commit_hash
-#include "visFile.hpp"           // for visFileBundle, _factory_aliasvisFile
+#include "visFile.hpp"           // for visFileBundle, visFileOptions, _factory_aliasvisFile
 
 #include "fmt.hpp" // for format
 
@@ -21,6 +22,7 @@
 #include <deque>      // for deque
 #include <exception>  // for exception
 #include <functional> // for _Bind_helper<>::type, bind, function
+#include <memory>     // for make_shared
 #include <regex>      // for match_results<>::_Base_type
 #include <stdexcept>  // for runtime_error, out_of_range
 #include <time.h>     // for timespec
@@ -64,6 +66,25 @@ BaseWriter::BaseWriter(Config& config, const std::string& unique_name,
         throw std::runtime_error(fmt::format("Unknown file type '{}'", file_type));
     }
 
+    // Set up how the files are written
+    auto write_engine = config.get_default<std::string>(unique_name, "write_engine", "pwrite");
+    file_options.direct_io = config.get_default<bool>(unique_name, "direct_io", false);
+    if (write_engine == "io_uring") {
+        auto queue_depth = config.get_default<uint32_t>(unique_name, "queue_depth", 32);
+        auto& depth_metric =
+            Metrics::instance().add_gauge("kotekan_writer_uring_queue_depth", unique_name);
+        auto& latency_metric = Metrics::instance().add_gauge(
+            "kotekan_writer_uring_completion_latency_seconds", unique_name);
+        file_options.uring =
+            std::make_shared<uringWriter>(queue_depth, kotekan::logLevel(_member_log_level),
+                                          &depth_metric, &latency_metric);
+    } else if (write_engine != "pwrite") {
+        throw std::runtime_error(fmt::format("Unknown write engine '{}'", write_engine));
+    }
+    if (file_options.direct_io && !file_options.uring) {
+        throw std::runtime_error("direct_io needs the 'io_uring' write engine.");
+    }
+
     file_length = config.get_default<size_t>(unique_name, "file_length", 1024);
     window = config.get_default<size_t>(unique_name, "window", 20);
 
@@ -153,7 +174,7 @@ void BaseWriter::init_acq(dset_id_t ds_id) {
     try {
         acq.file_bundle = std::make_unique<visFileBundle>(
             file_type, root_path, acq_fmt, file_fmt, metadata, file_length, window,
-            kotekan::logLevel(_member_log_level), ds_id, file_length);
+            kotekan::logLevel(_member_log_level), ds_id, file_length, file_options);
     } catch (std::exception& e) {
         FATAL_ERROR("Failed creating file bundle for new acquisition: {:s}", e.what());
     }
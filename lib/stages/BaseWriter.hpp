@@ -13,7 +13,7 @@
 #include "bufferContainer.hpp"   // for bufferContainer
 #include "datasetManager.hpp"    // for dset_id_t, fingerprint_t
 #include "prometheusMetrics.hpp" // for Counter, MetricFamily, Gauge
-#include "visFile.hpp"           // for visFileBundle
+#include "visFile.hpp"           // for visFileBundle, visFileOptions
 #include "visUtil.hpp"           // for movingAverage, time_ctype
 
 #include <cstdint> // for uint32_t, int64_t
@@ -83,6 +83,18 @@
  * @conf   critical_states  List of strings. A list of state types to consider
  *                          critical. That is, if they change in the incoming
  *                          data stream then a new acquisition will be started.
+ * @conf   write_engine     String (default: pwrite). How the raw file types
+ *                          ('raw', 'ring' and 'hfbraw') write their data. With
+ *                          'pwrite' each frame is written with blocking calls,
+ *                          with 'io_uring' each frame is copied and submitted
+ *                          as one asynchronous write through an io_uring
+ *                          shared by all the files of this writer.
+ * @conf   queue_depth      Int (default: 32). The maximum number of writes in
+ *                          flight for the 'io_uring' engine.
+ * @conf   direct_io        Bool (default: False). Open raw files with
+ *                          `O_DIRECT` and write whole page aligned frame slots,
+ *                          bypassing the page cache. Needs the 'io_uring'
+ *                          engine.
  *
  * @par Metrics
  * @metric kotekan_writer_write_time_seconds
@@ -92,6 +104,11 @@
  *         The number of frames dropped while attempting to write as they are too late.
  * @metric kotekan_writer_bad_dataset_frame_total
  *         The number of frames dropped as they belong to a bad dataset.
+ * @metric kotekan_writer_uring_queue_depth
+ *         The number of writes in flight with the 'io_uring' engine.
+ * @metric kotekan_writer_uring_completion_latency_seconds
+ *         The time from submitting a write to the io_uring until it completes.
+ *         An exponential moving average over ~10 writes.
  *
  * @author Richard Shaw and James Willis
  **/
@@ -193,6 +210,9 @@ private:
     bool ignore_version;
     double acq_timeout;
 
+    /// How to write the files, including the io_uring if we are using one
+    visFileOptions file_options;
+
     /// Input buffer to read from
     Buffer* in_buf;
 
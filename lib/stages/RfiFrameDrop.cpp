@@ -134,6 +134,10 @@ void RfiFrameDrop::main_thread() {
         DEBUG2("Frames are synced. Vis frame: {}; SK frame: {}, diff {}", vis_seq, sk_seq,
                vis_seq - sk_seq);
 
+        // Look up the counters for this frequency once for all the sub-frames
+        auto& freq_frame_counter = frame_counter.labels({std::to_string(freq_id)});
+        auto& freq_dropped_frame_counter = dropped_frame_counter.labels({std::to_string(freq_id)});
+
         // Calculate the scaling to turn kurtosis value into sigma
         size_t num_inputs = num_elements - metadata_vis->rfi_num_bad_inputs;
         float sigma_scale = sqrt((num_inputs * (sk_step - 1) * (sk_step + 2) * (sk_step + 3))
@@ -217,11 +221,11 @@ void RfiFrameDrop::main_thread() {
                 set_dataset_id(_buf_out, frame_id_out, dset_id_out);
                 mark_frame_full(_buf_out, unique_name.c_str(), frame_id_out++);
             } else {
-                dropped_frame_counter.labels({std::to_string(freq_id)}).inc();
+                freq_dropped_frame_counter.inc();
             }
 
             mark_frame_empty(_buf_in_vis, unique_name.c_str(), frame_id_in_vis++);
-            frame_counter.labels({std::to_string(freq_id)}).inc();
+            freq_frame_counter.inc();
         }
         mark_frame_empty(_buf_in_sk, unique_name.c_str(), frame_id_in_sk++);
     }
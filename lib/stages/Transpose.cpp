@@ -21,10 +21,10 @@
 #include <exception>    // for exception
 #include <functional>   // for _Bind_helper<>::type, bind, function
 #include <future>       // for async, future
-#include <map>          // for map
 #include <memory>       // for allocator_traits<>::value_type
+#include <optional>     // for optional
 #include <regex>        // for match_results<>::_Base_type
-#include <stdexcept>    // for out_of_range, invalid_argument
+#include <stdexcept>    // for invalid_argument
 #include <stdint.h>     // for uint32_t, uint64_t
 #include <system_error> // for system_error
 
@@ -207,9 +207,10 @@ dset_id_t Transpose::base_dset(dset_id_t ds_id) {
 
     datasetManager& dm = datasetManager::instance();
 
-    try {
-        return dm.datasets().at(ds_id).base_dset();
-    } catch (std::out_of_range& e) {
+    auto ds = dm.find_dataset(ds_id);
+    if (ds) {
+        return ds->base_dset();
+    } else {
         DEBUG("Fetching metadata state...");
         // fetch a metadata state just to ensure we have a copy of that dataset
         auto mstate_fut = std::async(&datasetManager::dataset_state<metadataState>, &dm, ds_id);
@@ -222,11 +223,11 @@ dset_id_t Transpose::base_dset(dset_id_t ds_id) {
         }
         const metadataState* mstate = mstate_fut.get();
         (void)mstate;
-        try {
-            return dm.datasets().at(ds_id).base_dset();
-        } catch (std::out_of_range& e) {
-            FATAL_ERROR("Failed to get base dataset of dataset with ID {}. {}", ds_id, e.what());
+        ds = dm.find_dataset(ds_id);
+        if (!ds) {
+            FATAL_ERROR("Failed to get base dataset of dataset with ID {}.", ds_id);
             return ds_id;
         }
+        return ds->base_dset();
     }
 }
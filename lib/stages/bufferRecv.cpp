@@ -63,7 +63,7 @@ bufferRecv::bufferRecv(Config& config, const std::string& unique_name,
     drop_frames = config.get_default<bool>(unique_name, "drop_frames", true);
 
     buf = get_buffer("buf");
-    register_producer(buf, unique_name.c_str());
+    buf_handle = register_producer(buf, unique_name.c_str());
 }
 
 bufferRecv::~bufferRecv() {}
@@ -164,8 +164,8 @@ void bufferRecv::internal_accept_connection(evutil_socket_t listener, short even
 
     // New connection instance
     connInstance* instance =
-        new connInstance(accept_args->unique_name, accept_args->buf, accept_args->buffer_recv,
-                         ip_str, port, read_timeout, drop_frames);
+        new connInstance(accept_args->unique_name, accept_args->buf, buf_handle,
+                         accept_args->buffer_recv, ip_str, port, read_timeout, drop_frames);
 
     // Setup logging for the instance object.
     instance->set_log_prefix(accept_args->unique_name + "/instance");
@@ -329,11 +329,12 @@ std::string bufferRecv::dot_string(const std::string& prefix) const {
     return dot;
 }
 
-connInstance::connInstance(const std::string& producer_name, Buffer* buf, bufferRecv* buffer_recv,
-                           const std::string& client_ip, int port, struct timeval read_timeout,
-                           bool drop_frames) :
+connInstance::connInstance(const std::string& producer_name, Buffer* buf, int buf_handle,
+                           bufferRecv* buffer_recv, const std::string& client_ip, int port,
+                           struct timeval read_timeout, bool drop_frames) :
     producer_name(producer_name),
     buf(buf),
+    buf_handle(buf_handle),
     buffer_recv(buffer_recv),
     client_ip(client_ip),
     port(port),
@@ -482,7 +483,7 @@ void connInstance::internal_read_callback() {
             } else {
                 // This call cannot be blocking because we checked that
                 // the frame is empty in get_next_frame()
-                uint8_t* frame = wait_for_empty_frame(buf, producer_name.c_str(), frame_id);
+                uint8_t* frame = wait_for_empty_frame_h(buf, buf_handle, frame_id);
                 if (frame == nullptr)
                     return;
 
@@ -497,7 +498,7 @@ void connInstance::internal_read_callback() {
                 if (metadata != nullptr)
                     memcpy(metadata, metadata_space, buf_frame_header.metadata_size);
 
-                mark_frame_full(buf, producer_name.c_str(), frame_id);
+                mark_frame_full_h(buf, buf_handle, frame_id);
 
                 // Save a prometheus metric of the elapsed time
                 double elapsed = current_time() - start_time;
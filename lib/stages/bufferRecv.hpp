@@ -113,6 +113,9 @@ private:
     /// The output buffer
     struct Buffer* buf;
 
+    /// Our producer handle on @c buf
+    int buf_handle;
+
     /// The port to listen for new connections on
     uint32_t listen_port;
 
@@ -233,9 +236,9 @@ struct acceptArgs {
 class connInstance : public kotekan::kotekanLogging {
 public:
     /// Constructor
-    connInstance(const std::string& producer_name, struct Buffer* buf, bufferRecv* buffer_recv,
-                 const std::string& client_ip, int port, struct timeval read_timeout,
-                 bool drop_frames);
+    connInstance(const std::string& producer_name, struct Buffer* buf, int buf_handle,
+                 bufferRecv* buffer_recv, const std::string& client_ip, int port,
+                 struct timeval read_timeout, bool drop_frames);
 
     /// Destructor
     ~connInstance();
@@ -275,6 +278,9 @@ public:
     /// The kotekan buffer to transfer data into
     struct Buffer* buf;
 
+    /// The producer handle of the parent stage on @c buf
+    int buf_handle;
+
     /// Pointer to the parient kotekan_stage which owns this instance
     bufferRecv* buffer_recv;
 
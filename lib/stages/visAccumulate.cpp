@@ -16,7 +16,8 @@
 #include "prometheusMetrics.hpp" // for Counter, MetricFamily, Metrics
 #include "version.h"             // for get_git_commit_hash
 #include "visBuffer.hpp"         // for VisFrameView
-#include "visUtil.hpp"           // for prod_ctype, frameID, modulo, input_ctype, operator+
+#include "visKernels.hpp"        // for accumulate_vis, accumulate_vis_copy, get_vis_kernel_isa
+#include "visUtil.hpp"           // for prod_ctype, frameID, visTrianglePlan, copy_vis_triangle
 
 #include "fmt.hpp"      // for format, fmt
 #include "gsl-lite.hpp" // for span<>::iterator, span
@@ -26,14 +27,16 @@
 #include <assert.h>   // for assert
 #include <atomic>     // for atomic_bool
 #include <cmath>      // for pow
-#include <complex>    // for operator*, complex
 #include <cstring>    // for memcpy
 #include <exception>  // for exception
 #include <iterator>   // for back_insert_iterator, begin, end, back_inserter
-#include <mutex>      // for lock_guard, mutex
+#include <memory>     // for make_unique, unique_ptr
+#include <mutex>      // for lock_guard, mutex, unique_lock
 #include <numeric>    // for iota
 #include <optional>   // for optional
+#include <pthread.h>  // for pthread_setaffinity_np
 #include <regex>      // for match_results<>::_Base_type
+#include <sched.h>    // for cpu_set_t, CPU_SET, CPU_ZERO
 #include <stdexcept>  // for runtime_error, invalid_argument
 #include <sys/time.h> // for TIMEVAL_TO_TIMESPEC
 #include <time.h>     // for size_t, timespec
@@ -94,6 +97,25 @@ visAccumulate::visAccumulate(Config& config, const std::string& unique_name,
 
     size_t nb = num_elements / block_size;
     num_prod_gpu = num_freq_in_frame * nb * (nb + 1) * block_size * block_size / 2;
+    INFO("Using the {:s} accumulation kernels", vis_kernel_isa_name(get_vis_kernel_isa()));
+
+    num_threads = config.get_default<uint32_t>(unique_name, "num_threads", 1);
+    if (num_threads == 0)
+        throw std::invalid_argument("visAccumulate: num_threads has to be at least 1.");
+
+    // Split the GPU products evenly over the threads. The boundaries are
+    // aligned to 16 products, a whole iteration of the widest vector kernels,
+    // so the results are bit-identical whatever the number of threads.
+    const size_t prod_align = 16;
+    for (uint32_t i = 0; i <= num_threads; i++) {
+        size_t split = (num_prod_gpu * i / num_threads + prod_align - 1) / prod_align * prod_align;
+        prod_splits.push_back(std::min(split, num_prod_gpu));
+    }
+
+    // Work out how to unpack the triangle, and split it so each thread gets
+    // about the same number of output products
+    triangle_plan = std::make_unique<visTrianglePlan>(input_remap, block_size, num_elements);
+    run_splits = triangle_plan->split(num_threads);
 
     // Get everything we need for registering dataset states
 
@@ -137,10 +159,10 @@ visAccumulate::visAccumulate(Config& config, const std::string& unique_name,
     register_base_dataset_states(instrument_name, freqs, inputs, prods);
 
     in_buf = get_buffer("in_buf");
-    register_consumer(in_buf, unique_name.c_str());
+    in_buf_handle = register_consumer(in_buf, unique_name.c_str());
 
     out_buf = get_buffer("out_buf");
-    register_producer(out_buf, unique_name.c_str());
+    int out_buf_handle = register_producer(out_buf, unique_name.c_str());
 
     // Because we reserve `num_freq_in_frame` output frames for each input frame, the output
     // buffer must have at least `num_freq_in_frame` frames allocated.
@@ -152,8 +174,8 @@ visAccumulate::visAccumulate(Config& config, const std::string& unique_name,
 
     // Create the state for the main visibility accumulation
     gated_datasets.emplace_back(
-        out_buf, gateSpec::create("uniform", "vis", kotekan::logLevel(_member_log_level)),
-        num_prod_gpu);
+        out_buf, out_buf_handle,
+        gateSpec::create("uniform", "vis", kotekan::logLevel(_member_log_level)), num_prod_gpu);
 
     // Get and validate any gating config
     nlohmann::json gating_conf = config.get_default<nlohmann::json>(unique_name, "gating", {});
@@ -207,11 +229,12 @@ visAccumulate::visAccumulate(Config& config, const std::string& unique_name,
 
         // Fetch and register the buffer
         auto buf = buffer_container.get_buffer(buffer_name);
-        register_producer(buf, unique_name.c_str());
+        int buf_handle = register_producer(buf, unique_name.c_str());
 
         // Create the gated datasets and register the update callback
         gated_datasets.emplace_back(
-            buf, gateSpec::create(mode, name, kotekan::logLevel(_member_log_level)), num_prod_gpu);
+            buf, buf_handle, gateSpec::create(mode, name, kotekan::logLevel(_member_log_level)),
+            num_prod_gpu);
 
         auto& state = gated_datasets.back();
         callbacks[name] = [&state](nlohmann::json& json) -> bool {
@@ -228,6 +251,19 @@ visAccumulate::visAccumulate(Config& config, const std::string& unique_name,
 }
 
 
+visAccumulate::~visAccumulate() {
+    {
+        std::lock_guard<std::mutex> lock(work_mtx);
+        work_stop = true;
+    }
+    work_cv.notify_all();
+
+    for (auto& thread : worker_threads) {
+        thread.join();
+    }
+}
+
+
 void visAccumulate::register_base_dataset_states(
     std::string& instrument_name, std::vector<std::pair<uint32_t, freq_ctype>>& freqs,
     std::vector<input_ctype>& inputs, std::vector<prod_ctype>& prods) {
@@ -281,10 +317,28 @@ void visAccumulate::main_thread() {
     if (!gps_time_enabled)
         WARN("GPS time not set, using much less accurate system time instead.");
 
+    // Start the extra worker threads, this thread does the first slice of each frame
+    for (uint32_t i = 1; i < num_threads; i++) {
+        worker_threads.emplace_back(&visAccumulate::worker_thread, this, i);
+
+        if (config.exists(unique_name, "cpu_affinity")) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            for (auto& cpu : config.get<std::vector<int>>(unique_name, "cpu_affinity"))
+                CPU_SET(cpu, &cpuset);
+
+            pthread_setaffinity_np(worker_threads.back().native_handle(), sizeof(cpu_set_t),
+                                   &cpuset);
+        }
+    }
+
+    // The datasets being accumulated into in the current frame
+    std::vector<std::reference_wrapper<internalState>> accumulating_datasets;
+
     while (!stop_thread) {
 
         // Fetch a new frame and get its sequence id
-        uint8_t* in_frame = wait_for_full_frame(in_buf, unique_name.c_str(), in_frame_id);
+        uint8_t* in_frame = wait_for_full_frame_h(in_buf, in_buf_handle, in_frame_id);
         if (in_frame == nullptr)
             break;
 
@@ -331,11 +385,11 @@ void visAccumulate::main_thread() {
 
             // Debias the weights estimate, by subtracting out the bias estimation
             float w = d0.weight_diff_sum / pow(d0.sample_weight_total, 2);
-            for (size_t i = 0; i < num_prod_gpu; i++) {
-                float di = d0.vis1[2 * i];
-                float dr = d0.vis1[2 * i + 1];
-                d0.vis2[i] -= w * (dr * dr + di * di);
-            }
+            parallel_for([&](uint32_t thread_id) {
+                auto [p_start, p_end] = prod_range(thread_id);
+                subtract_vis_power(d0.vis2.data() + p_start, d0.vis1.data() + 2 * p_start, w,
+                                   p_end - p_start);
+            });
 
             // Iterate over *only* the gated datasets (remember that element
             // zero is the vis), and remove the bias and copy in the variance
@@ -394,8 +448,8 @@ void visAccumulate::main_thread() {
 
             int32_t samples_in_frame = samples_per_data_set - lost_in_frame;
 
-            // Accumulate the weighted data into each dataset. At the moment this
-            // doesn't really work if there are multiple frequencies in the same buffer..
+            // Find the datasets to accumulate into, and count the samples going into them
+            accumulating_datasets.clear();
             for (internalState& dset : enabled_gated_datasets) {
 
                 float freq_in_MHz = tel.to_freq(dset.frames[0].freq_id);
@@ -405,14 +459,7 @@ void visAccumulate::main_thread() {
                 if (w == 0)
                     break;
 
-                // TODO: implement generalised non uniform weighting, I'm primarily
-                // not doing this because I don't want to burn cycles doing the
-                // multiplications
-                // Perform primary accumulation (assume that the weight is one)
-                for (size_t i = 0; i < 2 * num_prod_gpu; i++) {
-                    dset.vis1[i] += input[i];
-                }
-
+                accumulating_datasets.push_back(dset);
                 dset.sample_weight_total += samples_in_frame;
 
                 for (auto& frame : dset.frames) {
@@ -427,24 +474,53 @@ void visAccumulate::main_thread() {
 
             // We are calculating the weights by differencing even and odd samples.
             // Every even sample we save the set of visibilities...
-            if (frame_count % 2 == 0) {
-                std::memcpy(vis_even.data(), input, 8 * num_prod_gpu);
-                samples_even = samples_in_frame;
-            }
-            // ... every odd sample we accumulate the squared differences into the weight dataset
-            // NOTE: this incrementally calculates the variance, but eventually
-            // output_frame.weight will hold the *inverse* variance
-            // TODO: we might need to account for packet loss in here too, but it
-            // would require some awkward rescalings
-            else {
-                internalState& d0 = enabled_gated_datasets.at(0); // Save into the main vis dataset
-                for (size_t i = 0; i < num_prod_gpu; i++) {
-                    // NOTE: avoid using the slow std::complex routines in here
-                    float di = input[2 * i] - vis_even[2 * i];
-                    float dr = input[2 * i + 1] - vis_even[2 * i + 1];
-                    d0.vis2[i] += (dr * dr + di * di);
+            bool even = (frame_count % 2 == 0);
+            internalState& d0 = enabled_gated_datasets.at(0); // Save into the main vis dataset
+
+            // Accumulate the data, each thread taking a slice of the products. At the moment
+            // this doesn't really work if there are multiple frequencies in the same buffer..
+            parallel_for([&](uint32_t thread_id) {
+                auto [p_start, p_end] = prod_range(thread_id);
+                const int32_t* in = input + 2 * p_start;
+                int32_t* in_even = vis_even.data() + 2 * p_start;
+                size_t nprod = p_end - p_start;
+
+                // ... the even samples are saved during the first accumulation to
+                // avoid reading the input twice ...
+                bool save_even = even;
+
+                // TODO: implement generalised non uniform weighting, I'm primarily
+                // not doing this because I don't want to burn cycles doing the
+                // multiplications
+                // Perform primary accumulation (assume that the weight is one)
+                for (internalState& dset : accumulating_datasets) {
+                    int32_t* acc = dset.vis1.data() + 2 * p_start;
+                    if (save_even) {
+                        accumulate_vis_copy(acc, in_even, in, 2 * nprod);
+                        save_even = false;
+                    } else {
+                        accumulate_vis(acc, in, 2 * nprod);
+                    }
+                }
+
+                // ... or on their own if nothing was accumulated ...
+                if (save_even) {
+                    std::memcpy(in_even, in, 8 * nprod);
+                }
+                // ... every odd sample we accumulate the squared differences into the weight
+                // dataset
+                // NOTE: this incrementally calculates the variance, but eventually
+                // output_frame.weight will hold the *inverse* variance
+                // TODO: we might need to account for packet loss in here too, but it
+                // would require some awkward rescalings
+                else if (!even) {
+                    accumulate_vis_sq_diff(d0.vis2.data() + p_start, in, in_even, nprod);
                 }
+            });
 
+            if (even) {
+                samples_even = samples_in_frame;
+            } else {
                 // Accumulate the squared samples difference which we need for
                 // debiasing the variance estimate
                 float samples_diff = samples_in_frame - samples_even;
@@ -453,7 +529,7 @@ void visAccumulate::main_thread() {
         }
 
         // Move the input buffer on one step
-        mark_frame_empty(in_buf, unique_name.c_str(), in_frame_id++);
+        mark_frame_empty_h(in_buf, in_buf_handle, in_frame_id++);
         last_frame_count = frame_count;
         frames_in_this_cycle++;
     }
@@ -466,7 +542,7 @@ bool visAccumulate::initialise_output(visAccumulate::internalState& state, int i
 
     for (size_t freq_ind = 0; freq_ind < num_freq_in_frame; freq_ind++) {
 
-        if (wait_for_empty_frame(state.buf, unique_name.c_str(), state.frame_id + freq_ind)
+        if (wait_for_empty_frame_h(state.buf, state.buf_handle, state.frame_id + freq_ind)
             == nullptr) {
             return true;
         }
@@ -510,18 +586,22 @@ void visAccumulate::combine_gated(visAccumulate::internalState& gate,
 
     // Subtract out the bias from the gated data
     float scl = gate.sample_weight_total / vis.sample_weight_total;
-    for (size_t i = 0; i < 2 * num_prod_gpu; i++) {
-        gate.vis1[i] -= (int32_t)(scl * vis.vis1[i]);
-    }
 
     // TODO: very strong assumption that the weights are one (when on) baked in
     // here.
     gate.sample_weight_total = vis.sample_weight_total - gate.sample_weight_total;
 
-    // Copy in the proto weight data
-    for (size_t i = 0; i < num_prod_gpu; i++) {
-        gate.vis2[i] = scl * (1.0 - scl) * vis.vis2[i];
-    }
+    parallel_for([&](uint32_t thread_id) {
+        auto [p_start, p_end] = prod_range(thread_id);
+        size_t nprod = p_end - p_start;
+
+        subtract_scaled_vis(gate.vis1.data() + 2 * p_start, vis.vis1.data() + 2 * p_start, scl,
+                            2 * nprod);
+
+        // Copy in the proto weight data
+        scale_vis_weight(gate.vis2.data() + p_start, vis.vis2.data() + p_start,
+                         scl * (1.0 - scl), nprod);
+    });
 
     // The number of FPGA frames that went into this integration is the same as
     // for the ungated dataset. If we don't correct this, only the on gates are
@@ -570,23 +650,21 @@ void visAccumulate::finalise_output(visAccumulate::internalState& state,
             continue;
         }
 
-        // Copy the visibilities into place
-        map_vis_triangle(input_remap, block_size, num_elements, freq_ind,
-                         [&](int32_t pi, int32_t bi, bool conj) {
-                             cfloat t = {(float)state.vis1[2 * bi + 1], (float)state.vis1[2 * bi]};
-                             t = !conj ? t : std::conj(t);
-                             output_frame.vis[pi] = iw * t;
-                         });
-
-        // Unpack and invert the weights
-        map_vis_triangle(input_remap, block_size, num_elements, freq_ind,
-                         [&](int32_t pi, int32_t bi, bool conj) {
-                             (void)conj;
-                             float t = state.vis2[bi];
-                             output_frame.weight[pi] = w * w / t;
-                         });
-
-        mark_frame_full(state.buf, unique_name.c_str(), state.frame_id++);
+        // Each thread unpacks a slice of the triangle
+        size_t offset = freq_ind * triangle_plan->num_prod_gpu();
+        parallel_for([&](uint32_t thread_id) {
+            auto [run_start, run_end] = run_range(thread_id);
+
+            // Copy the visibilities into place
+            copy_vis_triangle(state.vis1.data() + 2 * offset, *triangle_plan, output_frame.vis,
+                              iw, run_start, run_end);
+
+            // Unpack and invert the weights
+            invert_weight_triangle(state.vis2.data() + offset, *triangle_plan,
+                                   output_frame.weight, w * w, run_start, run_end);
+        });
+
+        mark_frame_full_h(state.buf, state.buf_handle, state.frame_id++);
     }
 }
 
@@ -630,9 +708,68 @@ bool visAccumulate::reset_state(visAccumulate::internalState& state, timespec t)
 }
 
 
-visAccumulate::internalState::internalState(Buffer* out_buf, std::unique_ptr<gateSpec> gate_spec,
-                                            size_t nprod) :
+void visAccumulate::parallel_for(const std::function<void(uint32_t)>& f) {
+
+    if (num_threads == 1) {
+        f(0);
+        return;
+    }
+
+    // Hand the function to the workers...
+    {
+        std::lock_guard<std::mutex> lock(work_mtx);
+        work_fn = &f;
+        work_remaining = num_threads - 1;
+        work_generation++;
+    }
+    work_cv.notify_all();
+
+    // ... do our own share, and wait for everyone to finish
+    f(0);
+
+    std::unique_lock<std::mutex> lock(work_mtx);
+    done_cv.wait(lock, [&]() { return work_remaining == 0; });
+}
+
+
+void visAccumulate::worker_thread(uint32_t thread_id) {
+
+    uint64_t generation = 0;
+
+    while (true) {
+        const std::function<void(uint32_t)>* f;
+        {
+            std::unique_lock<std::mutex> lock(work_mtx);
+            work_cv.wait(lock, [&]() { return work_stop || work_generation != generation; });
+            if (work_stop)
+                return;
+            generation = work_generation;
+            f = work_fn;
+        }
+
+        (*f)(thread_id);
+
+        std::lock_guard<std::mutex> lock(work_mtx);
+        if (--work_remaining == 0)
+            done_cv.notify_one();
+    }
+}
+
+
+std::pair<size_t, size_t> visAccumulate::prod_range(uint32_t thread_id) const {
+    return {prod_splits[thread_id], prod_splits[thread_id + 1]};
+}
+
+
+std::pair<size_t, size_t> visAccumulate::run_range(uint32_t thread_id) const {
+    return {run_splits[thread_id], run_splits[thread_id + 1]};
+}
+
+
+visAccumulate::internalState::internalState(Buffer* out_buf, int out_buf_handle,
+                                            std::unique_ptr<gateSpec> gate_spec, size_t nprod) :
     buf(out_buf),
+    buf_handle(out_buf_handle),
     frame_id(buf),
     spec(std::move(gate_spec)),
     changed(true),
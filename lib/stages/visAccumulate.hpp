@@ -15,18 +15,20 @@
 #include "gateSpec.hpp"          // for gateSpec
 #include "prometheusMetrics.hpp" // for Counter, MetricFamily
 #include "visBuffer.hpp"         // for VisFrameView
-#include "visUtil.hpp"           // for frameID, freq_ctype, input_ctype, prod_ctype
-
-#include <cstdint>    // for uint32_t, int32_t
-#include <deque>      // for deque
-#include <functional> // for function
-#include <map>        // for map
-#include <memory>     // for unique_ptr
-#include <mutex>      // for mutex
-#include <string>     // for string
-#include <time.h>     // for size_t, timespec
-#include <utility>    // for pair
-#include <vector>     // for vector
+#include "visUtil.hpp"           // for frameID, freq_ctype, input_ctype, prod_ctype, visTriangl...
+
+#include <condition_variable> // for condition_variable
+#include <cstdint>            // for uint32_t, int32_t, uint64_t
+#include <deque>              // for deque
+#include <functional>         // for function
+#include <map>                // for map
+#include <memory>             // for unique_ptr
+#include <mutex>              // for mutex
+#include <string>             // for string
+#include <thread>             // for thread
+#include <time.h>             // for size_t, timespec
+#include <utility>            // for pair
+#include <vector>             // for vector
 
 
 /**
@@ -72,6 +74,11 @@
  *                              Default 0..1023.
  * @conf  max_age               Float. Drop frames later than this number of seconds.
  *                              Default is 60.0
+ * @conf  num_threads           Int. Number of threads to split the products of
+ *                              each frame over. Default 1. The output does not
+ *                              depend on this.
+ * @conf  cpu_affinity          Vector of Int. CPU cores to pin the extra worker
+ *                              threads to. Default is to not pin them.
  *
  * @par Metrics
  * @metric  kotekan_visaccumulate_skipped_frame_total
@@ -84,7 +91,7 @@ class visAccumulate : public kotekan::Stage {
 public:
     visAccumulate(kotekan::Config& config, const std::string& unique_name,
                   kotekan::bufferContainer& buffer_container);
-    ~visAccumulate() = default;
+    ~visAccumulate();
     void main_thread() override;
 
 private:
@@ -102,11 +109,13 @@ private:
          * Everything else will be set by the reset_state call during
          * initialisation.
          *
-         * @param  out_buf    Buffer we will output into.
-         * @param  gate_spec  Specification of how any gating is done.
-         * @param  nprod      Number of products.
+         * @param  out_buf         Buffer we will output into.
+         * @param  out_buf_handle  Our producer handle for `out_buf`.
+         * @param  gate_spec       Specification of how any gating is done.
+         * @param  nprod           Number of products.
          **/
-        internalState(Buffer* out_buf, std::unique_ptr<gateSpec> gate_spec, size_t nprod);
+        internalState(Buffer* out_buf, int out_buf_handle, std::unique_ptr<gateSpec> gate_spec,
+                      size_t nprod);
 
         /// View of the data accessed by their freq_ind
         std::vector<VisFrameView> frames;
@@ -114,6 +123,9 @@ private:
         /// The buffer we are outputting too
         Buffer* buf;
 
+        /// Our producer handle on the output buffer
+        int buf_handle;
+
         // Current frame ID of the buffer we are using
         frameID frame_id;
 
@@ -152,6 +164,9 @@ private:
     Buffer* in_buf;
     Buffer* out_buf; // Output for the main vis dataset only
 
+    // Our consumer handle on the input buffer
+    int in_buf_handle;
+
     // Parameters saved from the config files
     size_t num_elements;
     size_t num_freq_in_frame;
@@ -164,9 +179,15 @@ private:
     // Derived from config
     size_t num_prod_gpu;
 
+    // Number of threads (including the main thread) to process each frame with
+    uint32_t num_threads;
+
     // The mapping from buffer element order to output file element ordering
     std::vector<uint32_t> input_remap;
 
+    // How to unpack the GPU triangle with the above mapping
+    std::unique_ptr<visTrianglePlan> triangle_plan;
+
     // Helper methods to make code clearer
 
     /**
@@ -209,6 +230,41 @@ private:
      **/
     bool reset_state(internalState& state, timespec t);
 
+    /**
+     * @brief Run a function on all threads and wait for them to finish.
+     *
+     * The main thread runs it as thread zero. Each thread should only touch its
+     * own slice of the products as given by `prod_range` or `run_range`.
+     *
+     * @param  f  Function to run, given the thread ID.
+     **/
+    void parallel_for(const std::function<void(uint32_t)>& f);
+
+    /// Slice of the GPU products to process on a thread. The boundaries are
+    /// aligned so the vector kernels treat every product the same way as they
+    /// would on a single thread.
+    std::pair<size_t, size_t> prod_range(uint32_t thread_id) const;
+
+    /// Slice of the runs of `triangle_plan` to unpack on a thread.
+    std::pair<size_t, size_t> run_range(uint32_t thread_id) const;
+
+    /// Loop run by the extra worker threads
+    void worker_thread(uint32_t thread_id);
+
+    // Boundaries of the product and run slices for each thread
+    std::vector<size_t> prod_splits;
+    std::vector<size_t> run_splits;
+
+    // The extra worker threads and the state used to hand them work
+    std::vector<std::thread> worker_threads;
+    std::mutex work_mtx;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    const std::function<void(uint32_t)>* work_fn = nullptr;
+    uint64_t work_generation = 0;
+    uint32_t work_remaining = 0;
+    bool work_stop = false;
+
     // List of gating specifications
     std::map<std::string, gateSpec*> gating_specs;
 
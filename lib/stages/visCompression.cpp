@@ -2,9 +2,9 @@
 
 #include "Config.hpp"            // for Config
 #include "Hash.hpp"              // for Hash, operator<
-#include "Stack.hpp"             // for stack_chime_in_cyl, stack_diagonal
+#include "Stack.hpp"             // for stackPlan, stack_chime_in_cyl, stack_diagonal
 #include "StageFactory.hpp"      // for REGISTER_KOTEKAN_STAGE, StageMakerTemplate
-#include "buffer.h"              // for wait_for_full_frame, mark_frame_empty, mark_frame_full
+#include "buffer.h"              // for wait_for_full_frame_h, mark_frame_empty_h, mark_frame...
 #include "bufferContainer.hpp"   // for bufferContainer
 #include "datasetManager.hpp"    // for dset_id_t, state_id_t, datasetManager
 #include "datasetState.hpp"      // for stackState, prodState, inputState
@@ -24,7 +24,7 @@
 #include <functional>   // for _Bind_helper<>::type, bind, function, placeholders
 #include <future>       // for async, future
 #include <iterator>     // for begin, end
-#include <memory>       // for allocator_traits<>::value_type
+#include <memory>       // for unique_ptr, make_unique, allocator_traits<>::value_type
 #include <pthread.h>    // for pthread_setaffinity_np
 #include <regex>        // for match_results<>::_Base_type
 #include <sched.h>      // for cpu_set_t, CPU_SET, CPU_ZERO
@@ -59,8 +59,8 @@ baselineCompression::baselineCompression(Config& config, const std::string& uniq
     compression_frame_counter(Metrics::instance().add_counter(
         "kotekan_baselinecompression_frame_total", unique_name, {"thread_id"})) {
 
-    register_consumer(in_buf, unique_name.c_str());
-    register_producer(out_buf, unique_name.c_str());
+    in_buf_handle = register_consumer(in_buf, unique_name.c_str());
+    out_buf_handle = register_producer(out_buf, unique_name.c_str());
 
     // Fill out the map of stack types
     stack_type_defs["diagonal"] = stack_diagonal;
@@ -160,15 +160,24 @@ void baselineCompression::compress_thread(uint32_t thread_id) {
 
     // Wait for the input buffer to be filled with data
     // in order to get dataset ID
-    if (wait_for_full_frame(in_buf, unique_name.c_str(), input_frame_id) == nullptr) {
+    if (wait_for_full_frame_h(in_buf, in_buf_handle, input_frame_id) == nullptr) {
         return;
     }
     auto input_frame = VisFrameView(in_buf, input_frame_id);
 
+    // The stacking plan for the current stack and flags. This only needs
+    // rebuilding if either of them change
+    std::unique_ptr<stackPlan> plan;
+    const stackState* plan_sstate = nullptr;
+
+    // The metrics of this thread
+    auto& time_seconds_metric = compression_time_seconds_metric.labels({std::to_string(thread_id)});
+    auto& frame_counter = compression_frame_counter.labels({std::to_string(thread_id)});
+
     while (!stop_thread) {
 
         // Wait for the input buffer to be filled with data
-        if (wait_for_full_frame(in_buf, unique_name.c_str(), input_frame_id) == nullptr) {
+        if (wait_for_full_frame_h(in_buf, in_buf_handle, input_frame_id) == nullptr) {
             break;
         }
 
@@ -191,15 +200,10 @@ void baselineCompression::compress_thread(uint32_t thread_id) {
             std::tie(new_dset_id, sstate_ptr, pstate_ptr) = dset_id_map.at(input_frame.dataset_id);
         }
 
-        const auto& stack_map = sstate_ptr->get_rstack_map();
-        const auto& prods = pstate_ptr->get_prods();
         auto num_stack = sstate_ptr->get_num_stack();
 
-        std::vector<float> stack_norm(sstate_ptr->get_num_stack(), 0.0);
-        std::vector<float> stack_v2(sstate_ptr->get_num_stack(), 0.0);
-
         // Wait for the output buffer frame to be free
-        if (wait_for_empty_frame(out_buf, unique_name.c_str(), output_frame_id) == nullptr) {
+        if (wait_for_empty_frame_h(out_buf, out_buf_handle, output_frame_id) == nullptr) {
             break;
         }
 
@@ -212,87 +216,33 @@ void baselineCompression::compress_thread(uint32_t thread_id) {
         output_frame.copy_data(input_frame, {VisField::vis, VisField::weight});
         output_frame.dataset_id = new_dset_id;
 
-        // Zero the output frame
-        std::fill(std::begin(output_frame.vis), std::end(output_frame.vis), 0.0);
-        std::fill(std::begin(output_frame.weight), std::end(output_frame.weight), 0.0);
-
         // Flag out the excluded inputs
         for (auto& input : exclude_inputs) {
             output_frame.flags[input] = 0.0;
         }
 
-        auto in_vis = input_frame.vis.data();
-        auto out_vis = output_frame.vis.data();
-        auto in_weight = input_frame.weight.data();
-        auto out_weight = output_frame.weight.data();
-        auto flags = output_frame.flags.data();
-
-        // Iterate over all the products and average together
-        for (uint32_t prod_ind = 0; prod_ind < prods.size(); prod_ind++) {
-            // TODO: if the weights are ever different from 0 or 1, we will
-            // definitely need to rewrite this.
-
-            // Alias the parts of the data we are going to stack
-            cfloat vis = in_vis[prod_ind];
-            float weight = in_weight[prod_ind];
-
-            auto& p = prods[prod_ind];
-            auto& s = stack_map[prod_ind];
-
-            // If the weight is zero, completely skip this iteration
-            if (weight == 0 || flags[p.input_a] == 0 || flags[p.input_b] == 0)
-                continue;
-
-            vis = s.conjugate ? conj(vis) : vis;
-
-            // First summation of the visibilities (dividing by the total weight will be done later)
-            out_vis[s.stack] += vis;
-
-            // Accumulate the square for variance calculation
-            stack_v2[s.stack] += fast_norm(vis);
-
-            // Accumulate the weighted *variances*. Normalising and inversion
-            // will be done later
-            out_weight[s.stack] += (1.0 / weight);
-
-            // Accumulate the weights so we can normalize correctly
-            stack_norm[s.stack] += 1.0;
+        // Rebuild the stacking plan if the stack or the flags have changed
+        if (plan == nullptr || plan_sstate != sstate_ptr
+            || !plan->flags_match(output_frame.flags)) {
+            DEBUG("Building stacking plan for {:d} stacks.", num_stack);
+            plan = std::make_unique<stackPlan>(num_stack, sstate_ptr->get_rstack_map(),
+                                               pstate_ptr->get_prods(), output_frame.flags);
+            plan_sstate = sstate_ptr;
         }
 
-        // Loop over the stacks and normalise (and invert the variances)
-        float vart = 0.0;
-        float normt = 0.0;
-        for (uint32_t stack_ind = 0; stack_ind < num_stack; stack_ind++) {
-
-            // Calculate the mean and accumulate weight and place in the frame
-            float norm = stack_norm[stack_ind];
-
-            // Invert norm if set, otherwise use zero to set data to zero.
-            float inorm = (norm != 0.0) ? (1.0 / norm) : 0.0;
-            float iwgt = (output_frame.weight[stack_ind] != 0.0)
-                             ? (1.0 / output_frame.weight[stack_ind])
-                             : 0.0;
-
-            output_frame.vis[stack_ind] *= inorm;
-            output_frame.weight[stack_ind] = norm * norm * iwgt;
-
-            // Accumulate to calculate the variance of the residuals
-            vart += stack_v2[stack_ind] - std::norm(output_frame.vis[stack_ind]) * norm;
-            normt += norm;
-        }
+        // Average together the products in each stack
+        float residual =
+            plan->stack(input_frame.vis, input_frame.weight, output_frame.vis, output_frame.weight);
 
         // Mark the buffers and move on
-        mark_frame_full(out_buf, unique_name.c_str(), output_frame_id);
-        mark_frame_empty(in_buf, unique_name.c_str(), input_frame_id);
-
-        // Calculate residuals (return zero if no data for this freq)
-        float residual = (normt != 0.0) ? (vart / normt) : 0.0;
+        mark_frame_full_h(out_buf, out_buf_handle, output_frame_id);
+        mark_frame_empty_h(in_buf, in_buf_handle, input_frame_id);
 
         // Update prometheus metrics
         double elapsed = current_time() - start_time;
         compression_residuals_metric.labels({std::to_string(output_frame.freq_id)}).set(residual);
-        compression_time_seconds_metric.labels({std::to_string(thread_id)}).set(elapsed);
-        compression_frame_counter.labels({std::to_string(thread_id)}).inc();
+        time_seconds_metric.set(elapsed);
+        frame_counter.inc();
 
         // Get the current values of the shared frame IDs and increment them.
         {
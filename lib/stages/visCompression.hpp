@@ -103,6 +103,10 @@ private:
     Buffer* in_buf;
     Buffer* out_buf;
 
+    // Our consumer/producer handles on the buffers
+    int in_buf_handle;
+    int out_buf_handle;
+
     // Frame IDs, shared by compress threads and their mutex.
     frameID frame_id_in;
     frameID frame_id_out;
@@ -12,7 +12,7 @@
 #include "metadata.h"          // for metadataContainer
 #include "version.h"           // for get_git_commit_hash
 #include "visBuffer.hpp"       // for VisFrameView
-#include "visUtil.hpp"         // for prod_ctype, input_ctype, freq_ctype, copy_vis_triangle
+#include "visUtil.hpp"         // for prod_ctype, input_ctype, freq_ctype, copy_vis_triangle, vis...
 
 #include "gsl-lite.hpp" // for span<>::iterator, span
 
@@ -22,6 +22,7 @@
 #include <exception>  // for exception
 #include <functional> // for _Bind_helper<>::type, bind, function
 #include <iterator>   // for back_insert_iterator, begin, end, back_inserter
+#include <memory>     // for make_unique, unique_ptr
 #include <numeric>    // for iota
 #include <regex>      // for match_results<>::_Base_type
 #include <stdexcept>  // for runtime_error
@@ -63,6 +64,7 @@ visTransform::visTransform(Config& config, const std::string& unique_name,
 
     // Get the indices for reordering
     input_remap = std::get<0>(input_reorder);
+    triangle_plan = std::make_unique<visTrianglePlan>(input_remap, block_size, num_elements);
 
     // Get everything we need for registering dataset states
 
@@ -150,8 +152,7 @@ void visTransform::main_thread() {
 
             // Copy the visibility data into a proper triangle and write into
             // the file
-            copy_vis_triangle((int32_t*)frame, input_remap, block_size, num_elements,
-                              output_frame.vis);
+            copy_vis_triangle((int32_t*)frame, *triangle_plan, output_frame.vis);
 
             // Fill other datasets with reasonable values
             std::fill(output_frame.weight.begin(), output_frame.weight.end(), 1.0);
@@ -11,8 +11,9 @@
 #include "buffer.h"
 #include "bufferContainer.hpp"
 #include "datasetManager.hpp" // for dset_id_t
-#include "visUtil.hpp"        // for input_ctype, prod_ctype, freq_ctype (ptr only)
+#include "visUtil.hpp"        // for input_ctype, prod_ctype, freq_ctype (ptr only), visTriangl...
 
+#include <memory>   // for unique_ptr
 #include <stddef.h> // for size_t
 #include <stdint.h> // for uint32_t
 #include <string>   // for string
@@ -70,6 +71,9 @@ private:
     // The mapping from buffer element order to output file element ordering
     std::vector<uint32_t> input_remap;
 
+    // How to unpack the GPU triangle with the above mapping
+    std::unique_ptr<visTrianglePlan> triangle_plan;
+
     // dataset ID written to output frames
     dset_id_t _ds_id_out;
 
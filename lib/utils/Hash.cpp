@@ -2,10 +2,12 @@
 
 #include "fmt.hpp" // for format
 
+#include <algorithm>  // for min
 #include <inttypes.h> // IWYU pragma: keep
 #include <iostream>   // for istream, ostream, basic_istream::read
 #include <stdexcept>  // for invalid_argument
 #include <stdio.h>    // for sscanf
+#include <string.h>   // for memcpy
 
 
 using nlohmann::json;
@@ -36,6 +38,117 @@ void Hash::set_from_string(const std::string& s) {
     }
 }
 
+namespace {
+
+// The MurmurHash3_x64_128 constants and mixing functions
+const uint64_t c1 = 0x87c37b91114253d5LLU;
+const uint64_t c2 = 0x4cf5ad432745937fLLU;
+
+inline uint64_t rotl64(uint64_t x, int8_t r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdLLU;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53LLU;
+    k ^= k >> 33;
+    return k;
+}
+
+} // namespace
+
+HashStream::HashStream(uint32_t seed) : h1(seed), h2(seed) {}
+
+void HashStream::add_block(const uint8_t* block) {
+    uint64_t k1, k2;
+    memcpy(&k1, block, 8);
+    memcpy(&k2, block + 8, 8);
+
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+}
+
+void HashStream::add(const void* data, size_t n) {
+    const uint8_t* p = (const uint8_t*)data;
+    len += n;
+
+    // Complete any partial block first
+    if (tail_len > 0) {
+        size_t m = std::min(n, 16 - tail_len);
+        memcpy(tail + tail_len, p, m);
+        tail_len += m;
+        p += m;
+        n -= m;
+        if (tail_len < 16)
+            return;
+        add_block(tail);
+        tail_len = 0;
+    }
+
+    for (; n >= 16; n -= 16, p += 16) {
+        add_block(p);
+    }
+
+    memcpy(tail, p, n);
+    tail_len = n;
+}
+
+Hash HashStream::finalize() const {
+    uint64_t f1 = h1, f2 = h2;
+
+    // The tail is mixed as in MurmurHash3_x64_128, it's just easier to zero pad it
+    if (tail_len > 0) {
+        uint8_t block[16] = {0};
+        memcpy(block, tail, tail_len);
+        uint64_t k1, k2;
+        memcpy(&k1, block, 8);
+        memcpy(&k2, block + 8, 8);
+
+        if (tail_len > 8) {
+            k2 *= c2;
+            k2 = rotl64(k2, 33);
+            k2 *= c1;
+            f2 ^= k2;
+        }
+
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        f1 ^= k1;
+    }
+
+    f1 ^= len;
+    f2 ^= len;
+
+    f1 += f2;
+    f2 += f1;
+
+    f1 = fmix64(f1);
+    f2 = fmix64(f2);
+
+    f1 += f2;
+    f2 += f1;
+
+    return {f1, f2};
+}
+
 // Conversions of the index types to json
 void to_json(json& j, const Hash& h) {
     j = h.to_string();
@@ -9,9 +9,11 @@
 
 // cinttypes needed by some CentOS systems.
 #include <cinttypes> // IWYU pragma: keep
-#include <iostream>  // for istream, ostream
-#include <stdint.h>  // for uint64_t
-#include <string>    // for string
+#include <iostream>    // for istream, ostream
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint64_t, uint8_t, uint32_t
+#include <string>      // for string
+#include <type_traits> // for enable_if_t, is_arithmetic
 
 // Set a value for the hash seed
 #define _SEED 1420
@@ -87,6 +89,76 @@ inline Hash hash(const std::string& s) {
     return t;
 }
 
+/**
+ * @brief Compute a hash incrementally.
+ *
+ * Data can be fed in any number of pieces, and the result is the same as
+ * calling `hash` on all of it concatenated. This means large structures can be
+ * hashed field by field without first serialising them into one buffer.
+ *
+ * Values are hashed by their in-memory representation, so hashes of anything
+ * but bytes and strings depend on the endianness of the machine.
+ **/
+class HashStream {
+public:
+    /**
+     * @brief Start a new hash.
+     *
+     * @param  seed  The seed. Defaults to the one used by `hash`.
+     **/
+    HashStream(uint32_t seed = _SEED);
+
+    /**
+     * @brief Add bytes to the hash.
+     *
+     * @param  data  The bytes to add.
+     * @param  len   The number of bytes.
+     **/
+    void add(const void* data, size_t len);
+
+    /**
+     * @brief Add a number to the hash.
+     *
+     * @param  v  The value to add.
+     **/
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic<T>::value> add(T v) {
+        add(&v, sizeof(T));
+    }
+
+    /**
+     * @brief Add a string to the hash.
+     *
+     * The length is added first, so the boundaries between consecutive strings
+     * change the hash.
+     *
+     * @param  s  The string to add.
+     **/
+    void add(const std::string& s) {
+        add<uint64_t>(s.size());
+        add(s.data(), s.size());
+    }
+
+    /**
+     * @brief Get the hash of everything added so far.
+     *
+     * @returns  The hash.
+     **/
+    Hash finalize() const;
+
+private:
+    // Mix a 16 byte block into the state
+    void add_block(const uint8_t* block);
+
+    uint64_t h1, h2;
+
+    // Total number of bytes added, and any left over that don't fill a block
+    uint64_t len = 0;
+    uint8_t tail[16];
+    size_t tail_len = 0;
+};
+
+
 /**
  * @brief Comparison of two hash types.
  *
@@ -1,10 +1,12 @@
 #include "Stack.hpp"
 
-#include "visUtil.hpp" // for rstack_ctype, prod_ctype, input_ctype
+#include "visKernels.hpp" // for visStackSums, stack_vis_run
+#include "visUtil.hpp"    // for rstack_ctype, prod_ctype, input_ctype, cfloat
 
 #include "fmt.hpp" // for format, fmt
 
-#include <algorithm>  // for copy, sort, transform, max
+#include <algorithm>  // for copy, sort, transform, max, equal, fill
+#include <complex>    // for norm
 #include <cstdint>    // for uint32_t, int8_t, int16_t
 #include <functional> // for _Bind_helper<>::type, bind, _1, placeholders
 #include <iterator>   // for back_insert_iterator, begin, end, back_inserter
@@ -124,3 +126,100 @@ stack_chime_in_cyl(const std::vector<input_ctype>& inputs, const std::vector<pro
 
     return {++cur_stack_ind, stack_map};
 }
+
+
+stackPlan::stackPlan(uint32_t num_stack, const std::vector<rstack_ctype>& stack_map,
+                     const std::vector<prod_ctype>& prods, gsl::span<const float> flags) :
+    _num_stack(num_stack),
+    _num_prod(prods.size()),
+    _flags(flags.begin(), flags.end()),
+    _vis2(num_stack),
+    _norm(num_stack) {
+
+    if (stack_map.size() != prods.size()) {
+        throw std::invalid_argument(fmt::format(fmt("Stack map has {:d} entries but there are "
+                                                    "{:d} products."),
+                                                stack_map.size(), prods.size()));
+    }
+
+    for (uint32_t prod_ind = 0; prod_ind < prods.size(); prod_ind++) {
+        auto& p = prods[prod_ind];
+        auto& s = stack_map[prod_ind];
+
+        if (s.stack >= num_stack) {
+            throw std::invalid_argument(
+                fmt::format(fmt("Product {:d} maps to stack {:d}, but there are only {:d}."),
+                            prod_ind, s.stack, num_stack));
+        }
+
+        // Flagged products are left out, which also ends the current run
+        if (flags[p.input_a] == 0 || flags[p.input_b] == 0)
+            continue;
+
+        // Try to extend the last run. A run of one product can go either way.
+        if (!_runs.empty()) {
+            auto& r = _runs.back();
+            bool next_prod = (r.prod + r.length == prod_ind) && (r.conj == s.conjugate);
+            bool forward = (!r.reverse && s.stack == r.stack + r.length);
+            bool backward = ((r.reverse || r.length == 1) && s.stack + r.length == r.stack);
+            if (next_prod && (forward || backward)) {
+                r.reverse = backward;
+                r.length++;
+                continue;
+            }
+        }
+        _runs.push_back({prod_ind, s.stack, 1, s.conjugate, false});
+    }
+}
+
+bool stackPlan::flags_match(gsl::span<const float> flags) const {
+    return std::equal(flags.begin(), flags.end(), _flags.begin(), _flags.end());
+}
+
+float stackPlan::stack(gsl::span<const cfloat> vis, gsl::span<const float> weight,
+                       gsl::span<cfloat> out_vis, gsl::span<float> out_weight) {
+
+    if (vis.size() < _num_prod || weight.size() < _num_prod) {
+        throw std::invalid_argument("Frame is too small for the number of products.");
+    }
+    if (out_vis.size() < _num_stack || out_weight.size() < _num_stack) {
+        throw std::invalid_argument("Output is too small for the number of stacks.");
+    }
+
+    std::fill(out_vis.begin(), out_vis.begin() + _num_stack, 0.0);
+    std::fill(out_weight.begin(), out_weight.begin() + _num_stack, 0.0);
+    std::fill(_vis2.begin(), _vis2.end(), 0.0);
+    std::fill(_norm.begin(), _norm.end(), 0.0);
+
+    // Sum up the visibilities, and the weighted *variances*. Normalising and
+    // inversion are done below.
+    // TODO: if the weights are ever different from 0 or 1, we will
+    // definitely need to rewrite this.
+    visStackSums sums = {(float*)out_vis.data(), _vis2.data(), out_weight.data(), _norm.data()};
+    for (auto& r : _runs) {
+        stack_vis_run(sums, r.stack, (const float*)(vis.data() + r.prod), weight.data() + r.prod,
+                      r.length, r.conj, r.reverse);
+    }
+
+    // Loop over the stacks and normalise (and invert the variances)
+    float vart = 0.0;
+    float normt = 0.0;
+    for (uint32_t stack_ind = 0; stack_ind < _num_stack; stack_ind++) {
+
+        float norm = _norm[stack_ind];
+
+        // Invert norm if set, otherwise use zero to set data to zero.
+        float inorm = (norm != 0.0) ? (1.0 / norm) : 0.0;
+        float iwgt = (out_weight[stack_ind] != 0.0) ? (1.0 / out_weight[stack_ind]) : 0.0;
+
+        out_vis[stack_ind] *= inorm;
+        out_weight[stack_ind] = norm * norm * iwgt;
+
+        // Accumulate to calculate the variance of the residuals
+        vart += _vis2[stack_ind] - std::norm(out_vis[stack_ind]) * norm;
+        normt += norm;
+    }
+
+    // Calculate residuals (return zero if no data for this freq)
+    return (normt != 0.0) ? (vart / normt) : 0.0;
+}
@@ -1,7 +1,9 @@
 #ifndef STACK_HPP
 #define STACK_HPP
 
-#include "visUtil.hpp" // for input_ctype, prod_ctype, rstack_ctype
+#include "visUtil.hpp" // for input_ctype, prod_ctype, rstack_ctype, cfloat
+
+#include "gsl-lite.hpp" // for span
 
 #include <cstdint> // for int8_t, uint32_t, int16_t
 #include <iosfwd>  // for ostream
@@ -41,6 +43,99 @@ stack_diagonal(const std::vector<input_ctype>& inputs, const std::vector<prod_ct
 std::pair<uint32_t, std::vector<rstack_ctype>>
 stack_chime_in_cyl(const std::vector<input_ctype>& inputs, const std::vector<prod_ctype>& prods);
 
+/**
+ * @brief A precomputed plan for stacking the products of a frame.
+ *
+ * In the usual stackings, neighbouring products go into neighbouring stacks,
+ * so the plan splits the products into runs that each go into a run of
+ * consecutive stacks. These can then be added in with the vectorised
+ * `stack_vis_run`, reading the frame straight through. Any product involving
+ * a flagged input is left out of the runs when the plan is built, so stacking
+ * a frame only has to look at the weights.
+ *
+ * The flags change rarely, so a plan should be kept and only rebuilt if
+ * `flags_match` fails. As it holds the work buffers for the stacking, a plan
+ * must not be used by more than one thread at once.
+ **/
+class stackPlan {
+public:
+    /**
+     * @brief Build the plan.
+     *
+     * @param num_stack  The number of stacks.
+     * @param stack_map  The stack each product goes into.
+     * @param prods      The products.
+     * @param flags      The input flags. Products with a zero flagged input
+     *                   are left out.
+     **/
+    stackPlan(uint32_t num_stack, const std::vector<rstack_ctype>& stack_map,
+              const std::vector<prod_ctype>& prods, gsl::span<const float> flags);
+
+    /**
+     * @brief Check if the plan was built with the same flags.
+     *
+     * @param flags  The input flags of the frame.
+     *
+     * @returns True if the plan can be used with these flags.
+     **/
+    bool flags_match(gsl::span<const float> flags) const;
+
+    /**
+     * @brief Stack a frame.
+     *
+     * The stacked visibilities are the mean of the unflagged products with
+     * non-zero weight, and the stacked weights are the inverse of the variance
+     * of this mean.
+     *
+     * @param vis         The visibilities of the frame.
+     * @param weight      The weights of the frame.
+     * @param out_vis     Where to put the stacked visibilities.
+     * @param out_weight  Where to put the stacked weights.
+     *
+     * @returns The variance of the residuals around the stacked
+     *          visibilities. Zero if there was no data.
+     **/
+    float stack(gsl::span<const cfloat> vis, gsl::span<const float> weight,
+                gsl::span<cfloat> out_vis, gsl::span<float> out_weight);
+
+    /// A run of products going into consecutive stacks
+    struct run {
+        /// The first product
+        uint32_t prod;
+        /// The stack the first product goes into
+        uint32_t stack;
+        /// Number of products
+        uint32_t length;
+        /// If the products are conjugated
+        bool conj;
+        /// If the stacks go backwards
+        bool reverse;
+    };
+
+    /// The runs, in product order
+    const std::vector<run>& runs() const {
+        return _runs;
+    }
+
+    /// Number of stacks
+    uint32_t num_stack() const {
+        return _num_stack;
+    }
+
+private:
+    uint32_t _num_stack;
+    uint32_t _num_prod;
+    std::vector<run> _runs;
+
+    // The flags the plan was built with
+    std::vector<float> _flags;
+
+    // Work buffers for the sums of the squared visibilities and the counts
+    std::vector<float> _vis2;
+    std::vector<float> _norm;
+};
+
+
 #define CYL_A 0
 #define CYL_B 1
 #define CYL_C 2
@@ -1,17 +1,21 @@
 #include "datasetManager.hpp"
 
-#include "Config.hpp"     // for Config
-#include "Hash.hpp"       // for operator<, hash, operator==
-#include "restClient.hpp" // for restClient::restReply, restClient
-#include "restServer.hpp" // for restServer, connectionInstance, HTTP_RESPONSE, HTTP_RESPONSE::...
-
-#include <algorithm>  // for max
-#include <cstdint>    // for int32_t
-#include <functional> // for function, _Bind_helper<>::type, _Placeholder, bind, _1
-#include <iosfwd>     // for streamsize
-#include <mutex>      // for mutex, lock_guard, lock, adopt_lock, unique_lock
-#include <regex>      // for match_results<>::_Base_type
-#include <stdlib.h>   // for exit
+#include "Config.hpp"       // for Config
+#include "Hash.hpp"         // for operator<, hash, operator==, HashStream
+#include "datasetStore.hpp" // for datasetStore
+#include "restClient.hpp"   // for restClient::restReply, restClient
+#include "restServer.hpp"   // for restServer, connectionInstance, HTTP_RESPONSE, HTTP_RESPONSE...
+
+#include <algorithm>    // for max
+#include <cstdint>      // for int32_t
+#include <functional>   // for function, _Bind_helper<>::type, _Placeholder, bind, _1
+#include <iosfwd>       // for streamsize
+#include <memory>       // for make_unique
+#include <mutex>        // for mutex, lock_guard, lock, adopt_lock, unique_lock, defer_lock
+#include <regex>        // for match_results<>::_Base_type
+#include <shared_mutex> // for shared_lock, shared_mutex
+#include <stdexcept>    // for invalid_argument
+#include <stdlib.h>     // for exit
 
 using nlohmann::json;
 
@@ -21,6 +25,7 @@ datasetManager::datasetManager() :
     _stop_request_threads(false),
     _n_request_threads(0),
     _config_applied(false),
+    _broker_cbor(false),
     _rest_client(restClient::instance()),
     error_counter(kotekan::prometheus::Metrics::instance().add_gauge(
         "kotekan_datasetbroker_error_count", DS_UNIQUE_NAME)) {
@@ -64,9 +69,38 @@ datasetManager& datasetManager::instance(kotekan::Config& config) {
         dm._timeout_rest_client_s =
             config.get_default<int32_t>(DS_UNIQUE_NAME, "timeout_rest_client", 100);
 
+        std::string encoding =
+            config.get_default<std::string>(DS_UNIQUE_NAME, "broker_encoding", "json");
+        if (encoding != "json" && encoding != "cbor") {
+            throw std::invalid_argument(fmt::format(
+                fmt("datasetManager: unknown broker_encoding \"{:s}\", use \"json\" or "
+                    "\"cbor\"."),
+                encoding));
+        }
+        dm._offer_cbor = (encoding == "cbor");
+
+        std::string store_path = config.get_default<std::string>(DS_UNIQUE_NAME, "store_path", "");
+        if (store_path.empty()) {
+            dm._store.reset();
+        } else {
+            dm._store = std::make_unique<datasetStore>(store_path);
+            INFO_NON_OO("datasetManager: saving states and datasets from the broker in {:s}.",
+                        store_path);
+        }
+
         DEBUG_NON_OO("datasetManager: expecting broker at {:s}:{:d}.", dm._ds_broker_host,
                      dm._ds_broker_port);
     }
+
+    std::string state_hash =
+        config.get_default<std::string>(DS_UNIQUE_NAME, "state_hash", "binary");
+    if (state_hash != "binary" && state_hash != "json") {
+        throw std::invalid_argument(fmt::format(
+            fmt("datasetManager: unknown state_hash \"{:s}\", use \"binary\" or \"json\"."),
+            state_hash));
+    }
+    dm._json_state_hash = (state_hash == "json");
+
     dm._config_applied = true;
 
     return dm;
@@ -83,6 +117,11 @@ datasetManager::~datasetManager() {
 }
 
 
+datasetManager::state_cache& datasetManager::thread_state_cache() {
+    thread_local state_cache cache;
+    return cache;
+}
+
 void datasetManager::stop() {
     INFO_NON_OO("Stopping request threads...");
     _stop_request_threads = true;
@@ -92,7 +131,7 @@ void datasetManager::stop() {
 dset_id_t datasetManager::add_dataset(state_id_t state, dset_id_t base_dset) {
     datasetState* t = nullptr;
     try {
-        std::lock_guard<std::mutex> slck(_lock_states);
+        std::shared_lock<std::shared_mutex> slck(_lock_states);
         t = _states.at(state).get();
     } catch (std::exception& e) {
         // This must be a bug in the calling stage...
@@ -134,7 +173,7 @@ dset_id_t datasetManager::add_dataset(dataset ds) {
 
     {
         // insert the new entry
-        std::lock_guard<std::mutex> lck_ds(_lock_dsets);
+        std::lock_guard<std::shared_mutex> lck_ds(_lock_dsets);
 
         if (!_datasets.insert(std::pair<dset_id_t, dataset>(new_dset_id, ds)).second) {
             // There is already a dataset with the same hash.
@@ -162,13 +201,20 @@ dset_id_t datasetManager::add_dataset(dataset ds) {
     return new_dset_id;
 }
 
-// TODO: decide if this is the best way of hashing the state and dataset.
-// It has the advantage of being simple, there's a slight issue in that json
-// technically doesn't guarantee order of items in an object, but in
-// practice nlohmann::json ensures they are alphabetical by default. It
-// might also be a little slow as it requires full serialisation.
+// The JSON hashes have the advantage of being simple, there's a slight issue in
+// that json technically doesn't guarantee order of items in an object, but in
+// practice nlohmann::json ensures they are alphabetical by default. They are
+// slow for large states as they require full serialisation, so by default
+// states are hashed directly. Datasets are small, and the broker expects their
+// IDs to be the hash of their serialisation, so they are always hashed as json.
 state_id_t datasetManager::hash_state(datasetState& state) const {
-    return hash(state.to_json().dump());
+    if (_json_state_hash)
+        return hash(state.to_json().dump());
+
+    HashStream h;
+    h.add(state.type());
+    state.hash_data(h);
+    return h.finalize();
 }
 
 state_id_t datasetManager::hash_dataset(dataset& ds) const {
@@ -192,15 +238,31 @@ void datasetManager::register_state(state_id_t state) {
         t.detach();
 }
 
+restClient::encoding datasetManager::broker_encoding() const {
+    if (!_offer_cbor)
+        return restClient::encoding::json;
+
+    // Only send CBOR once we know the broker understands it
+    return _broker_cbor ? restClient::encoding::cbor : restClient::encoding::json_accept_cbor;
+}
+
+json datasetManager::parse_broker_reply(const std::string& reply) {
+    if (restClient::is_cbor(reply) && !_broker_cbor) {
+        DEBUG_NON_OO("datasetManager: broker replied in CBOR, switching to CBOR requests.");
+        _broker_cbor = true;
+    }
+    return restClient::parse_reply(reply);
+}
+
 void datasetManager::request_thread(const json&& request, const std::string&& endpoint,
                                     const std::function<bool(std::string&)>&& parse_reply) {
 
     restClient::restReply reply;
 
     while (true) {
-        reply =
-            _rest_client.make_request_blocking(endpoint, request, _ds_broker_host, _ds_broker_port,
-                                               _retries_rest_client, _timeout_rest_client_s);
+        reply = _rest_client.make_request_blocking(endpoint, request, _ds_broker_host,
+                                                   _ds_broker_port, _retries_rest_client,
+                                                   _timeout_rest_client_s, broker_encoding());
 
         // If parser succeeds, the request is done and this thread can exit.
         if (reply.first) {
@@ -235,7 +297,7 @@ bool datasetManager::register_state_parser(std::string& reply) {
     json js_reply;
 
     try {
-        js_reply = json::parse(reply);
+        js_reply = parse_broker_reply(reply);
     } catch (std::exception& e) {
         WARN_NON_OO("datasetManager: failure parsing reply received from broker after "
                     "registering dataset state (reply: {:s}): {:s}",
@@ -261,7 +323,7 @@ bool datasetManager::register_state_parser(std::string& reply) {
                 std::bind(&datasetManager::send_state_parser, this, std::placeholders::_1));
 
             {
-                std::lock_guard<std::mutex> slck(_lock_states);
+                std::shared_lock<std::shared_mutex> slck(_lock_states);
                 js_post["state"] = _states.at(state)->to_json();
                 js_post["type"] = _states.at(state)->type();
             }
@@ -292,7 +354,7 @@ bool datasetManager::register_state_parser(std::string& reply) {
 bool datasetManager::send_state_parser(std::string& reply) {
     json js_reply;
     try {
-        js_reply = json::parse(reply);
+        js_reply = parse_broker_reply(reply);
         if (js_reply.at("result") != "success")
             throw std::runtime_error(fmt::format(fmt("received error from broker: {:s}"),
                                                  js_reply.at("result").dump(4)));
@@ -330,7 +392,7 @@ bool datasetManager::register_dataset_parser(std::string& reply) {
     json js_reply;
 
     try {
-        js_reply = json::parse(reply);
+        js_reply = parse_broker_reply(reply);
         if (js_reply.at("result") != "success")
             throw std::runtime_error(fmt::format(fmt("received error from broker: {:s}"),
                                                  js_reply.at("result").dump(4)));
@@ -349,9 +411,9 @@ std::string datasetManager::summary() {
     std::string out;
 
     // lock both of them at the same time to prevent deadlocks
-    std::lock(_lock_states, _lock_dsets);
-    std::lock_guard<std::mutex> slock(_lock_states, std::adopt_lock);
-    std::lock_guard<std::mutex> dslock(_lock_dsets, std::adopt_lock);
+    std::shared_lock<std::shared_mutex> slock(_lock_states, std::defer_lock);
+    std::shared_lock<std::shared_mutex> dslock(_lock_dsets, std::defer_lock);
+    std::lock(slock, dslock);
 
     for (auto t : _datasets) {
         try {
@@ -372,7 +434,7 @@ const std::map<state_id_t, const datasetState*> datasetManager::states() {
 
     std::map<state_id_t, const datasetState*> cdt;
 
-    std::lock_guard<std::mutex> lock(_lock_states);
+    std::shared_lock<std::shared_mutex> lock(_lock_states);
     for (auto& dt : _states) {
         cdt[dt.first] = dt.second.get();
     }
@@ -381,17 +443,25 @@ const std::map<state_id_t, const datasetState*> datasetManager::states() {
 }
 
 const std::map<dset_id_t, dataset> datasetManager::datasets() {
-    std::lock_guard<std::mutex> lock(_lock_dsets);
+    std::shared_lock<std::shared_mutex> lock(_lock_dsets);
     return _datasets;
 }
 
+std::optional<dataset> datasetManager::find_dataset(dset_id_t dset) {
+    std::shared_lock<std::shared_mutex> lock(_lock_dsets);
+    auto it = _datasets.find(dset);
+    if (it == _datasets.end())
+        return {};
+    return it->second;
+}
+
 const std::vector<std::pair<dset_id_t, datasetState*>> datasetManager::ancestors(dset_id_t dset) {
 
     std::vector<std::pair<dset_id_t, datasetState*>> a_list;
 
-    std::lock(_lock_states, _lock_dsets);
-    std::lock_guard<std::mutex> slock(_lock_states, std::adopt_lock);
-    std::lock_guard<std::mutex> dslock(_lock_dsets, std::adopt_lock);
+    std::shared_lock<std::shared_mutex> slock(_lock_states, std::defer_lock);
+    std::shared_lock<std::shared_mutex> dslock(_lock_dsets, std::defer_lock);
+    std::lock(slock, dslock);
 
     // make sure we know this dataset before running into trouble
     if (_datasets.find(dset) == _datasets.end()) {
@@ -422,22 +492,47 @@ const std::vector<std::pair<dset_id_t, datasetState*>> datasetManager::ancestors
     return a_list;
 }
 
+bool datasetManager::reaches_root(dset_id_t ds_id) const {
+    auto it = _datasets.find(ds_id);
+    while (it != _datasets.end()) {
+        if (it->second.is_root())
+            return true;
+        it = _datasets.find(it->second.base_dset());
+    }
+    return false;
+}
+
 void datasetManager::update_datasets(dset_id_t ds_id) {
 
+    // Usually we know all the ancestors already. Check that without blocking
+    // other readers or waiting for updates of unrelated datasets.
+    {
+        std::shared_lock<std::shared_mutex> dslock(_lock_dsets);
+        if (reaches_root(ds_id))
+            return;
+    }
+
     // wait for ongoing dataset updates
-    std::lock(_lock_dsets, _lock_ds_update);
-    std::unique_lock<std::mutex> dslock(_lock_dsets, std::adopt_lock);
+    std::unique_lock<std::shared_mutex> dslock(_lock_dsets, std::defer_lock);
+    std::lock(dslock, _lock_ds_update);
     std::lock_guard<std::mutex> updatelock(_lock_ds_update, std::adopt_lock);
 
     // Walk up the tree from the given dataset until we find a state that we
-    // don't know. If we reach the root state, then we don't need to update
-    // anything so we exit
-    while (_datasets.count(ds_id) == 1) {
-        auto& ds = _datasets.at(ds_id);
-        if (ds.is_root()) {
+    // don't know, taking any we don't know from the local store. If we reach
+    // the root state, then we don't need to update anything so we exit
+    while (true) {
+        auto it = _datasets.find(ds_id);
+        if (it == _datasets.end() && _store) {
+            auto ds = _store->get_dataset(ds_id);
+            if (ds)
+                it = _datasets.emplace(ds_id, ds.value()).first;
+        }
+        if (it == _datasets.end())
+            break;
+        if (it->second.is_root()) {
             return;
         }
-        ds_id = ds.base_dset();
+        ds_id = it->second.base_dset();
     }
 
     // check if local dataset topology is up to date to include requested ds_id
@@ -447,13 +542,13 @@ void datasetManager::update_datasets(dset_id_t ds_id) {
 
     restClient::restReply reply = _rest_client.make_request_blocking(
         PATH_UPDATE_DATASETS, js_rqst, _ds_broker_host, _ds_broker_port, _retries_rest_client,
-        _timeout_rest_client_s);
+        _timeout_rest_client_s, broker_encoding());
 
     while (!_stop_request_threads && !parse_reply_dataset_update(reply)) {
         std::this_thread::sleep_for(std::chrono::milliseconds(_retry_wait_time_ms));
         reply = _rest_client.make_request_blocking(PATH_UPDATE_DATASETS, js_rqst, _ds_broker_host,
                                                    _ds_broker_port, _retries_rest_client,
-                                                   _timeout_rest_client_s);
+                                                   _timeout_rest_client_s, broker_encoding());
     }
 }
 
@@ -468,12 +563,12 @@ bool datasetManager::parse_reply_dataset_update(restClient::restReply reply) {
 
     json js_reply;
     try {
-        js_reply = json::parse(reply.second);
+        js_reply = parse_broker_reply(reply.second);
         if (js_reply.at("result") != "success")
             throw std::runtime_error(fmt::format(fmt("Broker answered with result={:s}"),
                                                  js_reply.at("result").dump(4)));
 
-        std::lock_guard<std::mutex> dslock(_lock_dsets);
+        std::lock_guard<std::shared_mutex> dslock(_lock_dsets);
         for (json::iterator ds = js_reply.at("datasets").begin();
              ds != js_reply.at("datasets").end(); ds++) {
 
@@ -484,6 +579,9 @@ bool datasetManager::parse_reply_dataset_update(restClient::restReply reply) {
                 // insert the new dataset
                 _datasets.insert(std::pair<dset_id_t, dataset>(ds_id, new_dset));
 
+                if (_store)
+                    _store->put_dataset(ds_id, new_dset);
+
             } catch (std::exception& e) {
                 WARN_NON_OO("datasetManager: failure parsing reply received from broker after "
                             "requesting dataset update: the following exception was thrown when "
@@ -504,6 +602,16 @@ bool datasetManager::parse_reply_dataset_update(restClient::restReply reply) {
     return true;
 }
 
+const datasetState* datasetManager::load_state(state_id_t state_id) {
+    state_uptr state = _store->get_state(state_id);
+    if (state == nullptr)
+        return nullptr;
+
+    DEBUG_NON_OO("datasetManager: found state {} in the local store.", state_id);
+    std::lock_guard<std::shared_mutex> slock(_lock_states);
+    return _states.emplace(state_id, std::move(state)).first->second.get();
+}
+
 void datasetManager::force_update_callback(kotekan::connectionInstance& conn) {
 
     INFO_NON_OO("Sending forced update to broker.");
@@ -517,7 +625,7 @@ void datasetManager::force_update_callback(kotekan::connectionInstance& conn) {
 
     // Register all states.
     {
-        std::lock_guard<std::mutex> slock(_lock_states);
+        std::shared_lock<std::shared_mutex> slock(_lock_states);
         for (auto s = _states.begin(); s != _states.end(); s++) {
             register_state(s->first);
         }
@@ -525,7 +633,7 @@ void datasetManager::force_update_callback(kotekan::connectionInstance& conn) {
 
     // Register all datasets.
     {
-        std::lock_guard<std::mutex> dslock(_lock_dsets);
+        std::shared_lock<std::shared_mutex> dslock(_lock_dsets);
         for (auto ds : _datasets) {
             register_dataset(ds.first, ds.second);
         }
@@ -552,7 +660,7 @@ datasetManager::closest_dataset_of_type(dset_id_t dset, const std::string& type)
     }
 
     {
-        std::lock_guard<std::mutex> dslock(_lock_dsets);
+        std::shared_lock<std::shared_mutex> dslock(_lock_dsets);
 
         while (true) {
             // Search for the requested type in each dataset
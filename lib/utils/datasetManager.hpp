@@ -5,6 +5,7 @@
 #include "Hash.hpp"              // for operator<, Hash
 #include "dataset.hpp"           // for dataset
 #include "datasetState.hpp"      // for datasetState, state_uptr, _factory_aliasdatasetState
+#include "datasetStore.hpp"      // for datasetStore
 #include "factory.hpp"           // for FACTORY
 #include "kotekanLogging.hpp"    // for WARN_NON_OO, DEBUG_NON_OO, DEBUG2_NON_OO, FATAL_ERROR_N...
 #include "prometheusMetrics.hpp" // for Gauge
@@ -24,12 +25,15 @@
 #include <mutex>              // for mutex, unique_lock, lock_guard
 #include <optional>           // for optional
 #include <set>                // for set
+#include <shared_mutex>       // for shared_mutex, shared_lock
 #include <stdexcept>          // for runtime_error, out_of_range
 #include <stdint.h>           // for uint32_t, int32_t, uint64_t
 #include <string>             // for string, basic_string
 #include <thread>             // for sleep_for
 #include <type_traits>        // for is_base_of, enable_if, enable_if_t
+#include <typeindex>          // for type_index
 #include <typeinfo>           // for type_info
+#include <unordered_map>      // for unordered_map
 #include <utility>            // for pair, move, forward
 #include <vector>             // for vector
 
@@ -68,6 +72,10 @@ const std::string PATH_REQUEST_STATE = "/request-state";
  * const std::vector<input_ctype>& inputs = input_state->get_inputs();
  * ```
  *
+ * States and datasets are never removed, so the lookups done by `dataset_state` are remembered in
+ * a per-thread cache. Repeated lookups from a stage's frame loop don't take any locks. Other
+ * lookups only take shared locks, so they don't block each other.
+ *
  * A stage that changes the state of the dataset in the frames it processes should inform the
  * datasetManager by adding a new state and dataset. If multiple states are being applied at the
  * same time a vector of states can be passed to `add_dataset`. This causes datasets linking them to
@@ -94,6 +102,25 @@ const std::string PATH_REQUEST_STATE = "/request-state";
  *                              datasetManager. Default 0.
  * @conf timeout_rest_client_s  Int. Timeout value passed to libevent. -1 will
  *                              use libevent default value (50s). Default 100.
+ * @conf broker_encoding        String. Encoding for messages to and from the
+ *                              broker. "json" always uses JSON text. "cbor"
+ *                              tells the broker it may reply in CBOR, and once
+ *                              it has done so, sends requests as CBOR too. With
+ *                              a broker that only speaks JSON this falls back
+ *                              to JSON. Default "json".
+ * @conf state_hash             String. How state IDs are calculated. "binary"
+ *                              hashes the contents of the states directly,
+ *                              "json" hashes their JSON serialisation, which
+ *                              gives the same IDs as older versions of kotekan
+ *                              but is much slower for large states. Default
+ *                              "binary".
+ * @conf store_path             String. If set (and `use_dataset_broker` is
+ *                              `True`), the states and datasets received from
+ *                              the broker are saved in this directory, and
+ *                              looked for there before asking the broker. This
+ *                              lets a restarted instance find them without
+ *                              waiting for the broker. Several instances can
+ *                              share a directory. Default "" (don't save them).
  *
  * @par metrics
  * @metric kotekan_datasetbroker_error_count Number of errors encountered in
@@ -230,6 +257,18 @@ public:
      **/
     const std::map<dset_id_t, dataset> datasets();
 
+    /**
+     * @brief Look up a single dataset.
+     *
+     * This doesn't ask the broker, and is much cheaper than copying all the
+     * datasets with `datasets()`.
+     *
+     * @param  dset  The ID of the dataset.
+     *
+     * @returns      The dataset, or unset if it is not known locally.
+     **/
+    std::optional<dataset> find_dataset(dset_id_t dset);
+
     /**
      * @brief Find the closest ancestor of a given type.
      *
@@ -328,6 +367,9 @@ private:
     /**
      * @brief Calculate the hash of a datasetState to use as the state_id.
      *
+     * Depending on `state_hash` this either hashes the state data directly or
+     * its JSON serialisation.
+     *
      * @param state State to hash.
      *
      * @returns Hash to use as ID.
@@ -358,6 +400,12 @@ private:
     /// parser function for register_state()
     bool register_state_parser(std::string& reply);
 
+    /// The encoding to use for the next request to the broker
+    restClient::encoding broker_encoding() const;
+
+    /// Parse a reply from the broker, noting if it supports CBOR
+    nlohmann::json parse_broker_reply(const std::string& reply);
+
     /// parser function for sending a state to the dataset broker
     /// from register_state_parser()
     bool send_state_parser(std::string& reply);
@@ -382,6 +430,29 @@ private:
     template<typename T>
     inline const T* request_state(state_id_t state_id);
 
+    /// Load a state from the local store, if it is there.
+    const datasetState* load_state(state_id_t state_id);
+
+    /// Check if all the ancestors of a dataset are known. Must be called with
+    /// `_lock_dsets` held.
+    bool reaches_root(dset_id_t ds_id) const;
+
+    /// Key for the cache of `dataset_state` lookups
+    using state_cache_key = std::pair<dset_id_t, std::type_index>;
+
+    /// Hash function for state_cache_key
+    struct state_cache_hash {
+        size_t operator()(const state_cache_key& k) const {
+            return k.first.l ^ k.second.hash_code();
+        }
+    };
+
+    /// Cache of the states found by `dataset_state`
+    using state_cache = std::unordered_map<state_cache_key, const datasetState*, state_cache_hash>;
+
+    /// Get the cache of `dataset_state` lookups for the calling thread
+    static state_cache& thread_state_cache();
+
     /// Store the list of all the registered states.
     std::map<state_id_t, state_uptr> _states;
 
@@ -389,18 +460,15 @@ private:
     /// and input datasets they correspond to
     std::map<dset_id_t, dataset> _datasets;
 
-    /// Lock for changing or using the states map.
-    std::mutex _lock_states;
+    /// Lock for changing or using the states map. Lookups take it shared.
+    std::shared_mutex _lock_states;
 
-    /// Lock for changing or using the datasets.
-    std::mutex _lock_dsets;
+    /// Lock for changing or using the datasets. Lookups take it shared.
+    std::shared_mutex _lock_dsets;
 
-    /// Lock for the ancestors request cv.
+    /// Lock to only request one state from the broker at a time.
     std::mutex _lock_rqst;
 
-    /// Lock for the register dataset cv.
-    std::mutex _lock_reg;
-
     /// Lock for the receive state cv.
     std::mutex _lock_recv_state;
 
@@ -432,6 +500,12 @@ private:
     /// Check if config loaded for this singleton before handing out instances
     std::atomic<bool> _config_applied;
 
+    /// Set once the broker has replied in CBOR
+    std::atomic<bool> _broker_cbor;
+
+    /// Where the states and datasets from the broker are saved, if anywhere
+    std::unique_ptr<datasetStore> _store;
+
     /// config params
     bool _use_broker = false;
     std::string _ds_broker_host;
@@ -439,6 +513,8 @@ private:
     uint32_t _retry_wait_time_ms;
     uint32_t _retries_rest_client;
     int32_t _timeout_rest_client_s;
+    bool _offer_cbor = false;
+    bool _json_state_hash = false;
 
     /// a reference to the restClient instance
     restClient& _rest_client;
@@ -455,6 +531,13 @@ private:
 template<typename T>
 inline const T* datasetManager::dataset_state(dset_id_t dset) {
 
+    // The ancestors of a dataset and the states never change once they are
+    // known, so anything found before can be returned straight away
+    state_cache& cache = thread_state_cache();
+    auto cached = cache.find({dset, typeid(T)});
+    if (cached != cache.end())
+        return (const T*)cached->second;
+
     // Try to find a matching dataset
     std::string type = FACTORY(datasetState)::label<T>();
     auto ret = closest_dataset_of_type(dset, type);
@@ -467,34 +550,41 @@ inline const T* datasetManager::dataset_state(dset_id_t dset) {
 
     state_id_t state_id = ret.value().second.state();
 
-    // NOTE: we may want to reconsider if we should have released the lock
-    // between here and the `closest_dataset_of_type` call above. There's a
-    // possibility we may end up doing multiple requests to comet
+    // Check if we have that state already
+    const datasetState* state = nullptr;
     {
-        std::lock_guard<std::mutex> dslock(_lock_dsets);
-
-        // Check if we have that state already
-        const datasetState* state = nullptr;
-        try {
-            state = _states.at(state_id).get();
-            return (const T*)state;
-        } catch (std::out_of_range& e) {
-            DEBUG_NON_OO("datasetManager: requested state {} not known locally.", state_id);
-        }
+        std::shared_lock<std::shared_mutex> slock(_lock_states);
+        auto it = _states.find(state_id);
+        if (it != _states.end())
+            state = it->second.get();
+    }
 
-        if (_use_broker) {
-            // Request the state from the broker.
-            state = request_state<T>(state_id);
-            while (!state && !_stop_request_threads) {
-                WARN_NON_OO("datasetManager: Failure requesting state {} from broker.\nRetrying...",
-                            state_id);
-                std::this_thread::sleep_for(std::chrono::milliseconds(_retry_wait_time_ms));
-                state = request_state<T>(state_id);
-            }
-            return (const T*)state;
-        } else
+    if (state == nullptr) {
+        DEBUG_NON_OO("datasetManager: requested state {} not known locally.", state_id);
+        if (!_use_broker)
             return nullptr;
+
+        // Look for it in the local store before asking the broker.
+        if (_store)
+            state = load_state(state_id);
+    }
+
+    if (state == nullptr) {
+        // Request the state from the broker.
+        std::lock_guard<std::mutex> rlock(_lock_rqst);
+        state = request_state<T>(state_id);
+        while (!state && !_stop_request_threads) {
+            WARN_NON_OO("datasetManager: Failure requesting state {} from broker.\nRetrying...",
+                        state_id);
+            std::this_thread::sleep_for(std::chrono::milliseconds(_retry_wait_time_ms));
+            state = request_state<T>(state_id);
+        }
     }
+
+    if (state != nullptr)
+        cache[{dset, typeid(T)}] = state;
+
+    return (const T*)state;
 }
 
 
@@ -514,9 +604,11 @@ datasetManager::add_state(std::unique_ptr<T>&& state,
 
     state_id_t hash = hash_state(*state);
 
+    std::unique_lock<std::shared_mutex> slock(_lock_states);
+
     // check if there is a hash collision
-    if (_states.find(hash) != _states.end()) {
-        auto find = _states.find(hash);
+    auto find = _states.find(hash);
+    if (find != _states.end()) {
         if (!state->equals(*(find->second))) {
             // FIXME: hash collision. make the value a vector and store same
             // hash entries? This would mean the state/dset has to be sent
@@ -525,20 +617,20 @@ datasetManager::add_state(std::unique_ptr<T>&& state,
                                "same hash {}.\n\n{:s}\n\n{:s}\n\ndatasetManager: Exiting...",
                                hash, state->to_json().dump(4), find->second->to_json().dump(4));
         }
-    } else {
-        // insert the new state
-        std::lock_guard<std::mutex> slock(_lock_states);
-        if (!_states.insert(std::pair<state_id_t, std::unique_ptr<T>>(hash, move(state))).second) {
-            DEBUG_NON_OO("datasetManager: a state with hash {} is already registered locally.",
-                         hash);
-        }
-
-        // tell the broker about it
-        if (_use_broker)
-            register_state(hash);
+        DEBUG_NON_OO("datasetManager: a state with hash {} is already registered locally.", hash);
+        return std::pair<state_id_t, const T*>(hash, (const T*)(find->second.get()));
     }
 
-    return std::pair<state_id_t, const T*>(hash, (const T*)(_states.at(hash).get()));
+    // insert the new state
+    const T* new_state = state.get();
+    _states.emplace(hash, std::move(state));
+    slock.unlock();
+
+    // tell the broker about it
+    if (_use_broker)
+        register_state(hash);
+
+    return std::pair<state_id_t, const T*>(hash, new_state);
 }
 
 
@@ -555,7 +647,7 @@ inline const T* datasetManager::request_state(state_id_t state_id) {
     // If an ongoing request returned just when this function was
     // called, we are done.
     {
-        std::lock_guard<std::mutex> lck_states(_lock_states);
+        std::shared_lock<std::shared_mutex> lck_states(_lock_states);
         if (_states.count(state_id))
             return (const T*)_states.at(state_id).get();
     }
@@ -564,8 +656,9 @@ inline const T* datasetManager::request_state(state_id_t state_id) {
     _requested_states.insert(state_id);
     nlohmann::json js_request;
     js_request["id"] = state_id;
-    restClient::restReply reply = _rest_client.make_request_blocking(
-        PATH_REQUEST_STATE, js_request, _ds_broker_host, _ds_broker_port);
+    restClient::restReply reply =
+        _rest_client.make_request_blocking(PATH_REQUEST_STATE, js_request, _ds_broker_host,
+                                           _ds_broker_port, 0, -1, broker_encoding());
     if (!reply.first) {
         WARN_NON_OO("datasetManager: Failure requesting state from broker: {:s}", reply.second);
         error_counter.set(++_conn_error_count);
@@ -574,7 +667,7 @@ inline const T* datasetManager::request_state(state_id_t state_id) {
 
     nlohmann::json js_reply;
     try {
-        js_reply = nlohmann::json::parse(reply.second);
+        js_reply = parse_broker_reply(reply.second);
         if (js_reply.at("result") != "success")
             throw std::runtime_error(fmt::format(fmt("Broker answered with result={:s}"),
                                                  js_reply.at("result").dump(4)));
@@ -589,7 +682,7 @@ inline const T* datasetManager::request_state(state_id_t state_id) {
         }
 
         // register the received state
-        std::unique_lock<std::mutex> slck(_lock_states);
+        std::unique_lock<std::shared_mutex> slck(_lock_states);
         auto new_state =
             _states.insert(std::pair<state_id_t, std::unique_ptr<datasetState>>(s_id, move(state)));
         slck.unlock();
@@ -601,6 +694,9 @@ inline const T* datasetManager::request_state(state_id_t state_id) {
         }
         _cv_received_state.notify_all();
 
+        if (_store)
+            _store->put_state(s_id, js_reply.at("state"));
+
         // hash collisions are checked for by the broker
         if (!new_state.second)
             INFO_NON_OO("datasetManager::request_state: received a state (with hash {}) that "
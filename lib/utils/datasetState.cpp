@@ -25,6 +25,10 @@ json datasetState::to_json() const {
     return j;
 }
 
+void datasetState::hash_data(HashStream& h) const {
+    h.add(data_to_json().dump());
+}
+
 // TODO: compare without serialization
 bool datasetState::equals(datasetState& s) const {
     return to_json() == s.to_json();
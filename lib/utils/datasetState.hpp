@@ -1,7 +1,7 @@
 #ifndef DATASETSTATE_HPP
 #define DATASETSTATE_HPP
 
-#include "Hash.hpp"     // for Hash
+#include "Hash.hpp"     // for Hash, HashStream
 #include "factory.hpp"  // for REGISTER_NAMED_TYPE_WITH_FACTORY, CREATE_FACTORY, FACTORY, Factory
 #include "gateSpec.hpp" // for gateSpec, _factory_aliasgateSpec
 #include "visUtil.hpp"  // for prod_ctype, rstack_ctype, time_ctype, input_ctype, freq_ctype
@@ -17,6 +17,7 @@
 #include <numeric>   // for iota
 #include <stddef.h>  // for size_t
 #include <stdexcept> // for runtime_error, out_of_range
+#include <string.h>  // for strnlen
 #include <string>    // for string
 #include <utility>   // for pair
 #include <vector>    // for vector, vector<>::iterator
@@ -39,7 +40,8 @@ using dset_id_t = Hash;
  *
  * This is meant to be subclassed. All subclasses must implement a constructor
  * that can build the type from a `json` argument, and a `data_to_json` method
- * that can serialise the type into a `json` object.
+ * that can serialise the type into a `json` object. Subclasses holding a lot of
+ * data should also implement `hash_data`.
  *
  * @author Richard Shaw, Rick Nitsche
  **/
@@ -88,6 +90,19 @@ public:
     std::string type() const;
 
 private:
+    /**
+     * @brief Add the internal data of this instance to a hash.
+     *
+     * This is used by the datasetManager to calculate the state ID without
+     * serialising the state. By default it hashes the output of `data_to_json`,
+     * derived classes holding a lot of data should override it to add their
+     * fields directly. Everything saved by `data_to_json` must go into the
+     * hash.
+     *
+     * @param  h  The hash to add to.
+     **/
+    virtual void hash_data(HashStream& h) const;
+
     // Add as friend so it can walk the inner state
     friend datasetManager;
 };
@@ -148,6 +163,16 @@ private:
         return j;
     }
 
+    /// Hash the frequencies without serializing them
+    void hash_data(HashStream& h) const override {
+        h.add<uint64_t>(_freqs.size());
+        for (const auto& [id, freq] : _freqs) {
+            h.add(id);
+            h.add(freq.centre);
+            h.add(freq.width);
+        }
+    }
+
     /// IDs that describe the subset that this dataset state defines
     std::vector<std::pair<uint32_t, freq_ctype>> _freqs;
 };
@@ -197,6 +222,16 @@ private:
         return j;
     }
 
+    /// Hash the inputs without serializing them
+    void hash_data(HashStream& h) const override {
+        h.add<uint64_t>(_inputs.size());
+        for (const auto& input : _inputs) {
+            h.add(input.chan_id);
+            size_t len = strnlen(input.correlator_input, sizeof(input.correlator_input));
+            h.add(std::string(input.correlator_input, len));
+        }
+    }
+
     /// The subset that this dataset state defines
     std::vector<input_ctype> _inputs;
 };
@@ -246,6 +281,13 @@ private:
         return j;
     }
 
+    /// Hash the products without serializing them
+    void hash_data(HashStream& h) const override {
+        static_assert(sizeof(prod_ctype) == 2 * sizeof(uint16_t), "prod_ctype is padded");
+        h.add<uint64_t>(_prods.size());
+        h.add(_prods.data(), _prods.size() * sizeof(prod_ctype));
+    }
+
     /// IDs that describe the subset that this dataset state defines
     std::vector<prod_ctype> _prods;
 };
@@ -296,6 +338,15 @@ private:
         return j;
     }
 
+    /// Hash the times without serializing them
+    void hash_data(HashStream& h) const override {
+        h.add<uint64_t>(_times.size());
+        for (const auto& t : _times) {
+            h.add(t.fpga_count);
+            h.add(t.ctime);
+        }
+    }
+
     /// Time index map of the dataset state.
     std::vector<time_ctype> _times;
 };
@@ -362,6 +413,12 @@ private:
         return j;
     }
 
+    /// Hash the indices without serializing them
+    void hash_data(HashStream& h) const override {
+        h.add<uint64_t>(_ev.size());
+        h.add(_ev.data(), _ev.size() * sizeof(uint32_t));
+    }
+
     /// Eigenvalues of the dataset state.
     std::vector<uint32_t> _ev;
 };
@@ -448,6 +505,16 @@ public:
     }
 
 private:
+    /// Hash the stack definition without serializing it
+    void hash_data(HashStream& h) const override {
+        h.add(_num_stack);
+        h.add<uint64_t>(_rstack_map.size());
+        for (const auto& s : _rstack_map) {
+            h.add(s.stack);
+            h.add<uint8_t>(s.conjugate);
+        }
+    }
+
     /// Total number of stacks
     uint32_t _num_stack;
 
@@ -742,6 +809,12 @@ private:
         return j;
     }
 
+    /// Hash the indices without serializing them
+    void hash_data(HashStream& h) const override {
+        h.add<uint64_t>(_beams.size());
+        h.add(_beams.data(), _beams.size() * sizeof(uint32_t));
+    }
+
     /// Time index map of the dataset state.
     std::vector<uint32_t> _beams;
 };
@@ -801,6 +874,12 @@ private:
         return j;
     }
 
+    /// Hash the indices without serializing them
+    void hash_data(HashStream& h) const override {
+        h.add<uint64_t>(_subfreqs.size());
+        h.add(_subfreqs.data(), _subfreqs.size() * sizeof(uint32_t));
+    }
+
     /// Time index map of the dataset state.
     std::vector<uint32_t> _subfreqs;
 };
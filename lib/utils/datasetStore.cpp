@@ -0,0 +1,138 @@
+#include "datasetStore.hpp"
+
+#include "kotekanLogging.hpp" // for WARN_NON_OO, DEBUG_NON_OO
+
+#include "fmt.hpp" // for format, fmt
+
+#include <cstdint>    // for uint8_t
+#include <errno.h>    // for errno, EEXIST
+#include <fstream>    // for ifstream
+#include <iterator>   // for istreambuf_iterator
+#include <stdexcept>  // for runtime_error
+#include <stdio.h>    // for rename
+#include <stdlib.h>   // for mkstemp
+#include <string.h>   // for strerror
+#include <sys/stat.h> // for mkdir, stat, fchmod
+#include <unistd.h>   // for close, unlink, write
+#include <vector>     // for vector
+
+using nlohmann::json;
+
+namespace {
+
+// Create a directory and any missing parents
+void make_dir(const std::string& path) {
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        mkdir(path.substr(0, pos).c_str(), 0775);
+    }
+    if (mkdir(path.c_str(), 0775) < 0 && errno != EEXIST) {
+        throw std::runtime_error(fmt::format(
+            fmt("datasetStore: could not create directory {:s}: {:s}"), path, strerror(errno)));
+    }
+}
+
+} // namespace
+
+datasetStore::datasetStore(const std::string& path) : _path(path) {
+    make_dir(_path + "/states");
+    make_dir(_path + "/datasets");
+}
+
+std::string datasetStore::state_file(const Hash& id) const {
+    return fmt::format(fmt("{:s}/states/{:s}.cbor"), _path, id.to_string());
+}
+
+std::string datasetStore::dataset_file(const Hash& id) const {
+    return fmt::format(fmt("{:s}/datasets/{:s}.cbor"), _path, id.to_string());
+}
+
+bool datasetStore::put_state(const Hash& id, const json& state) {
+    return put(state_file(id), state);
+}
+
+state_uptr datasetStore::get_state(const Hash& id) const {
+    auto js = get(state_file(id));
+    if (!js)
+        return nullptr;
+
+    try {
+        return datasetState::from_json(js.value());
+    } catch (std::exception& e) {
+        WARN_NON_OO("datasetStore: could not parse state {}: {:s}", id, e.what());
+        return nullptr;
+    }
+}
+
+bool datasetStore::put_dataset(const Hash& id, const dataset& ds) {
+    return put(dataset_file(id), ds.to_json());
+}
+
+std::optional<dataset> datasetStore::get_dataset(const Hash& id) const {
+    auto js = get(dataset_file(id));
+    if (!js)
+        return std::nullopt;
+
+    try {
+        dataset ds(js.value());
+        if (hash(ds.to_json().dump()) != id)
+            throw std::runtime_error("content doesn't match the ID");
+        return ds;
+    } catch (std::exception& e) {
+        WARN_NON_OO("datasetStore: could not parse dataset {}: {:s}", id, e.what());
+        return std::nullopt;
+    }
+}
+
+bool datasetStore::put(const std::string& file, const json& js) const {
+    struct stat st;
+    if (stat(file.c_str(), &st) == 0)
+        return true;
+
+    std::vector<uint8_t> data = json::to_cbor(js);
+
+    // Write a temporary file next to the entry, then move it into place
+    std::string tmp = file + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        WARN_NON_OO("datasetStore: could not create {:s}: {:s}", tmp, strerror(errno));
+        return false;
+    }
+    fchmod(fd, 0644);
+
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t ret = write(fd, data.data() + written, data.size() - written);
+        if (ret < 0) {
+            WARN_NON_OO("datasetStore: could not write {:s}: {:s}", tmp, strerror(errno));
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        written += ret;
+    }
+    close(fd);
+
+    if (rename(tmp.c_str(), file.c_str()) < 0) {
+        WARN_NON_OO("datasetStore: could not move {:s} into place: {:s}", file, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    DEBUG_NON_OO("datasetStore: saved {:s}", file);
+    return true;
+}
+
+std::optional<json> datasetStore::get(const std::string& file) const {
+    std::ifstream in(file, std::ios::binary);
+    if (!in)
+        return std::nullopt;
+
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+    try {
+        return json::from_cbor(data);
+    } catch (std::exception& e) {
+        WARN_NON_OO("datasetStore: could not read {:s}: {:s}", file, e.what());
+        return std::nullopt;
+    }
+}
@@ -0,0 +1,100 @@
+/*****************************************
+@file
+@brief A local store of dataset states and datasets.
+- datasetStore
+*****************************************/
+#ifndef DATASET_STORE_HPP
+#define DATASET_STORE_HPP
+
+#include "Hash.hpp"         // for Hash
+#include "dataset.hpp"      // for dataset
+#include "datasetState.hpp" // for state_uptr
+
+#include "json.hpp" // for json
+
+#include <optional> // for optional
+#include <string>   // for string
+
+/**
+ * @brief A directory of states and datasets, keyed by their IDs.
+ *
+ * The datasetManager keeps the states and datasets it gets from the broker in
+ * here, so that after a restart it can find them again without asking the
+ * broker. Each entry is a CBOR file named after its ID, in the subdirectories
+ * `states` and `datasets`.
+ *
+ * An ID always refers to the same content, so entries are never changed once
+ * written. They are written to a temporary file that is then renamed into
+ * place, so a crash can't leave a partial entry behind and several kotekan
+ * instances can share a store. Entries that can't be read are logged and
+ * treated as missing. Datasets are checked against their ID when they are
+ * loaded.
+ **/
+class datasetStore {
+public:
+    /**
+     * @brief Open a store, creating its directories if needed.
+     *
+     * @param  path  The directory of the store.
+     *
+     * @throws std::runtime_error if the directories can't be created.
+     **/
+    explicit datasetStore(const std::string& path);
+
+    /**
+     * @brief Save a state, unless it is in the store already.
+     *
+     * @param  id     ID of the state.
+     * @param  state  The state, as serialised by `datasetState::to_json`.
+     *
+     * @returns False if the state could not be written.
+     **/
+    bool put_state(const Hash& id, const nlohmann::json& state);
+
+    /**
+     * @brief Load a state.
+     *
+     * @param  id  ID of the state.
+     *
+     * @returns The state, or nullptr if it isn't in the store.
+     **/
+    state_uptr get_state(const Hash& id) const;
+
+    /**
+     * @brief Save a dataset, unless it is in the store already.
+     *
+     * @param  id  ID of the dataset.
+     * @param  ds  The dataset.
+     *
+     * @returns False if the dataset could not be written.
+     **/
+    bool put_dataset(const Hash& id, const dataset& ds);
+
+    /**
+     * @brief Load a dataset.
+     *
+     * @param  id  ID of the dataset.
+     *
+     * @returns The dataset, if it is in the store.
+     **/
+    std::optional<dataset> get_dataset(const Hash& id) const;
+
+    /// The directory of the store
+    const std::string& path() const {
+        return _path;
+    }
+
+private:
+    // Write an entry atomically, unless the file exists already
+    bool put(const std::string& file, const nlohmann::json& js) const;
+
+    // Read an entry
+    std::optional<nlohmann::json> get(const std::string& file) const;
+
+    std::string state_file(const Hash& id) const;
+    std::string dataset_file(const Hash& id) const;
+
+    std::string _path;
+};
+
+#endif // DATASET_STORE_HPP
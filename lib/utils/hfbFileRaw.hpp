@@ -9,7 +9,8 @@
 #include "FrameView.hpp"      // for FrameView
 #include "dataset.hpp"        // for dset_id_t
 #include "kotekanLogging.hpp" // for logLevel
-#include "visFile.hpp"        // for visFile
+#include "uringWriter.hpp"    // for uringWriter
+#include "visFile.hpp"        // for visFile, visFileOptions
 #include "visUtil.hpp"        // for time_ctype
 
 #include "json.hpp" // for json
@@ -18,6 +19,7 @@
 #include <fcntl.h>     // for O_CREAT, O_EXCL, O_WRONLY
 #include <fstream>     // for ofstream
 #include <map>         // for map
+#include <memory>      // for shared_ptr
 #include <stddef.h>    // for size_t
 #include <string>      // for string
 #include <sys/types.h> // for off_t
@@ -44,6 +46,8 @@
  *  - visMetadata struct dump
  *  - visBuffer dump
  *
+ * The file can be written through an io_uring in the same way as `visFileRaw`.
+ *
  * @author Richard Shaw
  **/
 class hfbFileRaw : public visFile {
@@ -60,11 +64,13 @@ public:
      * @param  metadata   Textual metadata to write into the file.
      * @param  dataset    ID of dataset we are writing.
      * @param  max_time   Maximum number of times to write into the file.
+     * @param  options    How to write the file.
      * @param  oflags     Flag to open the file with.
      **/
     hfbFileRaw(const std::string& name, const kotekan::logLevel log_level,
                const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-               size_t max_time, int oflags = O_CREAT | O_EXCL | O_WRONLY);
+               size_t max_time, const visFileOptions& options,
+               int oflags = O_CREAT | O_EXCL | O_WRONLY);
 
     ~hfbFileRaw();
 
@@ -146,6 +152,10 @@ protected:
     // File name (used for debugging)
     std::string _name;
 
+    // Where to submit the writes, or null to write directly
+    std::shared_ptr<uringWriter> uring;
+    bool direct_io;
+
     // Number of eigenvalues, used for checking structure
     // TODO: consider if this is necessary at all, or whether we need to be
     // checking all structure params
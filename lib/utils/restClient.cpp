@@ -2,6 +2,7 @@
 
 #include "kotekanLogging.hpp" // for FATAL_ERROR_NON_OO, DEBUG_NON_OO, WARN_NON_OO
 
+#include <algorithm>                   // for max, find_if
 #include <chrono>                      // for operator+, seconds, system_clock, system_clock::t...
 #include <condition_variable>          // for condition_variable
 #include <cstring>                     // for memcpy
@@ -15,9 +16,18 @@
 #include <event2/thread.h>             // for evthread_use_pthreads
 #include <evhttp.h>                    // for evhttp_request
 #include <pthread.h>                   // for pthread_setname_np
+#include <stdint.h>                    // for uint8_t
 #include <stdlib.h>                    // for free, malloc
 #include <sys/time.h>                  // for timeval
-#include <vector>                      // for __alloc_traits<>::value_type
+#include <vector>                      // for vector, __alloc_traits<>::value_type
+
+namespace {
+
+// Defaults for the connection limits
+const uint32_t DEFAULT_MAX_CONNECTIONS = 4;
+const uint32_t DEFAULT_MAX_IN_FLIGHT = 64;
+
+} // namespace
 
 
 restClient& restClient::instance() {
@@ -25,7 +35,11 @@ restClient& restClient::instance() {
     return client_instance;
 }
 
-restClient::restClient() : _main_thread() {
+restClient::restClient() :
+    _main_thread(),
+    _keep_alive(true),
+    _max_connections(DEFAULT_MAX_CONNECTIONS),
+    _max_in_flight(DEFAULT_MAX_IN_FLIGHT) {
 
     _stop_thread = false;
     _event_thread_started = false;
@@ -49,6 +63,14 @@ restClient::~restClient() {
     _main_thread.join();
     DEBUG_NON_OO("restClient: event thread stopped.");
     // Free the various libevent objects
+    for (auto& pool : _pools) {
+        for (auto& conn : pool.second.connections)
+            evhttp_connection_free(conn->evcon);
+        for (auto& waiting : pool.second.waiting) {
+            evhttp_request_free(waiting.req);
+            delete waiting.data;
+        }
+    }
     if (bev_req_write)
         bufferevent_free(bev_req_write);
     if (bev_req_read)
@@ -61,6 +83,13 @@ restClient::~restClient() {
         event_base_free(_base);
 }
 
+void restClient::set_connection_limits(bool keep_alive, uint32_t max_connections,
+                                       uint32_t max_in_flight) {
+    _keep_alive = keep_alive;
+    _max_connections = std::max(max_connections, 1u);
+    _max_in_flight = std::max(max_in_flight, 1u);
+}
+
 void restClient::timer(evutil_socket_t fd, short event, void* arg) {
 
     // Unused parameters, required by libevent. Suppress warning.
@@ -155,15 +184,10 @@ void restClient::event_thread() {
 }
 
 void restClient::http_request_done(struct evhttp_request* req, void* arg) {
-    // FIXME: evcon is passed here, because evhttp_request_get_connection(req)
-    // always returns a nullptr and there is no way to free the connection on
-    // completion in libevent < 2.1
-    // libevent 2.1 has a evhttp_connection_free_on_completion, but using it,
-    // the bufferevent never gets deleted...
-    // TODO: maybe keep the evhttp_connections in a pool and reuse them
-    // (set Connection:keep-alive header)
-    auto pair = (std::pair<std::function<void(restReply)>*, struct evhttp_connection*>*)arg;
-    std::function<void(restReply)>* ext_cb = pair->first;
+    // The connection is passed here, because evhttp_request_get_connection(req)
+    // always returns a nullptr in libevent < 2.1
+    auto data = (requestData*)arg;
+    std::function<void(restReply)>* ext_cb = data->request_done_cb;
 
     // this is where we store the reply
     std::string str_data("");
@@ -174,7 +198,7 @@ void restClient::http_request_done(struct evhttp_request* req, void* arg) {
         std::string str = evutil_socket_error_to_string(errcode);
         WARN_NON_OO("restClient: Request failed with socket error {:d} ({:s})", errcode, str);
         (*ext_cb)(restReply(false, str_data));
-        cleanup(pair);
+        data->client->request_finished(data);
         return;
     }
 
@@ -188,7 +212,7 @@ void restClient::http_request_done(struct evhttp_request* req, void* arg) {
             status_text = "Connection error";
         INFO_NON_OO("restClient: Received response code {:d} ({:s})", response_code, status_text);
         (*ext_cb)(restReply(false, str_data));
-        cleanup(pair);
+        data->client->request_finished(data);
         return;
     }
 
@@ -197,7 +221,7 @@ void restClient::http_request_done(struct evhttp_request* req, void* arg) {
     size_t datalen = evbuffer_get_length(input_buffer);
     if (datalen == 0) {
         (*ext_cb)(restReply(true, str_data));
-        cleanup(pair);
+        data->client->request_finished(data);
         return;
     }
 
@@ -213,7 +237,7 @@ void restClient::http_request_done(struct evhttp_request* req, void* arg) {
     if (n_vec < 0) {
         WARN_NON_OO("restClient: Failure in evbuffer_peek()");
         (*ext_cb)(restReply(false, str_data));
-        cleanup(pair);
+        data->client->request_finished(data);
         return;
     }
 
@@ -232,20 +256,86 @@ void restClient::http_request_done(struct evhttp_request* req, void* arg) {
 
     // call the external callback
     (*ext_cb)(restReply(true, str_data));
-    cleanup(pair);
+    data->client->request_finished(data);
+}
+
+void restClient::request_finished(requestData* data) {
+    connectionPool& pool = *data->pool;
+    pooledConnection* conn = data->conn;
+    delete data;
+
+    conn->num_requests--;
+    pool.in_flight--;
+
+    if (!_keep_alive && conn->num_requests == 0) {
+        evhttp_connection_free(conn->evcon);
+        auto it = std::find_if(pool.connections.begin(), pool.connections.end(),
+                               [conn](auto& c) { return c.get() == conn; });
+        pool.connections.erase(it);
+    }
+
+    send_waiting(pool);
 }
 
-void restClient::cleanup(
-    std::pair<std::function<void(restReply)>*, struct evhttp_connection*>* pair) {
-    if (pair->second)
-        evhttp_connection_free(pair->second);
-    delete pair;
+restClient::pooledConnection* restClient::get_connection(connectionPool& pool) {
+    // Use an idle connection, or the least busy one if no more can be opened.
+    // Without keep-alive every request gets a new connection.
+    if (_keep_alive) {
+        pooledConnection* least_busy = nullptr;
+        for (auto& conn : pool.connections) {
+            if (least_busy == nullptr || conn->num_requests < least_busy->num_requests)
+                least_busy = conn.get();
+        }
+        if (least_busy != nullptr
+            && (least_busy->num_requests == 0 || pool.connections.size() >= _max_connections))
+            return least_busy;
+    }
+
+    evhttp_connection* evcon =
+        evhttp_connection_base_new(_base, _dns, pool.host.c_str(), pool.port);
+    if (evcon == nullptr)
+        FATAL_ERROR_NON_OO("restClient: evhttp_connection_base_new() failed.");
+
+    if (pool.retries > 0)
+        evhttp_connection_set_retries(evcon, pool.retries);
+    if (pool.timeout >= 0)
+        evhttp_connection_set_timeout(evcon, pool.timeout);
+
+    pool.connections.push_back(std::make_unique<pooledConnection>(pooledConnection{evcon, 0}));
+    return pool.connections.back().get();
+}
+
+void restClient::send_waiting(connectionPool& pool) {
+    while (!pool.waiting.empty() && pool.in_flight < _max_in_flight) {
+        queuedRequest request = pool.waiting.front();
+        pool.waiting.pop_front();
+
+        pooledConnection* conn = get_connection(pool);
+        request.data->conn = conn;
+
+        if (evhttp_make_request(conn->evcon, request.req, request.type, request.path.c_str()))
+            FATAL_ERROR_NON_OO("restClient: evhttp_make_request() failed.");
+        conn->num_requests++;
+        pool.in_flight++;
+    }
+}
+
+bool restClient::is_cbor(const std::string& reply) {
+    // CBOR maps have major type 5, i.e. their first byte is in 0xa0 - 0xbf
+    return !reply.empty() && ((uint8_t)reply[0] & 0xe0) == 0xa0;
+}
+
+nlohmann::json restClient::parse_reply(const std::string& reply) {
+    if (is_cbor(reply))
+        return nlohmann::json::from_cbor(reply);
+    return nlohmann::json::parse(reply);
 }
 
 void restClient::make_request(const std::string& path,
                               std::function<void(restReply)>& request_done_cb,
                               const nlohmann::json& data, const std::string& host,
-                              const unsigned short port, const int retries, const int timeout) {
+                              const unsigned short port, const int retries, const int timeout,
+                              const encoding enc) {
     DEBUG2_NON_OO("restClient::make_request(): {}:{}{}, data = {}", host, port, path, data.dump(4));
 
     if (!bev_req_write || !bev_req_read)
@@ -253,11 +343,17 @@ void restClient::make_request(const std::string& path,
             "restClient: make_request called, but bev_req_write returned a nullptr.");
 
     // serialize json data
-    std::string datadump = data.dump();
+    std::string datadump;
+    if (enc == encoding::cbor) {
+        std::vector<uint8_t> cbor = nlohmann::json::to_cbor(data);
+        datadump.assign(cbor.begin(), cbor.end());
+    } else {
+        datadump = data.dump();
+    }
 
     // put as much of the request data as possible in a struct
     restRequest request = {
-        datadump.size(), path.size(), host.size(), retries, timeout, port, &request_done_cb,
+        datadump.size(), path.size(), host.size(), retries, timeout, port, enc, &request_done_cb,
     };
     if (data.empty())
         request.data_len = 0;
@@ -359,51 +455,55 @@ void restClient::_bev_req_readcb(struct bufferevent* bev, void* arg) {
                                "bufferevent ({} != {}).",
                                len_read, request.path_len);
 
-        evhttp_connection* evcon =
-            evhttp_connection_base_new(client->_base, client->_dns, host.c_str(), request.port);
-        if (evcon == nullptr)
-            FATAL_ERROR_NON_OO("restClient: evhttp_connection_base_new() failed.");
-
-        if (request.retries > 0)
-            evhttp_connection_set_retries(evcon, request.retries);
-        if (request.timeout >= 0)
-            evhttp_connection_set_timeout(evcon, request.timeout);
-
         // Fire off the request and pass the external callback to the internal one.
         // check if external callback function is callable
         if (!request.request_done_cb) {
-            evhttp_connection_free(evcon);
             FATAL_ERROR_NON_OO("restClient: external callback function is not callable.");
         }
 
+        connectionPool& pool =
+            client->_pools[std::make_tuple(host, request.port, request.retries, request.timeout)];
+        if (pool.host.empty()) {
+            pool.host = host;
+            pool.port = request.port;
+            pool.retries = request.retries;
+            pool.timeout = request.timeout;
+        }
+
         // pass the external callback function to the libevent callback
-        // also pass the connection to the callback, so it can be freed there
-        std::pair<std::function<void(restReply)>*, evhttp_connection*>* pair =
-            new std::pair<std::function<void(restReply)>*, evhttp_connection*>(
-                request.request_done_cb, evcon);
-        evhttp_request* req = evhttp_request_new(http_request_done, pair);
+        // also pass the pool to the callback, so the next request can be sent from there
+        requestData* data = new requestData{client, request.request_done_cb, &pool, nullptr};
+        evhttp_request* req = evhttp_request_new(http_request_done, data);
         if (req == nullptr) {
-            evhttp_connection_free(evcon);
+            delete data;
             FATAL_ERROR_NON_OO("restClient: evhttp_request_new() failed.");
         }
         evkeyvalq* output_headers = evhttp_request_get_output_headers(req);
         if (evhttp_add_header(output_headers, "Host", host.c_str())) {
-            evhttp_connection_free(evcon);
             evhttp_request_free(req);
+            delete data;
             FATAL_ERROR_NON_OO("restClient: Failure adding \"Host\" header.");
         }
-        if (evhttp_add_header(output_headers, "Connection", "close")) {
-            evhttp_connection_free(evcon);
+        if (!client->_keep_alive && evhttp_add_header(output_headers, "Connection", "close")) {
             evhttp_request_free(req);
+            delete data;
             FATAL_ERROR_NON_OO("restClient: Failure adding \"Connection\" header.");
         }
-        if (evhttp_add_header(output_headers, "Content-Type", "application/json")) {
-            evhttp_connection_free(evcon);
+        const char* content_type =
+            request.enc == encoding::cbor ? "application/cbor" : "application/json";
+        if (evhttp_add_header(output_headers, "Content-Type", content_type)) {
             evhttp_request_free(req);
+            delete data;
             FATAL_ERROR_NON_OO("restClient: Failure adding \"Content-Type\" header.");
         }
+        if (request.enc != encoding::json
+            && evhttp_add_header(output_headers, "Accept", "application/cbor, application/json")) {
+            evhttp_request_free(req);
+            delete data;
+            FATAL_ERROR_NON_OO("restClient: Failure adding \"Accept\" header.");
+        }
 
-        int ret;
+        evhttp_cmd_type type;
         if (request.data_len) {
             char buf[256];
 
@@ -417,8 +517,8 @@ void restClient::_bev_req_readcb(struct bufferevent* bev, void* arg) {
                     evbuffer_remove_buffer(bev_buffer, output_buffer, request.data_len - len_read);
             while (len_read < request.data_len);
             if (len_read != request.data_len) {
-                evhttp_connection_free(evcon);
                 evhttp_request_free(req);
+                delete data;
                 FATAL_ERROR_NON_OO("restClient::_bev_req_readcb: Failure reading data from "
                                    "bufferevent ({} != {}).",
                                    len_read, request.data_len);
@@ -426,22 +526,20 @@ void restClient::_bev_req_readcb(struct bufferevent* bev, void* arg) {
 
             evutil_snprintf(buf, sizeof(buf) - 1, "%lu", (unsigned long)request.data_len);
             if (evhttp_add_header(output_headers, "Content-Length", buf)) {
-                evhttp_connection_free(evcon);
                 evhttp_request_free(req);
+                delete data;
                 FATAL_ERROR_NON_OO("restClient: Failure adding \"Content-Length\" header.");
             }
             DEBUG_NON_OO("restClient: Sending {:s} bytes.", buf);
 
-            ret = evhttp_make_request(evcon, req, EVHTTP_REQ_POST, path.c_str());
+            type = EVHTTP_REQ_POST;
         } else {
             DEBUG_NON_OO("restClient: sending GET request.");
-            ret = evhttp_make_request(evcon, req, EVHTTP_REQ_GET, path.c_str());
-        }
-        if (ret) {
-            evhttp_connection_free(evcon);
-            evhttp_request_free(req);
-            FATAL_ERROR_NON_OO("restClient: evhttp_make_request() failed.");
+            type = EVHTTP_REQ_GET;
         }
+
+        pool.waiting.push_back({req, data, type, path});
+        client->send_waiting(pool);
     }
 }
 
@@ -449,7 +547,8 @@ restClient::restReply restClient::make_request_blocking(const std::string& path,
                                                         const nlohmann::json& data,
                                                         const std::string& host,
                                                         const unsigned short port,
-                                                        const int retries, const int timeout) {
+                                                        const int retries, const int timeout,
+                                                        const encoding enc) {
     restReply reply = restReply(false, "");
     bool reply_copied = false;
 
@@ -467,7 +566,7 @@ restClient::restReply restClient::make_request_blocking(const std::string& path,
 
     std::unique_lock<std::mutex> lck_reply(mtx_reply);
 
-    make_request(path, callback, data, host, port, retries, timeout);
+    make_request(path, callback, data, host, port, retries, timeout, enc);
 
     // Wait for the callback to receive the reply.
     // Note: This timeout is only in case libevent for any reason never
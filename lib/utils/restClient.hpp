@@ -11,15 +11,21 @@
 
 #include <atomic>             // for atomic
 #include <condition_variable> // for condition_variable
+#include <deque>              // for deque
 #include <event2/buffer.h>    // for evbuffer_iovec
-#include <event2/http.h>      // for evhttp_connection
+#include <event2/http.h>      // for evhttp_connection, evhttp_cmd_type
 #include <event2/util.h>      // for evutil_socket_t
 #include <functional>         // for function
+#include <map>                // for map
+#include <memory>             // for unique_ptr
 #include <mutex>              // for mutex
 #include <stddef.h>           // for size_t
+#include <stdint.h>           // for uint32_t
 #include <string>             // for string, allocator
 #include <thread>             // for thread
+#include <tuple>              // for tuple
 #include <utility>            // for pair
+#include <vector>             // for vector
 
 
 /**
@@ -28,6 +34,9 @@
  *
  * This class supports sending GET messages and POST messages with json data
  * using libevent and provides access to data from the reply of the server.
+ * POST data can also be sent encoded as CBOR, a binary representation of JSON
+ * that is much more compact for large arrays of numbers. Servers are only sent
+ * CBOR or told they may reply with it when this is requested with `encoding`.
  *
  * Implementation
  * ==============
@@ -56,15 +65,25 @@
  * read callback `_bev_req_readcb` attached to the reading side `bev_req_read` of the
  * bufferevent pair. This is done by the following:
  *
- * - Create a connection base.
- * - Make a new HTTP request. The external callback function as well as the connection base are
+ * - Make a new HTTP request. The external callback function as well as the connection pool are
  *   attached to the request in order to pass them to the internal callback function.
  * - Write request data into the HTTP request output buffer.
- * - Start the request.
+ * - Queue the request in the pool of connections to its server, and start it on one of them
+ *   if the server has fewer than `max_in_flight` requests waiting for a reply.
  *
  * When the request is done, the internal callback function `http_request_done` is called.
  * It calls the external callback that was initially given to `make_request` and hands the
- * result of the request to it.
+ * result of the request to it, then starts the next queued request.
+ *
+ * Connection pooling
+ * ==================
+ *
+ * Connections are kept open for later requests to the same server (host, port, retries and
+ * timeout, as libevent sets the last two per connection). There are up to `max_connections`
+ * connections to each server. A request goes to an idle connection if there is one, to a new
+ * connection if the limit isn't reached, or otherwise is queued behind the requests on the least
+ * busy connection. libevent sends the requests queued on a connection one after another, without
+ * reconnecting, and reconnects if the server closed the connection in between.
  *
  * @author Rick Nitsche
  */
@@ -73,6 +92,39 @@ public:
     /// The reply of a request: a pair with a success boolean and the reply string
     using restReply = std::pair<bool, std::string>;
 
+    /// How the data of a request is encoded, and how the server may reply
+    enum class encoding {
+        /// Send JSON, expect JSON back
+        json,
+        /// Send JSON, but accept a reply in CBOR
+        json_accept_cbor,
+        /// Send CBOR and accept a reply in CBOR
+        cbor
+    };
+
+    /**
+     * @brief Parse the reply to a request.
+     *
+     * Handles replies in JSON or CBOR. The encoding is recognised from the
+     * first byte, as CBOR encoded objects can never begin with a character
+     * that starts a JSON document.
+     *
+     * @param reply  The reply string.
+     *
+     * @return       The parsed reply.
+     * @throws nlohmann::json::exception if the reply can't be parsed.
+     */
+    static nlohmann::json parse_reply(const std::string& reply);
+
+    /**
+     * @brief Check if a reply is encoded as CBOR.
+     *
+     * @param reply  The reply string.
+     *
+     * @return       True if this is a CBOR object.
+     */
+    static bool is_cbor(const std::string& reply);
+
     /**
      * @brief Returns an instance of the rest client.
      *
@@ -80,6 +132,21 @@ public:
      */
     static restClient& instance();
 
+    /**
+     * @brief Set how connections to a server are used.
+     *
+     * Only applies to requests made after this call.
+     *
+     * @param keep_alive       Keep connections open for later requests. If false, every request
+     *                         opens its own connection, which is closed when it's done.
+     *                         Default: true.
+     * @param max_connections  The most connections kept open to one server. Default: 4.
+     * @param max_in_flight    The most requests sent to one server without a reply yet. Further
+     *                         requests wait until a reply comes in. Default: 64.
+     */
+    void set_connection_limits(bool keep_alive, uint32_t max_connections,
+                               uint32_t max_in_flight);
+
     /**
      * @brief Send GET or POST with json data to an endpoint.
      *
@@ -98,11 +165,13 @@ public:
      * @param retries   Max. retries to send message (default: 0).
      * @param timeout   Timeout in seconds. If -1 is passed, the default value
      * (of 50 seconds) is set (default: -1).
+     * @param enc       How to encode the data and which replies to accept
+     *                  (default: encoding::json).
      */
     void make_request(const std::string& path, std::function<void(restReply)>& request_done_cb,
                       const nlohmann::json& data = {}, const std::string& host = "127.0.0.1",
                       const unsigned short port = PORT_REST_SERVER, const int retries = 0,
-                      const int timeout = -1);
+                      const int timeout = -1, const encoding enc = encoding::json);
 
     /**
      * @brief Send GET or POST with json data to an endpoint. Blocking.
@@ -121,13 +190,16 @@ public:
      * @param retries   Max. retries to send message (default: 0).
      * @param timeout   Timeout in seconds. If -1 is passed, the default value
      * (of 50 seconds) is set (default: -1).
+     * @param enc       How to encode the data and which replies to accept
+     *                  (default: encoding::json).
      *
      * @return          restReply object.
      */
     restReply make_request_blocking(const std::string& path, const nlohmann::json& data = {},
                                     const std::string& host = "127.0.0.1",
                                     const unsigned short port = PORT_REST_SERVER,
-                                    const int retries = 0, const int timeout = -1);
+                                    const int retries = 0, const int timeout = -1,
+                                    const encoding enc = encoding::json);
 
 private:
     /// A structure to pass requests around inside the restClient
@@ -141,6 +213,7 @@ private:
         int retries;
         int timeout;
         unsigned short port;
+        encoding enc;
         std::function<void(restReply)>* request_done_cb;
     };
 
@@ -160,11 +233,53 @@ private:
     /// Internal thread function which runs the event loop.
     void event_thread();
 
+    /// A connection to a server, and the number of requests waiting for a reply on it
+    struct pooledConnection {
+        evhttp_connection* evcon;
+        uint32_t num_requests;
+    };
+
+    struct connectionPool;
+
+    /// What the internal callback needs to know about a request
+    struct requestData {
+        restClient* client;
+        std::function<void(restReply)>* request_done_cb;
+        connectionPool* pool;
+        pooledConnection* conn;
+    };
+
+    /// A request which is ready to be sent
+    struct queuedRequest {
+        evhttp_request* req;
+        requestData* data;
+        evhttp_cmd_type type;
+        std::string path;
+    };
+
+    /// The connections to one server, and the requests waiting to be sent to it
+    struct connectionPool {
+        std::string host;
+        unsigned short port;
+        int retries;
+        int timeout;
+        std::vector<std::unique_ptr<pooledConnection>> connections;
+        std::deque<queuedRequest> waiting;
+        uint32_t in_flight = 0;
+    };
+
     /// callback function for http requests
     static void http_request_done(struct evhttp_request* req, void* arg);
 
-    /// cleanup function that deletes evcon and the argument pair
-    static void cleanup(std::pair<std::function<void(restReply)>*, evhttp_connection*>* pair);
+    /// Book-keeping when a request is done: frees the connection if it's not kept, starts
+    /// waiting requests and deletes the request data.
+    void request_finished(requestData* data);
+
+    /// Send queued requests of a pool, while it has fewer than `max_in_flight` in flight.
+    void send_waiting(connectionPool& pool);
+
+    /// Get the connection of a pool to send the next request on
+    pooledConnection* get_connection(connectionPool& pool);
 
     /// Only to be called inside event thread
     bool _make_request(const restRequest* request);
@@ -210,6 +325,14 @@ private:
     /// Lock to protect writing to the bufferevent_pair's output buffer (the datasetManager does
     /// this in threads for example).
     std::mutex _mtx_bev_buffer;
+
+    /// Connection pools by host, port, retries and timeout. Only used in the event thread.
+    std::map<std::tuple<std::string, unsigned short, int, int>, connectionPool> _pools;
+
+    /// Connection limits, see `set_connection_limits`
+    std::atomic<bool> _keep_alive;
+    std::atomic<uint32_t> _max_connections;
+    std::atomic<uint32_t> _max_in_flight;
 };
 
 #endif // RESTCLIENT_HPP
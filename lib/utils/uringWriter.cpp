@@ -0,0 +1,258 @@
+#include "uringWriter.hpp"
+
+#include "visUtil.hpp" // for current_time, movingAverage
+
+#include "fmt.hpp" // for format, fmt
+
+#include <algorithm> // for max
+#include <cmath>     // for isnan
+#include <cstdint>   // for uintptr_t, uint64_t
+#include <errno.h>   // for errno, EINTR
+#include <stdexcept> // for runtime_error, invalid_argument
+#include <stdlib.h>  // for aligned_alloc, free
+#include <string.h>  // for memcpy, memset, strerror
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define URING_AVAILABLE
+#include <linux/io_uring.h> // for io_uring_params, io_uring_sqe, io_uring_cqe, IORING_OP_WRITE
+#include <sys/mman.h>       // for mmap, munmap, MAP_FAILED, MAP_SHARED, MAP_POPULATE
+#include <sys/syscall.h>    // for __NR_io_uring_setup, __NR_io_uring_enter
+#include <unistd.h>         // for close, syscall
+#endif
+
+using kotekan::prometheus::Gauge;
+
+#ifdef URING_AVAILABLE
+namespace {
+
+// There are no glibc wrappers for the io_uring system calls
+int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+} // namespace
+#endif
+
+uringWriter::uringWriter(uint32_t queue_depth, kotekan::logLevel log_level, Gauge* depth_metric,
+                         Gauge* latency_metric) :
+    _queue_depth(queue_depth),
+    slots(queue_depth),
+    depth_metric(depth_metric),
+    latency_metric(latency_metric),
+    latency(10) {
+
+    set_log_level(log_level);
+
+    if (queue_depth == 0) {
+        throw std::invalid_argument("The io_uring queue depth must be at least one.");
+    }
+    for (uint32_t i = queue_depth; i > 0; i--) {
+        free_slots.push_back(i - 1);
+    }
+
+#ifdef URING_AVAILABLE
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = io_uring_setup(queue_depth, &params);
+    if (ring_fd < 0) {
+        throw std::runtime_error(
+            fmt::format(fmt("Could not create io_uring: {:s}"), strerror(errno)));
+    }
+
+    // Map the submission and completion rings, which may share one mapping
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+
+    auto map = [&](size_t size, off_t offset) {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, offset);
+        if (ptr == MAP_FAILED) {
+            int err = errno;
+            close_ring();
+            throw std::runtime_error(
+                fmt::format(fmt("Could not map io_uring: {:s}"), strerror(err)));
+        }
+        return ptr;
+    };
+    sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+    cq_ptr = single_mmap ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ptr = map(sqes_size, IORING_OFF_SQES);
+
+    sq_tail = (uint32_t*)((uint8_t*)sq_ptr + params.sq_off.tail);
+    sq_mask = (uint32_t*)((uint8_t*)sq_ptr + params.sq_off.ring_mask);
+    sq_array = (uint32_t*)((uint8_t*)sq_ptr + params.sq_off.array);
+    cq_head = (uint32_t*)((uint8_t*)cq_ptr + params.cq_off.head);
+    cq_tail = (uint32_t*)((uint8_t*)cq_ptr + params.cq_off.tail);
+    cq_mask = (uint32_t*)((uint8_t*)cq_ptr + params.cq_off.ring_mask);
+    cqes = (uint8_t*)cq_ptr + params.cq_off.cqes;
+
+    DEBUG("Created io_uring with {:d} entries.", params.sq_entries);
+#else
+    throw std::runtime_error("io_uring is not available on this system.");
+#endif
+}
+
+uringWriter::~uringWriter() {
+    drain();
+    close_ring();
+    for (auto& s : slots) {
+        free(s.buf);
+    }
+}
+
+void uringWriter::close_ring() {
+#ifdef URING_AVAILABLE
+    if (sqes_ptr != nullptr)
+        munmap(sqes_ptr, sqes_size);
+    if (cq_ptr != nullptr && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if (sq_ptr != nullptr)
+        munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+#endif
+    sqes_ptr = cq_ptr = sq_ptr = nullptr;
+    ring_fd = -1;
+}
+
+bool uringWriter::write(int fd, off_t offset, const std::vector<piece>& pieces, size_t slot_size) {
+#ifdef URING_AVAILABLE
+    size_t size = 0;
+    for (auto& p : pieces) {
+        size += p.size;
+    }
+    if (size > slot_size) {
+        ERROR("Write of {:d} bytes doesn't fit in a slot of {:d} bytes.", size, slot_size);
+        return false;
+    }
+
+    // Wait for a staging buffer to be free
+    reap(_queue_depth - 1);
+    uint32_t ind = free_slots.back();
+    auto& s = slots[ind];
+
+    if (s.capacity < slot_size) {
+        free(s.buf);
+        s.capacity = ((slot_size + alignment - 1) / alignment) * alignment;
+        s.buf = (uint8_t*)aligned_alloc(alignment, s.capacity);
+        if (s.buf == nullptr) {
+            ERROR("Could not allocate a staging buffer of {:d} bytes.", s.capacity);
+            s.capacity = 0;
+            return false;
+        }
+    }
+
+    // Copy the data in, so the caller can reuse it straight away
+    uint8_t* dest = s.buf;
+    for (auto& p : pieces) {
+        memcpy(dest, p.data, p.size);
+        dest += p.size;
+    }
+    memset(dest, 0, slot_size - size);
+
+    s.size = slot_size;
+    s.fd = fd;
+    s.offset = offset;
+    s.submit_time = current_time();
+
+    // Fill in the submission queue entry. Only the kernel reads the tail, and
+    // only during io_uring_enter, so we can read it without synchronisation.
+    uint32_t tail = *sq_tail;
+    uint32_t sqe_ind = tail & *sq_mask;
+    io_uring_sqe* sqe = (io_uring_sqe*)sqes_ptr + sqe_ind;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)s.buf;
+    sqe->len = slot_size;
+    sqe->off = offset;
+    sqe->user_data = ind;
+    sq_array[sqe_ind] = sqe_ind;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        ret = io_uring_enter(ring_fd, 1, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        // Nothing was consumed, so take the entry back off the queue
+        ERROR("Could not submit write of {:d} bytes at offset {:d}: {:s}", slot_size, offset,
+              strerror(errno));
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        _num_errors++;
+        return false;
+    }
+
+    free_slots.pop_back();
+    _in_flight++;
+    update_metrics();
+
+    return true;
+#else
+    (void)fd;
+    (void)offset;
+    (void)pieces;
+    (void)slot_size;
+    return false;
+#endif
+}
+
+void uringWriter::drain() {
+    reap(0);
+}
+
+void uringWriter::reap(uint32_t max_in_flight) {
+#ifdef URING_AVAILABLE
+    while (true) {
+        uint32_t head = *cq_head;
+        uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            io_uring_cqe* cqe = (io_uring_cqe*)cqes + (head & *cq_mask);
+            uint32_t ind = cqe->user_data;
+            auto& s = slots[ind];
+
+            if (cqe->res < 0 || (size_t)cqe->res != s.size) {
+                ERROR("Write error attempting to write {:d} bytes at offset {:d} into fd {:d}: "
+                      "{:s}",
+                      s.size, s.offset, s.fd, cqe->res < 0 ? strerror(-cqe->res) : "short write");
+                _num_errors++;
+            }
+            latency.add_sample(current_time() - s.submit_time);
+
+            free_slots.push_back(ind);
+            _in_flight--;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if (_in_flight <= max_in_flight)
+            break;
+
+        // Wait for at least one more write to complete
+        if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            ERROR("Failed waiting for writes to complete: {:s}", strerror(errno));
+            break;
+        }
+    }
+    update_metrics();
+#else
+    (void)max_in_flight;
+#endif
+}
+
+void uringWriter::update_metrics() {
+    if (depth_metric != nullptr)
+        depth_metric->set(_in_flight);
+    if (latency_metric != nullptr && !std::isnan(latency.average()))
+        latency_metric->set(latency.average());
+}
@@ -0,0 +1,143 @@
+/*****************************************
+@file
+@brief Asynchronous file writes through io_uring.
+- uringWriter
+*****************************************/
+#ifndef URING_WRITER_HPP
+#define URING_WRITER_HPP
+
+#include "kotekanLogging.hpp"    // for kotekanLogging, logLevel
+#include "prometheusMetrics.hpp" // for Gauge
+#include "visUtil.hpp"           // for movingAverage
+
+#include <cstdint>     // for uint32_t, uint8_t, uint64_t
+#include <stddef.h>    // for size_t
+#include <sys/types.h> // for off_t
+#include <vector>      // for vector
+
+/**
+ * @brief Submit file writes asynchronously through an io_uring.
+ *
+ * Each write is a set of pieces that are copied into a staging buffer, padded
+ * out to a whole slot and submitted as a single write. The caller's memory can
+ * be reused as soon as `write` returns. The staging buffers are aligned to the
+ * page size, so if the slot sizes and offsets are too, the writes are suitable
+ * for files opened with `O_DIRECT`.
+ *
+ * At most `queue_depth` writes are in flight at any time. Once the queue is
+ * full, `write` waits for a write to complete. Completions are only
+ * collected when the writer is called, so it must only be used from one thread
+ * at a time, but it can be shared between files written by that thread.
+ *
+ * This talks to the kernel directly rather than through liburing, and is only
+ * available on Linux.
+ **/
+class uringWriter : public kotekan::kotekanLogging {
+public:
+    /// A piece of a write
+    struct piece {
+        const void* data;
+        size_t size;
+    };
+
+    /**
+     * @brief Create the io_uring.
+     *
+     * @param  queue_depth     Maximum number of writes in flight.
+     * @param  log_level       Log level for any errors.
+     * @param  depth_metric    If not null, set to the number of writes in flight.
+     * @param  latency_metric  If not null, set to a moving average of the time
+     *                         from submission to completion of a write.
+     *
+     * @throws std::runtime_error if io_uring is not available.
+     **/
+    uringWriter(uint32_t queue_depth, kotekan::logLevel log_level,
+                kotekan::prometheus::Gauge* depth_metric = nullptr,
+                kotekan::prometheus::Gauge* latency_metric = nullptr);
+
+    /**
+     * @brief Wait for all writes to complete, and tear down the io_uring.
+     **/
+    ~uringWriter();
+
+    uringWriter(const uringWriter&) = delete;
+    uringWriter& operator=(const uringWriter&) = delete;
+
+    /**
+     * @brief Write a slot of a file.
+     *
+     * @param  fd         File to write into.
+     * @param  offset     Offset of the slot in the file.
+     * @param  pieces     The data to write, one after the other.
+     * @param  slot_size  Size of the slot. Anything after the pieces is
+     *                    filled with zeros.
+     *
+     * @returns False if the write could not be submitted. Errors in the
+     *          write itself are logged when it completes.
+     **/
+    bool write(int fd, off_t offset, const std::vector<piece>& pieces, size_t slot_size);
+
+    /**
+     * @brief Wait for every write in flight to complete.
+     **/
+    void drain();
+
+    /// Number of writes currently in flight
+    uint32_t in_flight() const {
+        return _in_flight;
+    }
+
+    /// Number of writes that have failed
+    uint64_t num_errors() const {
+        return _num_errors;
+    }
+
+    /// The alignment of the staging buffers
+    static const size_t alignment = 4096;
+
+private:
+    // Collect completed writes, waiting until no more than `max_in_flight`
+    // remain
+    void reap(uint32_t max_in_flight);
+
+    // Update the metrics
+    void update_metrics();
+
+    // Unmap and close the io_uring
+    void close_ring();
+
+    // A staging buffer and the write it holds
+    struct slot {
+        uint8_t* buf = nullptr;
+        size_t capacity = 0;
+        size_t size = 0;
+        int fd = -1;
+        off_t offset = 0;
+        double submit_time = 0;
+    };
+
+    uint32_t _queue_depth;
+    uint32_t _in_flight = 0;
+    uint64_t _num_errors = 0;
+
+    std::vector<slot> slots;
+    std::vector<uint32_t> free_slots;
+
+    // The ring file descriptor and the shared memory
+    int ring_fd = -1;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    void* sqes_ptr = nullptr;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+
+    // Pointers into the submission and completion rings
+    uint32_t *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    void* cqes;
+
+    kotekan::prometheus::Gauge* depth_metric;
+    kotekan::prometheus::Gauge* latency_metric;
+    movingAverage latency;
+};
+
+#endif // URING_WRITER_HPP
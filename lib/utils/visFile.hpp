@@ -11,6 +11,7 @@
 #include "dataset.hpp"        // for dset_id_t
 #include "factory.hpp"        // for CREATE_FACTORY, FACTORY, Factory, REGISTER_NAMED_TYPE_WITH...
 #include "kotekanLogging.hpp" // for logLevel, kotekanLogging, DEBUG
+#include "uringWriter.hpp"    // for uringWriter
 #include "visUtil.hpp"        // for time_ctype, operator<
 
 #include <cstdint>    // for uint32_t
@@ -22,6 +23,20 @@
 #include <tuple>      // for tie, tuple
 #include <utility>    // for pair, forward
 
+/**
+ * @brief Options for how files are written, set per writer.
+ *
+ * These are passed to every file type, which can ignore any that don't apply.
+ **/
+struct visFileOptions {
+    /// If set, submit the writes through this io_uring instead of writing them
+    /// directly. It is shared between all the files of a writer.
+    std::shared_ptr<uringWriter> uring;
+    /// Open files with `O_DIRECT`, bypassing the page cache. Needs `uring`.
+    bool direct_io = false;
+};
+
+
 /** @brief A base class for files holding correlator data.
  *
  * The class specifies the interface that all correlator file types must follow.
@@ -93,7 +108,7 @@ protected:
 
 CREATE_FACTORY(visFile, const std::string& /*name*/, const kotekan::logLevel /*log_level*/,
                const std::map<std::string, std::string>& /*metadata*/, dset_id_t /*dataset*/,
-               size_t /*max_time*/);
+               size_t /*max_time*/, const visFileOptions& /*options*/);
 
 
 #define REGISTER_VIS_FILE(key, T) REGISTER_NAMED_TYPE_WITH_FACTORY(visFile, T, key)
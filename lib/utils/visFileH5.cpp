@@ -50,8 +50,9 @@ REGISTER_VIS_FILE("hdf5fast", visFileH5Fast);
 
 visFileH5::visFileH5(const std::string& name, const kotekan::logLevel log_level,
                      const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-                     size_t max_time) {
+                     size_t max_time, const visFileOptions& options) {
     set_log_level(log_level);
+    (void)options;
 
     auto& dm = datasetManager::instance();
 
@@ -298,8 +299,8 @@ void visFileH5::write_sample(uint32_t time_ind, uint32_t freq_ind, const FrameVi
 
 visFileH5Fast::visFileH5Fast(const std::string& name, const kotekan::logLevel log_level,
                              const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-                             size_t max_time) :
-    visFileH5(name, log_level, metadata, dataset, max_time) {}
+                             size_t max_time, const visFileOptions& options) :
+    visFileH5(name, log_level, metadata, dataset, max_time, options) {}
 
 void visFileH5Fast::deferred_init() {
     create_time_axis();
@@ -10,7 +10,7 @@
 #include "FrameView.hpp"      // for FrameView
 #include "datasetManager.hpp" // for dset_id_t
 #include "kotekanLogging.hpp" // for logLevel
-#include "visFile.hpp"        // for visFile
+#include "visFile.hpp"        // for visFile, visFileOptions
 #include "visUtil.hpp"        // for time_ctype, freq_ctype, input_ctype, prod_ctype, cfloat
 
 #include <cstdint>                 // for uint32_t
@@ -45,10 +45,11 @@ public:
      * @param metadata  Textual metadata to write into the file.
      * @param dataset   ID of dataset we are writing.
      * @param max_time  Maximum number of times to write into the file.
+     * @param options   How to write the file. Not used for HDF5.
      **/
     visFileH5(const std::string& name, const kotekan::logLevel log_level,
               const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-              size_t max_time);
+              size_t max_time, const visFileOptions& options);
 
     ~visFileH5();
 
@@ -149,10 +150,11 @@ public:
      * @param metadata  Textual metadata to write into the file.
      * @param dataset   ID of dataset we are writing.
      * @param max_time  Maximum number of times to write into the file.
+     * @param options   How to write the file. Not used for HDF5.
      **/
     visFileH5Fast(const std::string& name, const kotekan::logLevel log_level,
                   const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-                  size_t max_time);
+                  size_t max_time, const visFileOptions& options);
 
     // Write out the number of times as we are destroyed.
     ~visFileH5Fast();
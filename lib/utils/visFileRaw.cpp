@@ -13,10 +13,10 @@
 #include <cxxabi.h>     // for __forced_unwind
 #include <errno.h>      // for errno
 #include <exception>    // for exception
-#include <fcntl.h>      // for fallocate, sync_file_range, open, posix_fadvise, FALLOC_FL...
+#include <fcntl.h>      // for fallocate, sync_file_range, open, posix_fadvise, O_DIRECT
 #include <fstream>      // for ofstream, basic_ostream::write, ios
 #include <future>       // for async, future
-#include <stdexcept>    // for out_of_range, runtime_error
+#include <stdexcept>    // for out_of_range, runtime_error, invalid_argument
 #include <string.h>     // for strerror
 #include <sys/stat.h>   // for S_IRGRP, S_IROTH, S_IRUSR, S_IWGRP, S_IWUSR
 #include <system_error> // for system_error
@@ -32,10 +32,22 @@ REGISTER_VIS_FILE("raw", visFileRaw);
 //
 visFileRaw::visFileRaw(const std::string& name, const kotekan::logLevel log_level,
                        const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-                       size_t max_time, int oflags) :
-    _name(name) {
+                       size_t max_time, const visFileOptions& options, int oflags) :
+    _name(name),
+    uring(options.uring),
+    direct_io(options.direct_io) {
     set_log_level(log_level);
 
+    // The small unaligned writes done without an io_uring can't go through O_DIRECT
+    if (direct_io) {
+        if (!uring) {
+            throw std::invalid_argument("Writing raw files with O_DIRECT needs an io_uring.");
+        }
+#ifdef O_DIRECT
+        oflags |= O_DIRECT;
+#endif
+    }
+
     INFO("Creating new output file {:s}", name);
 
     // Get properties of stream from datasetManager
@@ -143,6 +155,9 @@ visFileRaw::~visFileRaw() {
     metadata_file.close();
 
     // TODO: final sync of data file.
+    if (uring) {
+        uring->drain();
+    }
     close(fd);
 
     std::remove(lock_filename.c_str());
@@ -162,6 +177,10 @@ void visFileRaw::flush_raw_async(int ind) {
 }
 
 void visFileRaw::flush_raw_sync(int ind) {
+    // Make sure the writes have actually been done
+    if (uring) {
+        uring->drain();
+    }
 #ifdef __linux__
     size_t n = nfreq * frame_size;
     sync_file_range(fd, ind * n, n,
@@ -236,6 +255,15 @@ void visFileRaw::write_sample(uint32_t time_ind, uint32_t freq_ind, const FrameV
     // Write out data to the right place
     off_t offset = (time_ind * nfreq + freq_ind) * frame_size;
 
+    if (uring) {
+        // With O_DIRECT the whole (aligned) frame slot must be written
+        size_t slot_size = direct_io ? frame_size : 1 + metadata_size + data_size;
+        uring->write(fd, offset,
+                     {{&ONE, 1}, {frame.metadata(), metadata_size}, {frame.data(), data_size}},
+                     slot_size);
+        return;
+    }
+
     write_raw(offset, 1, &ONE);
     write_raw(offset + 1, metadata_size, frame.metadata());
     write_raw(offset + 1 + metadata_size, data_size, frame.data());
@@ -1,7 +1,8 @@
 #include "visFileRing.hpp"
 
-#include "visFile.hpp" // for REGISTER_VIS_FILE, _factory_aliasvisFile
-#include "visUtil.hpp" // for time_ctype
+#include "uringWriter.hpp" // for uringWriter
+#include "visFile.hpp"     // for REGISTER_VIS_FILE, _factory_aliasvisFile
+#include "visUtil.hpp"     // for time_ctype
 
 #include "json.hpp" // for basic_json<>::value_type, json
 
@@ -19,8 +20,8 @@ REGISTER_VIS_FILE("ring", visFileRing);
 
 visFileRing::visFileRing(const std::string& name, const kotekan::logLevel log_level,
                          const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-                         size_t max_time) :
-    visFileRaw(name, log_level, metadata, dataset, max_time, O_CREAT | O_WRONLY),
+                         size_t max_time, const visFileOptions& options) :
+    visFileRaw(name, log_level, metadata, dataset, max_time, options, O_CREAT | O_WRONLY),
     file_len(max_time){};
 
 
@@ -41,6 +42,12 @@ uint32_t visFileRing::extend_time(time_ctype new_time) {
         size_t nb = nfreq * frame_size;
         std::vector<char> zeros(frame_size, 0);
         for (size_t i = 0; i < nfreq; i++) {
+            // The io_uring zero fills a slot for us
+            if (uring) {
+                uring->write(fd, cur_pos * nb + i * frame_size, {}, frame_size);
+                continue;
+            }
+
             int res = TEMP_FAILURE_RETRY(
                 pwrite(fd, zeros.data(), frame_size, cur_pos * nb + i * frame_size));
 
@@ -9,6 +9,7 @@
 
 #include "dataset.hpp"        // for dset_id_t
 #include "kotekanLogging.hpp" // for logLevel
+#include "visFile.hpp"        // for visFileOptions
 #include "visFileRaw.hpp"     // for visFileRaw
 #include "visUtil.hpp"        // for time_ctype
 
@@ -44,10 +45,11 @@ public:
      * @param metadata  Textual metadata to write into the file.
      * @param dataset   ID of dataset we are writing.
      * @param max_time  Maximum number of times to write into the file.
+     * @param options   How to write the file.
      **/
     visFileRing(const std::string& name, const kotekan::logLevel log_level,
                 const std::map<std::string, std::string>& metadata, dset_id_t dataset,
-                size_t max_time);
+                size_t max_time, const visFileOptions& options);
 
     /**
      * @brief Extend the file to a new time sample.
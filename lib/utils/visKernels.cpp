@@ -0,0 +1,563 @@
+#include "visKernels.hpp"
+
+#include <atomic>    // for atomic
+#include <stdexcept> // for invalid_argument
+#include <string>    // for operator+, string
+#if defined(__x86_64__)
+#include <immintrin.h> // for __m256i, __m256, __m512i, __m512, _mm256_add_epi32, _mm512_add...
+#define VIS_KERNELS_X86
+#endif
+
+namespace {
+
+/// The kernels for one instruction set
+struct visKernelTable {
+    void (*accumulate)(int32_t*, const int32_t*, size_t);
+    void (*accumulate_copy)(int32_t*, int32_t*, const int32_t*, size_t);
+    void (*sq_diff)(float*, const int32_t*, const int32_t*, size_t);
+    void (*subtract_power)(float*, const int32_t*, float, size_t);
+    void (*subtract_scaled)(int32_t*, const int32_t*, float, size_t);
+    void (*scale_weight)(float*, const float*, double, size_t);
+    void (*unpack)(float*, const int32_t*, float, float, size_t);
+    void (*invert_weight)(float*, const float*, float, size_t);
+    void (*stack_run)(const visStackSums&, size_t, const float*, const float*, size_t, bool, bool);
+};
+
+
+// Scalar implementations, these are also used for the tails of the vector loops
+
+void accumulate_scalar(int32_t* acc, const int32_t* in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += in[i];
+    }
+}
+
+void accumulate_copy_scalar(int32_t* acc, int32_t* copy, const int32_t* in, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        copy[i] = in[i];
+        acc[i] += in[i];
+    }
+}
+
+void sq_diff_scalar(float* var, const int32_t* in, const int32_t* even, size_t nprod) {
+    for (size_t i = 0; i < nprod; i++) {
+        // NOTE: avoid using the slow std::complex routines in here
+        float di = in[2 * i] - even[2 * i];
+        float dr = in[2 * i + 1] - even[2 * i + 1];
+        var[i] += (dr * dr + di * di);
+    }
+}
+
+void subtract_power_scalar(float* var, const int32_t* vis, float w, size_t nprod) {
+    for (size_t i = 0; i < nprod; i++) {
+        float di = vis[2 * i];
+        float dr = vis[2 * i + 1];
+        var[i] -= w * (dr * dr + di * di);
+    }
+}
+
+void subtract_scaled_scalar(int32_t* gate, const int32_t* vis, float scl, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        gate[i] -= (int32_t)(scl * vis[i]);
+    }
+}
+
+void scale_weight_scalar(float* out, const float* in, double scl, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = scl * in[i];
+    }
+}
+
+void unpack_scalar(float* out, const int32_t* in, float re_scl, float im_scl, size_t nprod) {
+    for (size_t i = 0; i < nprod; i++) {
+        out[2 * i] = re_scl * (float)in[2 * i + 1];
+        out[2 * i + 1] = im_scl * (float)in[2 * i];
+    }
+}
+
+void invert_weight_scalar(float* out, const float* in, float num, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = num / in[i];
+    }
+}
+
+void stack_run_scalar(const visStackSums& sums, size_t stack, const float* vis,
+                      const float* weight, size_t n, bool conj, bool reverse) {
+    const float sgn = conj ? -1.0f : 1.0f;
+    for (size_t i = 0; i < n; i++) {
+        float w = weight[i];
+
+        if (w == 0)
+            continue;
+
+        size_t s = reverse ? stack - i : stack + i;
+        float vr = vis[2 * i];
+        float vi = vis[2 * i + 1];
+        sums.vis[2 * s] += vr;
+        sums.vis[2 * s + 1] += sgn * vi;
+        sums.vis2[s] += vr * vr + vi * vi;
+        sums.inv_weight[s] += 1.0f / w;
+        sums.norm[s] += 1.0f;
+    }
+}
+
+const visKernelTable scalar_kernels = {accumulate_scalar,     accumulate_copy_scalar,
+                                       sq_diff_scalar,        subtract_power_scalar,
+                                       subtract_scaled_scalar, scale_weight_scalar,
+                                       unpack_scalar,          invert_weight_scalar,
+                                       stack_run_scalar};
+
+
+#ifdef VIS_KERNELS_X86
+
+// Number of int32s to process before `p` is aligned to `align` bytes
+inline size_t aligned_head(const int32_t* p, size_t align, size_t n) {
+    size_t head = ((align - (uintptr_t)p % align) % align) / sizeof(int32_t);
+    return head < n ? head : n;
+}
+
+
+// AVX2 implementations
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 void accumulate_avx2(int32_t* acc, const int32_t* in, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(acc + i));
+        __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+        _mm256_storeu_si256((__m256i*)(acc + i), _mm256_add_epi32(a, x));
+    }
+    accumulate_scalar(acc + i, in + i, n - i);
+}
+
+// The copy is only read again a frame later, so write it with non-temporal
+// stores to avoid reading it into cache first
+AVX2 void accumulate_copy_avx2(int32_t* acc, int32_t* copy, const int32_t* in, size_t n) {
+    size_t i = aligned_head(copy, 32, n);
+    accumulate_copy_scalar(acc, copy, in, i);
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(acc + i));
+        __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+        _mm256_stream_si256((__m256i*)(copy + i), x);
+        _mm256_storeu_si256((__m256i*)(acc + i), _mm256_add_epi32(a, x));
+    }
+    _mm_sfence();
+    accumulate_copy_scalar(acc + i, copy + i, in + i, n - i);
+}
+
+// Squared magnitudes of the 8 complex values held in two vectors of interleaved floats
+AVX2 inline __m256 power_avx2(__m256 d0, __m256 d1) {
+    // hadd leaves the products in the order [0 1 4 5 | 2 3 6 7], swap the middle pairs
+    __m256 h = _mm256_hadd_ps(_mm256_mul_ps(d0, d0), _mm256_mul_ps(d1, d1));
+    return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(h), 0xD8));
+}
+
+AVX2 inline __m256 load_diff_avx2(const int32_t* in, const int32_t* even) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)in);
+    __m256i e = _mm256_loadu_si256((const __m256i*)even);
+    return _mm256_cvtepi32_ps(_mm256_sub_epi32(x, e));
+}
+
+AVX2 void sq_diff_avx2(float* var, const int32_t* in, const int32_t* even, size_t nprod) {
+    size_t i = 0;
+    for (; i + 8 <= nprod; i += 8) {
+        __m256 d0 = load_diff_avx2(in + 2 * i, even + 2 * i);
+        __m256 d1 = load_diff_avx2(in + 2 * i + 8, even + 2 * i + 8);
+        __m256 v = _mm256_loadu_ps(var + i);
+        _mm256_storeu_ps(var + i, _mm256_add_ps(v, power_avx2(d0, d1)));
+    }
+    sq_diff_scalar(var + i, in + 2 * i, even + 2 * i, nprod - i);
+}
+
+AVX2 void subtract_power_avx2(float* var, const int32_t* vis, float w, size_t nprod) {
+    const __m256 wv = _mm256_set1_ps(w);
+    size_t i = 0;
+    for (; i + 8 <= nprod; i += 8) {
+        __m256 d0 = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(vis + 2 * i)));
+        __m256 d1 = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(vis + 2 * i + 8)));
+        __m256 v = _mm256_loadu_ps(var + i);
+        _mm256_storeu_ps(var + i, _mm256_sub_ps(v, _mm256_mul_ps(wv, power_avx2(d0, d1))));
+    }
+    subtract_power_scalar(var + i, vis + 2 * i, w, nprod - i);
+}
+
+AVX2 void subtract_scaled_avx2(int32_t* gate, const int32_t* vis, float scl, size_t n) {
+    const __m256 s = _mm256_set1_ps(scl);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(vis + i)));
+        __m256i t = _mm256_cvttps_epi32(_mm256_mul_ps(s, v));
+        __m256i g = _mm256_loadu_si256((const __m256i*)(gate + i));
+        _mm256_storeu_si256((__m256i*)(gate + i), _mm256_sub_epi32(g, t));
+    }
+    subtract_scaled_scalar(gate + i, vis + i, scl, n - i);
+}
+
+AVX2 void scale_weight_avx2(float* out, const float* in, double scl, size_t n) {
+    const __m256d s = _mm256_set1_pd(scl);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_cvtps_pd(_mm_loadu_ps(in + i));
+        _mm_storeu_ps(out + i, _mm256_cvtpd_ps(_mm256_mul_pd(s, v)));
+    }
+    scale_weight_scalar(out + i, in + i, scl, n - i);
+}
+
+AVX2 void unpack_avx2(float* out, const int32_t* in, float re_scl, float im_scl, size_t nprod) {
+    const __m256 s = _mm256_setr_ps(re_scl, im_scl, re_scl, im_scl, re_scl, im_scl, re_scl, im_scl);
+    size_t i = 0;
+    for (; i + 4 <= nprod; i += 4) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(in + 2 * i)));
+        // Swap each (imaginary, real) pair around
+        v = _mm256_permute_ps(v, 0xB1);
+        _mm256_storeu_ps(out + 2 * i, _mm256_mul_ps(s, v));
+    }
+    unpack_scalar(out + 2 * i, in + 2 * i, re_scl, im_scl, nprod - i);
+}
+
+AVX2 void invert_weight_avx2(float* out, const float* in, float num, size_t n) {
+    const __m256 s = _mm256_set1_ps(num);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_div_ps(s, _mm256_loadu_ps(in + i)));
+    }
+    invert_weight_scalar(out + i, in + i, num, n - i);
+}
+
+AVX2 inline void add_avx2(float* p, __m256 v) {
+    _mm256_storeu_ps(p, _mm256_add_ps(_mm256_loadu_ps(p), v));
+}
+
+AVX2 inline void add_sse(float* p, __m128 v) {
+    _mm_storeu_ps(p, _mm_add_ps(_mm_loadu_ps(p), v));
+}
+
+AVX2 void stack_run_avx2(const visStackSums& sums, size_t stack, const float* vis,
+                         const float* weight, size_t n, bool conj, bool reverse) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const float sgn = conj ? -1.0f : 1.0f;
+    const __m256 conj_sgn = _mm256_setr_ps(1, sgn, 1, sgn, 1, sgn, 1, sgn);
+    const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i rev = _mm256_setr_epi32(6, 7, 4, 5, 2, 3, 0, 1);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 w = _mm_loadu_ps(weight + i);
+        __m128 m = _mm_cmpneq_ps(w, zero);
+
+        // Zero the visibilities with zero weight
+        __m256 mv = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(m), dup);
+        __m256 v = _mm256_and_ps(mv, _mm256_mul_ps(conj_sgn, _mm256_loadu_ps(vis + 2 * i)));
+
+        // Sum the squares of each (real, imaginary) pair, and pick out one copy of each
+        __m256 sq = _mm256_mul_ps(v, v);
+        sq = _mm256_hadd_ps(sq, sq);
+        __m128 v2 = _mm256_castps256_ps128(
+            _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sq), 0x08)));
+
+        // The zero weights give infinities here, but they are masked out
+        __m128 iw = _mm_and_ps(m, _mm_div_ps(one, w));
+        __m128 nm = _mm_and_ps(m, one);
+
+        size_t s = stack + i;
+        if (reverse) {
+            // The stacks go backwards, so reverse the products to match
+            s = stack - i - 3;
+            v = _mm256_permutevar8x32_ps(v, rev);
+            v2 = _mm_shuffle_ps(v2, v2, 0x1B);
+            iw = _mm_shuffle_ps(iw, iw, 0x1B);
+            nm = _mm_shuffle_ps(nm, nm, 0x1B);
+        }
+        add_avx2(sums.vis + 2 * s, v);
+        add_sse(sums.vis2 + s, v2);
+        add_sse(sums.inv_weight + s, iw);
+        add_sse(sums.norm + s, nm);
+    }
+    stack_run_scalar(sums, reverse ? stack - i : stack + i, vis + 2 * i, weight + i, n - i, conj,
+                     reverse);
+}
+
+const visKernelTable avx2_kernels = {accumulate_avx2,     accumulate_copy_avx2,
+                                     sq_diff_avx2,        subtract_power_avx2,
+                                     subtract_scaled_avx2, scale_weight_avx2,
+                                     unpack_avx2,          invert_weight_avx2,
+                                     stack_run_avx2};
+
+
+// AVX-512 implementations
+
+// GCC 12 warns spuriously about the undefined vectors the AVX-512 conversion
+// and extraction intrinsics start from
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+#define AVX512 __attribute__((target("avx512f")))
+
+AVX512 void accumulate_avx512(int32_t* acc, const int32_t* in, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i a = _mm512_loadu_si512(acc + i);
+        __m512i x = _mm512_loadu_si512(in + i);
+        _mm512_storeu_si512(acc + i, _mm512_add_epi32(a, x));
+    }
+    accumulate_scalar(acc + i, in + i, n - i);
+}
+
+AVX512 void accumulate_copy_avx512(int32_t* acc, int32_t* copy, const int32_t* in, size_t n) {
+    size_t i = aligned_head(copy, 64, n);
+    accumulate_copy_scalar(acc, copy, in, i);
+    for (; i + 16 <= n; i += 16) {
+        __m512i a = _mm512_loadu_si512(acc + i);
+        __m512i x = _mm512_loadu_si512(in + i);
+        _mm512_stream_si512((__m512i*)(copy + i), x);
+        _mm512_storeu_si512(acc + i, _mm512_add_epi32(a, x));
+    }
+    _mm_sfence();
+    accumulate_copy_scalar(acc + i, copy + i, in + i, n - i);
+}
+
+// Squared magnitudes of the 16 complex values held in two vectors of interleaved floats
+AVX512 inline __m512 power_avx512(__m512 d0, __m512 d1) {
+    __m512 s0 = _mm512_mul_ps(d0, d0);
+    __m512 s1 = _mm512_mul_ps(d1, d1);
+    // Add each real part to its imaginary part, leaving the sums in the even elements
+    s0 = _mm512_add_ps(s0, _mm512_permute_ps(s0, 0xB1));
+    s1 = _mm512_add_ps(s1, _mm512_permute_ps(s1, 0xB1));
+    const __m512i even =
+        _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    return _mm512_permutex2var_ps(s0, even, s1);
+}
+
+AVX512 inline __m512 load_diff_avx512(const int32_t* in, const int32_t* even) {
+    __m512i x = _mm512_loadu_si512(in);
+    __m512i e = _mm512_loadu_si512(even);
+    return _mm512_cvtepi32_ps(_mm512_sub_epi32(x, e));
+}
+
+AVX512 void sq_diff_avx512(float* var, const int32_t* in, const int32_t* even, size_t nprod) {
+    size_t i = 0;
+    for (; i + 16 <= nprod; i += 16) {
+        __m512 d0 = load_diff_avx512(in + 2 * i, even + 2 * i);
+        __m512 d1 = load_diff_avx512(in + 2 * i + 16, even + 2 * i + 16);
+        __m512 v = _mm512_loadu_ps(var + i);
+        _mm512_storeu_ps(var + i, _mm512_add_ps(v, power_avx512(d0, d1)));
+    }
+    sq_diff_scalar(var + i, in + 2 * i, even + 2 * i, nprod - i);
+}
+
+AVX512 void subtract_power_avx512(float* var, const int32_t* vis, float w, size_t nprod) {
+    const __m512 wv = _mm512_set1_ps(w);
+    size_t i = 0;
+    for (; i + 16 <= nprod; i += 16) {
+        __m512 d0 = _mm512_cvtepi32_ps(_mm512_loadu_si512(vis + 2 * i));
+        __m512 d1 = _mm512_cvtepi32_ps(_mm512_loadu_si512(vis + 2 * i + 16));
+        __m512 v = _mm512_loadu_ps(var + i);
+        _mm512_storeu_ps(var + i, _mm512_sub_ps(v, _mm512_mul_ps(wv, power_avx512(d0, d1))));
+    }
+    subtract_power_scalar(var + i, vis + 2 * i, w, nprod - i);
+}
+
+AVX512 void subtract_scaled_avx512(int32_t* gate, const int32_t* vis, float scl, size_t n) {
+    const __m512 s = _mm512_set1_ps(scl);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_cvtepi32_ps(_mm512_loadu_si512(vis + i));
+        __m512i t = _mm512_cvttps_epi32(_mm512_mul_ps(s, v));
+        __m512i g = _mm512_loadu_si512(gate + i);
+        _mm512_storeu_si512(gate + i, _mm512_sub_epi32(g, t));
+    }
+    subtract_scaled_scalar(gate + i, vis + i, scl, n - i);
+}
+
+AVX512 void scale_weight_avx512(float* out, const float* in, double scl, size_t n) {
+    const __m512d s = _mm512_set1_pd(scl);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d v = _mm512_cvtps_pd(_mm256_loadu_ps(in + i));
+        _mm256_storeu_ps(out + i, _mm512_cvtpd_ps(_mm512_mul_pd(s, v)));
+    }
+    scale_weight_scalar(out + i, in + i, scl, n - i);
+}
+
+AVX512 void unpack_avx512(float* out, const int32_t* in, float re_scl, float im_scl,
+                          size_t nprod) {
+    const __m512 s = _mm512_setr_ps(re_scl, im_scl, re_scl, im_scl, re_scl, im_scl, re_scl, im_scl,
+                                    re_scl, im_scl, re_scl, im_scl, re_scl, im_scl, re_scl, im_scl);
+    size_t i = 0;
+    for (; i + 8 <= nprod; i += 8) {
+        __m512 v = _mm512_cvtepi32_ps(_mm512_loadu_si512(in + 2 * i));
+        // Swap each (imaginary, real) pair around
+        v = _mm512_permute_ps(v, 0xB1);
+        _mm512_storeu_ps(out + 2 * i, _mm512_mul_ps(s, v));
+    }
+    unpack_scalar(out + 2 * i, in + 2 * i, re_scl, im_scl, nprod - i);
+}
+
+AVX512 void invert_weight_avx512(float* out, const float* in, float num, size_t n) {
+    const __m512 s = _mm512_set1_ps(num);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(out + i, _mm512_div_ps(s, _mm512_loadu_ps(in + i)));
+    }
+    invert_weight_scalar(out + i, in + i, num, n - i);
+}
+
+AVX512 void stack_run_avx512(const visStackSums& sums, size_t stack, const float* vis,
+                             const float* weight, size_t n, bool conj, bool reverse) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const float sgn = conj ? -1.0f : 1.0f;
+    const __m512 conj_sgn =
+        _mm512_setr_ps(1, sgn, 1, sgn, 1, sgn, 1, sgn, 1, sgn, 1, sgn, 1, sgn, 1, sgn);
+    const __m512i dup = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7);
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 0, 2, 4, 6, 8, 10, 12, 14);
+    const __m512i rev = _mm512_setr_epi32(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    const __m256i rev8 = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 w = _mm256_loadu_ps(weight + i);
+        __m256 m = _mm256_cmp_ps(w, zero, _CMP_NEQ_UQ);
+
+        // Zero the visibilities with zero weight
+        __mmask16 mv = _mm512_cmpneq_ps_mask(
+            _mm512_permutexvar_ps(dup, _mm512_castps256_ps512(w)), _mm512_setzero_ps());
+        __m512 v = _mm512_maskz_mul_ps(mv, conj_sgn, _mm512_loadu_ps(vis + 2 * i));
+
+        // Sum the squares of each (real, imaginary) pair, and pick out one copy of each
+        __m512 sq = _mm512_mul_ps(v, v);
+        sq = _mm512_add_ps(sq, _mm512_permute_ps(sq, 0xB1));
+        __m256 v2 = _mm512_castps512_ps256(_mm512_permutexvar_ps(even, sq));
+
+        // The zero weights give infinities here, but they are masked out
+        __m256 iw = _mm256_and_ps(m, _mm256_div_ps(one, w));
+        __m256 nm = _mm256_and_ps(m, one);
+
+        size_t s = stack + i;
+        if (reverse) {
+            // The stacks go backwards, so reverse the products to match
+            s = stack - i - 7;
+            v = _mm512_permutexvar_ps(rev, v);
+            v2 = _mm256_permutevar8x32_ps(v2, rev8);
+            iw = _mm256_permutevar8x32_ps(iw, rev8);
+            nm = _mm256_permutevar8x32_ps(nm, rev8);
+        }
+        float* p = sums.vis + 2 * s;
+        _mm512_storeu_ps(p, _mm512_add_ps(_mm512_loadu_ps(p), v));
+        add_avx2(sums.vis2 + s, v2);
+        add_avx2(sums.inv_weight + s, iw);
+        add_avx2(sums.norm + s, nm);
+    }
+    stack_run_scalar(sums, reverse ? stack - i : stack + i, vis + 2 * i, weight + i, n - i, conj,
+                     reverse);
+}
+
+const visKernelTable avx512_kernels = {accumulate_avx512,     accumulate_copy_avx512,
+                                       sq_diff_avx512,        subtract_power_avx512,
+                                       subtract_scaled_avx512, scale_weight_avx512,
+                                       unpack_avx512,          invert_weight_avx512,
+                                       stack_run_avx512};
+
+#pragma GCC diagnostic pop
+
+#endif // VIS_KERNELS_X86
+
+
+const visKernelTable& kernel_table(visKernelISA isa) {
+    switch (isa) {
+#ifdef VIS_KERNELS_X86
+        case visKernelISA::avx512:
+            return avx512_kernels;
+        case visKernelISA::avx2:
+            return avx2_kernels;
+#endif
+        default:
+            return scalar_kernels;
+    }
+}
+
+/// The instruction set in use, starts as the best one available
+std::atomic<visKernelISA>& current_isa() {
+    static std::atomic<visKernelISA> isa(get_best_vis_kernel_isa());
+    return isa;
+}
+
+inline const visKernelTable& kernels() {
+    return kernel_table(current_isa().load(std::memory_order_relaxed));
+}
+
+} // namespace
+
+
+visKernelISA get_best_vis_kernel_isa() {
+#ifdef VIS_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return visKernelISA::avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return visKernelISA::avx2;
+#endif
+    return visKernelISA::scalar;
+}
+
+visKernelISA get_vis_kernel_isa() {
+    return current_isa().load();
+}
+
+void set_vis_kernel_isa(visKernelISA isa) {
+    if ((int)isa > (int)get_best_vis_kernel_isa())
+        throw std::invalid_argument(std::string("The CPU doesn't support the ")
+                                    + vis_kernel_isa_name(isa) + " visibility kernels");
+    current_isa().store(isa);
+}
+
+const char* vis_kernel_isa_name(visKernelISA isa) {
+    switch (isa) {
+        case visKernelISA::avx512:
+            return "avx512";
+        case visKernelISA::avx2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+void accumulate_vis(int32_t* acc, const int32_t* in, size_t n) {
+    kernels().accumulate(acc, in, n);
+}
+
+void accumulate_vis_copy(int32_t* acc, int32_t* copy, const int32_t* in, size_t n) {
+    kernels().accumulate_copy(acc, copy, in, n);
+}
+
+void accumulate_vis_sq_diff(float* var, const int32_t* in, const int32_t* even, size_t nprod) {
+    kernels().sq_diff(var, in, even, nprod);
+}
+
+void subtract_vis_power(float* var, const int32_t* vis, float w, size_t nprod) {
+    kernels().subtract_power(var, vis, w, nprod);
+}
+
+void subtract_scaled_vis(int32_t* gate, const int32_t* vis, float scl, size_t n) {
+    kernels().subtract_scaled(gate, vis, scl, n);
+}
+
+void scale_vis_weight(float* out, const float* in, double scl, size_t n) {
+    kernels().scale_weight(out, in, scl, n);
+}
+
+void unpack_vis(float* out, const int32_t* in, float re_scl, float im_scl, size_t nprod) {
+    kernels().unpack(out, in, re_scl, im_scl, nprod);
+}
+
+void invert_vis_weight(float* out, const float* in, float num, size_t n) {
+    kernels().invert_weight(out, in, num, n);
+}
+
+void stack_vis_run(const visStackSums& sums, size_t stack, const float* vis, const float* weight,
+                   size_t n, bool conj, bool reverse) {
+    kernels().stack_run(sums, stack, vis, weight, n, conj, reverse);
+}
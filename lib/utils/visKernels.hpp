@@ -0,0 +1,178 @@
+/*****************************************
+@file
+@brief Vectorised kernels for accumulating and stacking visibility data.
+- visKernelISA
+- accumulate_vis
+- accumulate_vis_copy
+- accumulate_vis_sq_diff
+- subtract_vis_power
+- subtract_scaled_vis
+- scale_vis_weight
+- unpack_vis
+- invert_vis_weight
+- visStackSums
+- stack_vis_run
+*****************************************/
+#ifndef VIS_KERNELS_HPP
+#define VIS_KERNELS_HPP
+
+#include <cstdint>  // for int32_t
+#include <stddef.h> // for size_t
+
+/**
+ * @brief The instruction sets the kernels are implemented for.
+ *
+ * The best one supported by the CPU is picked at runtime. AVX2 and AVX-512 are
+ * only available on x86_64.
+ **/
+enum class visKernelISA { scalar = 0, avx2 = 1, avx512 = 2 };
+
+/**
+ * @brief Get the instruction set the kernels are currently using.
+ **/
+visKernelISA get_vis_kernel_isa();
+
+/**
+ * @brief Get the best instruction set supported by this CPU.
+ **/
+visKernelISA get_best_vis_kernel_isa();
+
+/**
+ * @brief Force the kernels to use an instruction set.
+ *
+ * Mostly useful for testing and benchmarking.
+ *
+ * @param  isa  The instruction set to use. Must not be better than
+ *              `get_best_vis_kernel_isa()`.
+ * @throws std::invalid_argument if the CPU doesn't support `isa`.
+ **/
+void set_vis_kernel_isa(visKernelISA isa);
+
+/**
+ * @brief The name of an instruction set, for logging.
+ **/
+const char* vis_kernel_isa_name(visKernelISA isa);
+
+/**
+ * @brief Accumulate integer visibilities: `acc[i] += in[i]`.
+ *
+ * @param  acc  The accumulator.
+ * @param  in   The data to add.
+ * @param  n    Number of int32s (i.e. twice the number of complex values).
+ **/
+void accumulate_vis(int32_t* acc, const int32_t* in, size_t n);
+
+/**
+ * @brief Accumulate integer visibilities and save a copy of the input.
+ *
+ * Does `acc[i] += in[i]` and `copy[i] = in[i]` in one pass over the input.
+ *
+ * @param  acc   The accumulator.
+ * @param  copy  Where to copy the input to.
+ * @param  in    The data to add.
+ * @param  n     Number of int32s.
+ **/
+void accumulate_vis_copy(int32_t* acc, int32_t* copy, const int32_t* in, size_t n);
+
+/**
+ * @brief Accumulate the squared magnitude of the difference of two visibility sets.
+ *
+ * Does `var[i] += |in[i] - even[i]|^2` with `in` and `even` interleaved complex
+ * integers, and the difference taken as integers before converting to float.
+ *
+ * @param  var    The variance accumulator, length `nprod`.
+ * @param  in     The current visibilities, length `2 * nprod`.
+ * @param  even   The visibilities to difference against, length `2 * nprod`.
+ * @param  nprod  Number of complex visibilities.
+ **/
+void accumulate_vis_sq_diff(float* var, const int32_t* in, const int32_t* even, size_t nprod);
+
+/**
+ * @brief Subtract a scaled power: `var[i] -= w * |vis[i]|^2`.
+ *
+ * @param  var    The variance to correct, length `nprod`.
+ * @param  vis    Interleaved complex integer visibilities, length `2 * nprod`.
+ * @param  w      The scaling.
+ * @param  nprod  Number of complex visibilities.
+ **/
+void subtract_vis_power(float* var, const int32_t* vis, float w, size_t nprod);
+
+/**
+ * @brief Subtract scaled visibilities: `gate[i] -= (int32_t)(scl * vis[i])`.
+ *
+ * @param  gate  The visibilities to subtract from.
+ * @param  vis   The visibilities to scale.
+ * @param  scl   The scaling.
+ * @param  n     Number of int32s.
+ **/
+void subtract_scaled_vis(int32_t* gate, const int32_t* vis, float scl, size_t n);
+
+/**
+ * @brief Scale weights in double precision: `out[i] = (float)(scl * in[i])`.
+ *
+ * @param  out  Output array.
+ * @param  in   Input array.
+ * @param  scl  The scaling.
+ * @param  n    Number of floats.
+ **/
+void scale_vis_weight(float* out, const float* in, double scl, size_t n);
+
+/**
+ * @brief Unpack GPU visibilities into scaled complex floats.
+ *
+ * The GPU stores each visibility as an (imaginary, real) pair of integers. This
+ * does `out[2 * i] = re_scl * in[2 * i + 1]` and `out[2 * i + 1] = im_scl * in[2 * i]`,
+ * so the output can be conjugated by negating `im_scl`.
+ *
+ * @param  out     Interleaved (real, imaginary) output, length `2 * nprod`.
+ * @param  in      GPU visibilities, length `2 * nprod`.
+ * @param  re_scl  Scaling for the real part.
+ * @param  im_scl  Scaling for the imaginary part.
+ * @param  nprod   Number of complex visibilities.
+ **/
+void unpack_vis(float* out, const int32_t* in, float re_scl, float im_scl, size_t nprod);
+
+/**
+ * @brief Invert weights: `out[i] = num / in[i]`.
+ *
+ * @param  out  Output array.
+ * @param  in   Input array.
+ * @param  num  The numerator.
+ * @param  n    Number of floats.
+ **/
+void invert_vis_weight(float* out, const float* in, float num, size_t n);
+
+/**
+ * @brief Where the sums needed to stack visibilities are accumulated.
+ *
+ * Each array has an entry per stack.
+ **/
+struct visStackSums {
+    /// Sum of the visibilities, as interleaved complex values
+    float* vis;
+    /// Sum of the squared magnitudes of the visibilities
+    float* vis2;
+    /// Sum of the inverse weights, i.e. the variances
+    float* inv_weight;
+    /// Number of visibilities summed
+    float* norm;
+};
+
+/**
+ * @brief Add a run of consecutive products into a run of consecutive stacks.
+ *
+ * Product `i` of the run goes into stack `stack + i`, or `stack - i` if
+ * `reverse` is set. Products with zero weight are skipped.
+ *
+ * @param  sums     The sums to add to.
+ * @param  stack    The stack the first product goes into.
+ * @param  vis      Interleaved complex visibilities of the run, length `2 * n`.
+ * @param  weight   Weights of the run, length `n`.
+ * @param  n        Number of products in the run.
+ * @param  conj     Conjugate the visibilities before adding them.
+ * @param  reverse  The stacks go backwards along the run.
+ **/
+void stack_vis_run(const visStackSums& sums, size_t stack, const float* vis, const float* weight,
+                   size_t n, bool conj, bool reverse);
+
+#endif // VIS_KERNELS_HPP
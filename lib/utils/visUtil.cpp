@@ -1,6 +1,7 @@
 #include "visUtil.hpp"
 
-#include "Config.hpp" // for Config
+#include "Config.hpp"     // for Config
+#include "visKernels.hpp" // for invert_vis_weight, unpack_vis
 
 #include <cstring>   // for memset
 #include <exception> // for exception
@@ -148,6 +149,100 @@ void map_vis_triangle(const std::vector<uint32_t>& inputmap, size_t block, size_
 }
 
 
+visTrianglePlan::visTrianglePlan(const std::vector<uint32_t>& inputmap, size_t block,
+                                 size_t N) :
+    _num_prod(inputmap.size() * (inputmap.size() + 1) / 2),
+    _num_prod_gpu(gpu_N2_size(N, block)) {
+
+    if (inputmap.empty())
+        return;
+
+    // Walk the triangle in output order, extending the current run while the
+    // products stay contiguous in the GPU buffer
+    map_vis_triangle(inputmap, block, N, 0, [&](int32_t pi, int32_t bi, bool conj) {
+        if (!_runs.empty()) {
+            run& last = _runs.back();
+            if (last.out_index + last.length == (uint32_t)pi
+                && last.gpu_index + last.length == (uint32_t)bi && last.conj == conj) {
+                last.length++;
+                return;
+            }
+        }
+        _runs.push_back({(uint32_t)bi, (uint32_t)pi, 1, conj});
+    });
+
+    // ... and then put them into the order they are in the GPU buffer
+    std::sort(_runs.begin(), _runs.end(),
+              [](const run& a, const run& b) { return a.gpu_index < b.gpu_index; });
+}
+
+std::vector<size_t> visTrianglePlan::split(size_t n) const {
+
+    std::vector<size_t> splits = {0};
+    size_t r = 0, prods_before_run = 0;
+
+    for (size_t i = 1; i < n; i++) {
+        while (r < _runs.size() && prods_before_run < _num_prod * i / n) {
+            prods_before_run += _runs[r].length;
+            r++;
+        }
+        splits.push_back(r);
+    }
+    splits.push_back(_runs.size());
+
+    return splits;
+}
+
+void copy_vis_triangle(const int32_t* inputdata, const visTrianglePlan& plan,
+                       gsl::span<cfloat> output, float scale, size_t run_start, size_t run_end) {
+
+    if (output.size() < plan.num_prod()) {
+        throw std::invalid_argument("Output is too small for the visibility triangle.");
+    }
+
+    auto& runs = plan.runs();
+    run_end = std::min(run_end, runs.size());
+    float* out = (float*)output.data();
+
+    for (size_t r = run_start; r < run_end; r++) {
+        auto& run = runs[r];
+        float im_scale = run.conj ? -scale : scale;
+
+        // Heavily reordered inputs give lots of single products, which aren't
+        // worth calling the vector kernels for
+        if (run.length == 1) {
+            out[2 * run.out_index] = scale * (float)inputdata[2 * run.gpu_index + 1];
+            out[2 * run.out_index + 1] = im_scale * (float)inputdata[2 * run.gpu_index];
+        } else {
+            unpack_vis(out + 2 * run.out_index, inputdata + 2 * run.gpu_index, scale, im_scale,
+                       run.length);
+        }
+    }
+}
+
+void invert_weight_triangle(const float* inputdata, const visTrianglePlan& plan,
+                            gsl::span<float> output, float num, size_t run_start,
+                            size_t run_end) {
+
+    if (output.size() < plan.num_prod()) {
+        throw std::invalid_argument("Output is too small for the visibility triangle.");
+    }
+
+    auto& runs = plan.runs();
+    run_end = std::min(run_end, runs.size());
+
+    for (size_t r = run_start; r < run_end; r++) {
+        auto& run = runs[r];
+        if (run.length == 1) {
+            output[run.out_index] = num / inputdata[run.gpu_index];
+        } else {
+            invert_vis_weight(output.data() + run.out_index, inputdata + run.gpu_index, num,
+                              run.length);
+        }
+    }
+}
+
+
 std::tuple<uint32_t, uint32_t, std::string> parse_reorder_single(json j) {
     if (!j.is_array() || j.size() != 3) {
         throw std::runtime_error("Could not parse json item for input reordering: " + j.dump());
@@ -22,7 +22,7 @@
 #include <algorithm> // for max
 #include <chrono>
 #include <complex>     // for complex, imag, real
-#include <cstdint>     // for uint32_t, uint16_t, int64_t, int32_t, uint64_t
+#include <cstdint>     // for uint32_t, uint16_t, int64_t, int32_t, uint64_t, SIZE_MAX
 #include <cstdlib>     // for size_t, (anonymous), div
 #include <deque>       // for deque
 #include <functional>  // for function
@@ -416,6 +416,104 @@ void map_vis_triangle(const std::vector<uint32_t>& inputmap, size_t block, size_
                       std::function<void(int32_t, int32_t, bool)> f);
 
 
+/**
+ * @brief A precomputed plan for unpacking the GPU visibility triangle.
+ *
+ * This holds the same mapping as `map_vis_triangle`, worked out once for a
+ * given input map. The products are grouped into runs which are contiguous in
+ * both the GPU buffer and the output triangle, and the runs are sorted into
+ * the order of the GPU buffer. Unpacking with a plan then walks through the
+ * GPU blocks in memory order, copying a whole run at a time with the vector
+ * kernels.
+ *
+ * The runs touch distinct products, so different ranges of runs can be
+ * unpacked in parallel.
+ */
+class visTrianglePlan {
+public:
+    /// A run of products contiguous in the GPU buffer and the output
+    struct run {
+        /// Index of the first product in the GPU buffer
+        uint32_t gpu_index;
+        /// Index of the first product in the output triangle
+        uint32_t out_index;
+        /// Number of products
+        uint32_t length;
+        /// Whether the products need conjugating
+        bool conj;
+    };
+
+    /**
+     * @brief Work out the plan for an input map.
+     *
+     * @param inputmap  Vector of feed indices to use.
+     * @param block     Block size.
+     * @param N         Number of inputs in input data.
+     */
+    visTrianglePlan(const std::vector<uint32_t>& inputmap, size_t block, size_t N);
+
+    /// The runs in GPU memory order
+    const std::vector<run>& runs() const {
+        return _runs;
+    }
+
+    /// Number of products in the output triangle
+    size_t num_prod() const {
+        return _num_prod;
+    }
+
+    /// Number of products per frequency in the GPU buffer
+    size_t num_prod_gpu() const {
+        return _num_prod_gpu;
+    }
+
+    /**
+     * @brief Split the runs into ranges with about the same number of products.
+     *
+     * @param n  Number of ranges.
+     * @returns  The `n + 1` boundaries of the ranges as indices into `runs()`.
+     */
+    std::vector<size_t> split(size_t n) const;
+
+private:
+    std::vector<run> _runs;
+    size_t _num_prod;
+    size_t _num_prod_gpu;
+};
+
+
+/**
+ * @brief Copy the visibility triangle out of the buffer using a plan.
+ *
+ * @param inputdata  Input data to copy out. Add any frequency offset to this.
+ * @param plan       The plan for the input map.
+ * @param output     Region of memory to write into.
+ * @param scale      Scaling to apply to the visibilities.
+ * @param run_start  First run of the plan to copy.
+ * @param run_end    One past the last run to copy. Default is all of them.
+ */
+void copy_vis_triangle(const int32_t* inputdata, const visTrianglePlan& plan,
+                       gsl::span<cfloat> output, float scale = 1.0f, size_t run_start = 0,
+                       size_t run_end = SIZE_MAX);
+
+
+/**
+ * @brief Unpack and invert the weights in the GPU triangle using a plan.
+ *
+ * Sets `output[pi] = num / inputdata[bi]` for every product.
+ *
+ * @param inputdata  Input weights in the GPU product order.
+ * @param plan       The plan for the input map.
+ * @param output     Region of memory to write into.
+ * @param num        The numerator.
+ * @param run_start  First run of the plan to copy.
+ * @param run_end    One past the last run to copy. Default is all of them.
+ */
+void invert_weight_triangle(const float* inputdata, const visTrianglePlan& plan,
+                            gsl::span<float> output, float num, size_t run_start = 0,
+                            size_t run_end = SIZE_MAX);
+
+
 /**
  * @brief Parse the reordering configuration section
  * @param config    Configuration handle.
@@ -0,0 +1,294 @@
+#define BOOST_TEST_MODULE "test_buffer"
+
+#include "buffer.h" // for Buffer, create_buffer, mark_frame_empty, mark_frame_full, regi...
+
+#include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_PP_BOOL_2
+#include <chrono>                            // for duration, steady_clock, time_point
+#include <cstdint>                           // for uint64_t, uint8_t
+#include <cstring>                           // for memcpy, memset
+#include <iostream>                          // for operator<<, basic_ostream, cout, endl
+#include <thread>                            // for thread, sleep_for
+#include <time.h>                            // for clock_gettime, timespec, CLOCK_REALTIME
+
+using std::chrono::steady_clock;
+
+// Small frames so the buffers can be memlocked with the default ulimits.
+static const int num_frames = 4;
+static const int frame_size = 4096;
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static Buffer* make_buffer(const char* name, bool spsc) {
+    Buffer* buf = create_buffer(num_frames, frame_size, nullptr, name, "standard", 0);
+    BOOST_REQUIRE(buf != nullptr);
+    set_spsc_fast_path(buf, spsc ? 1 : 0);
+    register_producer(buf, "producer");
+    register_consumer(buf, "consumer");
+    return buf;
+}
+
+/*
+ * Push `n` frames through the buffer, checking they arrive in order.
+ *
+ * If `spacing_us` is non-zero the producer pauses between frames so the consumer is always
+ * asleep when the frame arrives, and the average time from `mark_frame_full` to the consumer
+ * returning from `wait_for_full_frame` is returned in nanoseconds.  Otherwise the frame rate in
+ * frames/s is returned.
+ */
+static double run_pipeline(Buffer* buf, uint64_t n, int spacing_us) {
+    uint64_t latency_sum = 0;
+    uint64_t errors = 0;
+
+    auto start = steady_clock::now();
+
+    std::thread producer([&]() {
+        for (uint64_t i = 0; i < n; ++i) {
+            int id = i % num_frames;
+            uint8_t* frame = wait_for_empty_frame(buf, "producer", id);
+            if (frame == nullptr)
+                return;
+            if (spacing_us > 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(spacing_us));
+            uint64_t t = now_ns();
+            memcpy(frame, &i, sizeof(i));
+            memcpy(frame + sizeof(i), &t, sizeof(t));
+            mark_frame_full(buf, "producer", id);
+        }
+    });
+
+    std::thread consumer([&]() {
+        for (uint64_t i = 0; i < n; ++i) {
+            int id = i % num_frames;
+            uint8_t* frame = wait_for_full_frame(buf, "consumer", id);
+            if (frame == nullptr)
+                return;
+            uint64_t t = now_ns();
+            uint64_t seq, sent;
+            memcpy(&seq, frame, sizeof(seq));
+            memcpy(&sent, frame + sizeof(seq), sizeof(sent));
+            errors += (seq != i);
+            latency_sum += t - sent;
+            mark_frame_empty(buf, "consumer", id);
+        }
+    });
+
+    producer.join();
+    consumer.join();
+
+    std::chrono::duration<double> elapsed = steady_clock::now() - start;
+
+    BOOST_CHECK_EQUAL(errors, 0);
+
+    if (spacing_us > 0)
+        return (double)latency_sum / n;
+    return n / elapsed.count();
+}
+
+BOOST_AUTO_TEST_CASE(spsc_mode_detection) {
+    Buffer* buf = create_buffer(num_frames, frame_size, nullptr, "detect", "standard", 0);
+    BOOST_REQUIRE(buf != nullptr);
+
+    BOOST_CHECK_EQUAL(buf->spsc_active, 0);
+    register_producer(buf, "producer");
+    BOOST_CHECK_EQUAL(buf->spsc_active, 0);
+    register_consumer(buf, "consumer");
+    BOOST_CHECK_EQUAL(buf->spsc_active, 1);
+
+    // A second consumer needs the general path
+    register_consumer(buf, "consumer2");
+    BOOST_CHECK_EQUAL(buf->spsc_active, 0);
+    unregister_consumer(buf, "consumer2");
+    BOOST_CHECK_EQUAL(buf->spsc_active, 1);
+
+    set_spsc_fast_path(buf, 0);
+    BOOST_CHECK_EQUAL(buf->spsc_active, 0);
+    set_spsc_fast_path(buf, 1);
+    BOOST_CHECK_EQUAL(buf->spsc_active, 1);
+
+    // Zeroing frames is only done by the locked path
+    zero_frames(buf);
+    BOOST_CHECK_EQUAL(buf->spsc_active, 0);
+
+    delete_buffer(buf);
+}
+
+BOOST_AUTO_TEST_CASE(spsc_shutdown) {
+    Buffer* buf = make_buffer("shutdown", true);
+
+    std::thread consumer(
+        [&]() { BOOST_CHECK(wait_for_full_frame(buf, "consumer", 0) == nullptr); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    send_shutdown_signal(buf);
+    consumer.join();
+
+    delete_buffer(buf);
+}
+
+BOOST_AUTO_TEST_CASE(spsc_timeout) {
+    Buffer* buf = make_buffer("timeout", true);
+
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += 10000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec += 1;
+        timeout.tv_nsec -= 1000000000;
+    }
+    BOOST_CHECK_EQUAL(wait_for_full_frame_timeout(buf, "consumer", 0, timeout), 1);
+
+    BOOST_CHECK(wait_for_empty_frame(buf, "producer", 0) != nullptr);
+    mark_frame_full(buf, "producer", 0);
+    BOOST_CHECK_EQUAL(wait_for_full_frame_timeout(buf, "consumer", 0, timeout), 0);
+    mark_frame_empty(buf, "consumer", 0);
+
+    delete_buffer(buf);
+}
+
+/*
+ * Compare the mutex path and the lock free fast path.
+ */
+BOOST_AUTO_TEST_CASE(spsc_benchmark) {
+    const uint64_t n_rate = 200000;
+    const uint64_t n_latency = 2000;
+
+    Buffer* buf_mutex = make_buffer("mutex", false);
+    Buffer* buf_spsc = make_buffer("spsc", true);
+    BOOST_CHECK_EQUAL(buf_mutex->spsc_active, 0);
+    BOOST_CHECK_EQUAL(buf_spsc->spsc_active, 1);
+
+    double rate_mutex = run_pipeline(buf_mutex, n_rate, 0);
+    double rate_spsc = run_pipeline(buf_spsc, n_rate, 0);
+    double latency_mutex = run_pipeline(buf_mutex, n_latency, 20);
+    double latency_spsc = run_pipeline(buf_spsc, n_latency, 20);
+
+    std::cout << "Buffer frame rate (frames/s):  mutex " << rate_mutex << ", spsc " << rate_spsc
+              << std::endl;
+    std::cout << "Buffer wakeup latency (ns):    mutex " << latency_mutex << ", spsc "
+              << latency_spsc << std::endl;
+
+    delete_buffer(buf_mutex);
+    delete_buffer(buf_spsc);
+}
+
+BOOST_AUTO_TEST_CASE(handle_api) {
+    for (int spsc = 0; spsc < 2; ++spsc) {
+        Buffer* buf = create_buffer(num_frames, frame_size, nullptr, "handles", "standard", 0);
+        BOOST_REQUIRE(buf != nullptr);
+        set_spsc_fast_path(buf, spsc);
+
+        int producer = register_producer(buf, "producer");
+        int consumer = register_consumer(buf, "consumer");
+        BOOST_CHECK(producer >= 0);
+        BOOST_CHECK(consumer >= 0);
+        BOOST_CHECK_EQUAL(buf->spsc_active, spsc);
+
+        // Mix the name and handle based calls on the same frames
+        for (int i = 0; i < 2 * num_frames; ++i) {
+            int id = i % num_frames;
+            BOOST_CHECK(wait_for_empty_frame_h(buf, producer, id) == buf->frames[id]);
+            mark_frame_full_h(buf, producer, id);
+            BOOST_CHECK_EQUAL(is_frame_empty(buf, id), 0);
+            BOOST_CHECK(wait_for_full_frame(buf, "consumer", id) == buf->frames[id]);
+            mark_frame_empty_h(buf, consumer, id);
+            BOOST_CHECK_EQUAL(is_frame_empty(buf, id), 1);
+            BOOST_CHECK(wait_for_empty_frame(buf, "producer", id) == buf->frames[id]);
+            mark_frame_full(buf, "producer", id);
+            BOOST_CHECK(wait_for_full_frame_h(buf, consumer, id) == buf->frames[id]);
+            mark_frame_empty(buf, "consumer", id);
+        }
+
+        delete_buffer(buf);
+    }
+}
+
+static void fill_and_release(Buffer* buf, int id) {
+    uint8_t* frame = wait_for_empty_frame(buf, "producer", id);
+    BOOST_REQUIRE(frame != nullptr);
+    memset(frame, 0xff, buf->frame_size);
+    mark_frame_full(buf, "producer", id);
+    BOOST_REQUIRE(wait_for_full_frame(buf, "consumer", id) != nullptr);
+    mark_frame_empty(buf, "consumer", id);
+}
+
+BOOST_AUTO_TEST_CASE(zero_frames_worker) {
+    Buffer* buf = make_buffer("zero", true);
+    zero_frames(buf);
+    BOOST_CHECK_EQUAL(buf->spsc_active, 0);
+
+    for (int i = 0; i < 4 * num_frames; ++i) {
+        int id = i % num_frames;
+        fill_and_release(buf, id);
+
+        // The frame is only handed back once the worker has zeroed it
+        uint8_t* frame = wait_for_empty_frame(buf, "producer", id);
+        BOOST_REQUIRE(frame != nullptr);
+        int non_zero = 0;
+        for (int j = 0; j < frame_size; ++j)
+            non_zero += (frame[j] != 0);
+        BOOST_CHECK_EQUAL(non_zero, 0);
+    }
+
+    delete_buffer(buf);
+}
+
+BOOST_AUTO_TEST_CASE(zero_frame_headers_worker) {
+    const int header_size = 8;
+    const int header_stride = 1056;
+
+    Buffer* buf = make_buffer("zero_headers", true);
+    zero_frame_headers(buf, header_size, header_stride);
+
+    fill_and_release(buf, 0);
+    uint8_t* frame = wait_for_empty_frame(buf, "producer", 0);
+    BOOST_REQUIRE(frame != nullptr);
+    int wrong = 0;
+    for (int j = 0; j < frame_size; ++j) {
+        bool header = (j % header_stride) < header_size;
+        wrong += (frame[j] != (header ? 0 : 0xff));
+    }
+    BOOST_CHECK_EQUAL(wrong, 0);
+
+    // Release the frame again so it is zeroed while the buffer is being deleted
+    mark_frame_full(buf, "producer", 0);
+    BOOST_REQUIRE(wait_for_full_frame(buf, "consumer", 0) != nullptr);
+    mark_frame_empty(buf, "consumer", 0);
+    delete_buffer(buf);
+}
+
+BOOST_AUTO_TEST_CASE(frame_memory_policy) {
+    // Huge pages may not be configured on the test machine, in which case the buffer
+    // falls back to normal pages, which must still work.
+    const int n = 2;
+    const int big_frame = (2 << 20) + PAGESIZE_MEM;
+    Buffer* buf = create_buffer_with_policy(n, big_frame, nullptr, "huge", "standard", 0,
+                                            BUFFER_PAGES_2MB, BUFFER_NUMA_INTERLEAVE);
+    BOOST_REQUIRE(buf != nullptr);
+
+    if (buf->frame_region != nullptr) {
+        BOOST_CHECK_EQUAL(buf->frame_page_size, 2u << 20);
+        BOOST_CHECK_EQUAL(buf->frame_region_size, (size_t)n * (4u << 20));
+        for (int i = 0; i < n; ++i)
+            BOOST_CHECK_EQUAL((uintptr_t)buf->frames[i] % (2u << 20), 0u);
+    } else {
+        BOOST_CHECK_EQUAL(buf->frame_page_size, (size_t)PAGESIZE_MEM);
+    }
+
+    // Swapping with a normally allocated buffer must copy rather than exchange frames
+    Buffer* normal = create_buffer(n, big_frame, nullptr, "normal", "standard", 0);
+    BOOST_REQUIRE(normal != nullptr);
+    register_consumer(buf, "consumer");
+    register_producer(normal, "producer");
+    uint8_t* huge_frame = buf->frames[0];
+    memset(huge_frame, 0x5a, big_frame);
+    swap_frames(buf, 0, normal, 0);
+    if (buf->frame_region != nullptr)
+        BOOST_CHECK(buf->frames[0] == huge_frame);
+    BOOST_CHECK_EQUAL(normal->frames[0][big_frame - 1], 0x5a);
+
+    delete_buffer(normal);
+    delete_buffer(buf);
+}
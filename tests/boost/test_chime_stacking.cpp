@@ -1,15 +1,19 @@
 #define BOOST_TEST_MODULE "test_chime_stacking"
 
-#include "Stack.hpp"        // for stack_chime_in_cyl, chimeFeed, CYL_A, CYL_D
+#include "Stack.hpp"        // for stack_chime_in_cyl, chimeFeed, stackPlan, CYL_A, CYL_D
 #include "datasetState.hpp" // for invert_stack
 #include "visUtil.hpp"      // for input_ctype, prod_ctype, rstack_ctype, stac...
 
 #include <algorithm>                         // for copy, max, transform
 #include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_PP_IIF_0, BOOST_PP_BO...
+#include <chrono>                            // for duration, steady_clock, time_point
+#include <complex>                           // for conj, norm
 #include <cstdint>                           // for uint32_t, uint16_t
+#include <iostream>                          // for cout, endl
 #include <memory>                            // for allocator_traits<>::value_type
 #include <numeric>                           // for iota
 #include <ostream>                           // for operator<<, ostream, basic_ostream, basic_o...
+#include <random>                            // for mt19937, uniform_int_distribution
 #include <stdexcept>                         // for invalid_argument
 #include <string>                            // for string
 #include <utility>                           // for pair
@@ -134,3 +138,177 @@ BOOST_AUTO_TEST_CASE(chimeStacking) {
     BOOST_CHECK_EQUAL_COLLECTIONS(stack_ind1.begin(), stack_ind1.end(), stack_ind2.begin(),
                                   stack_ind2.end());
 }
+
+
+// The original product by product stacking, to check the plan against
+static float stack_reference(uint32_t num_stack, const std::vector<rstack_ctype>& stack_map,
+                             const std::vector<prod_ctype>& prods, const std::vector<float>& flags,
+                             const std::vector<cfloat>& vis, const std::vector<float>& weight,
+                             std::vector<cfloat>& out_vis, std::vector<float>& out_weight) {
+    std::vector<float> stack_norm(num_stack, 0.0);
+    std::vector<float> stack_v2(num_stack, 0.0);
+    std::fill(out_vis.begin(), out_vis.end(), 0.0);
+    std::fill(out_weight.begin(), out_weight.end(), 0.0);
+
+    for (uint32_t prod_ind = 0; prod_ind < prods.size(); prod_ind++) {
+        auto& p = prods[prod_ind];
+        auto& s = stack_map[prod_ind];
+        if (weight[prod_ind] == 0 || flags[p.input_a] == 0 || flags[p.input_b] == 0)
+            continue;
+
+        cfloat v = s.conjugate ? std::conj(vis[prod_ind]) : vis[prod_ind];
+        out_vis[s.stack] += v;
+        stack_v2[s.stack] += fast_norm(v);
+        out_weight[s.stack] += (1.0 / weight[prod_ind]);
+        stack_norm[s.stack] += 1.0;
+    }
+
+    float vart = 0.0;
+    float normt = 0.0;
+    for (uint32_t stack_ind = 0; stack_ind < num_stack; stack_ind++) {
+        float norm = stack_norm[stack_ind];
+        float inorm = (norm != 0.0) ? (1.0 / norm) : 0.0;
+        float iwgt = (out_weight[stack_ind] != 0.0) ? (1.0 / out_weight[stack_ind]) : 0.0;
+
+        out_vis[stack_ind] *= inorm;
+        out_weight[stack_ind] = norm * norm * iwgt;
+
+        vart += stack_v2[stack_ind] - std::norm(out_vis[stack_ind]) * norm;
+        normt += norm;
+    }
+    return (normt != 0.0) ? (vart / normt) : 0.0;
+}
+
+// A full set of products and their CHIME stacking for `num_input` inputs
+static void chime_products(uint16_t num_input, std::vector<input_ctype>& inputs,
+                           std::vector<prod_ctype>& prods) {
+    inputs.clear();
+    prods.clear();
+    for (uint16_t i = 0; i < num_input; i++) {
+        inputs.emplace_back(i, "");
+        for (uint16_t j = i; j < num_input; j++) {
+            prods.push_back({i, j});
+        }
+    }
+}
+
+// Random data with small integer values and power of two weights, so that the
+// sums are exact and don't depend on the order they are done in
+static void random_frame(size_t nprod, int seed, std::vector<cfloat>& vis,
+                         std::vector<float>& weight) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> val(-100, 100);
+    std::uniform_int_distribution<int> wgt(0, 3);
+    vis.resize(nprod);
+    weight.resize(nprod);
+    for (size_t i = 0; i < nprod; i++) {
+        vis[i] = {(float)val(gen), (float)val(gen)};
+        int w = wgt(gen);
+        weight[i] = w ? (float)(1 << (w - 1)) : 0.0f;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(_stack_plan) {
+    std::vector<input_ctype> inputs;
+    std::vector<prod_ctype> prods;
+
+    // Use inputs from across all the cylinders so some products are conjugated
+    inputs = {{0, ""}, {1, ""}, {5, ""}, {256, ""}, {600, ""}, {1030, ""}, {1800, ""}};
+    for (uint16_t i = 0; i < inputs.size(); i++) {
+        for (uint16_t j = i; j < inputs.size(); j++) {
+            prods.push_back({i, j});
+        }
+    }
+    auto stack = stack_chime_in_cyl(inputs, prods);
+
+    std::vector<cfloat> vis;
+    std::vector<float> weight;
+    random_frame(prods.size(), 1, vis, weight);
+
+    std::vector<float> flags(inputs.size(), 1.0);
+    for (auto flagged : {-1, 2, 5}) {
+        if (flagged >= 0)
+            flags[flagged] = 0.0;
+
+        std::vector<cfloat> vis_ref(stack.first), vis_plan(stack.first);
+        std::vector<float> weight_ref(stack.first), weight_plan(stack.first);
+
+        float res_ref = stack_reference(stack.first, stack.second, prods, flags, vis, weight,
+                                        vis_ref, weight_ref);
+
+        stackPlan plan(stack.first, stack.second, prods, flags);
+        BOOST_CHECK(plan.flags_match(flags));
+
+        // The runs must cover exactly the unflagged products
+        size_t num_unflagged = 0, total = 0;
+        for (auto& p : prods)
+            num_unflagged += (flags[p.input_a] != 0 && flags[p.input_b] != 0);
+        for (auto& r : plan.runs())
+            total += r.length;
+        BOOST_CHECK_EQUAL(total, num_unflagged);
+
+        float res_plan = plan.stack(vis, weight, vis_plan, weight_plan);
+
+        BOOST_CHECK(vis_plan == vis_ref);
+        BOOST_CHECK(weight_plan == weight_ref);
+        BOOST_CHECK_EQUAL(res_plan, res_ref);
+    }
+
+    std::vector<float> other_flags(inputs.size(), 1.0);
+    stackPlan plan(stack.first, stack.second, prods, flags);
+    BOOST_CHECK(!plan.flags_match(other_flags));
+
+    // A mismatched stack map is an error
+    auto short_map = stack.second;
+    short_map.pop_back();
+    BOOST_CHECK_THROW(stackPlan(stack.first, short_map, prods, flags), std::invalid_argument);
+}
+
+/*
+ * Compare the time to stack a full CHIME frame product by product, with
+ * stacking it with a plan.
+ */
+BOOST_AUTO_TEST_CASE(_stack_plan_benchmark) {
+    using std::chrono::steady_clock;
+    const int iterations = 5;
+
+    std::vector<input_ctype> inputs;
+    std::vector<prod_ctype> prods;
+    chime_products(2048, inputs, prods);
+    auto stack = stack_chime_in_cyl(inputs, prods);
+
+    std::vector<cfloat> vis;
+    std::vector<float> weight;
+    random_frame(prods.size(), 2, vis, weight);
+    std::vector<float> flags(inputs.size(), 1.0);
+    flags[17] = 0.0;
+
+    std::vector<cfloat> vis_ref(stack.first), vis_plan(stack.first);
+    std::vector<float> weight_ref(stack.first), weight_plan(stack.first);
+
+    auto time = [&](auto&& f) {
+        f();
+        auto start = steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            f();
+        std::chrono::duration<double, std::milli> elapsed = steady_clock::now() - start;
+        return elapsed.count() / iterations;
+    };
+
+    auto start = steady_clock::now();
+    stackPlan plan(stack.first, stack.second, prods, flags);
+    std::chrono::duration<double, std::milli> t_plan = steady_clock::now() - start;
+
+    double t_ref = time([&]() {
+        stack_reference(stack.first, stack.second, prods, flags, vis, weight, vis_ref, weight_ref);
+    });
+    double t_stack = time([&]() { plan.stack(vis, weight, vis_plan, weight_plan); });
+
+    BOOST_CHECK(vis_plan == vis_ref);
+    BOOST_CHECK(weight_plan == weight_ref);
+
+    std::cout << "Stacking " << prods.size() << " products into " << stack.first
+              << " stacks (ms per frame): product by product " << t_ref << ", with plan "
+              << t_stack << " (" << plan.runs().size() << " runs, built in " << t_plan.count()
+              << ")" << std::endl;
+}
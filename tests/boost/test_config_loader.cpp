@@ -0,0 +1,154 @@
+#define BOOST_TEST_MODULE "test_config_loader"
+
+#include "configLoader.hpp" // for configCache, parse_yaml
+#include "errors.h"         // for _global_log_level, __enable_syslog
+
+#include "json.hpp" // for json
+
+#include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_REQUIRE
+#include <cmath>                             // for isinf
+#include <dirent.h>                          // for opendir, readdir, closedir, dirent
+#include <fstream>                           // for ofstream
+#include <optional>                          // for optional
+#include <stdexcept>                         // for runtime_error
+#include <stdlib.h>                          // for mkdtemp
+#include <string>                            // for string
+#include <unistd.h>                          // for rmdir, unlink
+
+using kotekan::configCache;
+using json = nlohmann::json;
+
+// A temporary directory that is removed when it goes out of scope
+struct tempDir {
+    tempDir() {
+        char templ[] = "/tmp/test_config_loader_XXXXXX";
+        path = mkdtemp(templ);
+    }
+    ~tempDir() {
+        for (auto sub : {"/cache", ""}) {
+            std::string dir = path + sub;
+            DIR* d = opendir(dir.c_str());
+            if (d == nullptr)
+                continue;
+            while (dirent* e = readdir(d)) {
+                unlink((dir + "/" + e->d_name).c_str());
+            }
+            closedir(d);
+            rmdir(dir.c_str());
+        }
+    }
+    std::string path;
+};
+
+#ifdef WITH_YAML_CPP
+BOOST_AUTO_TEST_CASE(_parse_yaml) {
+    // The expected JSON was made with json.dumps(yaml.safe_load(...)) in Python
+    std::string yaml = R"(
+bools: [yes, No, TRUE, off, On, "yes", y, n]
+ints: [0, 12, -12, +7, 1_000, 0755, 0x1F, -0x10, 0b101, 1:30, 08, 18446744073709551615,
+       -9223372036854775808, 123456789012345678901234]
+floats: [1.5, -2., .5, 1.0e+3, 6.8e-1, 1:30.5, 1e3, 1.0e3]
+nulls: [~, null, NULL, "null", ]
+strings: ['0x1F', "1.5", 2 * pi, abc, 12:30:00]
+explicit: [!!str 42, !!float 1, !!int "12", !!bool "yes"]
+block: |
+  line 1
+  line 2
+folded: >
+  a
+  b
+1: int key
+2.5: float key
+~: null key
+base: &base
+  a: 1
+  b: 2
+derived:
+  <<: *base
+  b: 3
+multi:
+  <<: [{x: 1}, {x: 2, y: 2}]
+alias: *base
+)";
+    json expected = json::parse(R"({
+        "bools": [true, false, true, false, true, "yes", "y", "n"],
+        "ints": [0, 12, -12, 7, 1000, 493, 31, -16, 5, 90, "08", 18446744073709551615,
+                 -9223372036854775808, 123456789012345678901234],
+        "floats": [1.5, -2.0, 0.5, 1000.0, 0.68, 90.5, "1e3", "1.0e3"],
+        "nulls": [null, null, null, "null"],
+        "strings": ["0x1F", "1.5", "2 * pi", "abc", 45000],
+        "explicit": ["42", 1.0, 12, true],
+        "block": "line 1\nline 2\n",
+        "folded": "a b\n",
+        "1": "int key",
+        "2.5": "float key",
+        "null": "null key",
+        "base": {"a": 1, "b": 2},
+        "derived": {"a": 1, "b": 3},
+        "multi": {"x": 1, "y": 2},
+        "alias": {"a": 1, "b": 2}})");
+
+    json config = kotekan::parse_yaml(yaml);
+    BOOST_CHECK_EQUAL(config, expected);
+    for (auto it = expected.begin(); it != expected.end(); ++it)
+        BOOST_CHECK_MESSAGE(config.at(it.key()) == it.value(), it.key());
+    BOOST_CHECK(config["ints"][0].is_number_unsigned());
+    BOOST_CHECK(config["ints"][2].is_number_integer());
+    BOOST_CHECK(config["floats"][1].is_number_float());
+
+    json inf = kotekan::parse_yaml("[.inf, -.Inf]");
+    BOOST_CHECK(std::isinf(inf[0].get<double>()) && inf[0].get<double>() > 0);
+    BOOST_CHECK(std::isinf(inf[1].get<double>()) && inf[1].get<double>() < 0);
+
+    // An empty document is null, like in Python
+    BOOST_CHECK(kotekan::parse_yaml("").is_null());
+
+    // Errors give the line and column
+    try {
+        kotekan::parse_yaml("a: 1\nb: [1, 2\n");
+        BOOST_ERROR("No exception for broken YAML");
+    } catch (std::runtime_error& e) {
+        BOOST_CHECK_MESSAGE(std::string(e.what()).find("line ") != std::string::npos, e.what());
+    }
+    BOOST_CHECK_THROW(kotekan::parse_yaml("a: !!int abc"), std::runtime_error);
+    BOOST_CHECK_THROW(kotekan::parse_yaml("<<: 1"), std::runtime_error);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(_config_cache) {
+    _global_log_level = 1;
+    __enable_syslog = 0;
+
+    tempDir dir;
+    std::string config_file = dir.path + "/config.yaml";
+    std::ofstream(config_file) << "num_elements: 2048\n";
+
+    configCache cache(dir.path + "/cache");
+    std::string key = configCache::key(config_file, false, "");
+    BOOST_CHECK_EQUAL(key.size(), 32);
+    BOOST_CHECK_EQUAL(key, configCache::key(config_file, false, "{\"a\": 1}"));
+    BOOST_CHECK(!cache.get(key));
+
+    json config = {{"num_elements", 2048}};
+    BOOST_CHECK(cache.put(key, config));
+    auto cached = cache.get(key);
+    BOOST_REQUIRE(cached);
+    BOOST_CHECK_EQUAL(cached.value(), config);
+
+    // Another instance finds it, a changed file doesn't
+    configCache cache2(dir.path + "/cache");
+    BOOST_CHECK(cache2.get(key));
+    std::ofstream(config_file) << "num_elements: 16\n";
+    BOOST_CHECK(!cache2.get(configCache::key(config_file, false, "")));
+
+    // Templates depend on the variables and the other files in their directory
+    std::string template_file = dir.path + "/config.j2";
+    std::ofstream(template_file) << "{% include 'config.yaml' %}\n";
+    std::string template_key = configCache::key(template_file, true, "");
+    BOOST_CHECK(template_key != configCache::key(template_file, true, "{\"a\": 1}"));
+    std::ofstream(config_file) << "num_elements: 1024\n";
+    BOOST_CHECK(template_key != configCache::key(template_file, true, ""));
+
+    BOOST_CHECK_THROW(configCache::key(dir.path + "/missing.yaml", false, ""),
+                      std::runtime_error);
+}
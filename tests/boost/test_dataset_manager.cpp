@@ -1,25 +1,28 @@
 #define BOOST_TEST_MODULE "test_datasetManager"
 
 #include "Config.hpp"         // for Config
-#include "Hash.hpp"           // for operator<<
+#include "Hash.hpp"           // for operator<<, hash, operator!=, operator==
 #include "dataset.hpp"        // for dataset
 #include "datasetManager.hpp" // for state_id_t, datasetManager, dset_id_t
-#include "datasetState.hpp"   // for inputState, prodState, freqState, datasetState
+#include "datasetState.hpp"   // for inputState, prodState, freqState, stackState, eigenvalu...
 #include "errors.h"           // for _global_log_level, __enable_syslog
 #include "test_utils.hpp"     // for CompareCTypes
-#include "visUtil.hpp"        // for input_ctype, prod_ctype, freq_ctype
+#include "visUtil.hpp"        // for input_ctype, prod_ctype, freq_ctype, rstack_ctype
 
 #include "json.hpp" // for basic_json<>::object_t, basic_json<>::value...
 
 #include <algorithm>                         // for max
+#include <atomic>                            // for atomic
 #include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_PP_IIF_0, BOOST_PP_BO...
+#include <chrono>                            // for duration, steady_clock
 #include <exception>                         // for exception
 #include <iostream>                          // for endl, operator<<, ostream, basic_ostream, cout
 #include <map>                               // for map
 #include <memory>                            // for allocator, make_unique, unique_ptr
-#include <stdexcept>                         // for out_of_range
-#include <stdint.h>                          // for uint32_t
+#include <stdexcept>                         // for out_of_range, invalid_argument
+#include <stdint.h>                          // for uint32_t, uint16_t
 #include <string>                            // for string, operator<<, string_literals
+#include <thread>                            // for thread
 #include <utility>                           // for pair
 #include <vector>                            // for vector
 
@@ -250,3 +253,158 @@ BOOST_FIXTURE_TEST_CASE(_equal_states, CompareCTypes) {
     BOOST_CHECK_EQUAL(input_state.second->to_json().dump(),
                       std::make_unique<inputState>(inputs)->to_json().dump());
 }
+
+BOOST_AUTO_TEST_CASE(_state_hash) {
+    _global_log_level = 4;
+    json json_config;
+    json json_config_dm;
+    json_config_dm["use_dataset_broker"] = false;
+    json_config_dm["state_hash"] = "json";
+    json_config["dataset_manager"] = json_config_dm;
+    Config conf;
+    conf.update_config(json_config);
+    datasetManager& dm = datasetManager::instance(conf);
+
+    std::vector<prod_ctype> prods = {{1, 2}, {3, 4}, {5, 6}};
+    std::vector<uint32_t> ind = {1, 2, 3};
+
+    // The compatibility mode hashes the serialised state
+    auto json_prod = dm.create_state<prodState>(prods);
+    BOOST_CHECK_EQUAL(json_prod.first, hash(json_prod.second->to_json().dump()));
+
+    json_config["dataset_manager"]["state_hash"] = "binary";
+    conf.update_config(json_config);
+    datasetManager::instance(conf);
+
+    // Identical states must get the same ID
+    auto prod1 = dm.create_state<prodState>(prods);
+    auto prod2 = dm.create_state<prodState>(prods);
+    BOOST_CHECK_EQUAL(prod1.first, prod2.first);
+    BOOST_CHECK(prod1.first != json_prod.first);
+
+    // ...but any change to the data must change the ID
+    prods[1].input_b = 5;
+    BOOST_CHECK(dm.create_state<prodState>(prods).first != prod1.first);
+
+    // States of different types with the same data get different IDs
+    BOOST_CHECK(dm.create_state<beamState>(ind).first
+                != dm.create_state<subfreqState>(ind).first);
+
+    std::vector<rstack_ctype> rstack = {{0, false}, {1, true}};
+    auto stack1 = dm.create_state<stackState>(2, std::vector<rstack_ctype>(rstack));
+    rstack[1].conjugate = false;
+    auto stack2 = dm.create_state<stackState>(2, std::vector<rstack_ctype>(rstack));
+    auto stack3 = dm.create_state<stackState>(3, std::vector<rstack_ctype>(rstack));
+    BOOST_CHECK(stack1.first != stack2.first);
+    BOOST_CHECK(stack2.first != stack3.first);
+
+    // States without a binary hash still work
+    auto meta1 = dm.create_state<metadataState>("none", "test", "v1");
+    auto meta2 = dm.create_state<metadataState>("none", "test", "v2");
+    BOOST_CHECK(meta1.first != meta2.first);
+
+    json_config["dataset_manager"]["state_hash"] = "md5";
+    conf.update_config(json_config);
+    BOOST_CHECK_THROW(datasetManager::instance(conf), std::invalid_argument);
+}
+
+/*
+ * Time registering the product and stack states of CHIME sized datasets, with
+ * both ways of calculating state IDs.
+ */
+BOOST_AUTO_TEST_CASE(_state_hash_benchmark) {
+    _global_log_level = 4;
+
+    const uint16_t num_elements = 2048;
+    std::vector<prod_ctype> prods;
+    std::vector<rstack_ctype> rstack;
+    for (uint16_t i = 0; i < num_elements; i++) {
+        for (uint16_t j = i; j < num_elements; j++) {
+            prods.push_back({i, j});
+            rstack.push_back({(uint32_t)(j - i), (i + j) % 2 == 1});
+        }
+    }
+
+    for (std::string mode : {"binary", "json"}) {
+        json json_config;
+        json_config["dataset_manager"]["use_dataset_broker"] = false;
+        json_config["dataset_manager"]["state_hash"] = mode;
+        Config conf;
+        conf.update_config(json_config);
+        datasetManager& dm = datasetManager::instance(conf);
+
+        auto start = std::chrono::steady_clock::now();
+        dm.create_state<prodState>(prods);
+        std::chrono::duration<double, std::milli> t_prod = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        dm.create_state<stackState>(num_elements, std::vector<rstack_ctype>(rstack));
+        std::chrono::duration<double, std::milli> t_stack =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << "Registering states for " << prods.size() << " products with " << mode
+                  << " hashes: prodState " << t_prod.count() << " ms, stackState "
+                  << t_stack.count() << " ms" << std::endl;
+    }
+}
+
+/*
+ * Time looking up states from several threads at once, like stages do from
+ * their frame loops.
+ */
+BOOST_AUTO_TEST_CASE(_lookup_benchmark) {
+    _global_log_level = 4;
+    json json_config;
+    json_config["dataset_manager"]["use_dataset_broker"] = false;
+    Config conf;
+    conf.update_config(json_config);
+    datasetManager& dm = datasetManager::instance(conf);
+
+    // A chain of datasets, like the one a frame has been through by the time
+    // it reaches a writer
+    std::vector<input_ctype> inputs = {input_ctype(1, "1"), input_ctype(2, "2")};
+    dset_id_t ds = dm.add_dataset(dm.create_state<inputState>(inputs).first);
+    for (size_t i = 1; i <= 20; i++) {
+        ds = dm.add_dataset(dm.create_state<eigenvalueState>(i).first, ds);
+    }
+    const inputState* expected = dm.dataset_state<inputState>(ds);
+    BOOST_REQUIRE(expected != nullptr);
+
+    const int num_threads = 4;
+    const int num_lookups = 200000;
+
+    auto time_threads = [&](auto&& f) {
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; i++)
+            threads.emplace_back(f);
+        for (auto& t : threads)
+            t.join();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / (num_threads * num_lookups);
+    };
+
+    std::atomic<int> num_wrong(0);
+
+    // Walking the ancestors on every lookup, which `dataset_state` did before
+    double t_walk = time_threads([&]() {
+        for (int i = 0; i < num_lookups; i++) {
+            auto found = dm.closest_dataset_of_type(ds, "inputs");
+            if (!found || dm.states().count(found.value().second.state()) == 0)
+                num_wrong++;
+        }
+    });
+
+    double t_lookup = time_threads([&]() {
+        for (int i = 0; i < num_lookups; i++) {
+            if (dm.dataset_state<inputState>(ds) != expected)
+                num_wrong++;
+        }
+    });
+
+    BOOST_CHECK_EQUAL(num_wrong, 0);
+
+    std::cout << "Looking up a state 20 datasets up from " << num_threads
+              << " threads (ns per lookup): walking the datasets " << t_walk
+              << ", dataset_state " << t_lookup << std::endl;
+}
@@ -0,0 +1,134 @@
+#define BOOST_TEST_MODULE "test_dataset_store"
+
+#include "Config.hpp"         // for Config
+#include "Hash.hpp"           // for Hash, hash, operator==
+#include "dataset.hpp"        // for dataset
+#include "datasetManager.hpp" // for datasetManager, dset_id_t, state_id_t
+#include "datasetState.hpp"   // for inputState, eigenvalueState, state_uptr
+#include "datasetStore.hpp"   // for datasetStore
+#include "errors.h"           // for _global_log_level, __enable_syslog
+#include "visUtil.hpp"        // for input_ctype
+
+#include "json.hpp" // for json
+
+#include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_REQUIRE
+#include <dirent.h>                          // for opendir, readdir, closedir, dirent
+#include <fstream>                           // for ofstream
+#include <optional>                          // for optional
+#include <stdlib.h>                          // for mkdtemp
+#include <string>                            // for string
+#include <unistd.h>                          // for rmdir, unlink
+#include <vector>                            // for vector
+
+using kotekan::Config;
+using json = nlohmann::json;
+
+// A temporary store directory that is removed when it goes out of scope
+struct tempStore {
+    tempStore() {
+        char templ[] = "/tmp/test_dataset_store_XXXXXX";
+        path = mkdtemp(templ);
+    }
+    ~tempStore() {
+        for (auto sub : {"/states", "/datasets"}) {
+            std::string dir = path + sub;
+            DIR* d = opendir(dir.c_str());
+            if (d == nullptr)
+                continue;
+            while (dirent* e = readdir(d)) {
+                unlink((dir + "/" + e->d_name).c_str());
+            }
+            closedir(d);
+            rmdir(dir.c_str());
+        }
+        rmdir(path.c_str());
+    }
+    std::string path;
+};
+
+std::vector<input_ctype> test_inputs() {
+    return {input_ctype(1, "1"), input_ctype(2, "2"), input_ctype(3, "3")};
+}
+
+BOOST_AUTO_TEST_CASE(_store) {
+    _global_log_level = 1;
+    __enable_syslog = 0;
+
+    tempStore dir;
+    datasetStore store(dir.path);
+
+    inputState inputs(test_inputs());
+    state_id_t state_id = hash(inputs.to_json().dump());
+    dataset ds(state_id, "inputs");
+    dset_id_t ds_id = hash(ds.to_json().dump());
+
+    BOOST_CHECK(store.get_state(state_id) == nullptr);
+    BOOST_CHECK(!store.get_dataset(ds_id));
+
+    BOOST_CHECK(store.put_state(state_id, inputs.to_json()));
+    BOOST_CHECK(store.put_dataset(ds_id, ds));
+    // Saving again does nothing
+    BOOST_CHECK(store.put_state(state_id, inputs.to_json()));
+
+    // Another instance finds them
+    datasetStore store2(dir.path);
+    state_uptr loaded = store2.get_state(state_id);
+    BOOST_REQUIRE(loaded != nullptr);
+    BOOST_CHECK(loaded->equals(inputs));
+    auto loaded_ds = store2.get_dataset(ds_id);
+    BOOST_REQUIRE(loaded_ds);
+    BOOST_CHECK(loaded_ds.value().equals(ds));
+
+    // A dataset filed under the wrong ID is ignored
+    BOOST_CHECK(store.put_dataset(state_id, ds));
+    BOOST_CHECK(!store.get_dataset(state_id));
+
+    // So is a broken file
+    Hash broken = hash("broken");
+    std::ofstream(dir.path + "/states/" + broken.to_string() + ".cbor") << "not cbor";
+    BOOST_CHECK(store.get_state(broken) == nullptr);
+}
+
+/*
+ * States and datasets saved by an earlier run are found without the broker,
+ * which isn't running here.
+ */
+BOOST_AUTO_TEST_CASE(_warm_restart) {
+    _global_log_level = 1;
+    __enable_syslog = 0;
+
+    tempStore dir;
+
+    inputState inputs(test_inputs());
+    eigenvalueState evs(4);
+    state_id_t inputs_id = hash(inputs.to_json().dump());
+    state_id_t evs_id = hash(evs.to_json().dump());
+    dataset root(inputs_id, "inputs");
+    dset_id_t root_id = hash(root.to_json().dump());
+    dataset child(evs_id, "eigenvalues", root_id);
+    dset_id_t child_id = hash(child.to_json().dump());
+
+    {
+        datasetStore store(dir.path);
+        store.put_state(inputs_id, inputs.to_json());
+        store.put_state(evs_id, evs.to_json());
+        store.put_dataset(root_id, root);
+        store.put_dataset(child_id, child);
+    }
+
+    json json_config;
+    json_config["dataset_manager"]["use_dataset_broker"] = true;
+    json_config["dataset_manager"]["ds_broker_port"] = 1;
+    json_config["dataset_manager"]["store_path"] = dir.path;
+    Config conf;
+    conf.update_config(json_config);
+    datasetManager& dm = datasetManager::instance(conf);
+
+    const inputState* found_inputs = dm.dataset_state<inputState>(child_id);
+    BOOST_REQUIRE(found_inputs != nullptr);
+    BOOST_CHECK(found_inputs->equals(inputs));
+
+    const eigenvalueState* found_evs = dm.dataset_state<eigenvalueState>(child_id);
+    BOOST_REQUIRE(found_evs != nullptr);
+    BOOST_CHECK_EQUAL(found_evs->get_num_ev(), 4);
+}
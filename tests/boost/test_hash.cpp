@@ -1,18 +1,22 @@
 #define BOOST_TEST_MODULE "test_config"
 
-#include "Hash.hpp" // for Hash, hash
+#include "Hash.hpp" // for Hash, hash, HashStream, operator!=, operator<<, operator==
 
 #include "fmt.hpp"  // for format
 #include "json.hpp" // for json
 
+#include <algorithm>                         // for min
 #include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_PP_IIF_0, BOOST_PP_BO...
+#include <stddef.h>                          // for size_t
 #include <stdint.h>                          // for uint64_t
 #include <stdlib.h>                          // for strtoull
-#include <string>                            // for string, allocator
+#include <string>                            // for string, allocator, operator""s
 
 
 using json = nlohmann::json;
 
+using namespace std::string_literals;
+
 BOOST_AUTO_TEST_CASE(_test_serialise) {
 
     /* The hash was calculated in python using:
@@ -55,3 +59,39 @@ BOOST_AUTO_TEST_CASE(_test_hash) {
     BOOST_CHECK_EQUAL(h1.h, high);
     BOOST_CHECK_EQUAL(h1.l, low);
 }
+
+
+BOOST_AUTO_TEST_CASE(_test_hash_stream) {
+
+    std::string s = "This is a long and random string.";
+    std::string hash_string = "4dcf87995e06b6b97f012becdab1a2d5";
+
+    // Feed the string in pieces of every size, the hash should not change
+    for (size_t step = 1; step <= s.size(); step++) {
+        HashStream h;
+        for (size_t i = 0; i < s.size(); i += step) {
+            h.add(s.data() + i, std::min(step, s.size() - i));
+        }
+        BOOST_CHECK_EQUAL(h.finalize().to_string(), hash_string);
+    }
+
+    // Check the tail handling against the one shot hash for every length
+    std::string data(100, 0);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = 17 * i + 3;
+    }
+    for (size_t len = 0; len < data.size(); len++) {
+        HashStream h;
+        h.add(data.data(), len / 3);
+        h.add(data.data() + len / 3, len - len / 3);
+        BOOST_CHECK_EQUAL(h.finalize(), hash(data.substr(0, len)));
+    }
+
+    // Strings are prefixed by their length, so the boundaries matter
+    HashStream h1, h2;
+    h1.add("ab"s);
+    h1.add("c"s);
+    h2.add("a"s);
+    h2.add("bc"s);
+    BOOST_CHECK(h1.finalize() != h2.finalize());
+}
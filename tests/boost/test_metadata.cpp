@@ -0,0 +1,88 @@
+#define BOOST_TEST_MODULE "test_metadata"
+
+#include "metadata.h" // for metadataContainer, create_metadata_pool, request_metadata_object
+
+#include <atomic>                            // for atomic
+#include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_...
+#include <cstdint>                           // for uint32_t, uint64_t
+#include <set>                               // for set
+#include <thread>                            // for thread
+#include <vector>                            // for vector
+
+BOOST_AUTO_TEST_CASE(pool_exhaustion) {
+    const int pool_size = 8;
+    metadataPool* pool = create_metadata_pool(pool_size, sizeof(uint64_t));
+
+    std::set<metadataContainer*> containers;
+    for (int i = 0; i < pool_size; ++i) {
+        metadataContainer* mc = request_metadata_object(pool);
+        BOOST_REQUIRE(mc != nullptr);
+        BOOST_CHECK_EQUAL(mc->ref_count, 1);
+        BOOST_CHECK_EQUAL(*(uint64_t*)mc->metadata, 0);
+        *(uint64_t*)mc->metadata = i + 1;
+        containers.insert(mc);
+    }
+    BOOST_CHECK_EQUAL(containers.size(), (size_t)pool_size);
+
+    // Containers go back to the pool once the last reference is dropped, and are zeroed
+    metadataContainer* first = *containers.begin();
+    increment_metadata_ref_count(first);
+    decrement_metadata_ref_count(first);
+    BOOST_CHECK_EQUAL(pool->in_use[first->pool_index], 1);
+    decrement_metadata_ref_count(first);
+    BOOST_CHECK_EQUAL(pool->in_use[first->pool_index], 0);
+
+    metadataContainer* again = request_metadata_object(pool);
+    BOOST_CHECK(again == first);
+    BOOST_CHECK_EQUAL(*(uint64_t*)again->metadata, 0);
+
+    for (auto mc : containers)
+        decrement_metadata_ref_count(mc);
+
+    delete_metadata_pool(pool);
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_requests) {
+    const int num_threads = 4;
+    const int per_thread = 4;
+    const int iterations = 100000;
+
+    metadataPool* pool = create_metadata_pool(num_threads * per_thread, sizeof(uint64_t));
+    std::atomic<int> errors(0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t]() {
+            metadataContainer* held[per_thread];
+            const uint64_t tag = t + 1;
+            for (int i = 0; i < iterations; ++i) {
+                int n = 1 + i % per_thread;
+                for (int j = 0; j < n; ++j) {
+                    held[j] = request_metadata_object(pool);
+                    if (*(uint64_t*)held[j]->metadata != 0)
+                        errors++;
+                    *(uint64_t*)held[j]->metadata = tag;
+                    // Simulate passing the metadata to another buffer
+                    increment_metadata_ref_count(held[j]);
+                }
+                for (int j = 0; j < n; ++j) {
+                    // Nobody else should have been given our container
+                    if (*(uint64_t*)held[j]->metadata != tag)
+                        errors++;
+                    decrement_metadata_ref_count(held[j]);
+                    decrement_metadata_ref_count(held[j]);
+                }
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    BOOST_CHECK_EQUAL(errors, 0);
+    for (unsigned int i = 0; i < pool->pool_size; ++i) {
+        BOOST_CHECK_EQUAL(pool->in_use[i], 0);
+        BOOST_CHECK_EQUAL(pool->metadata_objects[i]->ref_count, 0);
+    }
+
+    delete_metadata_pool(pool);
+}
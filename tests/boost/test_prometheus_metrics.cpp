@@ -3,11 +3,16 @@
 #include "prometheusMetrics.hpp" // for Metrics, MetricFamily, Counter, Gauge
 
 #include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_PP_BOOL_2
+#include <chrono>                            // for duration, steady_clock
 #include <cmath>                             // for sqrt, log
 #include <iostream>                          // for cout, ostream
 #include <string>                            // for string, allocator, basic_string, operator==
+#include <thread>                            // for thread
+#include <vector>                            // for vector
 
+using kotekan::prometheus::Counter;
 using kotekan::prometheus::Metrics;
+using std::chrono::steady_clock;
 
 
 BOOST_AUTO_TEST_CASE(simple_metrics) {
@@ -150,3 +155,164 @@ BOOST_AUTO_TEST_CASE(gauges_with_labels) {
     BOOST_CHECK(multi_metrics.find("bar_with_labels{stage_name=\"foo\",quux=\"baz\"} 42.0")
                 != std::string::npos);
 }
+
+
+BOOST_AUTO_TEST_CASE(concurrent_updates) {
+    Metrics& metrics = Metrics::instance();
+
+    auto& counter = metrics.add_counter("concurrent_counter", "threads");
+    auto& family = metrics.add_counter("concurrent_family", "threads", {"freq_id"});
+
+    const int nthreads = 4;
+    const int nupdates = 100000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < nupdates; i++) {
+                counter.inc();
+                family.labels({std::to_string((t + i) % 8)}).inc(2);
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    auto multi_metrics = metrics.serialize();
+    BOOST_CHECK(multi_metrics.find("concurrent_counter{stage_name=\"threads\"} 400000\n")
+                != std::string::npos);
+    for (int f = 0; f < 8; f++) {
+        BOOST_CHECK(multi_metrics.find("concurrent_family{stage_name=\"threads\",freq_id=\""
+                                       + std::to_string(f) + "\"} 100000\n")
+                    != std::string::npos);
+    }
+    metrics.remove_stage_metrics("threads");
+}
+
+/*
+ * Time updating metrics from several threads at once: a counter looked up by
+ * its labels on every update, as many stages do in their frame loop, the same
+ * counters looked up once beforehand, and a single shared counter and gauge.
+ */
+BOOST_AUTO_TEST_CASE(benchmark) {
+    Metrics& metrics = Metrics::instance();
+
+    const int nthreads = 4;
+    const int nupdates = 200000;
+    const int nfreq = 256;
+
+    auto& family = metrics.add_counter("bench_frames_total", "bench", {"freq_id", "reason"});
+    auto& counter = metrics.add_counter("bench_counter_total", "bench");
+    auto& gauge = metrics.add_gauge("bench_gauge", "bench");
+    for (int f = 0; f < nfreq; f++)
+        family.labels({std::to_string(f), "age"});
+
+    auto time = [&](auto&& f) {
+        auto start = steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nthreads; t++)
+            threads.emplace_back(f, t);
+        for (auto& t : threads)
+            t.join();
+        std::chrono::duration<double, std::nano> elapsed = steady_clock::now() - start;
+        return elapsed.count() / (nthreads * nupdates);
+    };
+
+    double t_labels = time([&](int t) {
+        for (int i = 0; i < nupdates; i++)
+            family.labels({std::to_string((t * 64 + i) % nfreq), "age"}).inc();
+    });
+
+    double t_bound = time([&](int t) {
+        std::vector<Counter*> bound;
+        for (int f = 0; f < nfreq; f++)
+            bound.push_back(&family.labels({std::to_string(f), "age"}));
+        for (int i = 0; i < nupdates; i++)
+            bound[(t * 64 + i) % nfreq]->inc();
+    });
+
+    double t_counter = time([&](int) {
+        for (int i = 0; i < nupdates; i++)
+            counter.inc();
+    });
+
+    double t_gauge = time([&](int) {
+        for (int i = 0; i < nupdates; i++)
+            gauge.set(i);
+    });
+
+    std::cout << "Updating metrics from " << nthreads << " threads (ns per update): labels "
+              << t_labels << ", looked up once " << t_bound << ", shared counter " << t_counter
+              << ", shared gauge " << t_gauge << std::endl;
+
+    metrics.remove_stage_metrics("bench");
+}
+
+
+BOOST_AUTO_TEST_CASE(cached_serialization) {
+    Metrics& metrics = Metrics::instance();
+
+    auto& counters = metrics.add_counter("cached_counter", "cache", {"freq_id"});
+    auto& gauge = metrics.add_gauge("cached_gauge", "cache");
+    counters.labels({"1"}).inc();
+    gauge.set(1.5);
+
+    auto first = metrics.serialize();
+    BOOST_CHECK(first.find("cached_counter{stage_name=\"cache\",freq_id=\"1\"} 1\n")
+                != std::string::npos);
+    BOOST_CHECK(first.find("cached_gauge{stage_name=\"cache\"} 1.500000 ") != std::string::npos);
+
+    // Nothing changed
+    BOOST_CHECK(metrics.serialize() == first);
+
+    // A changed value, a new series and a new family all show up
+    counters.labels({"1"}).inc();
+    counters.labels({"2"}).inc(5);
+    gauge.set(-2);
+    metrics.add_counter("cached_new", "cache").inc();
+    auto second = metrics.serialize();
+    BOOST_CHECK(second.find("cached_counter{stage_name=\"cache\",freq_id=\"1\"} 2\n")
+                != std::string::npos);
+    BOOST_CHECK(second.find("cached_counter{stage_name=\"cache\",freq_id=\"2\"} 5\n")
+                != std::string::npos);
+    BOOST_CHECK(second.find("cached_gauge{stage_name=\"cache\"} -2.000000 ") != std::string::npos);
+    BOOST_CHECK(second.find("cached_new{stage_name=\"cache\"} 1\n") != std::string::npos);
+    BOOST_CHECK(second.find(" 1.500000 ") == std::string::npos);
+
+    metrics.remove_stage_metrics("cache");
+    BOOST_CHECK(metrics.serialize().find("cached_") == std::string::npos);
+}
+
+/*
+ * Time a scrape of many series with per-frequency and per-input labels, when
+ * only a few of them change between scrapes.
+ */
+BOOST_AUTO_TEST_CASE(serialize_benchmark) {
+    Metrics& metrics = Metrics::instance();
+
+    const int nfamily = 10;
+    const int nseries = 2048;
+    const int nscrape = 20;
+
+    std::vector<Counter*> counters;
+    for (int f = 0; f < nfamily; f++) {
+        auto& family = metrics.add_counter("scrape_total_" + std::to_string(f), "scrape",
+                                           {"freq_id", "input"});
+        for (int i = 0; i < nseries; i++)
+            counters.push_back(&family.labels({std::to_string(i), std::to_string(i % 64)}));
+    }
+
+    size_t size = 0;
+    auto start = steady_clock::now();
+    for (int s = 0; s < nscrape; s++) {
+        for (size_t i = s; i < counters.size(); i += 100)
+            counters[i]->inc();
+        size = metrics.serialize().size();
+    }
+    std::chrono::duration<double, std::milli> elapsed = steady_clock::now() - start;
+
+    std::cout << "Serializing " << nfamily * nseries << " series (" << size
+              << " bytes), 1% changing: " << elapsed.count() / nscrape << " ms per scrape"
+              << std::endl;
+
+    metrics.remove_stage_metrics("scrape");
+}
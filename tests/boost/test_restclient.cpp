@@ -1,5 +1,6 @@
 #define BOOST_TEST_MODULE "test_restClient"
 
+#include "Config.hpp"         // for Config
 #include "errors.h"           // for __enable_syslog, _global_log_level
 #include "kotekanLogging.hpp" // for ERROR_NON_OO, INFO_NON_OO
 #include "restClient.hpp"     // for restClient::restReply, restClient
@@ -8,11 +9,14 @@
 #include "fmt.hpp"  // for format, fmt
 #include "json.hpp" // for basic_json, basic_json<>::value_type, opera...
 
+#include <algorithm>                         // for max
 #include <atomic>                            // for atomic, __atomic_base
 #include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_PP_BOOL_2, BOOST_TEST...
 #include <chrono>                            // for milliseconds
 #include <cstdint>                           // for uint32_t
 #include <functional>                        // for _Placeholder, _Bind_helper<>::type, bind
+#include <iostream>                          // for operator<<, basic_ostream, cout, endl
+#include <stdexcept>                         // for runtime_error
 #include <string>                            // for allocator, basic_string, string, operator!=
 #include <thread>                            // for sleep_for
 #include <vector>                            // for vector
@@ -275,3 +279,206 @@ BOOST_FIXTURE_TEST_CASE(_test_restclient_text_reply_blocking, TestContext) {
     json js = json::parse(reply.second);
     BOOST_CHECK(js["test"] == "failed");
 }
+
+BOOST_FIXTURE_TEST_CASE(_test_restclient_cbor, TestContext) {
+    _global_log_level = 4;
+    __enable_syslog = 0;
+
+    int port = restServer::instance().port;
+
+    // Echo the request back
+    TestContext::init(
+        [](connectionInstance& con, json& js) {
+            cb_called_count++;
+            con.send_json_reply(js);
+        },
+        "/test_restclient_echo");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    json request;
+    request["array"] = std::vector<uint32_t>(1000, 123456);
+    request["name"] = "test";
+
+    /* Plain JSON in both directions */
+
+    restClient::restReply reply = restClient::instance().make_request_blocking(
+        "/test_restclient_echo", request, "127.0.0.1", port, 0, -1, restClient::encoding::json);
+    BOOST_CHECK(reply.first);
+    BOOST_CHECK(!restClient::is_cbor(reply.second));
+    BOOST_CHECK(restClient::parse_reply(reply.second) == request);
+
+    /* JSON request, CBOR reply */
+
+    reply = restClient::instance().make_request_blocking("/test_restclient_echo", request,
+                                                         "127.0.0.1", port, 0, -1,
+                                                         restClient::encoding::json_accept_cbor);
+    BOOST_CHECK(reply.first);
+    BOOST_CHECK(restClient::is_cbor(reply.second));
+    BOOST_CHECK(restClient::parse_reply(reply.second) == request);
+
+    /* CBOR in both directions */
+
+    reply = restClient::instance().make_request_blocking(
+        "/test_restclient_echo", request, "127.0.0.1", port, 0, -1, restClient::encoding::cbor);
+    BOOST_CHECK(reply.first);
+    BOOST_CHECK(restClient::is_cbor(reply.second));
+    BOOST_CHECK(restClient::parse_reply(reply.second) == request);
+    BOOST_CHECK(reply.second.size() < request.dump().size());
+
+    BOOST_CHECK_EQUAL(cb_called_count, 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(_test_restserver_workers, TestContext) {
+    _global_log_level = 4;
+    __enable_syslog = 0;
+
+    int port = restServer::instance().port;
+
+    // Tracks how many requests to the slow endpoint are handled at once
+    std::atomic<int> num_running(0);
+    std::atomic<int> max_running(0);
+    TestContext::init(
+        [&](connectionInstance& con, json&) {
+            int n = ++num_running;
+            max_running = std::max<int>(max_running, n);
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            num_running--;
+            con.send_empty_reply(HTTP_RESPONSE::OK);
+        },
+        "/test_restserver_slow");
+    TestContext::init(
+        [](connectionInstance& con, json&) { con.send_empty_reply(HTTP_RESPONSE::OK); },
+        "/test_restserver_fast");
+    TestContext::init([](connectionInstance&, json&) { throw std::runtime_error("failed"); },
+                      "/test_restserver_throw");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    json request;
+    request["flag"] = true;
+    auto slow_requests = [&]() {
+        std::vector<std::thread> clients;
+        for (int i = 0; i < 2; i++) {
+            clients.emplace_back([&]() {
+                auto reply = restClient::instance().make_request_blocking(
+                    "/test_restserver_slow", request, "127.0.0.1", port);
+                if (!reply.first)
+                    error = true;
+            });
+        }
+        return clients;
+    };
+
+    /* A slow endpoint doesn't hold up the others */
+
+    auto clients = slow_requests();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto start = std::chrono::steady_clock::now();
+    auto reply = restClient::instance().make_request_blocking("/test_restserver_fast", request,
+                                                              "127.0.0.1", port);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    BOOST_CHECK(reply.first);
+    BOOST_CHECK_LT(elapsed.count(), 0.3);
+    for (auto& client : clients)
+        client.join();
+
+    // ...but requests to the same endpoint are handled one at a time
+    BOOST_CHECK_EQUAL(max_running, 1);
+
+    /* Unless the config allows more */
+
+    json json_config;
+    json_config["rest_server"]["endpoint_limits"]["test_restserver_slow"] = 2;
+    kotekan::Config config;
+    config.update_config(json_config);
+    restServer::instance().set_worker_config(config);
+
+    max_running = 0;
+    clients = slow_requests();
+    for (auto& client : clients)
+        client.join();
+    BOOST_CHECK_EQUAL(max_running, 2);
+    BOOST_CHECK(!error);
+
+    /* A callback throwing gives an error reply */
+
+    reply = restClient::instance().make_request_blocking("/test_restserver_throw", request,
+                                                         "127.0.0.1", port);
+    BOOST_CHECK(!reply.first);
+
+    /* Removing an endpoint waits for its callbacks to finish */
+
+    clients = slow_requests();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    restServer::instance().remove_json_callback("/test_restserver_slow");
+    BOOST_CHECK_EQUAL(num_running, 0);
+    for (auto& client : clients)
+        client.join();
+}
+
+/*
+ * Compare requests per second with a new connection for each request, and with
+ * connections kept open, one request at a time and with many in flight.
+ */
+BOOST_FIXTURE_TEST_CASE(_test_restclient_pooling_benchmark, TestContext) {
+    _global_log_level = 3;
+    __enable_syslog = 0;
+
+    int port = restServer::instance().port;
+    TestContext::init(
+        [](connectionInstance& con, json&) {
+            cb_called_count++;
+            con.send_empty_reply(HTTP_RESPONSE::OK);
+        },
+        "/test_restclient_bench");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    json request;
+    request["flag"] = true;
+    const int num_requests = 2000;
+
+    auto blocking = [&]() {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_requests; i++) {
+            auto reply = restClient::instance().make_request_blocking("/test_restclient_bench",
+                                                                      request, "127.0.0.1", port);
+            if (!reply.first)
+                error = true;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return num_requests / elapsed.count();
+    };
+
+    auto async = [&]() {
+        std::atomic<int> num_done(0);
+        std::function<void(restClient::restReply)> done = [&](restClient::restReply reply) {
+            if (!reply.first)
+                error = true;
+            num_done++;
+        };
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_requests; i++) {
+            restClient::instance().make_request("/test_restclient_bench", done, request,
+                                                "127.0.0.1", port);
+        }
+        while (num_done < num_requests)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return num_requests / elapsed.count();
+    };
+
+    restClient::instance().set_connection_limits(false, 4, 64);
+    double new_blocking = blocking();
+    double new_async = async();
+
+    restClient::instance().set_connection_limits(true, 4, 64);
+    double pooled_blocking = blocking();
+    double pooled_async = async();
+
+    BOOST_CHECK(!error);
+    BOOST_CHECK_EQUAL(cb_called_count, 4 * num_requests);
+
+    std::cout << "Requests per second, one at a time: new connections " << new_blocking
+              << ", pooled " << pooled_blocking << std::endl;
+    std::cout << "Requests per second, all at once: new connections " << new_async << ", pooled "
+              << pooled_async << std::endl;
+}
@@ -0,0 +1,170 @@
+#define BOOST_TEST_MODULE "test_uring_writer"
+
+#include "kotekanLogging.hpp" // for logLevel
+#include "uringWriter.hpp"    // for uringWriter, uringWriter::piece
+
+#include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_PP_BOOL_2
+#include <chrono>                            // for duration, steady_clock, time_point
+#include <cstdint>                           // for uint8_t
+#include <errno.h>                           // for errno
+#include <fcntl.h>                           // for open, O_RDWR, O_DIRECT, O_RDONLY
+#include <iostream>                          // for operator<<, basic_ostream, cout, endl
+#include <stdexcept>                         // for invalid_argument
+#include <stdlib.h>                          // for mkstemp
+#include <string>                            // for string
+#include <unistd.h>                          // for close, pread, pwrite, unlink
+#include <vector>                            // for vector
+
+using kotekan::logLevel;
+using std::chrono::steady_clock;
+
+// A temporary file that is removed when it goes out of scope
+struct tempFile {
+    tempFile() {
+        char templ[] = "/tmp/test_uring_writer_XXXXXX";
+        fd = mkstemp(templ);
+        name = templ;
+    }
+    ~tempFile() {
+        if (fd >= 0)
+            close(fd);
+        unlink(name.c_str());
+    }
+    std::vector<uint8_t> read(off_t offset, size_t size) {
+        std::vector<uint8_t> buf(size);
+        BOOST_REQUIRE_EQUAL(pread(fd, buf.data(), size, offset), (ssize_t)size);
+        return buf;
+    }
+    std::string name;
+    int fd;
+};
+
+// Data for frame `i`, split into a flag, a header and a body like a raw file
+struct testFrame {
+    testFrame(int i, size_t body_size) : header(40, 100 + i), body(body_size) {
+        for (size_t j = 0; j < body_size; j++)
+            body[j] = (i * 7 + j) % 251;
+    }
+    std::vector<uringWriter::piece> pieces() const {
+        return {{&flag, 1}, {header.data(), header.size()}, {body.data(), body.size()}};
+    }
+    std::vector<uint8_t> expected(size_t slot_size) const {
+        std::vector<uint8_t> e = {flag};
+        e.insert(e.end(), header.begin(), header.end());
+        e.insert(e.end(), body.begin(), body.end());
+        e.resize(slot_size, 0);
+        return e;
+    }
+    uint8_t flag = 1;
+    std::vector<uint8_t> header, body;
+};
+
+BOOST_AUTO_TEST_CASE(_write) {
+    tempFile file;
+    BOOST_REQUIRE(file.fd >= 0);
+
+    const size_t slot_size = 8192;
+    const int nframes = 20;
+
+    uringWriter writer(4, logLevel::WARN);
+    for (int i = 0; i < nframes; i++) {
+        // Write out of order, and reuse the frame memory straight away
+        int slot = (i * 7) % nframes;
+        testFrame frame(slot, 5000);
+        BOOST_CHECK(writer.write(file.fd, slot * slot_size, frame.pieces(), slot_size));
+        BOOST_CHECK(writer.in_flight() <= 4);
+    }
+    writer.drain();
+    BOOST_CHECK_EQUAL(writer.in_flight(), 0);
+    BOOST_CHECK_EQUAL(writer.num_errors(), 0);
+
+    for (int i = 0; i < nframes; i++) {
+        BOOST_CHECK(file.read(i * slot_size, slot_size) == testFrame(i, 5000).expected(slot_size));
+    }
+
+    // A slot that is too small is refused
+    testFrame frame(0, 5000);
+    BOOST_CHECK(!writer.write(file.fd, 0, frame.pieces(), 4096));
+}
+
+BOOST_AUTO_TEST_CASE(_direct_io) {
+    tempFile file;
+    int fd = open(file.name.c_str(), O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        BOOST_TEST_MESSAGE("O_DIRECT not supported here, skipping.");
+        return;
+    }
+
+    // The slots are page aligned, so they can be written with O_DIRECT
+    const size_t slot_size = 3 * uringWriter::alignment;
+    uringWriter writer(2, logLevel::WARN);
+    for (int i = 0; i < 5; i++) {
+        testFrame frame(i, 10000);
+        BOOST_CHECK(writer.write(fd, i * slot_size, frame.pieces(), slot_size));
+    }
+    writer.drain();
+    close(fd);
+    BOOST_CHECK_EQUAL(writer.num_errors(), 0);
+
+    for (int i = 0; i < 5; i++) {
+        BOOST_CHECK(file.read(i * slot_size, slot_size)
+                    == testFrame(i, 10000).expected(slot_size));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(_errors) {
+    BOOST_CHECK_THROW(uringWriter(0, logLevel::OFF), std::invalid_argument);
+
+    // Writes into a read only file fail when they complete
+    tempFile file;
+    int fd = open(file.name.c_str(), O_RDONLY);
+    BOOST_REQUIRE(fd >= 0);
+
+    uringWriter writer(2, logLevel::OFF);
+    testFrame frame(0, 100);
+    BOOST_CHECK(writer.write(fd, 0, frame.pieces(), 4096));
+    writer.drain();
+    close(fd);
+    BOOST_CHECK_EQUAL(writer.num_errors(), 1);
+}
+
+/*
+ * Compare writing frames the size of a stacked CHIME frame with three pwrite
+ * calls each, with writing them through the io_uring.
+ */
+BOOST_AUTO_TEST_CASE(_benchmark) {
+    const size_t body_size = 250000;
+    const size_t slot_size = 64 * uringWriter::alignment;
+    const int nframes = 200;
+
+    testFrame frame(0, body_size);
+
+    auto time = [&](auto&& f) {
+        tempFile file;
+        auto start = steady_clock::now();
+        f(file.fd);
+        std::chrono::duration<double, std::milli> elapsed = steady_clock::now() - start;
+        return elapsed.count() / nframes;
+    };
+
+    double t_pwrite = time([&](int fd) {
+        for (int i = 0; i < nframes; i++) {
+            off_t offset = i * slot_size;
+            for (auto& p : frame.pieces()) {
+                BOOST_REQUIRE(pwrite(fd, p.data, p.size, offset) == (ssize_t)p.size);
+                offset += p.size;
+            }
+        }
+    });
+
+    double t_uring = time([&](int fd) {
+        uringWriter writer(32, logLevel::WARN);
+        for (int i = 0; i < nframes; i++)
+            writer.write(fd, i * slot_size, frame.pieces(), 1 + 40 + body_size);
+        writer.drain();
+    });
+
+    std::cout << "Writing " << nframes << " frames of " << body_size
+              << " bytes (ms per frame): pwrite " << t_pwrite << ", io_uring " << t_uring
+              << std::endl;
+}
@@ -0,0 +1,188 @@
+#define BOOST_TEST_MODULE "test_vis_kernels"
+
+#include "visKernels.hpp" // for visKernelISA, accumulate_vis, set_vis_kernel_isa, get_best_vis...
+#include "visUtil.hpp"    // for gpu_N2_size
+
+#include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_PP_BOOL_2
+#include <chrono>                            // for duration, steady_clock, time_point
+#include <cstdint>                           // for int32_t
+#include <cstring>                           // for memcpy
+#include <iostream>                          // for operator<<, basic_ostream, cout, endl
+#include <random>                            // for mt19937, uniform_int_distribution
+#include <vector>                            // for vector
+
+using std::chrono::steady_clock;
+
+// An odd number of products so every kernel runs its scalar tail
+static const size_t nprod = 1000 * 16 + 5;
+
+static std::vector<visKernelISA> supported_isas() {
+    std::vector<visKernelISA> isas;
+    for (int i = 0; i <= (int)get_best_vis_kernel_isa(); i++)
+        isas.push_back((visKernelISA)i);
+    return isas;
+}
+
+static std::vector<int32_t> random_vis(size_t n, int seed) {
+    // Keep the values small enough that all the float arithmetic is exact, so the
+    // results are identical whatever order the operations are done in
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int32_t> dist(-1000, 1000);
+    std::vector<int32_t> v(n);
+    for (auto& x : v)
+        x = dist(gen);
+    return v;
+}
+
+struct kernelOutputs {
+    std::vector<int32_t> acc, copy, gate;
+    std::vector<float> var, weight, stack;
+};
+
+// Run every kernel once with the given instruction set
+static kernelOutputs run_kernels(visKernelISA isa) {
+    set_vis_kernel_isa(isa);
+
+    auto in = random_vis(2 * nprod, 1);
+    auto even = random_vis(2 * nprod, 2);
+
+    kernelOutputs out;
+    out.acc = random_vis(2 * nprod, 3);
+    out.copy.resize(2 * nprod);
+    out.gate = random_vis(2 * nprod, 4);
+    out.var.assign(nprod, 1.0f);
+
+    accumulate_vis(out.acc.data(), in.data(), 2 * nprod);
+    accumulate_vis_copy(out.acc.data(), out.copy.data(), even.data(), 2 * nprod);
+    accumulate_vis_sq_diff(out.var.data(), in.data(), out.copy.data(), nprod);
+    subtract_vis_power(out.var.data(), even.data(), 0.25f, nprod);
+    subtract_scaled_vis(out.gate.data(), out.acc.data(), 0.3f, 2 * nprod);
+    out.weight.resize(nprod);
+    scale_vis_weight(out.weight.data(), out.var.data(), 0.3 * (1.0 - 0.3), nprod);
+
+    // Stack runs of small values with power of two weights, so the sums are
+    // exact, going forwards and backwards into overlapping stacks
+    const size_t nstack = nprod / 2;
+    out.stack.assign(5 * nstack, 0.0f);
+    visStackSums sums = {out.stack.data(), out.stack.data() + 2 * nstack,
+                         out.stack.data() + 3 * nstack, out.stack.data() + 4 * nstack};
+    std::vector<float> stack_vis(2 * nprod), stack_weight(nprod);
+    for (size_t i = 0; i < nprod; i++) {
+        stack_vis[2 * i] = (float)(in[2 * i] % 8);
+        stack_vis[2 * i + 1] = (float)(in[2 * i + 1] % 8);
+        stack_weight[i] = (float)((1 << (even[i] & 3)) >> 1);
+    }
+    stack_vis_run(sums, 0, stack_vis.data(), stack_weight.data(), nstack, false, false);
+    stack_vis_run(sums, nstack - 1, stack_vis.data() + 2 * nstack, stack_weight.data() + nstack,
+                  nstack, true, true);
+    stack_vis_run(sums, 3, stack_vis.data() + 2 * 7, stack_weight.data() + 7, nstack - 10, true,
+                  false);
+
+    return out;
+}
+
+BOOST_AUTO_TEST_CASE(_scalar_reference) {
+    set_vis_kernel_isa(visKernelISA::scalar);
+
+    std::vector<int32_t> acc = {1, 2, 3, 4};
+    std::vector<int32_t> in = {3, -4, 5, 12};
+    std::vector<int32_t> copy(4);
+    accumulate_vis_copy(acc.data(), copy.data(), in.data(), 4);
+    BOOST_CHECK(acc == std::vector<int32_t>({4, -2, 8, 16}));
+    BOOST_CHECK(copy == in);
+
+    std::vector<int32_t> zero(4, 0);
+    std::vector<float> var = {1, 2};
+    accumulate_vis_sq_diff(var.data(), in.data(), zero.data(), 2);
+    BOOST_CHECK_EQUAL(var[0], 26);
+    BOOST_CHECK_EQUAL(var[1], 171);
+
+    subtract_vis_power(var.data(), in.data(), 1.0, 2);
+    BOOST_CHECK_EQUAL(var[0], 1);
+    BOOST_CHECK_EQUAL(var[1], 2);
+
+    subtract_scaled_vis(acc.data(), in.data(), 0.5, 4);
+    BOOST_CHECK(acc == std::vector<int32_t>({3, 0, 6, 10}));
+
+    // Products 0 and 2 go into stack 1, product 1 has zero weight
+    std::vector<float> stack_vis = {1, 2, 3, 4, 5, 6};
+    std::vector<float> stack_weight = {1, 0, 2};
+    std::vector<float> sum_vis(4, 0), sum_vis2(2, 0), sum_iw(2, 0), sum_norm(2, 0);
+    visStackSums sums = {sum_vis.data(), sum_vis2.data(), sum_iw.data(), sum_norm.data()};
+    stack_vis_run(sums, 1, stack_vis.data(), stack_weight.data(), 1, false, false);
+    stack_vis_run(sums, 0, stack_vis.data() + 2, stack_weight.data() + 1, 2, true, false);
+    BOOST_CHECK(sum_vis == std::vector<float>({0, 0, 6, -4}));
+    BOOST_CHECK(sum_vis2 == std::vector<float>({0, 66}));
+    BOOST_CHECK(sum_iw == std::vector<float>({0, 1.5}));
+    BOOST_CHECK(sum_norm == std::vector<float>({0, 2}));
+
+    set_vis_kernel_isa(get_best_vis_kernel_isa());
+}
+
+BOOST_AUTO_TEST_CASE(_isas_match_scalar) {
+    kernelOutputs ref = run_kernels(visKernelISA::scalar);
+
+    for (auto isa : supported_isas()) {
+        BOOST_TEST_MESSAGE("Checking " << vis_kernel_isa_name(isa));
+        kernelOutputs out = run_kernels(isa);
+        BOOST_CHECK(out.acc == ref.acc);
+        BOOST_CHECK(out.copy == ref.copy);
+        BOOST_CHECK(out.gate == ref.gate);
+        BOOST_CHECK(out.var == ref.var);
+        BOOST_CHECK(out.weight == ref.weight);
+        BOOST_CHECK(out.stack == ref.stack);
+    }
+
+    set_vis_kernel_isa(get_best_vis_kernel_isa());
+}
+
+BOOST_AUTO_TEST_CASE(_unsupported_isa) {
+    if (get_best_vis_kernel_isa() != visKernelISA::avx512)
+        BOOST_CHECK_THROW(set_vis_kernel_isa(visKernelISA::avx512), std::invalid_argument);
+}
+
+/*
+ * Time the kernels at CHIME sizes, 2048 elements in blocks of 32, for one frequency.
+ */
+BOOST_AUTO_TEST_CASE(_benchmark) {
+    const size_t n = gpu_N2_size(2048, 32);
+    const int iterations = 10;
+
+    auto in = random_vis(2 * n, 1);
+    std::vector<int32_t> acc(2 * n, 0), even(2 * n, 0), gate(2 * n, 0);
+    std::vector<float> var(n, 0), weight(n, 0);
+
+    auto time = [&](auto&& f) {
+        f();
+        auto start = steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            f();
+        std::chrono::duration<double, std::milli> elapsed = steady_clock::now() - start;
+        return elapsed.count() / iterations;
+    };
+
+    std::cout << "Visibility kernels for " << n << " products (ms per call)" << std::endl;
+    for (auto isa : supported_isas()) {
+        set_vis_kernel_isa(isa);
+
+        double t_acc = time([&]() { accumulate_vis(acc.data(), in.data(), 2 * n); });
+        double t_memcpy = time([&]() {
+            std::memcpy(even.data(), in.data(), 8 * n);
+            accumulate_vis(acc.data(), in.data(), 2 * n);
+        });
+        double t_copy =
+            time([&]() { accumulate_vis_copy(acc.data(), even.data(), in.data(), 2 * n); });
+        double t_var =
+            time([&]() { accumulate_vis_sq_diff(var.data(), in.data(), even.data(), n); });
+        double t_gate = time([&]() {
+            subtract_scaled_vis(gate.data(), acc.data(), 0.3f, 2 * n);
+            scale_vis_weight(weight.data(), var.data(), 0.21, n);
+        });
+
+        std::cout << "  " << vis_kernel_isa_name(isa) << ": accumulate " << t_acc
+                  << ", memcpy + accumulate " << t_memcpy << ", fused accumulate/copy " << t_copy
+                  << ", variance " << t_var << ", combine_gated " << t_gate << std::endl;
+    }
+
+    set_vis_kernel_isa(get_best_vis_kernel_isa());
+}
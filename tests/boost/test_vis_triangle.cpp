@@ -0,0 +1,170 @@
+#define BOOST_TEST_MODULE "test_vis_triangle"
+
+#include "visUtil.hpp" // for visTrianglePlan, copy_vis_triangle, map_vis_triangle, gpu_N2_size
+
+#include "gsl-lite.hpp" // for span
+
+#include <algorithm>                         // for reverse, shuffle
+#include <boost/test/included/unit_test.hpp> // for BOOST_PP_IIF_1, BOOST_CHECK, BOOST_PP_BOOL_2
+#include <chrono>                            // for duration, steady_clock, time_point
+#include <cstdint>                           // for int32_t, uint32_t
+#include <iostream>                          // for operator<<, basic_ostream, cout, endl
+#include <numeric>                           // for iota
+#include <random>                            // for mt19937, uniform_int_distribution
+#include <stdexcept>                         // for invalid_argument
+#include <string>                            // for string
+#include <utility>                           // for pair
+#include <vector>                            // for vector
+
+using std::chrono::steady_clock;
+
+static std::vector<int32_t> random_gpu_data(size_t n, int seed) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int32_t> dist(-100000, 100000);
+    std::vector<int32_t> v(n);
+    for (auto& x : v)
+        x = dist(gen);
+    return v;
+}
+
+// The input maps to test: in order, reversed, shuffled, and a subset with a repeat
+static std::vector<std::pair<std::string, std::vector<uint32_t>>> input_maps(size_t N) {
+    std::vector<uint32_t> ordered(N);
+    std::iota(ordered.begin(), ordered.end(), 0);
+
+    std::vector<uint32_t> reversed(ordered.rbegin(), ordered.rend());
+
+    std::vector<uint32_t> shuffled(ordered);
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(1));
+
+    std::vector<uint32_t> subset = {3, 1, 4, 1, 5, (uint32_t)N - 1};
+
+    return {{"ordered", ordered},
+            {"reversed", reversed},
+            {"shuffled", shuffled},
+            {"subset", subset}};
+}
+
+BOOST_AUTO_TEST_CASE(_plan_matches_map) {
+    for (size_t block : {1, 4, 32}) {
+        const size_t N = 64;
+        const size_t nfreq = 2;
+        auto data = random_gpu_data(2 * nfreq * gpu_N2_size(N, block), block);
+
+        std::vector<float> weights(nfreq * gpu_N2_size(N, block));
+        for (size_t i = 0; i < weights.size(); i++)
+            weights[i] = 1.0f + i;
+
+        for (auto& m : input_maps(N)) {
+            auto& name = m.first;
+            auto& inputmap = m.second;
+            BOOST_TEST_MESSAGE("Block size " << block << ", " << name << " input map");
+
+            size_t nprod = inputmap.size() * (inputmap.size() + 1) / 2;
+            visTrianglePlan plan(inputmap, block, N);
+            BOOST_CHECK_EQUAL(plan.num_prod(), nprod);
+            BOOST_CHECK_EQUAL(plan.num_prod_gpu(), gpu_N2_size(N, block));
+
+            // The runs must be in GPU order and cover every product
+            size_t total = 0;
+            for (size_t r = 0; r < plan.runs().size(); r++) {
+                total += plan.runs()[r].length;
+                if (r > 0)
+                    BOOST_CHECK(plan.runs()[r - 1].gpu_index <= plan.runs()[r].gpu_index);
+            }
+            BOOST_CHECK_EQUAL(total, nprod);
+
+            for (uint32_t freq = 0; freq < nfreq; freq++) {
+                size_t offset = freq * plan.num_prod_gpu();
+                const float scale = 0.25f;
+
+                // Reference results from map_vis_triangle
+                std::vector<cfloat> vis_ref(nprod);
+                std::vector<float> weight_ref(nprod);
+                map_vis_triangle(inputmap, block, N, freq, [&](int32_t pi, int32_t bi, bool conj) {
+                    cfloat t = {(float)data[2 * bi + 1], (float)data[2 * bi]};
+                    t = !conj ? t : std::conj(t);
+                    vis_ref[pi] = scale * t;
+                    weight_ref[pi] = 3.0f / weights[bi];
+                });
+
+                // Unpack in a few pieces, like a threaded stage would
+                std::vector<cfloat> vis(nprod);
+                std::vector<float> weight(nprod);
+                auto splits = plan.split(3);
+                BOOST_REQUIRE_EQUAL(splits.size(), 4);
+                for (size_t i = 0; i < 3; i++) {
+                    copy_vis_triangle(data.data() + 2 * offset, plan, vis, scale, splits[i],
+                                      splits[i + 1]);
+                    invert_weight_triangle(weights.data() + offset, plan, weight, 3.0f,
+                                           splits[i], splits[i + 1]);
+                }
+
+                BOOST_CHECK(vis == vis_ref);
+                BOOST_CHECK(weight == weight_ref);
+            }
+
+            // The unscaled copy must match the original version
+            if (inputmap.size() == N) {
+                std::vector<cfloat> vis_ref(nprod), vis(nprod);
+                copy_vis_triangle(data.data(), inputmap, block, N, vis_ref);
+                copy_vis_triangle(data.data(), plan, vis);
+                BOOST_CHECK(vis == vis_ref);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(_plan_errors) {
+    std::vector<uint32_t> inputmap = {0, 1, 2, 8};
+    BOOST_CHECK_THROW(visTrianglePlan(inputmap, 4, 8), std::invalid_argument);
+
+    inputmap = {0, 1, 2, 3};
+    visTrianglePlan plan(inputmap, 4, 8);
+    std::vector<int32_t> data(2 * gpu_N2_size(8, 4));
+    std::vector<cfloat> vis(plan.num_prod() - 1);
+    BOOST_CHECK_THROW(copy_vis_triangle(data.data(), plan, vis), std::invalid_argument);
+}
+
+/*
+ * Compare unpacking the CHIME sized GPU triangle one element at a time, with
+ * unpacking it with a plan.
+ */
+BOOST_AUTO_TEST_CASE(_benchmark) {
+    const size_t block = 32;
+    const int iterations = 5;
+
+    std::cout << "Unpacking the visibility triangle (ms per call)" << std::endl;
+
+    for (size_t N : {256, 1024, 2048}) {
+        auto data = random_gpu_data(2 * gpu_N2_size(N, block), 1);
+        std::vector<cfloat> vis(N * (N + 1) / 2);
+
+        for (auto& m : input_maps(N)) {
+            auto& name = m.first;
+            auto& inputmap = m.second;
+            if (inputmap.size() != N || name == "reversed")
+                continue;
+
+            auto time = [&](auto&& f) {
+                f();
+                auto start = steady_clock::now();
+                for (int i = 0; i < iterations; i++)
+                    f();
+                std::chrono::duration<double, std::milli> elapsed = steady_clock::now() - start;
+                return elapsed.count() / iterations;
+            };
+
+            auto start = steady_clock::now();
+            visTrianglePlan plan(inputmap, block, N);
+            std::chrono::duration<double, std::milli> t_plan = steady_clock::now() - start;
+
+            double t_map = time([&]() { copy_vis_triangle(data.data(), inputmap, block, N, vis); });
+            double t_copy = time([&]() { copy_vis_triangle(data.data(), plan, vis); });
+
+            std::cout << "  N=" << N << " " << name << ": element by element " << t_map
+                      << ", with plan " << t_copy << " (" << plan.runs().size()
+                      << " runs, built in " << t_plan.count() << ")" << std::endl;
+        }
+    }
+}
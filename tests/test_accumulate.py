@@ -31,6 +31,9 @@ gaussian_params.update(
 drop_frame_params = gaussian_params.copy()
 drop_frame_params.update({"drop_probability": 0.3})
 
+threaded_params = accumulate_params.copy()
+threaded_params.update({"num_elements": 32, "num_threads": 3})
+
 time_params = accumulate_params.copy()
 time_params.update({"integration_time": 5.0})
 
@@ -177,6 +180,30 @@ def lostweights_data(tmpdir_factory, request):
     yield (request.param, dump_buffer.load())
 
 
+@pytest.fixture(scope="module")
+def threaded_data(tmpdir_factory):
+
+    tmpdir = tmpdir_factory.mktemp("threaded")
+
+    dump_buffer = runner.DumpVisBuffer(str(tmpdir))
+
+    test = runner.KotekanStageTester(
+        "visAccumulate",
+        {},
+        runner.FakeGPUBuffer(
+            pattern="accumulate",
+            freq=threaded_params["freq"],
+            num_frames=threaded_params["total_frames"],
+        ),
+        dump_buffer,
+        threaded_params,
+    )
+
+    test.run()
+
+    yield dump_buffer.load()
+
+
 @pytest.fixture(scope="module")
 def time_data(tmpdir_factory):
 
@@ -306,6 +333,22 @@ def test_accumulate(accumulate_data):
         assert (frame.gain == 1.0).all()
 
 
+# Test that splitting the products over several threads gives the same result
+def test_threaded(threaded_data):
+
+    row, col = np.triu_indices(threaded_params["num_elements"])
+
+    pat = (row + 1.0j * col).astype(np.complex64)
+
+    nsamp = threaded_params["total_frames"] // threaded_params["int_frames"]
+    assert len(threaded_data) == nsamp
+
+    for frame in threaded_data:
+
+        assert (frame.vis == pat).all()
+        assert (frame.weight == 8.0).all()
+
+
 # Test that we are calculating the weights correctly in the presence of lost
 # data.
 def test_lostweights(lostweights_data):
@@ -22,8 +22,16 @@ writer_params = {
 }
 
 
-@pytest.fixture(scope="module")
-def written_data(tmpdir_factory):
+# Write with blocking writes, through an io_uring, and through an io_uring with O_DIRECT
+write_engines = {
+    "pwrite": {"write_engine": "pwrite"},
+    "io_uring": {"write_engine": "io_uring", "queue_depth": 4},
+    "io_uring_direct": {"write_engine": "io_uring", "queue_depth": 4, "direct_io": True},
+}
+
+
+@pytest.fixture(scope="module", params=list(write_engines.keys()))
+def written_data(tmpdir_factory, request):
 
     tmpdir = str(tmpdir_factory.mktemp("writer"))
 
@@ -36,9 +44,12 @@ def written_data(tmpdir_factory):
     params = writer_params.copy()
     params["root_path"] = tmpdir
 
+    stage_params = {"node_mode": False, "file_type": "raw"}
+    stage_params.update(write_engines[request.param])
+
     test = runner.KotekanStageTester(
         "VisWriter",
-        {"node_mode": False, "file_type": "raw"},
+        stage_params,
         fakevis_buffer,
         None,
         params,